@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# End-to-end benchmark of nd2tool. Converts a synthetic data set,
+# see src/nd2_mock.h, with each output mode and reports the speed in
+# MB/s of image data read from the "nd2 file".
+#
+# Usage: bench/bench_e2e.sh [nd2tool]
+#
+# The data set and the conversion can be set with environment
+# variables (defaults within parentheses): FOV (4), CHANNELS (3),
+# PLANES (20), SIZE (1024, the width and height), MBPS (0, the read
+# speed limit per thread, 0 = none), THREADS (1), MODES (all modes
+# below, separated by ';'). BENCH_DIR (a temporary folder) is where
+# the files are written, so choose the disk that should be measured.
+#
+
+set -e
+
+ND2TOOL=$(realpath "$(command -v "${1:-nd2tool}")")
+FOV=${FOV:-4}
+CHANNELS=${CHANNELS:-3}
+PLANES=${PLANES:-20}
+SIZE=${SIZE:-1024}
+MBPS=${MBPS:-0}
+THREADS=${THREADS:-1}
+MODES=${MODES:-"--format tif;--format tif --composite;--format tif --libtiff;\
+--format tif --compress lzw;--format tif --compress deflate;\
+--format tif --compress zstd;--format ometiff;--format zarr;--format npy"}
+
+if [ -n "$BENCH_DIR" ]; then
+    dir=$(mktemp -d "$BENCH_DIR/nd2tool_bench_XXXXXX")
+else
+    dir=$(mktemp -d)
+fi
+trap 'rm -rf "$dir"' EXIT
+
+printf '{"nd2tool-mock": 1, "fov": %d, "channels": %d, "planes": %d, "width": %d, "height": %d, "mbps": %s}\n' \
+       "$FOV" "$CHANNELS" "$PLANES" "$SIZE" "$SIZE" "$MBPS" > "$dir/bench.nd2"
+raw_mb=$(awk "BEGIN {print $FOV*$CHANNELS*$PLANES*$SIZE*$SIZE*2/1e6}")
+
+echo "# $("$ND2TOOL" --version | head -n 1)"
+echo "# $FOV FOV x $CHANNELS channels x $PLANES planes of $SIZE x $SIZE," \
+     "$raw_mb MB, --threads $THREADS"
+printf "%-36s %8s %10s %10s\n" "# mode" "time [s]" "MB/s" "out [MB]"
+
+echo "$MODES" | tr ';' '\n' | while read -r mode; do
+    rm -rf "$dir/bench"
+    t0=$(date +%s.%N)
+    # shellcheck disable=SC2086
+    if (cd "$dir" && "$ND2TOOL" --backend mock --no-cache --verbose 0 \
+                            --threads "$THREADS" $mode bench.nd2 \
+                            > /dev/null 2>&1); then
+        t1=$(date +%s.%N)
+        out_mb=$(du -sb "$dir/bench" | awk '{print $1/1e6}')
+        awk -v m="$mode" -v t0="$t0" -v t1="$t1" -v raw="$raw_mb" -v out="$out_mb" \
+            'BEGIN {printf "%-36s %8.2f %10.1f %10.1f\n", m, t1-t0, raw/(t1-t0), out}'
+    else
+        printf "%-36s %8s\n" "$mode" "failed"
+    fi
+done
@@ -2,9 +2,9 @@
 set -e
 
 srcdir=../src/
-ver_major=`sed -rn 's/^#define.*ND2TOOL_VERSION_MAJOR.*([0-9]+).*$/\1/p' < $srcdir/nd2tool.h`
-ver_minor=`sed -rn 's/^#define.*ND2TOOL_VERSION_MINOR.*([0-9]+).*$/\1/p' < $srcdir/nd2tool.h`
-ver_patch=`sed -rn 's/^#define.*ND2TOOL_VERSION_PATCH.*([0-9]+).*$/\1/p' < $srcdir/nd2tool.h`
+ver_major=`sed -rn 's/^#define.*ND2TOOL_VERSION_MAJOR.*([0-9]+).*$/\1/p' < $srcdir/version.h`
+ver_minor=`sed -rn 's/^#define.*ND2TOOL_VERSION_MINOR.*([0-9]+).*$/\1/p' < $srcdir/version.h`
+ver_patch=`sed -rn 's/^#define.*ND2TOOL_VERSION_PATCH.*([0-9]+).*$/\1/p' < $srcdir/version.h`
 ND2TOOL_VERSION="${ver_major}.${ver_minor}.${ver_patch}"
 
 tempfile=$(mktemp)
@@ -0,0 +1,454 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "cache_util.h"
+
+#define NOT_NULL(x) {                                           \
+        if(x == NULL){                                          \
+            fprintf(stderr, "cache_util: NULL pointer at %s:%d\n", \
+                    __FILE__, __LINE__);                        \
+            exit(EXIT_FAILURE);                                 \
+        }                                                       \
+    }
+
+/* Identifies the format of the cache files */
+static const char cache_magic[8] = {'N', 'D', '2', 'C', 'A', 'C', 'H', '1'};
+
+static uint64_t fnv1a(uint64_t hash, const void * data, size_t n)
+{
+    const uint8_t * p = data;
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        hash ^= p[kk];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+
+int cache_key_get(const char * file, cache_key_t * key)
+{
+    memset(key, 0, sizeof(cache_key_t));
+    struct stat st;
+    if(stat(file, &st) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+    key->size = st.st_size;
+#ifdef __APPLE__
+    key->mtime_ns = (int64_t) st.st_mtimespec.tv_sec * 1000000000
+        + st.st_mtimespec.tv_nsec;
+#else
+    key->mtime_ns = (int64_t) st.st_mtim.tv_sec * 1000000000
+        + st.st_mtim.tv_nsec;
+#endif
+
+    key->path = realpath(file, NULL);
+    if(key->path == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    FILE * fid = fopen(file, "rb");
+    if(fid == NULL)
+    {
+        cache_key_free(key);
+        return EXIT_FAILURE;
+    }
+    uint8_t * header = malloc(CACHE_HEADER_BYTES);
+    NOT_NULL(header);
+    size_t nread = fread(header, 1, CACHE_HEADER_BYTES, fid);
+    fclose(fid);
+    key->header_hash = fnv1a(FNV_OFFSET, header, nread);
+    free(header);
+    return EXIT_SUCCESS;
+}
+
+void cache_key_free(cache_key_t * key)
+{
+    free(key->path);
+    key->path = NULL;
+}
+
+/* $XDG_CACHE_HOME/nd2tool or $HOME/.cache/nd2tool, created if
+ * needed. Returns NULL if there is no such folder. */
+static char * cache_dir(void)
+{
+    const char * base = getenv("XDG_CACHE_HOME");
+    const char * sub = "nd2tool";
+    if(base == NULL || base[0] == '\0')
+    {
+        base = getenv("HOME");
+        sub = ".cache/nd2tool";
+        if(base == NULL || base[0] == '\0')
+        {
+            return NULL;
+        }
+    }
+    size_t slen = strlen(base) + strlen(sub) + 2;
+    char * dir = malloc(slen);
+    NOT_NULL(dir);
+    snprintf(dir, slen, "%s/%s", base, sub);
+
+    /* Create each level that is missing */
+    for(char * p = dir + strlen(base) + 1; ; p++)
+    {
+        if(*p == '/' || *p == '\0')
+        {
+            char c = *p;
+            *p = '\0';
+            if(mkdir(dir, 0777) != 0 && errno != EEXIST)
+            {
+                free(dir);
+                return NULL;
+            }
+            *p = c;
+            if(c == '\0')
+            {
+                break;
+            }
+        }
+    }
+    return dir;
+}
+
+/* The cache file for a key, named by the hash of the path */
+static char * cache_file(const cache_key_t * key)
+{
+    char * dir = cache_dir();
+    if(dir == NULL)
+    {
+        return NULL;
+    }
+    uint64_t h = fnv1a(FNV_OFFSET, key->path, strlen(key->path));
+    size_t slen = strlen(dir) + 32;
+    char * name = malloc(slen);
+    NOT_NULL(name);
+    snprintf(name, slen, "%s/%016" PRIx64 ".bin", dir, h);
+    free(dir);
+    return name;
+}
+
+cache_buf_t * cache_buf_new(void)
+{
+    cache_buf_t * buf = calloc(1, sizeof(cache_buf_t));
+    NOT_NULL(buf);
+    return buf;
+}
+
+void cache_buf_free(cache_buf_t * buf)
+{
+    if(buf == NULL)
+    {
+        return;
+    }
+    free(buf->data);
+    free(buf);
+}
+
+void cache_put_bytes(cache_buf_t * buf, const void * bytes, size_t n)
+{
+    if(buf->size + n > buf->alloc)
+    {
+        size_t alloc = buf->alloc < 1024 ? 1024 : buf->alloc;
+        while(buf->size + n > alloc)
+        {
+            alloc *= 2;
+        }
+        buf->data = realloc(buf->data, alloc);
+        NOT_NULL(buf->data);
+        buf->alloc = alloc;
+    }
+    if(n > 0)
+    {
+        memcpy(buf->data + buf->size, bytes, n);
+    }
+    buf->size += n;
+}
+
+void cache_put_i64(cache_buf_t * buf, int64_t value)
+{
+    cache_put_bytes(buf, &value, sizeof(value));
+}
+
+void cache_put_f64(cache_buf_t * buf, double value)
+{
+    cache_put_bytes(buf, &value, sizeof(value));
+}
+
+void cache_put_f64s(cache_buf_t * buf, const double * values, size_t n)
+{
+    cache_put_bytes(buf, values, n*sizeof(double));
+}
+
+void cache_put_str(cache_buf_t * buf, const char * str)
+{
+    if(str == NULL)
+    {
+        cache_put_i64(buf, -1);
+        return;
+    }
+    size_t len = strlen(str);
+    cache_put_i64(buf, (int64_t) len);
+    cache_put_bytes(buf, str, len);
+}
+
+void cache_get_bytes(cache_buf_t * buf, void * bytes, size_t n)
+{
+    if(buf->error || n > buf->size - buf->pos)
+    {
+        buf->error = 1;
+        memset(bytes, 0, n);
+        return;
+    }
+    memcpy(bytes, buf->data + buf->pos, n);
+    buf->pos += n;
+}
+
+int64_t cache_get_i64(cache_buf_t * buf)
+{
+    int64_t value;
+    cache_get_bytes(buf, &value, sizeof(value));
+    return value;
+}
+
+double cache_get_f64(cache_buf_t * buf)
+{
+    double value;
+    cache_get_bytes(buf, &value, sizeof(value));
+    return value;
+}
+
+void cache_get_f64s(cache_buf_t * buf, double * values, size_t n)
+{
+    cache_get_bytes(buf, values, n*sizeof(double));
+}
+
+char * cache_get_str(cache_buf_t * buf)
+{
+    int64_t len = cache_get_i64(buf);
+    if(buf->error || len < 0)
+    {
+        return NULL;
+    }
+    if((uint64_t) len > buf->size - buf->pos)
+    {
+        buf->error = 1;
+        return NULL;
+    }
+    char * str = malloc(len + 1);
+    NOT_NULL(str);
+    cache_get_bytes(buf, str, len);
+    str[len] = '\0';
+    return str;
+}
+
+/* The key as it is stored first in each cache file */
+static void cache_put_key(cache_buf_t * buf, const cache_key_t * key)
+{
+    cache_put_bytes(buf, cache_magic, sizeof(cache_magic));
+    cache_put_str(buf, key->path);
+    cache_put_i64(buf, key->size);
+    cache_put_i64(buf, key->mtime_ns);
+    cache_put_i64(buf, (int64_t) key->header_hash);
+}
+
+int cache_write(const cache_key_t * key, const cache_buf_t * payload)
+{
+    char * name = cache_file(key);
+    if(name == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    size_t slen = strlen(name) + 16;
+    char * tmp = malloc(slen);
+    NOT_NULL(tmp);
+    snprintf(tmp, slen, "%s_XXXXXX", name);
+    int fd = mkstemp(tmp);
+    if(fd < 0)
+    {
+        free(tmp);
+        free(name);
+        return EXIT_FAILURE;
+    }
+
+    cache_buf_t * buf = cache_buf_new();
+    cache_put_key(buf, key);
+    cache_put_bytes(buf, payload->data, payload->size);
+
+    int status = EXIT_SUCCESS;
+    size_t nwritten = 0;
+    while(nwritten < buf->size)
+    {
+        ssize_t nw = write(fd, buf->data + nwritten, buf->size - nwritten);
+        if(nw < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(nw <= 0)
+        {
+            status = EXIT_FAILURE;
+            break;
+        }
+        nwritten += nw;
+    }
+    if(close(fd) != 0)
+    {
+        status = EXIT_FAILURE;
+    }
+    if(status == EXIT_SUCCESS && rename(tmp, name) != 0)
+    {
+        status = EXIT_FAILURE;
+    }
+    if(status != EXIT_SUCCESS)
+    {
+        unlink(tmp);
+    }
+    cache_buf_free(buf);
+    free(tmp);
+    free(name);
+    return status;
+}
+
+cache_buf_t * cache_read(const cache_key_t * key)
+{
+    char * name = cache_file(key);
+    if(name == NULL)
+    {
+        return NULL;
+    }
+    FILE * fid = fopen(name, "rb");
+    free(name);
+    if(fid == NULL)
+    {
+        return NULL;
+    }
+
+    cache_buf_t * buf = cache_buf_new();
+    uint8_t chunk[65536];
+    size_t nread;
+    while((nread = fread(chunk, 1, sizeof(chunk), fid)) > 0)
+    {
+        cache_put_bytes(buf, chunk, nread);
+    }
+    int ferr = ferror(fid);
+    fclose(fid);
+
+    /* Compare the stored key to the expected one */
+    cache_buf_t * expected = cache_buf_new();
+    cache_put_key(expected, key);
+    if(ferr || buf->size < expected->size
+       || memcmp(buf->data, expected->data, expected->size) != 0)
+    {
+        cache_buf_free(expected);
+        cache_buf_free(buf);
+        return NULL;
+    }
+    buf->pos = expected->size;
+    cache_buf_free(expected);
+    return buf;
+}
+
+void cache_util_ut(void)
+{
+    printf("-> testing cache_util\n");
+    /* Use a temporary cache folder */
+    char * old_cache = getenv("XDG_CACHE_HOME");
+    if(old_cache != NULL)
+    {
+        old_cache = strdup(old_cache);
+    }
+    char dir[] = "/tmp/nd2tool_ut_XXXXXX";
+    if(mkdtemp(dir) == NULL)
+    {
+        fprintf(stderr, "cache_util_ut: Unable to create a temporary folder\n");
+        exit(EXIT_FAILURE);
+    }
+    setenv("XDG_CACHE_HOME", dir, 1);
+
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/data.nd2", dir);
+    FILE * fid = fopen(file, "wb");
+    NOT_NULL(fid);
+    fprintf(fid, "some file");
+    fclose(fid);
+
+    cache_key_t key;
+    int ok = cache_key_get(file, &key) == EXIT_SUCCESS;
+    ok = ok && cache_read(&key) == NULL;
+
+    double values[3] = {1.5, -2, 1e300};
+    cache_buf_t * payload = cache_buf_new();
+    cache_put_i64(payload, 42);
+    cache_put_str(payload, "camera");
+    cache_put_str(payload, NULL);
+    cache_put_f64s(payload, values, 3);
+    ok = ok && cache_write(&key, payload) == EXIT_SUCCESS;
+    cache_buf_free(payload);
+
+    cache_buf_t * buf = cache_read(&key);
+    ok = ok && buf != NULL;
+    if(buf != NULL)
+    {
+        double got[3];
+        ok = ok && cache_get_i64(buf) == 42;
+        char * s1 = cache_get_str(buf);
+        char * s2 = cache_get_str(buf);
+        cache_get_f64s(buf, got, 3);
+        ok = ok && s1 != NULL && strcmp(s1, "camera") == 0 && s2 == NULL;
+        ok = ok && memcmp(got, values, sizeof(values)) == 0;
+        ok = ok && buf->error == 0 && buf->pos == buf->size;
+        /* Reading past the end is an error, not a crash */
+        ok = ok && cache_get_str(buf) == NULL && buf->error == 1;
+        free(s1);
+        free(s2);
+        cache_buf_free(buf);
+    }
+
+    /* A changed file invalidates the entry */
+    fid = fopen(file, "ab");
+    NOT_NULL(fid);
+    fprintf(fid, "!");
+    fclose(fid);
+    cache_key_t key2;
+    ok = ok && cache_key_get(file, &key2) == EXIT_SUCCESS;
+    ok = ok && key2.size == key.size + 1 && key2.header_hash != key.header_hash;
+    ok = ok && cache_read(&key2) == NULL;
+
+    char * name = cache_file(&key);
+    if(name != NULL)
+    {
+        unlink(name);
+    }
+    free(name);
+    cache_key_free(&key);
+    cache_key_free(&key2);
+    unlink(file);
+    char sub[PATH_MAX];
+    snprintf(sub, sizeof(sub), "%s/nd2tool", dir);
+    rmdir(sub);
+    rmdir(dir);
+
+    if(old_cache != NULL)
+    {
+        setenv("XDG_CACHE_HOME", old_cache, 1);
+        free(old_cache);
+    } else {
+        unsetenv("XDG_CACHE_HOME");
+    }
+
+    if(!ok)
+    {
+        fprintf(stderr, "cache_util_ut: failed\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("ok\n");
+}
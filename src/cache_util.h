@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A small on-disk cache for data derived from a file, used to avoid
+ * parsing the metadata of the same nd2 file on every run.
+ *
+ * The cache files are placed in $XDG_CACHE_HOME/nd2tool/ (or
+ * $HOME/.cache/nd2tool/), one per input file, named by a hash of the
+ * absolute path. Each starts with the key of the input file. An
+ * entry is only used when the path, the size, the modification time
+ * and a hash of the first bytes of the file all match, otherwise the
+ * data is parsed again and the entry is replaced.
+ *
+ * The payload is a sequence of values written with cache_put_* and
+ * read back in the same order with cache_get_*. Reading past the end
+ * sets the error flag of the buffer instead of failing.
+ */
+
+/* The identity of a file, see cache_key_get */
+typedef struct {
+    char * path; /* Absolute path */
+    int64_t size;
+    int64_t mtime_ns;
+    uint64_t header_hash; /* FNV-1a of the first CACHE_HEADER_BYTES */
+} cache_key_t;
+
+#define CACHE_HEADER_BYTES 65536
+
+typedef struct {
+    uint8_t * data;
+    size_t size;
+    size_t alloc;
+    size_t pos; /* Read position */
+    int error; /* Set if a value could not be read */
+} cache_buf_t;
+
+/* Fill key from the file. Returns EXIT_SUCCESS or EXIT_FAILURE */
+int cache_key_get(const char * file, cache_key_t * key);
+void cache_key_free(cache_key_t * key);
+
+cache_buf_t * cache_buf_new(void);
+void cache_buf_free(cache_buf_t * buf);
+
+void cache_put_i64(cache_buf_t * buf, int64_t value);
+void cache_put_f64(cache_buf_t * buf, double value);
+/* n doubles */
+void cache_put_f64s(cache_buf_t * buf, const double * values, size_t n);
+/* n bytes */
+void cache_put_bytes(cache_buf_t * buf, const void * bytes, size_t n);
+/* A string or NULL */
+void cache_put_str(cache_buf_t * buf, const char * str);
+
+int64_t cache_get_i64(cache_buf_t * buf);
+double cache_get_f64(cache_buf_t * buf);
+void cache_get_f64s(cache_buf_t * buf, double * values, size_t n);
+void cache_get_bytes(cache_buf_t * buf, void * bytes, size_t n);
+/* Returns a new string or NULL */
+char * cache_get_str(cache_buf_t * buf);
+
+/* Store payload for key, replacing any previous entry. The entry is
+ * written to a temporary file and renamed into place so that
+ * concurrent runs never see a partial entry. Returns EXIT_SUCCESS or
+ * EXIT_FAILURE */
+int cache_write(const cache_key_t * key, const cache_buf_t * payload);
+
+/* Return the payload stored for key or NULL if there is none or if
+ * it is stale */
+cache_buf_t * cache_read(const cache_key_t * key);
+
+/* Write, read and invalidate an entry */
+void cache_util_ut(void);
@@ -0,0 +1,196 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "coltab_util.h"
+
+#define NOT_NULL(x) {                                           \
+        if(x == NULL){                                          \
+            fprintf(stderr, "coltab: NULL pointer at %s:%d\n", \
+                    __FILE__, __LINE__);                        \
+            exit(EXIT_FAILURE);                                 \
+        }                                                       \
+    }
+
+#define COLTAB_ALIGN 64
+
+static size_t coltab_type_size(coltab_type_t type)
+{
+    return type == COLTAB_INT32 ? sizeof(int32_t) : sizeof(double);
+}
+
+static const char * coltab_type_name(coltab_type_t type)
+{
+    return type == COLTAB_INT32 ? "int32" : "float64";
+}
+
+/* Write s as a quoted JSON string */
+static void json_puts(FILE * fid, const char * s)
+{
+    fputc('"', fid);
+    for( ; *s != '\0'; s++)
+    {
+        unsigned char ch = (unsigned char) *s;
+        if(ch == '"' || ch == '\\')
+        {
+            fputc('\\', fid);
+            fputc(ch, fid);
+        } else if(ch < 0x20)
+        {
+            fprintf(fid, "\\u%04x", ch);
+        } else {
+            fputc(ch, fid);
+        }
+    }
+    fputc('"', fid);
+}
+
+static uint64_t align_up(uint64_t n)
+{
+    return (n + COLTAB_ALIGN - 1) / COLTAB_ALIGN * COLTAB_ALIGN;
+}
+
+int coltab_write(const char * fName, const char * source, int64_t nrows,
+                 const coltab_col_t * cols, int ncols)
+{
+    /* The header */
+    char * header = NULL;
+    size_t hsize = 0;
+    FILE * hf = open_memstream(&header, &hsize);
+    NOT_NULL(hf);
+    const uint16_t one = 1;
+    fprintf(hf, "{\"format\": \"nd2tool-columns\", \"version\": 1, "
+            "\"byteorder\": \"%s\", \"nrows\": %" PRId64 ", \"source\": ",
+            *((const uint8_t *) &one) == 1 ? "little" : "big", nrows);
+    if(source != NULL)
+    {
+        json_puts(hf, source);
+    } else {
+        fprintf(hf, "null");
+    }
+    fprintf(hf, ", \"columns\": [");
+    uint64_t offset = 0;
+    for(int kk = 0; kk < ncols; kk++)
+    {
+        uint64_t nbytes = nrows*coltab_type_size(cols[kk].type);
+        fprintf(hf, "%s{\"name\": ", kk > 0 ? ", " : "");
+        json_puts(hf, cols[kk].name);
+        fprintf(hf, ", \"dtype\": \"%s\", \"unit\": ",
+                coltab_type_name(cols[kk].type));
+        json_puts(hf, cols[kk].unit != NULL ? cols[kk].unit : "");
+        fprintf(hf, ", \"offset\": %" PRIu64 ", \"nbytes\": %" PRIu64 "}",
+                offset, nbytes);
+        offset = align_up(offset + nbytes);
+    }
+    fprintf(hf, "]}\n");
+    fclose(hf);
+
+    /* Pad so that the data is aligned */
+    uint64_t hlen = align_up(16 + hsize) - 16;
+
+    FILE * fid = fopen(fName, "wb");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "coltab: Unable to open %s: %s\n",
+                fName, strerror(errno));
+        free(header);
+        return EXIT_FAILURE;
+    }
+
+    uint8_t lenbytes[8];
+    for(int kk = 0; kk < 8; kk++)
+    {
+        lenbytes[kk] = (uint8_t) (hlen >> (8*kk));
+    }
+    fwrite("ND2COLS1", 1, 8, fid);
+    fwrite(lenbytes, 1, 8, fid);
+    fwrite(header, 1, hsize, fid);
+    static const char zeros[COLTAB_ALIGN] = {0};
+    for(uint64_t kk = hsize; kk < hlen; kk++)
+    {
+        fputc(' ', fid);
+    }
+    free(header);
+
+    offset = 0;
+    for(int kk = 0; kk < ncols; kk++)
+    {
+        uint64_t nbytes = nrows*coltab_type_size(cols[kk].type);
+        if(nbytes > 0)
+        {
+            fwrite(cols[kk].data, 1, nbytes, fid);
+        }
+        uint64_t next = align_up(offset + nbytes);
+        if(kk + 1 < ncols)
+        {
+            fwrite(zeros, 1, next - offset - nbytes, fid);
+        }
+        offset = next;
+    }
+
+    int status = EXIT_SUCCESS;
+    if(ferror(fid))
+    {
+        status = EXIT_FAILURE;
+    }
+    if(fclose(fid) != 0)
+    {
+        status = EXIT_FAILURE;
+    }
+    if(status != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "coltab: Failed to write %s\n", fName);
+    }
+    return status;
+}
+
+void coltab_util_ut(void)
+{
+    printf("-> testing coltab_util\n");
+    int32_t a[3] = {1, 2, 3};
+    double b[3] = {0.5, -1e10, 3};
+    coltab_col_t cols[2] = {
+        {"a", NULL, COLTAB_INT32, a},
+        {"b", "um", COLTAB_FLOAT64, b}};
+
+    char fName[] = "/tmp/nd2tool_ut_XXXXXX";
+    int fd = mkstemp(fName);
+    if(fd < 0)
+    {
+        fprintf(stderr, "coltab_util_ut: Unable to create a temporary file\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    int ok = coltab_write(fName, "x\"y.nd2", 3, cols, 2) == EXIT_SUCCESS;
+
+    FILE * fid = fopen(fName, "rb");
+    NOT_NULL(fid);
+    uint8_t buf[1024] = {0};
+    size_t nread = fread(buf, 1, sizeof(buf), fid);
+    fclose(fid);
+    unlink(fName);
+
+    uint64_t hlen = 0;
+    for(int kk = 0; kk < 8; kk++)
+    {
+        hlen |= (uint64_t) buf[8+kk] << (8*kk);
+    }
+    uint64_t data = 16 + hlen;
+    ok = ok && memcmp(buf, "ND2COLS1", 8) == 0 && data % COLTAB_ALIGN == 0;
+    ok = ok && strstr((char *) buf + 16, "\"source\": \"x\\\"y.nd2\"") != NULL;
+    ok = ok && strstr((char *) buf + 16,
+                      "{\"name\": \"b\", \"dtype\": \"float64\", \"unit\": \"um\", "
+                      "\"offset\": 64, \"nbytes\": 24}") != NULL;
+    ok = ok && nread == data + 64 + sizeof(b);
+    ok = ok && memcmp(buf + data, a, sizeof(a)) == 0;
+    ok = ok && memcmp(buf + data + 64, b, sizeof(b)) == 0;
+    if(!ok)
+    {
+        fprintf(stderr, "coltab_util_ut: Wrong file content\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("ok: %zu bytes, data at %" PRIu64 "\n", nread, data);
+}
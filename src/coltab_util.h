@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Writes a table as one contiguous array per column, so that a
+ * column can be loaded or memory mapped without parsing any text.
+ *
+ * Layout of a file:
+ *   8 bytes  "ND2COLS1"
+ *   8 bytes  Header length H, uint64_t little endian
+ *   H bytes  JSON header, padded with spaces
+ *   The columns, each starting at a multiple of 64 bytes
+ *
+ * The data begins at byte 16 + H, which is a multiple of 64. The
+ * header describes the columns:
+ *
+ * {"format": "nd2tool-columns", "version": 1, "byteorder": "little",
+ *  "nrows": 2, "source": "file.nd2",
+ *  "columns": [{"name": "x", "dtype": "float64", "unit": "um",
+ *               "offset": 0, "nbytes": 16}, ...]}
+ *
+ * where offset is relative to the beginning of the data and dtype is
+ * int32 or float64. The values are in the byte order of the machine
+ * that wrote the file, as stated by "byteorder".
+ */
+
+typedef enum {
+    COLTAB_INT32,
+    COLTAB_FLOAT64
+} coltab_type_t;
+
+typedef struct {
+    const char * name;
+    const char * unit; /* Or NULL */
+    coltab_type_t type;
+    const void * data; /* nrows values of type */
+} coltab_col_t;
+
+/* Write ncols columns of nrows values to fName. source is stored in
+ * the header, it can be NULL. Returns EXIT_SUCCESS or EXIT_FAILURE */
+int coltab_write(const char * fName, const char * source, int64_t nrows,
+                 const coltab_col_t * cols, int ncols);
+
+/* Write a small table and check the file */
+void coltab_util_ut(void);
@@ -0,0 +1,410 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deinterleave.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DEINTERLEAVE_X86
+#include <immintrin.h>
+#endif
+
+#define INLINED inline __attribute__((always_inline))
+
+/*
+ * Scalar kernels. With nchan known at compile time the inner loop is
+ * unrolled by the compiler.
+ */
+
+static INLINED void
+di_scalar_n(uint16_t * restrict out, const uint16_t * restrict in,
+            size_t from, size_t npix, const size_t nchan)
+{
+    for(size_t pp = from; pp < npix; pp++)
+    {
+        for(size_t cc = 0; cc < nchan; cc++)
+        {
+            out[cc*npix + pp] = in[pp*nchan + cc];
+        }
+    }
+}
+
+static void
+di_scalar(uint16_t * restrict out, const uint16_t * restrict in,
+          size_t from, size_t npix, int nchan)
+{
+    switch(nchan)
+    {
+    case 1:
+        memcpy(out + from, in + from, (npix-from)*sizeof(uint16_t));
+        break;
+    case 2:
+        di_scalar_n(out, in, from, npix, 2);
+        break;
+    case 3:
+        di_scalar_n(out, in, from, npix, 3);
+        break;
+    case 4:
+        di_scalar_n(out, in, from, npix, 4);
+        break;
+    default:
+        di_scalar_n(out, in, from, npix, nchan);
+        break;
+    }
+}
+
+#ifdef DEINTERLEAVE_X86
+
+/* pshufb masks that gather channel c of 8 pixels from vector j when
+ * 3 channels are interlaced. -1 gives a zero which is or-ed away. */
+static const int8_t di_mask3[3][3][16] = {
+    {{ 0,  1,  6,  7, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1,  2,  3,  8,  9, 14, 15, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  4,  5, 10, 11}},
+    {{ 2,  3,  8,  9, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1,  4,  5, 10, 11, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0,  1,  6,  7, 12, 13}},
+    {{ 4,  5, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1,  0,  1,  6,  7, 12, 13, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  2,  3,  8,  9, 14, 15}}};
+
+/* Even 16-bit words to the low half, odd to the high half */
+static const int8_t di_mask2[16] = {
+    0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15};
+
+/* Two pixels with 4 channels to one 32-bit word per channel */
+static const int8_t di_mask4[16] = {
+    0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15};
+
+/*
+ * SSE4.1 kernels, 8 pixels per iteration. Return the number of
+ * pixels processed, the rest is left to the scalar code.
+ */
+
+__attribute__((target("sse4.1")))
+static size_t
+di_sse41_2(uint16_t * restrict out, const uint16_t * restrict in, size_t npix)
+{
+    const __m128i mask = _mm_loadu_si128((const __m128i *) di_mask2);
+    size_t pp = 0;
+    for( ; pp + 8 <= npix; pp += 8)
+    {
+        const __m128i * src = (const __m128i *) (in + 2*pp);
+        __m128i a = _mm_shuffle_epi8(_mm_loadu_si128(src), mask);
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128(src + 1), mask);
+        _mm_storeu_si128((__m128i *) (out + pp),
+                         _mm_unpacklo_epi64(a, b));
+        _mm_storeu_si128((__m128i *) (out + npix + pp),
+                         _mm_unpackhi_epi64(a, b));
+    }
+    return pp;
+}
+
+__attribute__((target("sse4.1")))
+static size_t
+di_sse41_3(uint16_t * restrict out, const uint16_t * restrict in, size_t npix)
+{
+    __m128i mask[3][3];
+    for(int cc = 0; cc < 3; cc++)
+    {
+        for(int jj = 0; jj < 3; jj++)
+        {
+            mask[cc][jj] = _mm_loadu_si128((const __m128i *) di_mask3[cc][jj]);
+        }
+    }
+
+    size_t pp = 0;
+    for( ; pp + 8 <= npix; pp += 8)
+    {
+        const __m128i * src = (const __m128i *) (in + 3*pp);
+        __m128i v0 = _mm_loadu_si128(src);
+        __m128i v1 = _mm_loadu_si128(src + 1);
+        __m128i v2 = _mm_loadu_si128(src + 2);
+        for(int cc = 0; cc < 3; cc++)
+        {
+            __m128i c = _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(v0, mask[cc][0]),
+                             _mm_shuffle_epi8(v1, mask[cc][1])),
+                _mm_shuffle_epi8(v2, mask[cc][2]));
+            _mm_storeu_si128((__m128i *) (out + cc*npix + pp), c);
+        }
+    }
+    return pp;
+}
+
+__attribute__((target("sse4.1")))
+static size_t
+di_sse41_4(uint16_t * restrict out, const uint16_t * restrict in, size_t npix)
+{
+    const __m128i mask = _mm_loadu_si128((const __m128i *) di_mask4);
+    size_t pp = 0;
+    for( ; pp + 8 <= npix; pp += 8)
+    {
+        const __m128i * src = (const __m128i *) (in + 4*pp);
+        /* One 32-bit word per channel, i.e., two pixels */
+        __m128i v0 = _mm_shuffle_epi8(_mm_loadu_si128(src), mask);
+        __m128i v1 = _mm_shuffle_epi8(_mm_loadu_si128(src + 1), mask);
+        __m128i v2 = _mm_shuffle_epi8(_mm_loadu_si128(src + 2), mask);
+        __m128i v3 = _mm_shuffle_epi8(_mm_loadu_si128(src + 3), mask);
+        /* 4x4 transpose of the 32-bit words */
+        __m128i t0 = _mm_unpacklo_epi32(v0, v1);
+        __m128i t1 = _mm_unpacklo_epi32(v2, v3);
+        __m128i t2 = _mm_unpackhi_epi32(v0, v1);
+        __m128i t3 = _mm_unpackhi_epi32(v2, v3);
+        _mm_storeu_si128((__m128i *) (out + pp),
+                         _mm_unpacklo_epi64(t0, t1));
+        _mm_storeu_si128((__m128i *) (out + npix + pp),
+                         _mm_unpackhi_epi64(t0, t1));
+        _mm_storeu_si128((__m128i *) (out + 2*npix + pp),
+                         _mm_unpacklo_epi64(t2, t3));
+        _mm_storeu_si128((__m128i *) (out + 3*npix + pp),
+                         _mm_unpackhi_epi64(t2, t3));
+    }
+    return pp;
+}
+
+/*
+ * AVX2 kernels, 16 pixels per iteration. The input is loaded so that
+ * the low 128-bit lane holds the first 8 pixels and the high lane the
+ * next 8. Then the in-lane shuffles of the SSE kernels can be used
+ * without any lane crossing.
+ */
+
+__attribute__((target("avx2")))
+static inline __m256i
+di_load2x128(const uint16_t * lo, const uint16_t * hi)
+{
+    __m256i v = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) lo));
+    return _mm256_inserti128_si256(v, _mm_loadu_si128((const __m128i *) hi), 1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+di_mask256(const int8_t * mask)
+{
+    return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) mask));
+}
+
+__attribute__((target("avx2")))
+static size_t
+di_avx2_2(uint16_t * restrict out, const uint16_t * restrict in, size_t npix)
+{
+    const __m256i mask = di_mask256(di_mask2);
+    size_t pp = 0;
+    for( ; pp + 16 <= npix; pp += 16)
+    {
+        const uint16_t * src = in + 2*pp;
+        __m256i a = _mm256_shuffle_epi8(di_load2x128(src, src + 16), mask);
+        __m256i b = _mm256_shuffle_epi8(di_load2x128(src + 8, src + 24), mask);
+        _mm256_storeu_si256((__m256i *) (out + pp),
+                            _mm256_unpacklo_epi64(a, b));
+        _mm256_storeu_si256((__m256i *) (out + npix + pp),
+                            _mm256_unpackhi_epi64(a, b));
+    }
+    return pp;
+}
+
+__attribute__((target("avx2")))
+static size_t
+di_avx2_3(uint16_t * restrict out, const uint16_t * restrict in, size_t npix)
+{
+    __m256i mask[3][3];
+    for(int cc = 0; cc < 3; cc++)
+    {
+        for(int jj = 0; jj < 3; jj++)
+        {
+            mask[cc][jj] = di_mask256(di_mask3[cc][jj]);
+        }
+    }
+
+    size_t pp = 0;
+    for( ; pp + 16 <= npix; pp += 16)
+    {
+        const uint16_t * src = in + 3*pp;
+        __m256i v0 = di_load2x128(src, src + 24);
+        __m256i v1 = di_load2x128(src + 8, src + 32);
+        __m256i v2 = di_load2x128(src + 16, src + 40);
+        for(int cc = 0; cc < 3; cc++)
+        {
+            __m256i c = _mm256_or_si256(
+                _mm256_or_si256(_mm256_shuffle_epi8(v0, mask[cc][0]),
+                                _mm256_shuffle_epi8(v1, mask[cc][1])),
+                _mm256_shuffle_epi8(v2, mask[cc][2]));
+            _mm256_storeu_si256((__m256i *) (out + cc*npix + pp), c);
+        }
+    }
+    return pp;
+}
+
+__attribute__((target("avx2")))
+static size_t
+di_avx2_4(uint16_t * restrict out, const uint16_t * restrict in, size_t npix)
+{
+    const __m256i mask = di_mask256(di_mask4);
+    size_t pp = 0;
+    for( ; pp + 16 <= npix; pp += 16)
+    {
+        const uint16_t * src = in + 4*pp;
+        __m256i v0 = _mm256_shuffle_epi8(di_load2x128(src, src + 32), mask);
+        __m256i v1 = _mm256_shuffle_epi8(di_load2x128(src + 8, src + 40), mask);
+        __m256i v2 = _mm256_shuffle_epi8(di_load2x128(src + 16, src + 48), mask);
+        __m256i v3 = _mm256_shuffle_epi8(di_load2x128(src + 24, src + 56), mask);
+        __m256i t0 = _mm256_unpacklo_epi32(v0, v1);
+        __m256i t1 = _mm256_unpacklo_epi32(v2, v3);
+        __m256i t2 = _mm256_unpackhi_epi32(v0, v1);
+        __m256i t3 = _mm256_unpackhi_epi32(v2, v3);
+        _mm256_storeu_si256((__m256i *) (out + pp),
+                            _mm256_unpacklo_epi64(t0, t1));
+        _mm256_storeu_si256((__m256i *) (out + npix + pp),
+                            _mm256_unpackhi_epi64(t0, t1));
+        _mm256_storeu_si256((__m256i *) (out + 2*npix + pp),
+                            _mm256_unpacklo_epi64(t2, t3));
+        _mm256_storeu_si256((__m256i *) (out + 3*npix + pp),
+                            _mm256_unpackhi_epi64(t2, t3));
+    }
+    return pp;
+}
+
+#endif /* DEINTERLEAVE_X86 */
+
+deinterleave_isa_t deinterleave_isa(void)
+{
+#ifdef DEINTERLEAVE_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        return DEINTERLEAVE_AVX2;
+    }
+    if(__builtin_cpu_supports("sse4.1"))
+    {
+        return DEINTERLEAVE_SSE41;
+    }
+#endif
+    return DEINTERLEAVE_SCALAR;
+}
+
+const char * deinterleave_isa_name(deinterleave_isa_t isa)
+{
+    switch(isa)
+    {
+    case DEINTERLEAVE_AVX2:
+        return "avx2";
+    case DEINTERLEAVE_SSE41:
+        return "sse4.1";
+    default:
+        return "scalar";
+    }
+}
+
+void deinterleave_u16_isa(uint16_t * out, const uint16_t * in,
+                          size_t npix, int nchan,
+                          deinterleave_isa_t isa)
+{
+    size_t done = 0;
+
+    if(isa > deinterleave_isa())
+    {
+        isa = deinterleave_isa();
+    }
+
+#ifdef DEINTERLEAVE_X86
+    if(isa == DEINTERLEAVE_AVX2)
+    {
+        switch(nchan)
+        {
+        case 2:
+            done = di_avx2_2(out, in, npix);
+            break;
+        case 3:
+            done = di_avx2_3(out, in, npix);
+            break;
+        case 4:
+            done = di_avx2_4(out, in, npix);
+            break;
+        default:
+            break;
+        }
+    }
+    if(isa == DEINTERLEAVE_SSE41)
+    {
+        switch(nchan)
+        {
+        case 2:
+            done = di_sse41_2(out, in, npix);
+            break;
+        case 3:
+            done = di_sse41_3(out, in, npix);
+            break;
+        case 4:
+            done = di_sse41_4(out, in, npix);
+            break;
+        default:
+            break;
+        }
+    }
+#endif
+
+    /* Remaining pixels, and everything when there is no vector
+     * kernel for this number of channels */
+    di_scalar(out, in, done, npix, nchan);
+    return;
+}
+
+void deinterleave_u16(uint16_t * out, const uint16_t * in,
+                      size_t npix, int nchan)
+{
+    deinterleave_u16_isa(out, in, npix, nchan, deinterleave_isa());
+}
+
+static void deinterleave_test(size_t npix, int nchan, deinterleave_isa_t isa)
+{
+    uint16_t * in = calloc(npix*nchan + 1, sizeof(uint16_t));
+    uint16_t * out = calloc(npix*nchan + 1, sizeof(uint16_t));
+    if(in == NULL || out == NULL)
+    {
+        fprintf(stderr, "deinterleave_test: calloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t kk = 0; kk < npix*nchan; kk++)
+    {
+        in[kk] = (uint16_t) (kk*2654435761u >> 7);
+    }
+
+    deinterleave_u16_isa(out, in, npix, nchan, isa);
+
+    for(size_t pp = 0; pp < npix; pp++)
+    {
+        for(int cc = 0; cc < nchan; cc++)
+        {
+            if(out[cc*npix + pp] != in[pp*nchan + cc])
+            {
+                fprintf(stderr, "deinterleave_test failed\n");
+                fprintf(stderr, "isa=%s, npix=%zu, nchan=%d, pixel %zu, channel %d\n",
+                        deinterleave_isa_name(isa), npix, nchan, pp, cc);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    free(out);
+    free(in);
+}
+
+void deinterleave_ut(void)
+{
+    printf("-> testing deinterleave_u16\n");
+    const size_t sizes[] = {0, 1, 7, 8, 9, 15, 16, 17, 31, 33, 1024, 4099};
+    const size_t nsizes = sizeof(sizes)/sizeof(sizes[0]);
+
+    for(int isa = DEINTERLEAVE_SCALAR; isa <= (int) deinterleave_isa(); isa++)
+    {
+        for(int nchan = 1; nchan <= 6; nchan++)
+        {
+            for(size_t kk = 0; kk < nsizes; kk++)
+            {
+                deinterleave_test(sizes[kk], nchan, isa);
+            }
+        }
+        printf("ok: deinterleave_u16 (%s)\n",
+               deinterleave_isa_name(isa));
+    }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Split interlaced image data into one plane per channel.
+ *
+ * The nd2 library returns the pixels of all channels interlaced,
+ * i.e., in[pp*nchan + cc] is pixel pp of channel cc. These functions
+ * write channel cc to out + cc*npix.
+ *
+ * There are kernels specialised for 1, 2, 3 and 4 channels, with
+ * AVX2 and SSE4.1 versions on x86. The fastest kernel that the CPU
+ * supports is selected at runtime.
+ */
+
+typedef enum {
+    DEINTERLEAVE_SCALAR,
+    DEINTERLEAVE_SSE41,
+    DEINTERLEAVE_AVX2
+} deinterleave_isa_t;
+
+/* De-interleave npix pixels with nchan channels from in to out */
+void deinterleave_u16(uint16_t * out, const uint16_t * in,
+                      size_t npix, int nchan);
+
+/* Like deinterleave_u16 but using a specific instruction set. Falls
+ * back to scalar code if the CPU does not support isa. */
+void deinterleave_u16_isa(uint16_t * out, const uint16_t * in,
+                          size_t npix, int nchan,
+                          deinterleave_isa_t isa);
+
+/* The best instruction set supported by this CPU */
+deinterleave_isa_t deinterleave_isa(void);
+
+/* Name of an instruction set, "scalar", "sse4.1" or "avx2" */
+const char * deinterleave_isa_name(deinterleave_isa_t isa);
+
+/* Compare all kernels to a reference implementation */
+void deinterleave_ut(void);
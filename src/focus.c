@@ -0,0 +1,309 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "focus.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FOCUS_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * All kernels work on one row at a time. down is non-zero when there
+ * is a row below, i.e. for all but the last row. The vector kernels
+ * return the number of pixels done, the rest is done by fo_row_scalar.
+ */
+
+static void
+fo_row_scalar(focus_sums_t * s, const uint16_t * row, size_t from,
+              size_t M, int down)
+{
+    uint64_t sum = 0;
+    uint64_t energy = 0;
+    for(size_t xx = from; xx < M; xx++)
+    {
+        int64_t v = row[xx];
+        sum += v;
+        if(xx + 1 < M)
+        {
+            int64_t d = row[xx+1] - v;
+            energy += d*d;
+        }
+        if(down)
+        {
+            int64_t d = row[xx+M] - v;
+            energy += d*d;
+        }
+    }
+    s->sum += sum;
+    s->energy += energy;
+}
+
+#ifdef FOCUS_X86
+
+/* The differences are up to 65535 in magnitude so the squares fit in
+ * unsigned 32-bit lanes. They are summed in 64-bit lanes. */
+
+__attribute__((target("sse4.1")))
+static inline __m128i
+fo_add_u32_sse41(__m128i acc, __m128i v)
+{
+    const __m128i zero = _mm_setzero_si128();
+    acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+    return _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i
+fo_load4(const uint16_t * p)
+{
+    return _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *) p));
+}
+
+__attribute__((target("sse4.1")))
+static uint64_t
+fo_hsum_sse41(__m128i v)
+{
+    uint64_t w[2];
+    _mm_storeu_si128((__m128i *) w, v);
+    return w[0] + w[1];
+}
+
+__attribute__((target("sse4.1")))
+static size_t
+fo_row_sse41(focus_sums_t * s, const uint16_t * row, size_t M, int down)
+{
+    __m128i sum = _mm_setzero_si128();
+    __m128i energy = _mm_setzero_si128();
+    size_t xx = 0;
+    for( ; xx + 4 < M; xx += 4)
+    {
+        __m128i a = fo_load4(row + xx);
+        __m128i dx = _mm_sub_epi32(fo_load4(row + xx + 1), a);
+        sum = fo_add_u32_sse41(sum, a);
+        energy = fo_add_u32_sse41(energy, _mm_mullo_epi32(dx, dx));
+        if(down)
+        {
+            __m128i dy = _mm_sub_epi32(fo_load4(row + xx + M), a);
+            energy = fo_add_u32_sse41(energy, _mm_mullo_epi32(dy, dy));
+        }
+    }
+    s->sum += fo_hsum_sse41(sum);
+    s->energy += fo_hsum_sse41(energy);
+    return xx;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+fo_add_u32_avx2(__m256i acc, __m256i v)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+    return _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+fo_load8(const uint16_t * p)
+{
+    return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) p));
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+fo_hsum_avx2(__m256i v)
+{
+    uint64_t w[4];
+    _mm256_storeu_si256((__m256i *) w, v);
+    return w[0] + w[1] + w[2] + w[3];
+}
+
+__attribute__((target("avx2")))
+static size_t
+fo_row_avx2(focus_sums_t * s, const uint16_t * row, size_t M, int down)
+{
+    __m256i sum = _mm256_setzero_si256();
+    __m256i energy = _mm256_setzero_si256();
+    size_t xx = 0;
+    for( ; xx + 8 < M; xx += 8)
+    {
+        __m256i a = fo_load8(row + xx);
+        __m256i dx = _mm256_sub_epi32(fo_load8(row + xx + 1), a);
+        sum = fo_add_u32_avx2(sum, a);
+        energy = fo_add_u32_avx2(energy, _mm256_mullo_epi32(dx, dx));
+        if(down)
+        {
+            __m256i dy = _mm256_sub_epi32(fo_load8(row + xx + M), a);
+            energy = fo_add_u32_avx2(energy, _mm256_mullo_epi32(dy, dy));
+        }
+    }
+    s->sum += fo_hsum_avx2(sum);
+    s->energy += fo_hsum_avx2(energy);
+    return xx;
+}
+
+#endif /* FOCUS_X86 */
+
+void focus_sums_u16_isa(focus_sums_t * s, const uint16_t * I,
+                        size_t M, size_t N, deinterleave_isa_t isa)
+{
+    memset(s, 0, sizeof(focus_sums_t));
+
+    if(isa > deinterleave_isa())
+    {
+        isa = deinterleave_isa();
+    }
+
+    for(size_t yy = 0; yy < N; yy++)
+    {
+        const uint16_t * row = I + yy*M;
+        int down = yy + 1 < N;
+        size_t done = 0;
+#ifdef FOCUS_X86
+        if(isa == DEINTERLEAVE_AVX2)
+        {
+            done = fo_row_avx2(s, row, M, down);
+        }
+        if(isa == DEINTERLEAVE_SSE41)
+        {
+            done = fo_row_sse41(s, row, M, down);
+        }
+#endif
+        fo_row_scalar(s, row, done, M, down);
+    }
+}
+
+void focus_sums_u16(focus_sums_t * s, const uint16_t * I,
+                    size_t M, size_t N)
+{
+    focus_sums_u16_isa(s, I, M, N, deinterleave_isa());
+}
+
+double focus_score(const focus_sums_t * s, size_t M, size_t N)
+{
+    if(M == 0 || N == 0 || M*N == 1 || s->sum == 0)
+    {
+        return 0;
+    }
+    double ndiff = (double) (M-1)*N + (double) M*(N-1);
+    double mean = (double) s->sum / ((double) M*N);
+    return (double) s->energy / ndiff / (mean*mean);
+}
+
+double focus_u16(const uint16_t * I, size_t M, size_t N)
+{
+    focus_sums_t s;
+    focus_sums_u16(&s, I, M, N);
+    return focus_score(&s, M, N);
+}
+
+/* Straight from the definition */
+static void
+focus_sums_ref(focus_sums_t * s, const uint16_t * I, size_t M, size_t N)
+{
+    memset(s, 0, sizeof(focus_sums_t));
+    for(size_t yy = 0; yy < N; yy++)
+    {
+        for(size_t xx = 0; xx < M; xx++)
+        {
+            int64_t v = I[yy*M + xx];
+            s->sum += v;
+            if(xx + 1 < M)
+            {
+                int64_t d = I[yy*M + xx + 1] - v;
+                s->energy += d*d;
+            }
+            if(yy + 1 < N)
+            {
+                int64_t d = I[(yy+1)*M + xx] - v;
+                s->energy += d*d;
+            }
+        }
+    }
+}
+
+static void focus_test(size_t M, size_t N, deinterleave_isa_t isa)
+{
+    /* Exactly one plane, so that reads past it are found by the
+     * sanitizers */
+    uint16_t * I = calloc(M*N, sizeof(uint16_t));
+    if(I == NULL)
+    {
+        fprintf(stderr, "focus_test: calloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t kk = 0; kk < M*N; kk++)
+    {
+        /* Includes the extremes, 0 next to 65535 */
+        I[kk] = kk % 5 == 0 ? 65535 : (uint16_t) (kk*2654435761u >> 9);
+    }
+
+    focus_sums_t ref;
+    focus_sums_t s;
+    focus_sums_ref(&ref, I, M, N);
+    focus_sums_u16_isa(&s, I, M, N, isa);
+    if(s.sum != ref.sum || s.energy != ref.energy)
+    {
+        fprintf(stderr, "focus_test failed\n");
+        fprintf(stderr, "isa=%s, M=%zu, N=%zu\n",
+                deinterleave_isa_name(isa), M, N);
+        exit(EXIT_FAILURE);
+    }
+    free(I);
+}
+
+void focus_ut(void)
+{
+    printf("-> testing focus_u16\n");
+    const size_t sizes[] = {1, 2, 3, 4, 5, 8, 9, 15, 16, 17, 33, 257};
+    const size_t nsizes = sizeof(sizes)/sizeof(sizes[0]);
+    for(int isa = DEINTERLEAVE_SCALAR; isa <= (int) deinterleave_isa(); isa++)
+    {
+        for(size_t mm = 0; mm < nsizes; mm++)
+        {
+            for(size_t nn = 0; nn < nsizes; nn++)
+            {
+                focus_test(sizes[mm], sizes[nn], isa);
+            }
+        }
+        printf("ok: focus_u16 (%s)\n", deinterleave_isa_name(isa));
+    }
+
+    /* A sharp edge scores higher than a ramp between the same values,
+     * and the score does not depend on the brightness */
+    size_t M = 64;
+    uint16_t * sharp = calloc(M*M, sizeof(uint16_t));
+    uint16_t * blurred = calloc(M*M, sizeof(uint16_t));
+    uint16_t * bright = calloc(M*M, sizeof(uint16_t));
+    if(sharp == NULL || blurred == NULL || bright == NULL)
+    {
+        fprintf(stderr, "focus_ut: calloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t yy = 0; yy < M; yy++)
+    {
+        for(size_t xx = 0; xx < M; xx++)
+        {
+            sharp[yy*M + xx] = xx < M/2 ? 100 : 1100;
+            double t = ((double) xx - (M/2 - 8)) / 16.0;
+            t = t < 0 ? 0 : t > 1 ? 1 : t;
+            blurred[yy*M + xx] = (uint16_t) (100 + 1000*t);
+            bright[yy*M + xx] = 2*sharp[yy*M + xx];
+        }
+    }
+    double fs = focus_u16(sharp, M, M);
+    double fb = focus_u16(blurred, M, M);
+    double f2 = focus_u16(bright, M, M);
+    if(!(fs > fb) || fabs(f2 - fs) > 1e-9*fs)
+    {
+        fprintf(stderr, "focus_ut: sharp %f, blurred %f, bright %f\n",
+                fs, fb, f2);
+        exit(EXIT_FAILURE);
+    }
+    free(bright);
+    free(blurred);
+    free(sharp);
+    printf("ok: focus_score\n");
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "deinterleave.h"
+
+/* A focus measure of an image plane, to find the most in focus slice
+ * of a stack, see --focus.
+ *
+ * The measure is the gradient energy, i.e. the mean of the squared
+ * differences between each pixel and its right and lower neighbour,
+ * divided by the squared mean intensity so that slices that are
+ * dimmer, e.g. from bleaching, are not penalised. It is larger the
+ * sharper the plane is.
+ *
+ * The sums are exact integers so all kernels give the same result.
+ * They use the instruction sets of deinterleave.h and are selected at
+ * runtime in the same way.
+ */
+
+typedef struct {
+    uint64_t sum; /* Of the pixel values */
+    uint64_t energy; /* Of the squared differences to the neighbours */
+} focus_sums_t;
+
+/* The sums over a plane of M x N pixels, M is the fast dimension */
+void focus_sums_u16(focus_sums_t * s, const uint16_t * I,
+                    size_t M, size_t N);
+
+/* Like focus_sums_u16 but using a specific instruction set. Falls
+ * back to scalar code if the CPU does not support isa. */
+void focus_sums_u16_isa(focus_sums_t * s, const uint16_t * I,
+                        size_t M, size_t N, deinterleave_isa_t isa);
+
+/* The focus measure from the sums of a plane of M x N pixels, 0 for
+ * planes that are black or too small */
+double focus_score(const focus_sums_t * s, size_t M, size_t N);
+
+/* focus_score of a plane */
+double focus_u16(const uint16_t * I, size_t M, size_t N);
+
+/* Compare all kernels to a reference implementation */
+void focus_ut(void);
@@ -0,0 +1,264 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash_util.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+/* Bytes of the file that are mapped at a time by hash_file */
+#define HASH_FILE_CHUNK ((size_t) 64*1024*1024)
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/* Little endian reads, like the tif files */
+static inline uint64_t read64(const uint8_t * p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t * p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t hash_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= hash_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* Consume 32-byte stripes, returns the number of bytes used */
+static size_t hash_stripes(uint64_t * v, const uint8_t * p, size_t len)
+{
+    const uint8_t * start = p;
+    const uint8_t * end = p + len;
+    while(p + 32 <= end)
+    {
+        v[0] = hash_round(v[0], read64(p));
+        v[1] = hash_round(v[1], read64(p + 8));
+        v[2] = hash_round(v[2], read64(p + 16));
+        v[3] = hash_round(v[3], read64(p + 24));
+        p += 32;
+    }
+    return p - start;
+}
+
+void hash_init(hash_state_t * h, uint64_t seed)
+{
+    memset(h, 0, sizeof(hash_state_t));
+    h->v[0] = seed + PRIME64_1 + PRIME64_2;
+    h->v[1] = seed + PRIME64_2;
+    h->v[2] = seed;
+    h->v[3] = seed - PRIME64_1;
+}
+
+void hash_update(hash_state_t * h, const void * data, size_t len)
+{
+    const uint8_t * p = data;
+    h->total_len += len;
+
+    if(h->memsize + len < 32)
+    {
+        memcpy(h->mem + h->memsize, p, len);
+        h->memsize += len;
+        return;
+    }
+    if(h->memsize > 0)
+    {
+        size_t fill = 32 - h->memsize;
+        memcpy(h->mem + h->memsize, p, fill);
+        hash_stripes(h->v, h->mem, 32);
+        p += fill;
+        len -= fill;
+        h->memsize = 0;
+    }
+    size_t used = hash_stripes(h->v, p, len);
+    memcpy(h->mem, p + used, len - used);
+    h->memsize = len - used;
+}
+
+uint64_t hash_digest(const hash_state_t * h)
+{
+    uint64_t acc;
+    if(h->total_len >= 32)
+    {
+        acc = rotl64(h->v[0], 1) + rotl64(h->v[1], 7)
+            + rotl64(h->v[2], 12) + rotl64(h->v[3], 18);
+        for(int kk = 0; kk < 4; kk++)
+        {
+            acc = hash_merge_round(acc, h->v[kk]);
+        }
+    } else {
+        /* v[2] is the seed */
+        acc = h->v[2] + PRIME64_5;
+    }
+    acc += h->total_len;
+
+    const uint8_t * p = h->mem;
+    size_t len = h->memsize;
+    while(len >= 8)
+    {
+        acc ^= hash_round(0, read64(p));
+        acc = rotl64(acc, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+        len -= 8;
+    }
+    if(len >= 4)
+    {
+        acc ^= (uint64_t) read32(p) * PRIME64_1;
+        acc = rotl64(acc, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+    while(len > 0)
+    {
+        acc ^= p[0] * PRIME64_5;
+        acc = rotl64(acc, 11) * PRIME64_1;
+        p++;
+        len--;
+    }
+
+    acc ^= acc >> 33;
+    acc *= PRIME64_2;
+    acc ^= acc >> 29;
+    acc *= PRIME64_3;
+    acc ^= acc >> 32;
+    return acc;
+}
+
+uint64_t hash_u64(const void * data, size_t len)
+{
+    hash_state_t h;
+    hash_init(&h, 0);
+    hash_update(&h, data, len);
+    return hash_digest(&h);
+}
+
+uint64_t hash_pages(const uint64_t * page, int64_t n)
+{
+    return hash_u64(page, n*sizeof(uint64_t));
+}
+
+int hash_file(const char * fName, uint64_t * hash, int64_t * size)
+{
+    int fd = open(fName, O_RDONLY);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    struct stat sb;
+    if(fstat(fd, &sb) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    size_t nbytes = (size_t) sb.st_size;
+
+    hash_state_t h;
+    hash_init(&h, 0);
+    /* Mapped one chunk at a time so that the pages can be dropped as
+     * soon as they are hashed */
+    for(size_t pos = 0; pos < nbytes; pos += HASH_FILE_CHUNK)
+    {
+        size_t len = nbytes - pos;
+        if(len > HASH_FILE_CHUNK)
+        {
+            len = HASH_FILE_CHUNK;
+        }
+        void * p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, (off_t) pos);
+        if(p == MAP_FAILED)
+        {
+            close(fd);
+            return -1;
+        }
+        madvise(p, len, MADV_SEQUENTIAL);
+        hash_update(&h, p, len);
+        munmap(p, len);
+    }
+    close(fd);
+    hash[0] = hash_digest(&h);
+    if(size != NULL)
+    {
+        size[0] = (int64_t) nbytes;
+    }
+    return 0;
+}
+
+void hash_util_ut(void)
+{
+    printf("-> testing hash_util\n");
+    int ok = 1;
+    /* Reference values from xxhsum */
+    ok = ok && hash_u64("", 0) == 0xEF46DB3751D8E999ULL;
+    ok = ok && hash_u64("a", 1) == 0xD24EC4F1A98C6E5BULL;
+    const char * str = "Nobody inspects the spammish repetition";
+    ok = ok && hash_u64(str, strlen(str)) == 0xFBCEA83C8A378BF1ULL;
+
+    /* Fed in pieces of all sizes */
+    size_t n = 1000;
+    uint8_t * data = malloc(n);
+    if(data == NULL)
+    {
+        fprintf(stderr, "hash_util_ut: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        data[kk] = (uint8_t) (kk*7919 >> 3);
+    }
+    uint64_t ref = hash_u64(data, n);
+    for(size_t step = 1; step < 70; step++)
+    {
+        hash_state_t h;
+        hash_init(&h, 0);
+        for(size_t pos = 0; pos < n; pos += step)
+        {
+            hash_update(&h, data + pos, pos + step > n ? n - pos : step);
+        }
+        ok = ok && hash_digest(&h) == ref;
+    }
+
+    char fName[] = "/tmp/nd2tool_ut_XXXXXX";
+    int fd = mkstemp(fName);
+    ok = ok && fd >= 0 && write(fd, data, n) == (ssize_t) n;
+    if(fd >= 0)
+    {
+        close(fd);
+        uint64_t fhash = 0;
+        int64_t fsize = 0;
+        ok = ok && hash_file(fName, &fhash, &fsize) == 0;
+        ok = ok && fhash == ref && fsize == (int64_t) n;
+        unlink(fName);
+    }
+    free(data);
+
+    if(!ok)
+    {
+        fprintf(stderr, "hash_util_ut: failed\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("ok: hash_util\n");
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* XXH64 hashes, the same as `xxhsum -H1`, for the manifest of the
+ * source file and the pixel data of the output files.
+ *
+ * The pixel data of a stack is hashed one page at a time, when the
+ * page is written, so the pages can come in any order and from
+ * several threads. The hash of the stack is then the hash of the
+ * page hashes, in page order, see hash_pages.
+ */
+
+typedef struct {
+    uint64_t total_len;
+    uint64_t v[4];
+    uint8_t mem[32];
+    size_t memsize;
+} hash_state_t;
+
+void hash_init(hash_state_t * h, uint64_t seed);
+void hash_update(hash_state_t * h, const void * data, size_t len);
+uint64_t hash_digest(const hash_state_t * h);
+
+/* XXH64 of data with seed 0 */
+uint64_t hash_u64(const void * data, size_t len);
+
+/* The hash of a stack of n pages with the page hashes in page, stored
+ * as little endian 64-bit words */
+uint64_t hash_pages(const uint64_t * page, int64_t n);
+
+/* Hash the file fName by mapping it, without keeping it in memory.
+ * The size is returned in size (if not NULL). Returns 0 on success. */
+int hash_file(const char * fName, uint64_t * hash, int64_t * size);
+
+void hash_util_ut(void);
@@ -0,0 +1,596 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "journal_util.h"
+#include "nd2tool_util.h"
+
+static void * ckcalloc(size_t n, size_t size)
+{
+    void * p = calloc(n, size);
+    if(p == NULL)
+    {
+        fprintf(stderr, "journal: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static char * ckstrdup(const char * s)
+{
+    char * d = strdup(s);
+    if(d == NULL)
+    {
+        fprintf(stderr, "journal: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return d;
+}
+
+static void journal_fsync(int fd)
+{
+#ifdef __APPLE__
+    fsync(fd);
+#else
+    fdatasync(fd);
+#endif
+}
+
+/* The name without the folder */
+static const char * journal_basename(const char * name)
+{
+    const char * slash = strrchr(name, '/');
+    return slash == NULL ? name : slash + 1;
+}
+
+static journal_file_t * journal_add(journal_t * j, const char * outname,
+                                    const char * tmpname,
+                                    int64_t M, int64_t N, int64_t P,
+                                    int64_t bpp, int compression)
+{
+    if(j->nfiles == j->nalloc)
+    {
+        j->nalloc = j->nalloc == 0 ? 64 : 2*j->nalloc;
+        j->files = realloc(j->files, j->nalloc*sizeof(journal_file_t *));
+        if(j->files == NULL)
+        {
+            fprintf(stderr, "journal: Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    journal_file_t * f = ckcalloc(1, sizeof(journal_file_t));
+    f->id = j->nfiles;
+    f->outname = ckstrdup(journal_basename(outname));
+    f->tmpname = ckstrdup(journal_basename(tmpname));
+    f->M = M;
+    f->N = N;
+    f->P = P;
+    f->bpp = bpp;
+    f->compression = compression;
+    f->done = ckcalloc(P, 1);
+    f->offsets = ckcalloc(P*bpp, sizeof(uint64_t));
+    f->bytes = ckcalloc(P*bpp, sizeof(uint64_t));
+    f->page_hash = ckcalloc(P, sizeof(uint64_t));
+    f->fd = -1;
+    j->files[j->nfiles++] = f;
+    return f;
+}
+
+static void journal_file_free(journal_file_t * f)
+{
+    free(f->outname);
+    free(f->tmpname);
+    free(f->done);
+    free(f->offsets);
+    free(f->bytes);
+    free(f->page_hash);
+    free(f);
+}
+
+/* The page record of page k of f, without the newline */
+static void journal_put_page(FILE * fid, const journal_file_t * f, int64_t k)
+{
+    fprintf(fid, "page\t%d\t%" PRId64 "\t%016" PRIx64 "\t", f->id, k,
+            f->page_hash[k]);
+    for(int64_t bb = 0; bb < f->bpp; bb++)
+    {
+        fprintf(fid, "%s%" PRIu64 " %" PRIu64, bb > 0 ? " " : "",
+                f->offsets[k*f->bpp + bb], f->bytes[k*f->bpp + bb]);
+    }
+    fprintf(fid, "\n");
+}
+
+/* Parse one line of the journal, complete lines only */
+static void journal_parse_line(journal_t * j, char * line)
+{
+    size_t len = strlen(line);
+    if(len == 0 || line[len-1] != '\n')
+    {
+        return;
+    }
+    line[len-1] = '\0';
+
+    char * save = NULL;
+    char * type = strtok_r(line, "\t", &save);
+    char * sid = strtok_r(NULL, "\t", &save);
+    if(type == NULL || sid == NULL)
+    {
+        return;
+    }
+    int id = atoi(sid);
+
+    if(strcmp(type, "begin") == 0)
+    {
+        int64_t v[5] = {0};
+        for(int kk = 0; kk < 5; kk++)
+        {
+            char * s = strtok_r(NULL, "\t", &save);
+            if(s == NULL)
+            {
+                return;
+            }
+            v[kk] = strtoll(s, NULL, 10);
+        }
+        char * tmpname = strtok_r(NULL, "\t", &save);
+        char * outname = strtok_r(NULL, "\t", &save);
+        if(id != j->nfiles || outname == NULL || v[2] < 1 || v[3] < 1)
+        {
+            return;
+        }
+        journal_file_t * f = journal_add(j, outname, tmpname,
+                                         v[0], v[1], v[2], v[3], (int) v[4]);
+        f->earlier = 1;
+        return;
+    }
+
+    if(id < 0 || id >= j->nfiles)
+    {
+        return;
+    }
+    journal_file_t * f = j->files[id];
+
+    if(strcmp(type, "end") == 0)
+    {
+        f->ended = 1;
+        return;
+    }
+
+    if(strcmp(type, "page") == 0)
+    {
+        char * s = strtok_r(NULL, "\t", &save);
+        if(s == NULL)
+        {
+            return;
+        }
+        int64_t k = strtoll(s, NULL, 10);
+        char * shash = strtok_r(NULL, "\t", &save);
+        if(k < 0 || k >= f->P || shash == NULL)
+        {
+            return;
+        }
+        uint64_t * offsets = f->offsets + k*f->bpp;
+        uint64_t * bytes = f->bytes + k*f->bpp;
+        for(int64_t bb = 0; bb < f->bpp; bb++)
+        {
+            char * so = strtok_r(NULL, " \t", &save);
+            char * sb = strtok_r(NULL, " \t", &save);
+            if(so == NULL || sb == NULL)
+            {
+                return;
+            }
+            offsets[bb] = strtoull(so, NULL, 10);
+            bytes[bb] = strtoull(sb, NULL, 10);
+        }
+        f->page_hash[k] = strtoull(shash, NULL, 16);
+        f->done[k] = 1;
+    }
+}
+
+journal_t * journal_open(const char * dir, int resume)
+{
+    /* The folder is locked, rather than the journal, since the journal
+     * is replaced below */
+    int lockfd = open(dir, O_RDONLY);
+    if(lockfd < 0)
+    {
+        fprintf(stderr, "Unable to open %s: %s\n", dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if(flock(lockfd, LOCK_EX | LOCK_NB) != 0)
+    {
+        close(lockfd);
+        return NULL;
+    }
+
+    journal_t * j = ckcalloc(1, sizeof(journal_t));
+    j->lockfd = lockfd;
+    j->dir = ckstrdup(dir);
+    size_t slen = strlen(dir) + 32;
+    j->path = ckcalloc(slen, 1);
+    snprintf(j->path, slen, "%s/nd2tool.journal", dir);
+    pthread_mutex_init(&j->lock, NULL);
+
+    if(resume)
+    {
+        FILE * fid = fopen(j->path, "r");
+        if(fid != NULL)
+        {
+            char * line = NULL;
+            size_t len = 0;
+            while(getline(&line, &len, fid) > 0)
+            {
+                journal_parse_line(j, line);
+            }
+            free(line);
+            fclose(fid);
+        }
+    }
+
+    /* Start over, with the files that can still be resumed. This
+     * also drops a partial record at the end. The old journal is
+     * replaced only when the new one is complete. */
+    char * tmppath = ckcalloc(slen + 4, 1);
+    snprintf(tmppath, slen + 4, "%s.tmp", j->path);
+    j->fid = fopen(tmppath, "w");
+    if(j->fid == NULL)
+    {
+        fprintf(stderr, "Unable to write the journal %s: %s\n",
+                tmppath, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for(int kk = 0; kk < j->nfiles; kk++)
+    {
+        journal_file_t * f = j->files[kk];
+        fprintf(j->fid, "begin\t%d\t%" PRId64 "\t%" PRId64 "\t%" PRId64
+                "\t%" PRId64 "\t%d\t%s\t%s\n", f->id, f->M, f->N, f->P,
+                f->bpp, f->compression, f->tmpname, f->outname);
+        if(f->ended)
+        {
+            fprintf(j->fid, "end\t%d\n", f->id);
+            continue;
+        }
+        for(int64_t k = 0; k < f->P; k++)
+        {
+            if(f->done[k] == 0)
+            {
+                continue;
+            }
+            journal_put_page(j->fid, f, k);
+        }
+    }
+    fflush(j->fid);
+    journal_fsync(fileno(j->fid));
+    if(rename(tmppath, j->path) != 0)
+    {
+        fprintf(stderr, "Unable to write the journal %s: %s\n",
+                j->path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    free(tmppath);
+    return j;
+}
+
+/* Sync the data files, then write the page records */
+static void journal_sync_locked(journal_t * j)
+{
+    for(int kk = 0; kk < j->npending; kk++)
+    {
+        journal_file_t * f = j->pending_file[kk];
+        int first = 1;
+        for(int ll = 0; ll < kk; ll++)
+        {
+            if(j->pending_file[ll] == f)
+            {
+                first = 0;
+            }
+        }
+        if(first && f->fd >= 0)
+        {
+            journal_fsync(f->fd);
+        }
+    }
+    for(int kk = 0; kk < j->npending; kk++)
+    {
+        journal_file_t * f = j->pending_file[kk];
+        int64_t k = j->pending_page[kk];
+        journal_put_page(j->fid, f, k);
+        f->done[k] = 1;
+    }
+    if(j->npending > 0)
+    {
+        fflush(j->fid);
+        journal_fsync(fileno(j->fid));
+    }
+    j->npending = 0;
+}
+
+void journal_sync(journal_t * j)
+{
+    pthread_mutex_lock(&j->lock);
+    journal_sync_locked(j);
+    pthread_mutex_unlock(&j->lock);
+}
+
+/* Is name like something_tmp_XXXXXX, see create_tmp_file */
+static int journal_is_tmp(const char * name)
+{
+    size_t len = strlen(name);
+    if(len < 12 || strncmp(name + len - 11, "_tmp_", 5) != 0)
+    {
+        return 0;
+    }
+    for(size_t kk = len - 6; kk < len; kk++)
+    {
+        if(!isalnum((unsigned char) name[kk]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int journal_close(journal_t * j, int completed)
+{
+    if(j == NULL)
+    {
+        return 0;
+    }
+    journal_sync(j);
+    fclose(j->fid);
+    int nremoved = 0;
+    if(completed)
+    {
+        /* The files of the earlier run that were not continued can't
+         * be resumed once the journal is gone */
+        for(int kk = 0; kk < j->nfiles; kk++)
+        {
+            journal_file_t * f = j->files[kk];
+            if(!f->earlier || f->ended || !journal_is_tmp(f->tmpname))
+            {
+                continue;
+            }
+            char * name = journal_tmpname(j, f);
+            if(unlink(name) == 0)
+            {
+                nremoved++;
+            }
+            free(name);
+        }
+        unlink(j->path);
+    }
+    for(int kk = 0; kk < j->nfiles; kk++)
+    {
+        journal_file_free(j->files[kk]);
+    }
+    pthread_mutex_destroy(&j->lock);
+    close(j->lockfd); /* Releases the lock */
+    free(j->files);
+    free(j->path);
+    free(j->dir);
+    free(j);
+    return nremoved;
+}
+
+journal_file_t * journal_find(journal_t * j, const char * outname)
+{
+    const char * name = journal_basename(outname);
+    journal_file_t * found = NULL;
+    pthread_mutex_lock(&j->lock);
+    for(int kk = 0; kk < j->nfiles; kk++)
+    {
+        journal_file_t * f = j->files[kk];
+        if(!f->ended && f->fd < 0 && strcmp(f->outname, name) == 0)
+        {
+            found = f;
+        }
+    }
+    pthread_mutex_unlock(&j->lock);
+    return found;
+}
+
+char * journal_tmpname(const journal_t * j, const journal_file_t * f)
+{
+    size_t slen = strlen(j->dir) + strlen(f->tmpname) + 2;
+    char * name = ckcalloc(slen, 1);
+    snprintf(name, slen, "%s/%s", j->dir, f->tmpname);
+    return name;
+}
+
+journal_file_t * journal_begin(journal_t * j,
+                               const char * outname, const char * tmpname,
+                               int64_t M, int64_t N, int64_t P,
+                               int64_t bpp, int compression, int fd)
+{
+    pthread_mutex_lock(&j->lock);
+    journal_file_t * f = journal_add(j, outname, tmpname, M, N, P, bpp,
+                                     compression);
+    f->fd = fd;
+    fprintf(j->fid, "begin\t%d\t%" PRId64 "\t%" PRId64 "\t%" PRId64
+            "\t%" PRId64 "\t%d\t%s\t%s\n", f->id, f->M, f->N, f->P,
+            f->bpp, f->compression, f->tmpname, f->outname);
+    fflush(j->fid);
+    pthread_mutex_unlock(&j->lock);
+    return f;
+}
+
+void journal_resume(journal_t * j, journal_file_t * f, int fd)
+{
+    pthread_mutex_lock(&j->lock);
+    f->fd = fd;
+    pthread_mutex_unlock(&j->lock);
+}
+
+void journal_page(journal_t * j, journal_file_t * f, int64_t k,
+                  const uint64_t * offsets, const uint64_t * bytes,
+                  uint64_t page_hash)
+{
+    pthread_mutex_lock(&j->lock);
+    memcpy(f->offsets + k*f->bpp, offsets, f->bpp*sizeof(uint64_t));
+    memcpy(f->bytes + k*f->bpp, bytes, f->bpp*sizeof(uint64_t));
+    f->page_hash[k] = page_hash;
+    j->pending_file[j->npending] = f;
+    j->pending_page[j->npending] = k;
+    j->npending++;
+    if(j->npending == JOURNAL_SYNC_PAGES)
+    {
+        journal_sync_locked(j);
+    }
+    pthread_mutex_unlock(&j->lock);
+}
+
+static void journal_end_locked(journal_t * j, journal_file_t * f)
+{
+    /* Pages of f that are still pending are not needed any more */
+    int kept = 0;
+    for(int kk = 0; kk < j->npending; kk++)
+    {
+        if(j->pending_file[kk] != f)
+        {
+            j->pending_file[kept] = j->pending_file[kk];
+            j->pending_page[kept] = j->pending_page[kk];
+            kept++;
+        }
+    }
+    j->npending = kept;
+    fprintf(j->fid, "end\t%d\n", f->id);
+    fflush(j->fid);
+    f->ended = 1;
+    f->fd = -1;
+}
+
+void journal_end(journal_t * j, journal_file_t * f)
+{
+    pthread_mutex_lock(&j->lock);
+    journal_end_locked(j, f);
+    pthread_mutex_unlock(&j->lock);
+}
+
+void journal_drop(journal_t * j, journal_file_t * f)
+{
+    journal_end(j, f);
+}
+
+void journal_util_ut(void)
+{
+    printf("-> testing journal_util\n");
+    char dir[] = "/tmp/journal_ut_XXXXXX";
+    if(mkdtemp(dir) == NULL)
+    {
+        fprintf(stderr, "journal_util_ut: Unable to create a folder\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t slen = sizeof(dir) + 64;
+    char * out = ckcalloc(slen, 1);
+    char * tmp = ckcalloc(slen, 1);
+    char * out2 = ckcalloc(slen, 1);
+    char * tmp2 = ckcalloc(slen, 1);
+    char * other = ckcalloc(slen, 1);
+    snprintf(out, slen, "%s/a b_001.tif", dir);
+    snprintf(tmp, slen, "%s/a b_001.tif_tmp_abc123", dir);
+    snprintf(out2, slen, "%s/b_001.tif", dir);
+    snprintf(tmp2, slen, "%s/b_001.tif_tmp_def456", dir);
+    /* E.g. from another process, not in the journal */
+    snprintf(other, slen, "%s/c_001.tif_tmp_XYZ789", dir);
+    FILE * fid = fopen(tmp, "w");
+    FILE * fid2 = fopen(tmp2, "w");
+    FILE * fid3 = fopen(other, "w");
+    int ok = fid != NULL && fid2 != NULL && fid3 != NULL;
+    if(fid3 != NULL)
+    {
+        fclose(fid3);
+    }
+
+    /* 20 pages with 2 blocks each, the last 4 are pending at close */
+    const int64_t P = 30;
+    journal_t * j = journal_open(dir, 0);
+    ok = ok && j != NULL;
+    if(j == NULL)
+    {
+        fprintf(stderr, "journal_util_ut: Unable to open the journal\n");
+        exit(EXIT_FAILURE);
+    }
+    /* The folder is taken */
+    ok = ok && journal_open(dir, 0) == NULL;
+    journal_file_t * f = journal_begin(j, out, tmp, 8, 8, P, 2, 1,
+                                       fid == NULL ? -1 : fileno(fid));
+    journal_begin(j, out2, tmp2, 8, 8, 2, 1, 1,
+                  fid2 == NULL ? -1 : fileno(fid2));
+    for(int64_t k = 0; k < 20; k++)
+    {
+        uint64_t offsets[2] = {1000*k, 1000*k + 500};
+        uint64_t bytes[2] = {500, 400 + k};
+        journal_page(j, f, k, offsets, bytes, 0xF00D0000ULL + k);
+    }
+    ok = ok && j->npending == 20 - JOURNAL_SYNC_PAGES;
+    ok = ok && journal_close(j, 0) == 0;
+    if(fid != NULL)
+    {
+        fclose(fid);
+    }
+    if(fid2 != NULL)
+    {
+        fclose(fid2);
+    }
+
+    /* Resume, a truncated record at the end is ignored */
+    char * jpath = ckcalloc(slen, 1);
+    snprintf(jpath, slen, "%s/nd2tool.journal", dir);
+    FILE * ja = fopen(jpath, "a");
+    if(ja != NULL)
+    {
+        fprintf(ja, "page\t0\t25\t0\t1 2");
+        fclose(ja);
+    }
+    j = journal_open(dir, 1);
+    if(j == NULL)
+    {
+        fprintf(stderr, "journal_util_ut: Unable to open the journal again\n");
+        exit(EXIT_FAILURE);
+    }
+    f = journal_find(j, out);
+    ok = ok && f != NULL && f->bpp == 2 && f->P == P;
+    if(f != NULL)
+    {
+        for(int64_t k = 0; k < P; k++)
+        {
+            ok = ok && f->done[k] == (k < 20);
+        }
+        ok = ok && f->offsets[2*19 + 1] == 19500 && f->bytes[2*19 + 1] == 419;
+        ok = ok && f->page_hash[19] == 0xF00D0000ULL + 19;
+        char * name = journal_tmpname(j, f);
+        ok = ok && strcmp(name, tmp) == 0;
+        free(name);
+    }
+    if(f != NULL)
+    {
+        journal_end(j, f);
+    }
+    ok = ok && journal_find(j, out) == NULL;
+    ok = ok && journal_find(j, out2) != NULL;
+    /* Only the file of the journal that wasn't continued is removed */
+    ok = ok && journal_close(j, 1) == 1;
+    ok = ok && access(jpath, F_OK) != 0;
+    ok = ok && access(tmp2, F_OK) != 0 && access(other, F_OK) == 0;
+    ok = ok && access(tmp, F_OK) == 0;
+
+    remove_tree(dir);
+    free(jpath);
+    free(other);
+    free(tmp2);
+    free(out2);
+    free(tmp);
+    free(out);
+    if(!ok)
+    {
+        fprintf(stderr, "journal_util_ut: failed\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("ok: journal_util\n");
+}
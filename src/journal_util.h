@@ -0,0 +1,113 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* A checkpoint journal of the files that are being written to an
+ * output folder, see --resume.
+ *
+ * Before an output file is written through a temporary file, the pair
+ * is recorded with journal_begin. Each page that has been written is
+ * recorded with journal_page, with the location of its strips. The
+ * page records are kept until JOURNAL_SYNC_PAGES of them have been
+ * collected, then the data files are synced and the records written,
+ * so that the journal never claims a page that isn't on disk. At most
+ * that many pages are lost when the program dies. journal_end marks
+ * the file as finished once it has its final name.
+ *
+ * The journal, nd2tool.journal in the folder, is a text file with one
+ * record per line, fields separated by tabs:
+ *
+ *   begin <id> <M> <N> <P> <blocks per page> <compression> <tmp> <out>
+ *   page <id> <k> <hash> <offset> <bytes> ... (one pair per block)
+ *   end <id>
+ *
+ * where the names are relative to the folder and hash is the XXH64 of
+ * the pixel data of the page, in hex.
+ *
+ * Only one process at a time can have a journal in a folder, it is
+ * locked with flock until journal_close.
+ */
+
+#define JOURNAL_SYNC_PAGES 16
+
+/* An output file that is, or was, written */
+typedef struct
+{
+    int id;
+    char * outname; /* Without the folder */
+    char * tmpname;
+    int64_t M;
+    int64_t N;
+    int64_t P;
+    int64_t bpp; /* Blocks (strips or tiles) per page */
+    int compression;
+    int ended;
+    int earlier; /* Read from the journal of an earlier run */
+    uint8_t * done; /* P, pages that are on disk */
+    uint64_t * offsets; /* P x bpp, where the blocks of the done pages are */
+    uint64_t * bytes;
+    uint64_t * page_hash; /* P */
+    int fd; /* Of the temporary file while it is written, else -1 */
+} journal_file_t;
+
+typedef struct
+{
+    char * dir;
+    char * path;
+    FILE * fid;
+    int lockfd; /* The folder, locked */
+    pthread_mutex_t lock;
+    journal_file_t ** files;
+    int nfiles;
+    int nalloc;
+    /* Pages written but not yet in the journal */
+    journal_file_t * pending_file[JOURNAL_SYNC_PAGES];
+    int64_t pending_page[JOURNAL_SYNC_PAGES];
+    int npending;
+} journal_t;
+
+/* Open the journal in dir. With resume the records of an earlier run
+ * are read, otherwise it is started over. Returns NULL if another
+ * process has a journal in dir. Exits on failure. */
+journal_t * journal_open(const char * dir, int resume);
+
+/* Write what is pending and close the journal. With completed the
+ * journal is removed, else it is kept for --resume. When it is removed
+ * the temporary files of the earlier run that were not continued are
+ * removed too, returns how many. */
+int journal_close(journal_t * j, int completed);
+
+/* The unfinished entry for outname, NULL if there is none */
+journal_file_t * journal_find(journal_t * j, const char * outname);
+
+/* Full path to the temporary file of f. Free it */
+char * journal_tmpname(const journal_t * j, const journal_file_t * f);
+
+/* Forget f and the pages in it, e.g. when it can't be resumed */
+void journal_drop(journal_t * j, journal_file_t * f);
+
+/* Start to write outname through tmpname, open as fd. */
+journal_file_t * journal_begin(journal_t * j,
+                               const char * outname, const char * tmpname,
+                               int64_t M, int64_t N, int64_t P,
+                               int64_t bpp, int compression, int fd);
+
+/* Continue to write f, found by journal_find, now open as fd */
+void journal_resume(journal_t * j, journal_file_t * f, int fd);
+
+/* Page k of f has been written, its blocks are at offsets[0..bpp-1]
+ * with the sizes in bytes */
+void journal_page(journal_t * j, journal_file_t * f, int64_t k,
+                  const uint64_t * offsets, const uint64_t * bytes,
+                  uint64_t page_hash);
+
+/* Sync the data files and write the pending page records. Call before
+ * the files with pending pages are closed. */
+void journal_sync(journal_t * j);
+
+/* f is finished and has its final name. Call after journal_sync. */
+void journal_end(journal_t * j, journal_file_t * f);
+
+void journal_util_ut(void);
@@ -42,3 +42,467 @@ char * get_json_string(const cJSON * j, const char * item)
             item, __FILE__,__LINE__);
     return NULL;
 }
+
+static const char * skip_ws(const char * p)
+{
+    while(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+    {
+        p++;
+    }
+    return p;
+}
+
+/* Skip a string starting at the opening quote, returns a pointer
+ * after the closing quote or NULL */
+static const char * skip_string(const char * p)
+{
+    p++;
+    while(*p != '"')
+    {
+        if(*p == '\0')
+        {
+            return NULL;
+        }
+        if(*p == '\\' && p[1] != '\0')
+        {
+            p++;
+        }
+        p++;
+    }
+    return p+1;
+}
+
+/* Skip the value at p, returns a pointer after it or NULL if the
+ * text ends before the value does */
+static const char * skip_value(const char * p)
+{
+    if(*p == '"')
+    {
+        return skip_string(p);
+    }
+    if(*p == '{' || *p == '[')
+    {
+        /* Brackets balance within a value, only strings need care */
+        int depth = 0;
+        do {
+            switch(*p)
+            {
+            case '\0':
+                return NULL;
+            case '"':
+                p = skip_string(p);
+                if(p == NULL)
+                {
+                    return NULL;
+                }
+                continue;
+            case '{':
+            case '[':
+                depth++;
+                break;
+            case '}':
+            case ']':
+                depth--;
+                break;
+            }
+            p++;
+        } while(depth > 0);
+        return p;
+    }
+    /* Number, true, false or null */
+    const char * start = p;
+    while(*p != '\0' && strchr(",}] \t\r\n", *p) == NULL)
+    {
+        p++;
+    }
+    return p == start ? NULL : p;
+}
+
+/* The value of key in the object at p */
+static const char * object_get(const char * p, const char * key, size_t keylen)
+{
+    p = skip_ws(p);
+    if(*p != '{')
+    {
+        return NULL;
+    }
+    p = skip_ws(p+1);
+    while(*p == '"')
+    {
+        const char * kstart = p + 1;
+        p = skip_string(p);
+        if(p == NULL)
+        {
+            return NULL;
+        }
+        size_t len = p - 1 - kstart;
+        p = skip_ws(p);
+        if(*p != ':')
+        {
+            return NULL;
+        }
+        p = skip_ws(p+1);
+        if(len == keylen && memcmp(kstart, key, keylen) == 0)
+        {
+            return p;
+        }
+        p = skip_value(p);
+        if(p == NULL)
+        {
+            return NULL;
+        }
+        p = skip_ws(p);
+        if(*p != ',')
+        {
+            return NULL;
+        }
+        p = skip_ws(p+1);
+    }
+    return NULL;
+}
+
+const char * json_first(const char * js)
+{
+    if(js == NULL)
+    {
+        return NULL;
+    }
+    const char * p = skip_ws(js);
+    if(*p != '[')
+    {
+        return NULL;
+    }
+    p = skip_ws(p+1);
+    if(*p == ']' || *p == '\0')
+    {
+        return NULL;
+    }
+    return p;
+}
+
+const char * json_next(const char * v)
+{
+    const char * p = skip_value(v);
+    if(p == NULL)
+    {
+        return NULL;
+    }
+    p = skip_ws(p);
+    if(*p != ',')
+    {
+        return NULL;
+    }
+    p = skip_ws(p+1);
+    return *p == '\0' ? NULL : p;
+}
+
+int json_array_size(const char * js)
+{
+    if(js == NULL || *skip_ws(js) != '[')
+    {
+        return -1;
+    }
+    int n = 0;
+    for(const char * v = json_first(js); v != NULL; v = json_next(v))
+    {
+        n++;
+    }
+    return n;
+}
+
+const char * json_path(const char * js, const char * path)
+{
+    if(js == NULL)
+    {
+        return NULL;
+    }
+    const char * p = skip_ws(js);
+    while(*path != '\0' && p != NULL)
+    {
+        if(*path == '.')
+        {
+            path++;
+        } else if(*path == '[')
+        {
+            char * end = NULL;
+            long idx = strtol(path+1, &end, 10);
+            if(end == path+1 || *end != ']' || idx < 0)
+            {
+                return NULL;
+            }
+            path = end + 1;
+            p = json_first(p);
+            while(p != NULL && idx-- > 0)
+            {
+                p = json_next(p);
+            }
+        } else {
+            size_t len = strcspn(path, ".[");
+            p = object_get(p, path, len);
+            path += len;
+        }
+    }
+    return p;
+}
+
+/* A JSON number at v, returns 0 on success */
+static int parse_number(const char * v, double * store)
+{
+    if(v == NULL || !(*v == '-' || (*v >= '0' && *v <= '9')))
+    {
+        return EXIT_FAILURE;
+    }
+    char * end = NULL;
+    double value = strtod(v, &end);
+    if(end == v)
+    {
+        return EXIT_FAILURE;
+    }
+    *store = value;
+    return EXIT_SUCCESS;
+}
+
+int json_path_double(const char * js, const char * path, double * store)
+{
+    return parse_number(json_path(js, path), store);
+}
+
+int json_path_int(const char * js, const char * path, int * store)
+{
+    double value = 0;
+    if(json_path_double(js, path, &value) != EXIT_SUCCESS
+       || value > INT_MAX || value < INT_MIN)
+    {
+        return EXIT_FAILURE;
+    }
+    *store = (int) value;
+    return EXIT_SUCCESS;
+}
+
+int json_path_doubles(const char * js, const char * path, double * store, int n)
+{
+    const char * v = json_first(json_path(js, path));
+    for(int kk = 0; kk < n; kk++)
+    {
+        if(parse_number(v, store + kk) != EXIT_SUCCESS)
+        {
+            return EXIT_FAILURE;
+        }
+        v = json_next(v);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Append the code point cp as UTF-8 */
+static char * put_utf8(char * out, unsigned long cp)
+{
+    if(cp < 0x80)
+    {
+        *out++ = (char) cp;
+    } else if(cp < 0x800)
+    {
+        *out++ = (char) (0xC0 | (cp >> 6));
+        *out++ = (char) (0x80 | (cp & 0x3F));
+    } else if(cp < 0x10000)
+    {
+        *out++ = (char) (0xE0 | (cp >> 12));
+        *out++ = (char) (0x80 | ((cp >> 6) & 0x3F));
+        *out++ = (char) (0x80 | (cp & 0x3F));
+    } else {
+        *out++ = (char) (0xF0 | (cp >> 18));
+        *out++ = (char) (0x80 | ((cp >> 12) & 0x3F));
+        *out++ = (char) (0x80 | ((cp >> 6) & 0x3F));
+        *out++ = (char) (0x80 | (cp & 0x3F));
+    }
+    return out;
+}
+
+/* Four hex digits at p, -1 if invalid */
+static long parse_hex4(const char * p)
+{
+    long value = 0;
+    for(int kk = 0; kk < 4; kk++)
+    {
+        char c = p[kk];
+        value *= 16;
+        if(c >= '0' && c <= '9')
+        {
+            value += c - '0';
+        } else if(c >= 'a' && c <= 'f')
+        {
+            value += c - 'a' + 10;
+        } else if(c >= 'A' && c <= 'F')
+        {
+            value += c - 'A' + 10;
+        } else {
+            return -1;
+        }
+    }
+    return value;
+}
+
+char * json_path_string(const char * js, const char * path)
+{
+    const char * v = json_path(js, path);
+    if(v == NULL || *v != '"')
+    {
+        return NULL;
+    }
+    const char * end = skip_string(v);
+    if(end == NULL)
+    {
+        return NULL;
+    }
+    /* The escaped text is never shorter than the result */
+    char * str = malloc(end - v);
+    assert(str != NULL);
+    char * out = str;
+    for(const char * p = v+1; p < end-1; p++)
+    {
+        if(*p != '\\')
+        {
+            *out++ = *p;
+            continue;
+        }
+        p++;
+        switch(*p)
+        {
+        case 'b': *out++ = '\b'; break;
+        case 'f': *out++ = '\f'; break;
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+        case 'u':
+        {
+            long cp = end - p > 4 ? parse_hex4(p+1) : -1;
+            if(cp < 0)
+            {
+                free(str);
+                return NULL;
+            }
+            p += 4;
+            /* Surrogate pair */
+            if(cp >= 0xD800 && cp < 0xDC00 && end - p > 6
+               && p[1] == '\\' && p[2] == 'u')
+            {
+                long lo = parse_hex4(p+3);
+                if(lo >= 0xDC00 && lo < 0xE000)
+                {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    p += 6;
+                }
+            }
+            out = put_utf8(out, (unsigned long) cp);
+        }
+        break;
+        default: /* '"', '\\' and '/' */
+            *out++ = *p;
+        }
+    }
+    *out = '\0';
+    return str;
+}
+
+/* Frame metadata as returned by Lim_FileGetFrameMetadata, shortened
+ * from a file with two channels */
+static const char * json_util_frame_sample =
+    "{\"contents\":{\"channelCount\":2},\"channels\":["
+    "{\"channel\":{\"name\":\"A647\",\"index\":0,\"colorRGB\":16711680,"
+    "\"emissionLambdaNm\":700.0,\"excitationLambdaNm\":640.0},"
+    "\"loops\":{\"XYPosLoop\":0,\"ZStackLoop\":3},"
+    "\"microscope\":{\"objectiveMagnification\":100.0,"
+    "\"objectiveName\":\"Plan Apo \\u03bb 100x Oil\","
+    "\"objectiveNumericalAperture\":1.45,\"zoomMagnification\":1.0,"
+    "\"immersionRefractiveIndex\":1.515,\"projectiveMagnification\":-1.0,"
+    "\"pinholeDiameterUm\":-1.0,\"modalityFlags\":[\"fluorescence\",\"camera\"]},"
+    "\"volume\":{\"axesCalibrated\":[true,true,true],"
+    "\"axesCalibration\":[0.13,0.13,0.3],\"axesInterpretation\":[\"distance\","
+    "\"distance\",\"distance\"],\"bitsPerComponentInMemory\":16,"
+    "\"bitsPerComponentSignificant\":16,\"cameraTransformationMatrix\":"
+    "[-0.9999,0.0123,-0.0123,-0.9999],\"componentCount\":1,"
+    "\"componentDataType\":\"unsigned\",\"voxelCount\":[2048,2048,51]},"
+    "\"time\":{\"relativeTimeMs\":1234.5,\"absoluteJulianDayNumber\":2459000.5},"
+    "\"position\":{\"stagePositionUm\":[-3411.2,1520.75,4711.3],"
+    "\"pfsOffset\":-1,\"name\":\"{[\\\"]}\"}},"
+    "{\"channel\":{\"name\":\"dapi\",\"index\":1,\"colorRGB\":16711935,"
+    "\"emissionLambdaNm\":455.0,\"excitationLambdaNm\":405.0},"
+    "\"loops\":{\"XYPosLoop\":0,\"ZStackLoop\":3},"
+    "\"microscope\":{\"objectiveMagnification\":100.0,"
+    "\"objectiveName\":\"Plan Apo \\u03bb 100x Oil\","
+    "\"objectiveNumericalAperture\":1.45,\"zoomMagnification\":1.0,"
+    "\"immersionRefractiveIndex\":1.515,\"projectiveMagnification\":-1.0,"
+    "\"pinholeDiameterUm\":-1.0,\"modalityFlags\":[\"fluorescence\",\"camera\"]},"
+    "\"volume\":{\"axesCalibrated\":[true,true,true],"
+    "\"axesCalibration\":[0.13,0.13,0.3],\"axesInterpretation\":[\"distance\","
+    "\"distance\",\"distance\"],\"bitsPerComponentInMemory\":16,"
+    "\"bitsPerComponentSignificant\":16,\"cameraTransformationMatrix\":"
+    "[-0.9999,0.0123,-0.0123,-0.9999],\"componentCount\":1,"
+    "\"componentDataType\":\"unsigned\",\"voxelCount\":[2048,2048,51]},"
+    "\"time\":{\"relativeTimeMs\":1240.5,\"absoluteJulianDayNumber\":2459000.5},"
+    "\"position\":{\"stagePositionUm\":[-3411.2,1520.75,4711.6],"
+    "\"pfsOffset\":-1,\"name\":\"\"}}]}";
+
+int json_stage_positions(const char * js, double * pos, int maxchan)
+{
+    int cc = 0;
+    for(const char * c = json_first(json_path(js, "channels"));
+        c != NULL && cc < maxchan; c = json_next(c))
+    {
+        if(json_path_doubles(c, "position.stagePositionUm", pos + 3*cc, 3) != 0)
+        {
+            return -1;
+        }
+        cc++;
+    }
+    return cc;
+}
+
+const char * json_util_sample(void)
+{
+    return json_util_frame_sample;
+}
+
+void json_util_ut(void)
+{
+    printf("-> testing json_util\n");
+    const char * js = json_util_frame_sample;
+    int ok = 1;
+
+    double pos[6] = {0};
+    const double pos_ref[6] = {-3411.2, 1520.75, 4711.3,
+                               -3411.2, 1520.75, 4711.6};
+    ok = ok && json_stage_positions(js, pos, 2) == 2;
+    ok = ok && memcmp(pos, pos_ref, sizeof(pos)) == 0;
+    ok = ok && json_stage_positions(js, pos, 1) == 1;
+
+    int value = 0;
+    ok = ok && json_path_int(js, "contents.channelCount", &value) == 0 && value == 2;
+    ok = ok && json_path_int(js, "channels[1].volume.voxelCount[2]", &value) == 0
+        && value == 51;
+    ok = ok && json_array_size(json_path(js, "channels")) == 2;
+    ok = ok && json_array_size(json_path(js, "contents")) == -1;
+    ok = ok && json_path(js, "channels[2]") == NULL;
+    ok = ok && json_path(js, "channels[0].nothing") == NULL;
+    ok = ok && json_path_int(js, "channels[0].channel.name", &value) != 0;
+
+    char * name = json_path_string(js, "channels[0].microscope.objectiveName");
+    ok = ok && name != NULL && strcmp(name, "Plan Apo \xce\xbb 100x Oil") == 0;
+    free(name);
+    name = json_path_string(js, "channels[0].position.name");
+    ok = ok && name != NULL && strcmp(name, "{[\"]}") == 0;
+    free(name);
+    name = json_path_string("{\"a\": \"\\ud83d\\ude00\\t\\/\"}", "a");
+    ok = ok && name != NULL && strcmp(name, "\xf0\x9f\x98\x80\t/") == 0;
+    free(name);
+
+    /* Truncated input */
+    ok = ok && json_path("{\"a\": [1, 2", "a[3]") == NULL;
+    ok = ok && json_path("{\"a\": \"b", "c") == NULL;
+
+    if(!ok)
+    {
+        fprintf(stderr, "json_util_ut: failed\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("ok\n");
+}
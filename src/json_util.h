@@ -2,6 +2,7 @@
 #define __json_util_h__
 
 #include <assert.h>
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,4 +16,49 @@ int get_json_double(const cJSON * j, const char * item, double * store);
 /* Returns A newly allocated string or NULL on failure */
 char * get_json_string(const cJSON * j, const char * item);
 
+/* On-demand extraction from JSON text, without building a cJSON tree
+ * and without allocations (except for json_path_string).
+ *
+ * The text is only scanned as far as needed to reach the requested
+ * value, skipping over everything else, and is not validated beyond
+ * that. A path is a sequence of object keys separated by '.' and
+ * array indices in brackets, e.g.
+ * "channels[1].position.stagePositionUm". Keys are compared to the
+ * raw text in the document, i.e. without resolving escapes.
+ *
+ * The functions take a pointer to a value in the text, usually the
+ * start of the document, and return pointers to values within it so
+ * that a sub-object found once can be searched several times.
+ */
+
+/* The value at path below the value at js, or NULL if not found */
+const char * json_path(const char * js, const char * path);
+
+/* The first element of the array at js, NULL if empty or not an
+ * array */
+const char * json_first(const char * js);
+/* The element after the value at v in the same array, NULL after
+ * the last element */
+const char * json_next(const char * v);
+/* Number of elements in the array at js, -1 if not an array */
+int json_array_size(const char * js);
+
+/* Get a number, returns 0 on success */
+int json_path_int(const char * js, const char * path, int * store);
+int json_path_double(const char * js, const char * path, double * store);
+/* The first n numbers of the array at path, returns 0 on success */
+int json_path_doubles(const char * js, const char * path, double * store, int n);
+/* Returns a newly allocated string or NULL if not found */
+char * json_path_string(const char * js, const char * path);
+
+/* The stage positions of up to maxchan channels of the frame
+ * metadata js, as parse_frame_meta in nd2tool.c gets them. Returns the
+ * number of channels, -1 on failure */
+int json_stage_positions(const char * js, double * pos, int maxchan);
+/* Frame metadata with two channels, what json_util_ut is run on */
+const char * json_util_sample(void);
+
+/* Test json_path on a frame metadata string */
+void json_util_ut(void);
+
 #endif
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nd2_backend.h"
+#include "nd2_mock.h"
+
+/* The Nikon SDK */
+
+static void * sdk_open(const char * fName)
+{
+    return Lim_FileOpenForReadUtf8(fName);
+}
+
+static void sdk_close(void * h)
+{
+    Lim_FileClose(h);
+}
+
+static int sdk_get_coord_size(void * h)
+{
+    return (int) Lim_FileGetCoordSize(h);
+}
+
+static int sdk_get_coord_info(void * h, int coord, char * type, int maxTypeSize)
+{
+    return (int) Lim_FileGetCoordInfo(h, coord, type, maxTypeSize);
+}
+
+static int sdk_get_seq_count(void * h)
+{
+    return (int) Lim_FileGetSeqCount(h);
+}
+
+static char * sdk_get_attributes(void * h)
+{
+    return Lim_FileGetAttributes(h);
+}
+
+static char * sdk_get_metadata(void * h)
+{
+    return Lim_FileGetMetadata(h);
+}
+
+static char * sdk_get_frame_metadata(void * h, int64_t seq)
+{
+    return Lim_FileGetFrameMetadata(h, (LIMUINT) seq);
+}
+
+static char * sdk_get_textinfo(void * h)
+{
+    return Lim_FileGetTextinfo(h);
+}
+
+static char * sdk_get_experiment(void * h)
+{
+    return Lim_FileGetExperiment(h);
+}
+
+static int sdk_get_image_data(void * h, int64_t seq, LIMPICTURE * pic)
+{
+    return Lim_FileGetImageData(h, (LIMUINT) seq, pic);
+}
+
+static void sdk_free_string(char * s)
+{
+    Lim_FileFreeString(s);
+}
+
+const nd2_backend_t nd2_backend_sdk = {
+    .name = "sdk",
+    .open = sdk_open,
+    .close = sdk_close,
+    .get_coord_size = sdk_get_coord_size,
+    .get_coord_info = sdk_get_coord_info,
+    .get_seq_count = sdk_get_seq_count,
+    .get_attributes = sdk_get_attributes,
+    .get_metadata = sdk_get_metadata,
+    .get_frame_metadata = sdk_get_frame_metadata,
+    .get_textinfo = sdk_get_textinfo,
+    .get_experiment = sdk_get_experiment,
+    .get_image_data = sdk_get_image_data,
+    .free_string = sdk_free_string
+};
+
+const nd2_backend_t * nd2_backend_from_name(const char * name)
+{
+    if(strcmp(name, nd2_backend_sdk.name) == 0)
+    {
+        return &nd2_backend_sdk;
+    }
+    if(strcmp(name, nd2_backend_mock.name) == 0)
+    {
+        return &nd2_backend_mock;
+    }
+    return NULL;
+}
+
+nd2_file_t * nd2_file_open(const nd2_backend_t * backend, const char * fName)
+{
+    void * h = backend->open(fName);
+    if(h == NULL)
+    {
+        return NULL;
+    }
+    nd2_file_t * f = calloc(1, sizeof(nd2_file_t));
+    if(f == NULL)
+    {
+        fprintf(stderr, "nd2_backend: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    f->backend = backend;
+    f->h = h;
+    return f;
+}
+
+void nd2_file_close(nd2_file_t * f)
+{
+    if(f == NULL)
+    {
+        return;
+    }
+    f->backend->close(f->h);
+    free(f);
+}
+
+int nd2_file_coord_size(nd2_file_t * f)
+{
+    return f->backend->get_coord_size(f->h);
+}
+
+int nd2_file_coord_info(nd2_file_t * f, int coord, char * type, int maxTypeSize)
+{
+    return f->backend->get_coord_info(f->h, coord, type, maxTypeSize);
+}
+
+int nd2_file_seq_count(nd2_file_t * f)
+{
+    return f->backend->get_seq_count(f->h);
+}
+
+char * nd2_file_attributes(nd2_file_t * f)
+{
+    return f->backend->get_attributes(f->h);
+}
+
+char * nd2_file_metadata(nd2_file_t * f)
+{
+    return f->backend->get_metadata(f->h);
+}
+
+char * nd2_file_frame_metadata(nd2_file_t * f, int64_t seq)
+{
+    return f->backend->get_frame_metadata(f->h, seq);
+}
+
+char * nd2_file_textinfo(nd2_file_t * f)
+{
+    return f->backend->get_textinfo(f->h);
+}
+
+char * nd2_file_experiment(nd2_file_t * f)
+{
+    return f->backend->get_experiment(f->h);
+}
+
+int nd2_file_image_data(nd2_file_t * f, int64_t seq, LIMPICTURE * pic)
+{
+    return f->backend->get_image_data(f->h, seq, pic);
+}
+
+void nd2_file_free_string(nd2_file_t * f, char * s)
+{
+    f->backend->free_string(s);
+}
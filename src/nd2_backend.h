@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "Nd2ReadSdk_stripped.h"
+
+/* The functions that nd2tool uses to read nd2 files, so that the
+ * Nikon SDK can be replaced, for example by the mock backend in
+ * nd2_mock.h when there is no nd2 file at hand.
+ *
+ * The functions have the same meaning as the Lim_File* functions
+ * that they are named after. Strings are returned with free_string.
+ * A backend has to support one open handle per thread, like the SDK.
+ */
+typedef struct
+{
+    const char * name;
+    void * (*open)(const char * fName);
+    void (*close)(void * h);
+    int (*get_coord_size)(void * h);
+    /* Writes the type of loop coord to type and returns its size */
+    int (*get_coord_info)(void * h, int coord, char * type, int maxTypeSize);
+    int (*get_seq_count)(void * h);
+    char * (*get_attributes)(void * h);
+    char * (*get_metadata)(void * h);
+    char * (*get_frame_metadata)(void * h, int64_t seq);
+    char * (*get_textinfo)(void * h);
+    char * (*get_experiment)(void * h);
+    /* Interlaced pixels to pic, initialized by Lim_InitPicture.
+     * Returns 0 on success */
+    int (*get_image_data)(void * h, int64_t seq, LIMPICTURE * pic);
+    void (*free_string)(char * s);
+} nd2_backend_t;
+
+/* An open file, returned by nd2_file_open */
+typedef struct
+{
+    const nd2_backend_t * backend;
+    void * h;
+} nd2_file_t;
+
+extern const nd2_backend_t nd2_backend_sdk;
+
+/* Look up a backend by name, "sdk" or "mock". NULL if unknown */
+const nd2_backend_t * nd2_backend_from_name(const char * name);
+
+/* Returns NULL if the file can't be opened by the backend */
+nd2_file_t * nd2_file_open(const nd2_backend_t * backend, const char * fName);
+void nd2_file_close(nd2_file_t * f);
+int nd2_file_coord_size(nd2_file_t * f);
+int nd2_file_coord_info(nd2_file_t * f, int coord, char * type, int maxTypeSize);
+int nd2_file_seq_count(nd2_file_t * f);
+char * nd2_file_attributes(nd2_file_t * f);
+char * nd2_file_metadata(nd2_file_t * f);
+char * nd2_file_frame_metadata(nd2_file_t * f, int64_t seq);
+char * nd2_file_textinfo(nd2_file_t * f);
+char * nd2_file_experiment(nd2_file_t * f);
+int nd2_file_image_data(nd2_file_t * f, int64_t seq, LIMPICTURE * pic);
+void nd2_file_free_string(nd2_file_t * f, char * s);
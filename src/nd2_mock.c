@@ -0,0 +1,424 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "json_util.h"
+#include "nd2_mock.h"
+
+#define NOT_NULL(x) {                                           \
+        if(x == NULL){                                          \
+            fprintf(stderr, "nd2_mock: NULL pointer at %s:%d\n", \
+                    __FILE__, __LINE__);                        \
+            exit(EXIT_FAILURE);                                 \
+        }                                                       \
+    }
+
+/* Largest spec file that is read */
+#define ND2_MOCK_MAX_SPEC 65536
+
+typedef struct
+{
+    nd2_mock_spec_t spec;
+    /* One interlaced plane that the others are made from */
+    uint16_t * plane;
+    /* For the speed limit */
+    struct timespec t0;
+    double bytes;
+} nd2_mock_t;
+
+/* See nd2_mock_count_reads */
+static uint32_t * mock_reads = NULL;
+
+void nd2_mock_count_reads(uint32_t * counts)
+{
+    mock_reads = counts;
+}
+
+int nd2_mock_parse_spec(const char * js, nd2_mock_spec_t * spec)
+{
+    int version = 0;
+    if(json_path_int(js, "nd2tool-mock", &version) != 0 || version != 1)
+    {
+        return -1;
+    }
+    spec->fov = 1;
+    spec->channels = 2;
+    spec->planes = 10;
+    spec->width = 512;
+    spec->height = 512;
+    spec->mbps = 0;
+    json_path_int(js, "fov", &spec->fov);
+    json_path_int(js, "channels", &spec->channels);
+    json_path_int(js, "planes", &spec->planes);
+    json_path_int(js, "width", &spec->width);
+    json_path_int(js, "height", &spec->height);
+    json_path_double(js, "mbps", &spec->mbps);
+    if(spec->fov < 1 || spec->channels < 1 || spec->planes < 1
+       || spec->width < 1 || spec->height < 1 || spec->mbps < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int nd2_mock_write_spec(const char * fName, const nd2_mock_spec_t * spec)
+{
+    FILE * fid = fopen(fName, "w");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "nd2_mock: Unable to open %s: %s\n",
+                fName, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    fprintf(fid, "{\"nd2tool-mock\": 1, \"fov\": %d, \"channels\": %d, "
+            "\"planes\": %d, \"width\": %d, \"height\": %d, \"mbps\": %g}\n",
+            spec->fov, spec->channels, spec->planes,
+            spec->width, spec->height, spec->mbps);
+    if(fclose(fid) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Background, noise and a dot every 64 pixels */
+static void mock_make_plane(nd2_mock_t * m)
+{
+    const nd2_mock_spec_t * s = &m->spec;
+    size_t C = s->channels;
+    m->plane = calloc((size_t) s->width*s->height*C, sizeof(uint16_t));
+    NOT_NULL(m->plane);
+    uint32_t rng = 0x2545F491u;
+    for(int yy = 0; yy < s->height; yy++)
+    {
+        for(int xx = 0; xx < s->width; xx++)
+        {
+            int dx = (xx % 64) - 32;
+            int dy = (yy % 64) - 32;
+            int dot = dx*dx + dy*dy < 9;
+            for(size_t cc = 0; cc < C; cc++)
+            {
+                rng ^= rng << 13;
+                rng ^= rng >> 17;
+                rng ^= rng << 5;
+                uint32_t v = 100 + 50*cc + (xx + yy) / 16 + (rng & 0x1f);
+                v += dot ? 1000*(cc+1) : 0;
+                m->plane[((size_t) yy*s->width + xx)*C + cc] = (uint16_t) v;
+            }
+        }
+    }
+}
+
+static void * mock_open(const char * fName)
+{
+    FILE * fid = fopen(fName, "r");
+    if(fid == NULL)
+    {
+        return NULL;
+    }
+    char * js = calloc(ND2_MOCK_MAX_SPEC + 1, 1);
+    NOT_NULL(js);
+    size_t n = fread(js, 1, ND2_MOCK_MAX_SPEC, fid);
+    fclose(fid);
+    js[n] = '\0';
+
+    nd2_mock_spec_t spec = {0};
+    int ok = memchr(js, '\0', n) == NULL && nd2_mock_parse_spec(js, &spec) == 0;
+    free(js);
+    if(!ok)
+    {
+        return NULL;
+    }
+    nd2_mock_t * m = calloc(1, sizeof(nd2_mock_t));
+    NOT_NULL(m);
+    m->spec = spec;
+    mock_make_plane(m);
+    clock_gettime(CLOCK_MONOTONIC, &m->t0);
+    return m;
+}
+
+static void mock_close(void * h)
+{
+    nd2_mock_t * m = (nd2_mock_t *) h;
+    free(m->plane);
+    free(m);
+}
+
+static int mock_get_coord_size(void * h)
+{
+    nd2_mock_t * m = (nd2_mock_t *) h;
+    return m->spec.fov > 1 ? 2 : 1;
+}
+
+static int mock_get_coord_info(void * h, int coord, char * type, int maxTypeSize)
+{
+    nd2_mock_t * m = (nd2_mock_t *) h;
+    if(m->spec.fov == 1)
+    {
+        coord++;
+    }
+    snprintf(type, maxTypeSize, "%s", coord == 0 ? "XYPosLoop" : "ZStackLoop");
+    return coord == 0 ? m->spec.fov : m->spec.planes;
+}
+
+static int mock_get_seq_count(void * h)
+{
+    nd2_mock_t * m = (nd2_mock_t *) h;
+    return m->spec.fov*m->spec.planes;
+}
+
+/* A string written with open_memstream */
+typedef struct
+{
+    char * str;
+    size_t len;
+    FILE * fid;
+} mock_str_t;
+
+static FILE * mock_str_open(mock_str_t * s)
+{
+    s->fid = open_memstream(&s->str, &s->len);
+    NOT_NULL(s->fid);
+    return s->fid;
+}
+
+static char * mock_str_close(mock_str_t * s)
+{
+    fclose(s->fid);
+    return s->str;
+}
+
+static char * mock_get_attributes(void * h)
+{
+    const nd2_mock_spec_t * s = &((nd2_mock_t *) h)->spec;
+    mock_str_t str;
+    FILE * fid = mock_str_open(&str);
+    fprintf(fid, "{\"bitsPerComponentInMemory\":16,"
+            "\"bitsPerComponentSignificant\":16,"
+            "\"componentCount\":%d,\"heightPx\":%d,"
+            "\"pixelDataType\":\"unsigned\",\"sequenceCount\":%d,"
+            "\"widthBytes\":%d,\"widthPx\":%d}",
+            s->channels, s->height, s->fov*s->planes,
+            2*s->width*s->channels, s->width);
+    return mock_str_close(&str);
+}
+
+static char * mock_get_metadata(void * h)
+{
+    const nd2_mock_spec_t * s = &((nd2_mock_t *) h)->spec;
+    mock_str_t str;
+    FILE * fid = mock_str_open(&str);
+    fprintf(fid, "{\"contents\":{\"channelCount\":%d,\"frameCount\":%d},"
+            "\"channels\":[", s->channels, s->fov*s->planes);
+    for(int cc = 0; cc < s->channels; cc++)
+    {
+        fprintf(fid, "%s{\"channel\":{\"name\":\"mock%d\",\"index\":%d,"
+                "\"emissionLambdaNm\":%d},"
+                "\"microscope\":{\"objectiveMagnification\":60.0,"
+                "\"objectiveName\":\"Mock 60x Oil\","
+                "\"objectiveNumericalAperture\":1.4,"
+                "\"immersionRefractiveIndex\":1.515},"
+                "\"volume\":{\"axesCalibration\":[0.13,0.13,0.3],"
+                "\"voxelCount\":[%d,%d,%d]}}",
+                cc > 0 ? "," : "", cc, cc, 450 + 100*cc,
+                s->width, s->height, s->planes);
+    }
+    fprintf(fid, "]}");
+    return mock_str_close(&str);
+}
+
+static char * mock_get_frame_metadata(void * h, int64_t seq)
+{
+    const nd2_mock_spec_t * s = &((nd2_mock_t *) h)->spec;
+    int64_t fov = seq / s->planes;
+    int64_t z = seq % s->planes;
+    double ms = 100.0*seq;
+    mock_str_t str;
+    FILE * fid = mock_str_open(&str);
+    fprintf(fid, "{\"channels\":[");
+    for(int cc = 0; cc < s->channels; cc++)
+    {
+        fprintf(fid, "%s{\"position\":{\"stagePositionUm\":[%.1f,%.1f,%.2f],"
+                "\"pfsOffset\":0},"
+                "\"time\":{\"relativeTimeMs\":%.1f,"
+                "\"absoluteJulianDayNumber\":%.9f}}",
+                cc > 0 ? "," : "", 500.0*fov, 0.0, 1000.0 + 0.3*z,
+                ms, 2460000.5 + ms/86400000.0);
+    }
+    fprintf(fid, "]}");
+    return mock_str_close(&str);
+}
+
+static char * mock_get_textinfo(void * h)
+{
+    const nd2_mock_spec_t * s = &((nd2_mock_t *) h)->spec;
+    mock_str_t str;
+    FILE * fid = mock_str_open(&str);
+    /* Line breaks as escaped "\r\n" like in the files */
+    fprintf(fid, "{\"description\":\"Metadata:\\r\\n"
+            "Dimensions: XY(%d) x \xce\xbb(%d) x Z(%d)\\r\\n"
+            "Camera Name: nd2tool mock\\r\\n"
+            " Microscope Settings:   Microscope: nd2tool mock\\r\\n\"}",
+            s->fov, s->channels, s->planes);
+    return mock_str_close(&str);
+}
+
+static char * mock_get_experiment(void * h)
+{
+    (void) h;
+    return strdup("[]");
+}
+
+static int mock_get_image_data(void * h, int64_t seq, LIMPICTURE * pic)
+{
+    nd2_mock_t * m = (nd2_mock_t *) h;
+    const nd2_mock_spec_t * s = &m->spec;
+    size_t row = (size_t) s->width*s->channels;
+    size_t N = s->height;
+    if(seq < 0 || seq >= (int64_t) s->fov*s->planes || pic->pImageData == NULL
+       || pic->uiSize < row*N*sizeof(uint16_t))
+    {
+        return -1;
+    }
+
+    /* The plane shifted by seq rows */
+    uint16_t * out = (uint16_t *) pic->pImageData;
+    size_t shift = (size_t) seq % N;
+    memcpy(out, m->plane + shift*row, (N - shift)*row*sizeof(uint16_t));
+    memcpy(out + (N - shift)*row, m->plane, shift*row*sizeof(uint16_t));
+    for(int cc = 0; cc < s->channels; cc++)
+    {
+        out[cc] = (uint16_t) seq;
+    }
+    if(mock_reads != NULL)
+    {
+        __atomic_fetch_add(&mock_reads[seq], 1, __ATOMIC_RELAXED);
+    }
+
+    if(s->mbps > 0)
+    {
+        /* Sleep until the average speed is down to s->mbps */
+        m->bytes += (double) row*N*sizeof(uint16_t);
+        double target = m->bytes / (s->mbps*1e6);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (double) (now.tv_sec - m->t0.tv_sec)
+            + 1e-9*(double) (now.tv_nsec - m->t0.tv_nsec);
+        if(target > elapsed)
+        {
+            double wait = target - elapsed;
+            struct timespec ts;
+            ts.tv_sec = (time_t) wait;
+            ts.tv_nsec = (long) ((wait - (double) ts.tv_sec)*1e9);
+            nanosleep(&ts, NULL);
+        }
+    }
+    return 0;
+}
+
+static void mock_free_string(char * s)
+{
+    free(s);
+}
+
+const nd2_backend_t nd2_backend_mock = {
+    .name = "mock",
+    .open = mock_open,
+    .close = mock_close,
+    .get_coord_size = mock_get_coord_size,
+    .get_coord_info = mock_get_coord_info,
+    .get_seq_count = mock_get_seq_count,
+    .get_attributes = mock_get_attributes,
+    .get_metadata = mock_get_metadata,
+    .get_frame_metadata = mock_get_frame_metadata,
+    .get_textinfo = mock_get_textinfo,
+    .get_experiment = mock_get_experiment,
+    .get_image_data = mock_get_image_data,
+    .free_string = mock_free_string
+};
+
+void nd2_mock_ut(void)
+{
+    printf("-> testing nd2_mock\n");
+    char fName[] = "/tmp/nd2tool_ut_XXXXXX";
+    int fd = mkstemp(fName);
+    if(fd < 0)
+    {
+        fprintf(stderr, "nd2_mock_ut: Unable to create a temporary file\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    nd2_mock_spec_t spec = {3, 2, 5, 64, 48, 0};
+    int ok = nd2_mock_write_spec(fName, &spec) == EXIT_SUCCESS;
+    nd2_file_t * f = ok ? nd2_file_open(&nd2_backend_mock, fName) : NULL;
+    ok = f != NULL;
+
+    char type[64] = {0};
+    ok = ok && nd2_file_coord_size(f) == 2;
+    ok = ok && nd2_file_coord_info(f, 0, type, sizeof(type)) == 3
+        && strcmp(type, "XYPosLoop") == 0;
+    ok = ok && nd2_file_coord_info(f, 1, type, sizeof(type)) == 5
+        && strcmp(type, "ZStackLoop") == 0;
+    ok = ok && nd2_file_seq_count(f) == 15;
+
+    if(ok)
+    {
+        int value = 0;
+        char * str = nd2_file_attributes(f);
+        ok = ok && json_path_int(str, "widthBytes", &value) == 0 && value == 256;
+        nd2_file_free_string(f, str);
+
+        str = nd2_file_metadata(f);
+        double vox[3] = {0};
+        ok = ok && json_path_int(str, "contents.channelCount", &value) == 0
+            && value == 2;
+        ok = ok && json_path_doubles(str, "channels[1].volume.voxelCount", vox, 3) == 0
+            && vox[0] == 64 && vox[1] == 48 && vox[2] == 5;
+        nd2_file_free_string(f, str);
+
+        str = nd2_file_frame_metadata(f, 7);
+        double pos[3] = {0};
+        ok = ok && json_path_doubles(str, "channels[0].position.stagePositionUm",
+                                     pos, 3) == 0 && pos[0] == 500.0;
+        nd2_file_free_string(f, str);
+
+        str = nd2_file_textinfo(f);
+        char * desc = json_path_string(str, "description");
+        ok = ok && desc != NULL && strstr(desc, "Dimensions: XY(3)") != NULL;
+        free(desc);
+        nd2_file_free_string(f, str);
+    }
+
+    if(ok)
+    {
+        LIMPICTURE pic = {0};
+        pic.uiSize = 64*48*2*sizeof(uint16_t);
+        pic.pImageData = calloc(pic.uiSize, 1);
+        NOT_NULL(pic.pImageData);
+        uint16_t * p = (uint16_t *) pic.pImageData;
+        ok = ok && nd2_file_image_data(f, 7, &pic) == 0 && p[0] == 7 && p[1] == 7;
+        ok = ok && nd2_file_image_data(f, 15, &pic) != 0;
+        free(pic.pImageData);
+    }
+    nd2_file_close(f);
+
+    /* Anything else is not a mock file */
+    FILE * fid = fopen(fName, "w");
+    NOT_NULL(fid);
+    fprintf(fid, "{\"fov\": 2}");
+    fclose(fid);
+    ok = ok && nd2_file_open(&nd2_backend_mock, fName) == NULL;
+    unlink(fName);
+
+    if(!ok)
+    {
+        fprintf(stderr, "nd2_mock_ut: failed\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("ok\n");
+}
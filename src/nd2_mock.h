@@ -0,0 +1,44 @@
+#pragma once
+
+#include "nd2_backend.h"
+
+/* A backend that synthesizes nd2 files, for testing and benchmarking
+ * without real data, see --backend mock.
+ *
+ * The "file" is a small JSON document that describes the data set:
+ *
+ * {"nd2tool-mock": 1, "fov": 4, "channels": 3, "planes": 40,
+ *  "width": 2048, "height": 2048, "mbps": 500}
+ *
+ * All fields but "nd2tool-mock" are optional. The image planes are
+ * 16-bit with a background, noise and some dots, shifted a few rows
+ * per plane so that no two planes are the same. "mbps" limits the
+ * speed of get_image_data to that many MB/s per open handle, to mimic
+ * a slow disk. 0, the default, is as fast as possible.
+ */
+
+typedef struct
+{
+    int fov;
+    int channels;
+    int planes;
+    int width;
+    int height;
+    double mbps;
+} nd2_mock_spec_t;
+
+extern const nd2_backend_t nd2_backend_mock;
+
+/* Parse a spec from js. Returns 0 on success */
+int nd2_mock_parse_spec(const char * js, nd2_mock_spec_t * spec);
+
+/* Write spec to fName. Returns EXIT_SUCCESS or EXIT_FAILURE */
+int nd2_mock_write_spec(const char * fName, const nd2_mock_spec_t * spec);
+
+/* When counts is not NULL, every read of plane seq, by any handle,
+ * increments counts[seq]. Set it to NULL before counts is freed. For
+ * tests that each plane is only read once. */
+void nd2_mock_count_reads(uint32_t * counts);
+
+/* Open a small data set and check what the backend returns */
+void nd2_mock_ut(void);
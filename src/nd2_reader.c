@@ -0,0 +1,410 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "nd2_reader.h"
+
+#define NOT_NULL(x) {                                           \
+        if(x == NULL){                                          \
+            fprintf(stderr, "nd2_reader: NULL pointer at %s:%d\n", \
+                    __FILE__, __LINE__);                        \
+            exit(EXIT_FAILURE);                                 \
+        }                                                       \
+    }
+
+#define ND2_CHUNK_MAGIC 0x0ABECEDAu
+#define ND2_CHUNK_HEADER 16
+static const char nd2_map_signature[] = "ND2 CHUNK MAP SIGNATURE 0000001!";
+static const char nd2_filemap_name[] = "ND2 FILEMAP SIGNATURE NAME 0001!";
+static const char nd2_frame_prefix[] = "ImageDataSeq|";
+
+static uint32_t rd_u32(const uint8_t * p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8
+        | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t rd_u64(const uint8_t * p)
+{
+    return (uint64_t) rd_u32(p) | (uint64_t) rd_u32(p + 4) << 32;
+}
+
+/* Check the chunk header at offset, set the offset and size of the
+ * data. Returns 0 on success */
+static int chunk_data(const nd2_reader_t * r, uint64_t offset,
+                      uint64_t * data, uint64_t * nbytes)
+{
+    if(offset > r->size || r->size - offset < ND2_CHUNK_HEADER)
+    {
+        return -1;
+    }
+    const uint8_t * h = r->map + offset;
+    if(rd_u32(h) != ND2_CHUNK_MAGIC)
+    {
+        return -1;
+    }
+    uint64_t name_len = rd_u32(h + 4);
+    uint64_t len = rd_u64(h + 8);
+    uint64_t start = offset + ND2_CHUNK_HEADER + name_len;
+    if(start > r->size || len > r->size - start)
+    {
+        return -1;
+    }
+    data[0] = start;
+    nbytes[0] = len;
+    return 0;
+}
+
+/* Parse the entries of the chunk map */
+static int read_chunk_map(nd2_reader_t * r, uint64_t map_offset)
+{
+    uint64_t data = 0;
+    uint64_t nbytes = 0;
+    if(chunk_data(r, map_offset, &data, &nbytes) != 0)
+    {
+        return -1;
+    }
+    /* The name is between the header and the data */
+    const uint8_t * name = r->map + map_offset + ND2_CHUNK_HEADER;
+    uint64_t name_len = data - map_offset - ND2_CHUNK_HEADER;
+    if(name_len < strlen(nd2_filemap_name)
+       || memcmp(name, nd2_filemap_name, strlen(nd2_filemap_name)) != 0)
+    {
+        return -1;
+    }
+
+    const uint8_t * p = r->map + data;
+    const uint8_t * end = p + nbytes;
+    int64_t alloc = 0;
+    while(p < end)
+    {
+        const uint8_t * bang = memchr(p, '!', end - p);
+        if(bang == NULL)
+        {
+            return -1;
+        }
+        uint32_t len = (uint32_t) (bang - p + 1);
+        if(len == strlen(nd2_map_signature)
+           && memcmp(p, nd2_map_signature, len) == 0)
+        {
+            break;
+        }
+        if(end - (bang + 1) < 16)
+        {
+            return -1;
+        }
+        if(r->nchunks == alloc)
+        {
+            alloc = alloc == 0 ? 1024 : 2*alloc;
+            r->chunks = realloc(r->chunks, alloc*sizeof(nd2_chunk_t));
+            NOT_NULL(r->chunks);
+        }
+        nd2_chunk_t * c = r->chunks + r->nchunks++;
+        c->name = (const char *) p;
+        c->name_len = len;
+        c->offset = rd_u64(bang + 1);
+        c->nbytes = rd_u64(bang + 9);
+        p = bang + 17;
+    }
+    return 0;
+}
+
+/* Find the planes among the chunks */
+static int find_frames(nd2_reader_t * r)
+{
+    size_t plen = strlen(nd2_frame_prefix);
+    for(int64_t kk = 0; kk < r->nchunks; kk++)
+    {
+        const nd2_chunk_t * c = r->chunks + kk;
+        if(c->name_len <= plen || memcmp(c->name, nd2_frame_prefix, plen) != 0)
+        {
+            continue;
+        }
+        int64_t seq = 0;
+        for(uint32_t ii = plen; ii + 1 < c->name_len; ii++)
+        {
+            if(c->name[ii] < '0' || c->name[ii] > '9' || seq > INT32_MAX)
+            {
+                return -1;
+            }
+            seq = 10*seq + (c->name[ii] - '0');
+        }
+        if(seq + 1 > r->nframes)
+        {
+            r->nframes = seq + 1;
+        }
+    }
+
+    r->frame_offset = calloc(r->nframes + 1, sizeof(uint64_t));
+    r->frame_bytes = calloc(r->nframes + 1, sizeof(uint64_t));
+    NOT_NULL(r->frame_offset);
+    NOT_NULL(r->frame_bytes);
+    for(int64_t kk = 0; kk < r->nchunks; kk++)
+    {
+        const nd2_chunk_t * c = r->chunks + kk;
+        if(c->name_len <= plen || memcmp(c->name, nd2_frame_prefix, plen) != 0)
+        {
+            continue;
+        }
+        int64_t seq = strtoll(c->name + plen, NULL, 10);
+        uint64_t data = 0;
+        uint64_t nbytes = 0;
+        /* Skip the time stamp */
+        if(chunk_data(r, c->offset, &data, &nbytes) != 0 || nbytes < 8)
+        {
+            return -1;
+        }
+        r->frame_offset[seq] = data + 8;
+        r->frame_bytes[seq] = nbytes - 8;
+    }
+    return 0;
+}
+
+nd2_reader_t * nd2_reader_open(const char * fName, int verbose)
+{
+    nd2_reader_t * r = calloc(1, sizeof(nd2_reader_t));
+    NOT_NULL(r);
+    r->fd = open(fName, O_RDONLY);
+    if(r->fd < 0)
+    {
+        if(verbose > 0)
+        {
+            fprintf(stderr, "nd2_reader: Unable to open %s: %s\n",
+                    fName, strerror(errno));
+        }
+        free(r);
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(r->fd, &st) != 0 || st.st_size < 40 + ND2_CHUNK_HEADER)
+    {
+        if(verbose > 0)
+        {
+            fprintf(stderr, "nd2_reader: %s is too small\n", fName);
+        }
+        close(r->fd);
+        free(r);
+        return NULL;
+    }
+    r->size = st.st_size;
+    void * map = mmap(NULL, r->size, PROT_READ, MAP_SHARED, r->fd, 0);
+    if(map == MAP_FAILED)
+    {
+        if(verbose > 0)
+        {
+            fprintf(stderr, "nd2_reader: Unable to map %s: %s\n",
+                    fName, strerror(errno));
+        }
+        close(r->fd);
+        free(r);
+        return NULL;
+    }
+    r->map = map;
+
+    const uint8_t * tail = r->map + r->size - 40;
+    int ok = rd_u32(r->map) == ND2_CHUNK_MAGIC;
+    ok = ok && memcmp(tail, nd2_map_signature, 32) == 0;
+    ok = ok && read_chunk_map(r, rd_u64(tail + 32)) == 0;
+    ok = ok && find_frames(r) == 0;
+    if(!ok)
+    {
+        if(verbose > 0)
+        {
+            fprintf(stderr, "nd2_reader: %s has no chunk map that can be used\n",
+                    fName);
+        }
+        nd2_reader_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+void nd2_reader_close(nd2_reader_t * r)
+{
+    if(r == NULL)
+    {
+        return;
+    }
+    munmap((void *) r->map, r->size);
+    close(r->fd);
+    free(r->chunks);
+    free(r->frame_offset);
+    free(r->frame_bytes);
+    free(r);
+}
+
+const void * nd2_reader_frame(const nd2_reader_t * r, int64_t seq,
+                              uint64_t * nbytes)
+{
+    if(seq < 0 || seq >= r->nframes || r->frame_offset[seq] == 0)
+    {
+        return NULL;
+    }
+    nbytes[0] = r->frame_bytes[seq];
+    return r->map + r->frame_offset[seq];
+}
+
+void nd2_reader_prefetch(const nd2_reader_t * r, int64_t seq)
+{
+    if(seq < 0 || seq >= r->nframes || r->frame_offset[seq] == 0)
+    {
+        return;
+    }
+    uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t first = r->frame_offset[seq] / page * page;
+    uint64_t last = r->frame_offset[seq] + r->frame_bytes[seq];
+    posix_madvise((void *) (r->map + first), last - first,
+                  POSIX_MADV_WILLNEED);
+}
+
+const void * nd2_reader_chunk(const nd2_reader_t * r, const char * name,
+                              uint64_t * nbytes)
+{
+    size_t len = strlen(name);
+    for(int64_t kk = 0; kk < r->nchunks; kk++)
+    {
+        const nd2_chunk_t * c = r->chunks + kk;
+        uint64_t data = 0;
+        if(c->name_len == len && memcmp(c->name, name, len) == 0
+           && chunk_data(r, c->offset, &data, nbytes) == 0)
+        {
+            return r->map + data;
+        }
+    }
+    return NULL;
+}
+
+/* Write one chunk with the name padded to name_len bytes */
+static uint64_t ut_put_chunk(FILE * fid, const char * name, uint32_t name_len,
+                             const void * data, uint64_t nbytes)
+{
+    uint64_t offset = (uint64_t) ftell(fid);
+    uint8_t h[ND2_CHUNK_HEADER];
+    uint32_t magic = ND2_CHUNK_MAGIC;
+    for(int kk = 0; kk < 4; kk++)
+    {
+        h[kk] = (uint8_t) (magic >> (8*kk));
+        h[4+kk] = (uint8_t) (name_len >> (8*kk));
+    }
+    for(int kk = 0; kk < 8; kk++)
+    {
+        h[8+kk] = (uint8_t) (nbytes >> (8*kk));
+    }
+    fwrite(h, 1, sizeof(h), fid);
+    char * padded = calloc(name_len, 1);
+    NOT_NULL(padded);
+    memcpy(padded, name, strlen(name));
+    fwrite(padded, 1, name_len, fid);
+    free(padded);
+    fwrite(data, 1, nbytes, fid);
+    return offset;
+}
+
+static void ut_put_u64(FILE * fid, uint64_t value)
+{
+    uint8_t b[8];
+    for(int kk = 0; kk < 8; kk++)
+    {
+        b[kk] = (uint8_t) (value >> (8*kk));
+    }
+    fwrite(b, 1, 8, fid);
+}
+
+void nd2_reader_ut(void)
+{
+    printf("-> testing nd2_reader\n");
+    char fName[] = "/tmp/nd2tool_ut_XXXXXX";
+    int fd = mkstemp(fName);
+    if(fd < 0)
+    {
+        fprintf(stderr, "nd2_reader_ut: Unable to create a temporary file\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    /* Three planes of 4 x 3 pixels with 2 channels, written in
+     * reverse order */
+    const int nframes = 3;
+    const uint64_t plane_bytes = 4*3*2*sizeof(uint16_t);
+    FILE * fid = fopen(fName, "wb");
+    NOT_NULL(fid);
+    ut_put_chunk(fid, "ND2 FILE SIGNATURE CHUNK NAME01!", 32, "Ver3.0", 6);
+    uint64_t offsets[3];
+    uint8_t * frame = calloc(8 + plane_bytes, 1);
+    NOT_NULL(frame);
+    for(int ff = nframes-1; ff >= 0; ff--)
+    {
+        uint16_t * pixels = (uint16_t *) (frame + 8);
+        for(uint64_t kk = 0; kk < plane_bytes/2; kk++)
+        {
+            pixels[kk] = (uint16_t) (1000*ff + kk);
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "ImageDataSeq|%d!", ff);
+        offsets[ff] = ut_put_chunk(fid, name, 64, frame, 8 + plane_bytes);
+    }
+    uint64_t meta_offset = ut_put_chunk(fid, "ImageMetadataLV!", 16, "meta", 4);
+
+    /* The chunk map */
+    char * map = NULL;
+    size_t map_size = 0;
+    FILE * mf = open_memstream(&map, &map_size);
+    NOT_NULL(mf);
+    for(int ff = 0; ff < nframes; ff++)
+    {
+        fprintf(mf, "ImageDataSeq|%d!", ff);
+        ut_put_u64(mf, offsets[ff]);
+        ut_put_u64(mf, 8 + plane_bytes);
+    }
+    fprintf(mf, "ImageMetadataLV!");
+    ut_put_u64(mf, meta_offset);
+    ut_put_u64(mf, 4);
+    fprintf(mf, "%s", nd2_map_signature);
+    ut_put_u64(mf, 0);
+    fclose(mf);
+    uint64_t map_offset = ut_put_chunk(fid, nd2_filemap_name, 32,
+                                       map, map_size);
+    free(map);
+    fwrite(nd2_map_signature, 1, 32, fid);
+    ut_put_u64(fid, map_offset);
+    fclose(fid);
+
+    nd2_reader_t * r = nd2_reader_open(fName, 1);
+    int ok = r != NULL && r->nframes == nframes;
+    for(int ff = 0; ok && ff < nframes; ff++)
+    {
+        uint64_t nbytes = 0;
+        const uint16_t * pixels = nd2_reader_frame(r, ff, &nbytes);
+        ok = ok && pixels != NULL && nbytes == plane_bytes;
+        ok = ok && pixels[0] == 1000*ff && pixels[plane_bytes/2-1] == 1000*ff + 23;
+        nd2_reader_prefetch(r, ff);
+    }
+    uint64_t nbytes = 0;
+    ok = ok && nd2_reader_frame(r, nframes, &nbytes) == NULL;
+    const char * meta = ok ? nd2_reader_chunk(r, "ImageMetadataLV!", &nbytes) : NULL;
+    ok = ok && meta != NULL && nbytes == 4 && memcmp(meta, "meta", 4) == 0;
+    ok = ok && nd2_reader_chunk(r, "ImageMetadata!", &nbytes) == NULL;
+    nd2_reader_close(r);
+
+    /* A file without the chunk map is rejected */
+    if(ok)
+    {
+        ok = truncate(fName, (off_t) map_offset) == 0;
+        ok = ok && nd2_reader_open(fName, 0) == NULL;
+    }
+    unlink(fName);
+    free(frame);
+    if(!ok)
+    {
+        fprintf(stderr, "nd2_reader_ut: failed\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("ok\n");
+}
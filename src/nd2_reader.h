@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+
+/* A minimal reader for the container format of nd2 files (version
+ * 3, written by NIS-Elements 4 and later) that maps the file into
+ * memory.
+ *
+ * An nd2 file is a sequence of chunks. Each starts with a header of
+ * 16 bytes: the magic number 0x0ABECEDA (uint32), the length of the
+ * name (uint32) and the length of the data (uint64), all little
+ * endian. The name ends with '!' and is padded with zeros to the
+ * given length, then comes the data.
+ *
+ * The last 40 bytes of the file are "ND2 CHUNK MAP SIGNATURE 0000001!"
+ * and the offset of the chunk map, a chunk with the name
+ * "ND2 FILEMAP SIGNATURE NAME 0001!". Its data lists the name of
+ * each chunk followed by its offset and data length (uint64).
+ *
+ * The image planes are in the chunks "ImageDataSeq|<seq>!", a time
+ * stamp (double) followed by the interleaved pixels, row by row.
+ * Only uncompressed planes can be used directly, compressed planes
+ * are reported as not available and have to be read with the SDK.
+ *
+ * Only the pixel data is read from the file, the metadata still
+ * comes from the SDK. Everything is read-only so a reader can be used
+ * from any number of threads.
+ */
+
+typedef struct {
+    const char * name; /* Points into the map, not 0-terminated */
+    uint32_t name_len; /* Including the '!' */
+    uint64_t offset; /* Of the chunk header */
+    uint64_t nbytes; /* Size of the data */
+} nd2_chunk_t;
+
+typedef struct {
+    int fd;
+    const uint8_t * map;
+    uint64_t size;
+    nd2_chunk_t * chunks; /* From the chunk map */
+    int64_t nchunks;
+    /* Pixels of each plane, by sequence index, 0 if missing */
+    uint64_t * frame_offset;
+    uint64_t * frame_bytes;
+    int64_t nframes;
+} nd2_reader_t;
+
+/* Map fName and read the chunk map. Returns NULL, with a message if
+ * verbose > 0, if the file can't be opened or is not in the
+ * supported format. */
+nd2_reader_t * nd2_reader_open(const char * fName, int verbose);
+
+void nd2_reader_close(nd2_reader_t * r);
+
+/* The pixels of plane seq in the map, and their size in nbytes.
+ * Returns NULL if there is no such plane. */
+const void * nd2_reader_frame(const nd2_reader_t * r, int64_t seq,
+                              uint64_t * nbytes);
+
+/* Ask the kernel to start reading plane seq from disk */
+void nd2_reader_prefetch(const nd2_reader_t * r, int64_t seq);
+
+/* The data of the chunk called name (including the '!'), NULL if
+ * there is none */
+const void * nd2_reader_chunk(const nd2_reader_t * r, const char * name,
+                              uint64_t * nbytes);
+
+/* Write a small file in the nd2 container format and read it back */
+void nd2_reader_ut(void);
@@ -6,7 +6,22 @@
  */
 #include "Nd2ReadSdk_stripped.h"
 
+#include "deinterleave.h"
+#include "focus.h"
 #include "tiff_util.h"
+#include "tiff_compress.h"
+#include "zarr_util.h"
+#include "npy_util.h"
+#include "cache_util.h"
+#include "coltab_util.h"
+#include "nd2_reader.h"
+#include "nd2_backend.h"
+#include "nd2_mock.h"
+#include "tpool.h"
+#include "plane_ring.h"
+#include "prof_util.h"
+#include "journal_util.h"
+#include "hash_util.h"
 #include "json_util.h"
 #include "srgb_from_lambda.h"
 
@@ -17,6 +32,21 @@ typedef enum {
     SHOW_METADATA
 } nt_purpose;
 
+/* Output format, see --format */
+typedef enum {
+    FORMAT_TIF,
+    FORMAT_ZARR,
+    FORMAT_OMETIFF,
+    FORMAT_NPY
+} nt_format;
+
+/* Where the image planes are read from, see --reader */
+typedef enum {
+    READER_SDK,
+    READER_NATIVE, /* nd2_reader.h, SDK for compressed files */
+    READER_CHECK /* Both, and compare */
+} nt_reader;
+
 /* General settings */
 typedef struct{
     int verbose;
@@ -47,6 +77,8 @@ typedef struct{
     int deconwolf; /* Write deconwolf script? */
     int deconwolfx; /* Write deconwolf script and as for arguments */
     int deconwolf_dots; /* Write script for dot detection */
+    int cache; /* Use the metadata cache, see --no-cache */
+    int frame_table; /* Write the frame metadata, see --frame-table */
 
     /* If only extracting a subset of the slices */
     int use_range;
@@ -54,6 +86,20 @@ typedef struct{
     int range_to;
 
     char * dwargs; /* Extra arguments to dw */
+
+    int nthreads; /* Threads for the conversion, 0 = one per core */
+    int queue_depth; /* Planes to read ahead per thread, 0 = none */
+    int njobs; /* Files to convert at the same time */
+    int libtiff; /* Write tif files with libtiff instead of tiff_writer */
+    uint16_t compression; /* TIFF Compression value, see --compress */
+    nt_format format;
+    nt_reader reader;
+    const nd2_backend_t * backend; /* See --backend */
+    int profile; /* Print the time per stage, see --profile */
+    char * trace; /* Chrome trace file, see --trace */
+    int resume; /* Continue the files of an interrupted run, see --resume */
+    int verify; /* Check the hashes in the manifest, see --verify */
+    int focus; /* Write the focus measure of each plane, see --focus */
 } ntconf_t;
 
 
@@ -70,6 +116,7 @@ typedef struct{
     int sequenceCount; // "sequenceCount": 61,
     int widthBytes; // "widthBytes": 16384,
     int widthPx; //"widthPx": 2048
+    int compressed; // "compressionType": "lossless", absent if not compressed
 } file_attrib_t;
 
 /* Data from Lim_FileGetMetadata */
@@ -89,8 +136,17 @@ typedef struct{
     double dz_nm;
 } channel_attrib_t;
 
+/* Data from Lim_FileGetFrameMetadata, only read with --shake,
+ * --coord or --frame-table and only for the FOVs and planes selected
+ * by --fov and --slice, the other values are 0. See
+ * nd2info_read_frames. There is one value per frame and channel,
+ * three for the stage position, NAN if missing in the metadata. */
 typedef struct{
     double * stagePositionUm;
+    double * relativeTimeMs;
+    double * absoluteJulianDayNumber;
+    double * pfsOffset;
+    uint8_t * valid; /* Non-zero for the frames that were read */
 } meta_frame_t;
 
 typedef struct
@@ -103,19 +159,84 @@ typedef struct
 {
     ntconf_t * conf;
     char * filename;
+    /* Handle opened by nd2info and reused by nd2_to_tiff, closed by
+     * nd2info_free */
+    void * nd2;
     metadata_t * meta_att;
     file_attrib_t * file_att;
     meta_frame_t * meta_frame;
     char * error;
     int nFOV;
+    int seqCount; /* From Lim_FileGetSeqCount */
     char * loopstring;
     char * outfolder;
+    char * zarrstore; /* outfolder/outfolder.ome.zarr with --format zarr */
     char * logfile;
     FILE * log;
     char * camera_name;
     char * microscope_name;
+    /* The file mapped by the built-in reader, NULL unless --reader
+     * native or check. Shared by all threads. */
+    nd2_reader_t * native;
+    /* Number of image planes read by nd2_get_plane, and how many of
+     * them that came from info->native */
+    i64 nread;
+    i64 nnative;
+    /* Size of the finished output files, see nd2worker_commit */
+    i64 bytes_written;
+    /* The files that are written to the outfolder, see --resume. NULL
+     * with --dry or when another process has the journal */
+    journal_t * journal;
+    /* nd2tool.manifest in the outfolder, the hashes of the nd2 file and
+     * of the pixel data of the output files. NULL with --dry */
+    FILE * manifest;
+    /* The nd2 file is hashed by source_thread during the conversion,
+     * see nd2info_hash_start */
+    pthread_t source_thread;
+    int source_hashing;
+    int source_status;
+    uint64_t source_hash;
+    i64 source_size;
+    /* With --focus, the focus measure of each plane that is written,
+     * focus[(fov*nchan + channel)*P + slice], NAN for the planes that
+     * were not, see nd2worker_focus */
+    double * focus;
 } nd2info_t;
 
+/* One interlaced image plane, see nd2_get_plane. pixels points
+ * either to pic or into the file mapped by info->native. */
+typedef struct
+{
+    LIMPICTURE pic;
+    const uint16_t * pixels;
+} nd2_plane_t;
+
+/* Per-thread state when converting to tif */
+typedef struct
+{
+    ntconf_t * conf;
+    nd2info_t * info;
+    void * nd2; /* Handle to the nd2 file, one per thread */
+    nd2_plane_t * plane; /* Without --queue-depth */
+    uint16_t * S; /* One image plane per channel and writer */
+    /* Threads writing the planes of a FOV, see nd2worker_write_planes */
+    int nwriters;
+
+    /* Planes to read for the current FOV, see nd2worker_start_planes */
+    const i64 * seq;
+    i64 nseq;
+    i64 nextseq;
+    /* Interlaced planes read ahead by another thread, NULL without
+     * --queue-depth */
+    plane_ring_t * ring;
+    plane_slot_t * slot; /* The plane in use by nd2worker_next_plane */
+    pthread_t reader;
+
+    ttags * tags;
+    FILE * out; /* stdout or a buffer, see nd2worker_printf */
+    FILE * log; /* info->log or a buffer */
+} nd2worker_t;
+
 /*
  * Forward declarations
  */
@@ -134,19 +255,28 @@ static void file_attrib_free(file_attrib_t * f);
 static void metadata_free(metadata_t * m);
 static metadata_t * parse_metadata(const char * str);
 static file_attrib_t * parse_file_attrib(const char * str);
-/* Parse the frame metadata (given as text), say what number of
- * channels that we expect (nchannels) and where to put the coordinates (pos) */
-static void parse_stagePosition(const char * frameMeta, int nchannels, double * pos);
-
-static void check_stage_position(nd2info_t * info, int fov, int channel);
+/* Parse the frame metadata (given as text) of frame seq, say what
+ * number of channels that we expect (nchannels). The stage position,
+ * time stamps and PFS offset of each channel go to mf, at row
+ * seq*nchannels + channel */
+static void parse_frame_meta(const char * frameMeta, int nchannels,
+                             meta_frame_t * mf, i64 seq);
+/* The planes [p0, p1) of a FOV selected by --slice */
+static void nd2_slice_range(const ntconf_t * conf, i64 P, i64 * p0, i64 * p1);
+/* Non-zero if the FOV ff (0-indexed) is selected by --fov */
+static int nd2_fov_selected(const ntconf_t * conf, i64 ff);
+/* Open an nd2 file, NULL on failure */
+static void * open_nd2(ntconf_t * conf, char * filename);
+
+static void check_stage_position(nd2worker_t * w, int fov, int channel);
 
 /* RAW metadata extraction without JSON parsing  */
 static void showmeta(ntconf_t * conf, char * file);
-static void showmeta_file(char *);
-static void showmeta_coord(char *);
-static void showmeta_frame(char *);
-static void showmeta_text(char *);
-static void showmeta_exp(char *);
+static void showmeta_file(ntconf_t * conf, char *);
+static void showmeta_coord(ntconf_t * conf, char *);
+static void showmeta_frame(ntconf_t * conf, char *);
+static void showmeta_text(ntconf_t * conf, char *);
+static void showmeta_exp(ntconf_t * conf, char *);
 
 /* Convert to tif and place in the outfolder. The outfolder has to
    exist. */
@@ -155,6 +285,13 @@ static int nd2_to_tiff(ntconf_t *, nd2info_t *);
 /* Show XYZ coordinates of all images in csv format */
 static void nd2_show_coordinates(nd2info_t * info);
 
+/* Write the frame metadata to file.nd2.frames, see coltab_util.h */
+static int nd2_write_frame_table(nd2info_t * info);
+
+/* Messages from the conversion threads, see nd2_convert_fovs */
+static void nd2worker_printf(nd2worker_t * w, const char *fmt, ...);
+static void nd2worker_log(nd2worker_t * w, const char *fmt, ...);
+
 /* Write some initial information to the log file, info->log */
 static void hello_log(ntconf_t * conf, nd2info_t * info, int argc, char ** argv);
 
@@ -351,6 +488,7 @@ static void nd2info_free(nd2info_t * n)
     free(n->loopstring);
     free(n->logfile);
     free(n->outfolder);
+    free(n->zarrstore);
 
     if(n->log != NULL)
     {
@@ -360,14 +498,21 @@ static void nd2info_free(nd2info_t * n)
 
     if(n->meta_frame != NULL)
     {
-        if(n->meta_frame->stagePositionUm != NULL)
-        {
-            free(n->meta_frame->stagePositionUm);
-        }
+        free(n->meta_frame->stagePositionUm);
+        free(n->meta_frame->relativeTimeMs);
+        free(n->meta_frame->absoluteJulianDayNumber);
+        free(n->meta_frame->pfsOffset);
+        free(n->meta_frame->valid);
         free(n->meta_frame);
     }
     free(n->camera_name);
     free(n->microscope_name);
+    free(n->focus);
+    if(n->nd2 != NULL)
+    {
+        nd2_file_close(n->nd2);
+    }
+    nd2_reader_close(n->native);
     free(n);
 }
 
@@ -381,31 +526,26 @@ static nd2info_t * nd2info_new(ntconf_t * conf)
 }
 
 
-/** @breif Parse the result from Lim_FileGetMetadata */
+/** @breif Parse the result from Lim_FileGetMetadata
+ *
+ * Returns NULL if the size of the volumes can't be found.
+ */
 static metadata_t * parse_metadata(const char * str)
 {
     NOT_NULL(str);
-    cJSON *j = cJSON_Parse(str);
-
-    if (j == NULL)
+    const char * j = json_path(str, "");
+    if (j == NULL || *j != '{')
     {
         fprintf(stderr, "Error parsing metadata (%s, line %d)\n", __FILE__, __LINE__);
-        const char *error_ptr = cJSON_GetErrorPtr();
-        if (error_ptr != NULL)
-        {
-            fprintf(stderr, "Error before: %s\n", error_ptr);
-        }
         fprintf(stderr, "Unable to continue\n");
         exit(EXIT_FAILURE);
     }
 
     metadata_t * m = ckcalloc(1, sizeof(metadata_t));
 
-    const cJSON * j_contents = cJSON_GetObjectItemCaseSensitive(j, "contents");
-    NOT_NULL(m);
-
-    if(get_json_int(j_contents, "channelCount", &m->nchannels) != 0)
+    if(json_path_int(j, "contents.channelCount", &m->nchannels) != 0)
     {
+        fprintf(stderr, "ERROR: Failed to parse contents.channelCount\n");
         fprintf(stderr, "Unable to continue (%s, line %d)\n",
                 __FILE__, __LINE__);
         free(m);
@@ -422,24 +562,25 @@ static metadata_t * parse_metadata(const char * str)
         m->channels[cc]->name = NULL;
     }
 
-    cJSON * j_channel = NULL;
-    cJSON * j_channels = cJSON_GetObjectItemCaseSensitive(j, "channels");
-    if(j_channels == NULL)
+    const char * j_channels = json_path(j, "channels");
+    if(json_array_size(j_channels) < 0)
     {
         fprintf(stderr, "Unable to find any channels in the nd2 file\n");
         exit(EXIT_FAILURE);
     }
 
     int cc = 0;
-    cJSON_ArrayForEach(j_channel, j_channels)
+    for(const char * j_channel = json_first(j_channels);
+        j_channel != NULL; j_channel = json_next(j_channel))
     {
         if(cc >= m->nchannels)
         {
             fprintf(stderr, "Got conflicting number of channels\n");
             exit(EXIT_FAILURE);
         }
+        channel_attrib_t * chan = m->channels[cc];
 
-        cJSON * j_chan = cJSON_GetObjectItemCaseSensitive(j_channel, "channel");
+        const char * j_chan = json_path(j_channel, "channel");
         if(j_chan == NULL)
         {
             fprintf(stderr, "Unable to parse the JSON data. \n"
@@ -448,84 +589,71 @@ static metadata_t * parse_metadata(const char * str)
             exit(EXIT_FAILURE);
         }
 
+        chan->name = json_path_string(j_chan, "name");
+        NOT_NULL(chan->name);
 
-        m->channels[cc]->name = get_json_string(j_chan, "name");
-        NOT_NULL(m->channels[cc]->name);
-
-        get_json_double(j_chan,
-                        "emissionLambdaNm",
-                        &m->channels[cc]->emissionLambdaNm);
+        if(json_path_double(j_chan, "emissionLambdaNm",
+                            &chan->emissionLambdaNm) != 0)
+        {
+            fprintf(stderr, "ERROR: Failed to parse channel/emissionLambdaNm\n");
+            chan->emissionLambdaNm = -1.0;
+        }
 
         { /* Pixel size and image size */
-            cJSON * j_vol = cJSON_GetObjectItemCaseSensitive(j_channel,
-                                                             "volume");
-
-            cJSON * j_ax = cJSON_GetObjectItemCaseSensitive(j_vol,
-                                                            "axesCalibration");
-            cJSON * j_ax_0 = cJSON_GetArrayItem(j_ax, 0);
-            assert(cJSON_IsNumber(j_ax_0));
-            m->channels[cc]->dx_nm = 1000.0*j_ax_0->valuedouble;
-            cJSON * j_ax_1 = cJSON_GetArrayItem(j_ax, 1);
-            assert(cJSON_IsNumber(j_ax_1));
-            m->channels[cc]->dy_nm = 1000.0*j_ax_1->valuedouble;
-            cJSON * j_ax_2 = cJSON_GetArrayItem(j_ax, 2);
-            assert(cJSON_IsNumber(j_ax_2));
-            m->channels[cc]->dz_nm = 1000.0*j_ax_2->valuedouble;
-
-            cJSON * j_vox = cJSON_GetObjectItemCaseSensitive(j_vol,
-                                                             "voxelCount");
-            cJSON * j_temp = cJSON_GetArrayItem(j_vox, 0);
-            m->channels[cc]->M = j_temp->valueint;
-            j_temp = cJSON_GetArrayItem(j_vox, 1);
-            m->channels[cc]->N = j_temp->valueint;
-            j_temp = cJSON_GetArrayItem(j_vox, 2);
-            m->channels[cc]->P = j_temp->valueint;
+            const char * j_vol = json_path(j_channel, "volume");
+            double ax[3] = {0};
+            if(json_path_doubles(j_vol, "axesCalibration", ax, 3) != 0)
+            {
+                fprintf(stderr, "ERROR: Failed to parse channel/volume/axesCalibration\n");
+                metadata_free(m);
+                return NULL;
+            }
+            chan->dx_nm = 1000.0*ax[0];
+            chan->dy_nm = 1000.0*ax[1];
+            chan->dz_nm = 1000.0*ax[2];
 
+            double vox[3] = {0};
+            if(json_path_doubles(j_vol, "voxelCount", vox, 3) != 0
+               || vox[0] < 1 || vox[1] < 1 || vox[2] < 1)
+            {
+                fprintf(stderr, "ERROR: Failed to parse channel/volume/voxelCount\n");
+                metadata_free(m);
+                return NULL;
+            }
+            chan->M = (int) vox[0];
+            chan->N = (int) vox[1];
+            chan->P = (int) vox[2];
         }
         { /* Optical configuration*/
-            cJSON * j_mic = cJSON_GetObjectItemCaseSensitive(j_channel,
-                                                             "microscope");
+            const char * j_mic = json_path(j_channel, "microscope");
             if(j_mic == NULL)
             {
                 printf("Warning: Could not find channel/microscope\n");
                 goto done_optical_configuration;
             }
-            cJSON * j_tmp = cJSON_GetObjectItemCaseSensitive(j_mic,
-                                                             "immersionRefractiveIndex");
 
-            if(j_tmp == NULL)
+            if(json_path_double(j_mic, "immersionRefractiveIndex",
+                                &chan->immersionRefractiveIndex) != 0)
             {
                 printf("Warning: Could not find channel/microscope/immersionRefractiveIndex\n");
-            } else {
-                m->channels[cc]->immersionRefractiveIndex = j_tmp->valuedouble;
             }
 
-            j_tmp = cJSON_GetObjectItemCaseSensitive(j_mic,
-                                                     "objectiveNumericalAperture");
-            if(j_tmp == NULL)
+            if(json_path_double(j_mic, "objectiveNumericalAperture",
+                                &chan->objectiveNumericalAperture) != 0)
             {
                 printf("Warning: Could not find channel/microscope/objectiveNumericalAperture\n");
-            } else {
-                m->channels[cc]->objectiveNumericalAperture = j_tmp->valuedouble;
             }
 
-            j_tmp = cJSON_GetObjectItemCaseSensitive(j_mic,
-                                                     "objectiveMagnification");
-            if(j_tmp == NULL)
+            if(json_path_double(j_mic, "objectiveMagnification",
+                                &chan->objectiveMagnification) != 0)
             {
                 printf("Warning: Could not find channel/microscope/objectiveMagnification\n");
-            } else {
-                m->channels[cc]->objectiveMagnification = j_tmp->valuedouble;
             }
 
-            j_tmp = cJSON_GetObjectItemCaseSensitive(j_mic,
-                                                     "objectiveName");
-
-            if(j_tmp == NULL)
+            chan->objectiveName = json_path_string(j_mic, "objectiveName");
+            if(chan->objectiveName == NULL)
             {
                 printf("Warning: Could not find channel/microscope/objectiveName\n");
-            } else {
-                m->channels[cc]->objectiveName = strdup(j_tmp->valuestring);
             }
 
         done_optical_configuration: ;
@@ -534,43 +662,44 @@ static metadata_t * parse_metadata(const char * str)
         cc++;
     }
 
-    cJSON_Delete(j);
     return m;
 }
 
 
-/** @brief Parse the result from Lim_FileGetMetadata */
+/** @brief Parse the result from Lim_FileGetAttributes */
 static file_attrib_t * parse_file_attrib(const char * str)
 {
-    cJSON *json = cJSON_Parse(str);
-
-    if (json == NULL)
+    NOT_NULL(str);
+    const char * j = json_path(str, "");
+    if(j == NULL || *j != '{')
     {
         fprintf(stderr, "Error parsing file attributes\n");
-        const char *error_ptr = cJSON_GetErrorPtr();
-        if (error_ptr != NULL)
-        {
-            fprintf(stderr, "Error before: %s\n", error_ptr);
-        }
         exit(EXIT_FAILURE);
     }
 
     file_attrib_t * attrib = ckcalloc(1, sizeof(file_attrib_t));
 
-    get_json_int(json, "heightPx",
-                 &attrib->heightPx);
-    get_json_int(json, "widthPx",
-                 &attrib->widthPx);
-    get_json_int(json, "sequenceCount",
-                 &attrib->sequenceCount);
-    get_json_int(json, "componentCount",
-                 &attrib->componentCount);
-    get_json_int(json, "bitsPerComponentInMemory",
-                 &attrib->bitsPerComponentInMemory);
-    get_json_int(json, "bitsPerComponentSignificant",
-                 &attrib->bitsPerComponentSignificant);
-
-    cJSON_Delete(json);
+    const char * fields[] = {"heightPx", "widthPx", "widthBytes",
+                             "sequenceCount", "componentCount",
+                             "bitsPerComponentInMemory",
+                             "bitsPerComponentSignificant"};
+    int * store[] = {&attrib->heightPx, &attrib->widthPx,
+                     &attrib->widthBytes,
+                     &attrib->sequenceCount, &attrib->componentCount,
+                     &attrib->bitsPerComponentInMemory,
+                     &attrib->bitsPerComponentSignificant};
+    for(size_t kk = 0; kk < sizeof(fields)/sizeof(fields[0]); kk++)
+    {
+        if(json_path_int(str, fields[kk], store[kk]) != 0)
+        {
+            fprintf(stderr, "ERROR: Failed to parse %s in the file attributes\n",
+                    fields[kk]);
+            *store[kk] = -1;
+        }
+    }
+    char * compression = json_path_string(str, "compressionType");
+    attrib->compressed = compression != NULL;
+    free(compression);
     return attrib;
 }
 
@@ -588,7 +717,7 @@ static void check_cmd_line(int argc, char ** argv)
 
 static void nd2info_set_outfolder(nd2info_t * info)
 {
-  //    free(info->outfolder);
+    free(info->outfolder); /* Set by nd2info and again before the conversion */
     assert(info->filename != NULL);
     info->outfolder = strdup(info->filename);
     char * outfolder = strdup(basename(info->outfolder));
@@ -600,35 +729,172 @@ static void nd2info_set_outfolder(nd2info_t * info)
 }
 
 
-static nd2info_t * nd2info(ntconf_t * conf, const char * file)
+/** @brief Allocate the per-frame arrays of mf for seqCount frames */
+static void
+meta_frame_alloc(meta_frame_t * mf, i64 seqCount, int nchannel)
 {
-    nd2info_t * info = nd2info_new(conf);
-    NOT_NULL(info);
-    assert(file != NULL);
-    info->filename = strdup(file);
-    NOT_NULL(info->filename);
+    mf->stagePositionUm = ckcalloc(3*seqCount*nchannel, sizeof(double));
+    mf->relativeTimeMs = ckcalloc(seqCount*nchannel, sizeof(double));
+    mf->absoluteJulianDayNumber = ckcalloc(seqCount*nchannel, sizeof(double));
+    mf->pfsOffset = ckcalloc(seqCount*nchannel, sizeof(double));
+    mf->valid = ckcalloc(seqCount, sizeof(uint8_t));
+}
 
-    struct stat stats;
-    if(stat(info->filename, &stats) != 0)
+/* Frames per job in nd2info_read_frames */
+#define ND2_FRAMES_PER_JOB 64
+
+/* Shared state of the threads in nd2info_read_frames */
+typedef struct
+{
+    ntconf_t * conf;
+    nd2info_t * info;
+    const i64 * seq; /* Frames to read */
+    i64 nseq;
+    void ** nd2; /* One handle per thread, opened on first use */
+} nd2_frame_scan_t;
+
+static void
+nd2_frame_scan_job(void * arg, i64 job, int thread)
+{
+    nd2_frame_scan_t * scan = (nd2_frame_scan_t *) arg;
+    nd2info_t * info = scan->info;
+    meta_frame_t * mf = info->meta_frame;
+    int nchannel = info->meta_att->nchannels;
+
+    if(scan->nd2[thread] == NULL)
     {
-        size_t slen = strlen(file) + 128;
-        info->error = ckcalloc(slen, 1);
-        snprintf(info->error, slen, "Can't open %s\n", file);
-        return info;
+        scan->nd2[thread] = open_nd2(scan->conf, info->filename);
+        if(scan->nd2[thread] == NULL)
+        {
+            fprintf(stderr, "Failed to read from %s\n", info->filename);
+            exit(EXIT_FAILURE);
+        }
     }
+    void * nd2 = scan->nd2[thread];
+    prof_thread_name("metadata");
 
-    void * nd2 = Lim_FileOpenForReadUtf8(file);
-    if(nd2 == NULL)
+    i64 first = job*ND2_FRAMES_PER_JOB;
+    i64 last = first + ND2_FRAMES_PER_JOB;
+    if(last > scan->nseq)
     {
-        size_t slen = strlen(file) + 128;
-        info->error = ckcalloc(slen, 1);
-        snprintf(info->error, slen,
-                 "%s is not a valid nd2 file\n", file);
-        return info;
+        last = scan->nseq;
+    }
+    for(i64 kk = first; kk < last; kk++)
+    {
+        i64 seq = scan->seq[kk];
+        uint64_t t0 = prof_begin();
+        char * frameMeta = nd2_file_frame_metadata(nd2, seq);
+        if(scan->conf->verbose > 2)
+        {
+            printf("# FileGetFrameMetadata for image %" PRId64 "\n", seq);
+            printf("%s\n", frameMeta);
+        }
+        /* Each frame has its own place in the arrays */
+        parse_frame_meta(frameMeta, nchannel, mf, seq);
+        mf->valid[seq] = 1;
+        nd2_file_free_string(nd2, frameMeta);
+        prof_end(PROF_FRAME_META, t0, 0, seq);
+    }
+}
+
+/** @brief Read the stage positions from the frame metadata
+ *
+ * Lim_FileGetFrameMetadata is slow, so only the frames of the FOVs
+ * and planes selected by --fov and --slice are read, and they are
+ * read by --threads threads with one handle each. The first thread
+ * uses nd2.
+ */
+static void
+nd2info_read_frames(ntconf_t * conf, nd2info_t * info, void * nd2)
+{
+    int seqCount = info->seqCount;
+    int nchannel = info->meta_att->nchannels;
+    i64 P = info->meta_att->channels[0]->P;
+    i64 p0 = 0;
+    i64 p1 = 0;
+    nd2_slice_range(conf, P, &p0, &p1);
+
+    meta_frame_t * mf = info->meta_frame;
+    if(mf->valid == NULL)
+    {
+        meta_frame_alloc(mf, seqCount, nchannel);
+    }
+
+    /* The frames to read, the ones from the cache are skipped */
+    i64 * seq = ckcalloc(seqCount, sizeof(i64));
+    i64 nseq = 0;
+    for(i64 ff = 0; ff < info->nFOV; ff++)
+    {
+        if(!nd2_fov_selected(conf, ff))
+        {
+            continue;
+        }
+        for(i64 kk = p0; kk < p1 && kk + ff*P < seqCount; kk++)
+        {
+            if(mf->valid[kk + ff*P] == 0)
+            {
+                seq[nseq++] = kk + ff*P;
+            }
+        }
+    }
+
+    i64 njobs = (nseq + ND2_FRAMES_PER_JOB - 1) / ND2_FRAMES_PER_JOB;
+    int nthreads = conf->nthreads < 1 ? tpool_ncpu() : conf->nthreads;
+    if(conf->verbose > 2)
+    {
+        nthreads = 1; /* Keep the frames in order */
+    }
+    if(nthreads > njobs)
+    {
+        nthreads = njobs;
+    }
+    if(nthreads < 1)
+    {
+        free(seq);
+        return;
+    }
+    if(conf->verbose > 1)
+    {
+        printf("Reading the metadata of %" PRId64 " frames using %d threads\n",
+               nseq, nthreads);
+    }
+
+    nd2_frame_scan_t scan = {0};
+    scan.conf = conf;
+    scan.info = info;
+    scan.seq = seq;
+    scan.nseq = nseq;
+    scan.nd2 = ckcalloc(nthreads, sizeof(void*));
+    scan.nd2[0] = nd2;
+
+    tpool_t * pool = tpool_new(nthreads);
+    tpool_run(pool, njobs, nd2_frame_scan_job, &scan);
+    tpool_free(pool);
+
+    for(int kk = 1; kk < nthreads; kk++)
+    {
+        if(scan.nd2[kk] != NULL)
+        {
+            nd2_file_close(scan.nd2[kk]);
+        }
     }
+    free(scan.nd2);
+    free(seq);
+    return;
+}
+
+/** @brief Parse the metadata of an open nd2 file into info
+ *
+ * Everything but the per-frame metadata, see nd2info_read_frames.
+ * Sets info->error and returns EXIT_FAILURE on failure.
+ */
+static int
+nd2info_parse(ntconf_t * conf, nd2info_t * info, void * nd2)
+{
+    const char * file = info->filename;
 
     //LIMFILEAPI LIMSIZE         Lim_FileGetCoordSize(LIMFILEHANDLE hFile);
-    int csize = Lim_FileGetCoordSize(nd2);
+    int csize = nd2_file_coord_size(nd2);
     if(conf->verbose > 2)
     {
         printf("# Lim_FileGetCoordSize\n");
@@ -641,8 +907,7 @@ static nd2info_t * nd2info(ntconf_t * conf, const char * file)
         info->error = ckcalloc(slen, 1);
         snprintf(info->error, slen,
                  "Error: Can't find coordinates in %s\n", file);
-        Lim_FileClose(nd2);
-        return info;
+        return EXIT_FAILURE;
     }
 
     int nFOV = 1;
@@ -653,7 +918,7 @@ static nd2info_t * nd2info(ntconf_t * conf, const char * file)
         int buffsize = 1024;
         char * buffer = ckcalloc(buffsize, 1);
 
-        int dsize = Lim_FileGetCoordInfo(nd2, kk, buffer, buffsize);
+        int dsize = nd2_file_coord_info(nd2, kk, buffer, buffsize);
 
         if(conf->verbose > 2)
         {
@@ -696,45 +961,27 @@ static nd2info_t * nd2info(ntconf_t * conf, const char * file)
         info->error = ckcalloc(slen, 1);
         snprintf(info->error, slen,
                  "Error: Can't find any image planes %s\n", file);
-        Lim_FileClose(nd2);
-        return info;
+        return EXIT_FAILURE;
     }
 
     info->nFOV = nFOV;
 
-    int seqCount = Lim_FileGetSeqCount(nd2);
+    info->seqCount = nd2_file_seq_count(nd2);
 
-    char * fileAttributes = Lim_FileGetAttributes(nd2);
+    char * fileAttributes = nd2_file_attributes(nd2);
     info->file_att = parse_file_attrib(fileAttributes);
-    Lim_FileFreeString(fileAttributes);
+    nd2_file_free_string(nd2, fileAttributes);
 
-    char * fileMeta = Lim_FileGetMetadata(nd2);
+    char * fileMeta = nd2_file_metadata(nd2);
     info->meta_att = parse_metadata(fileMeta);
-    Lim_FileFreeString(fileMeta);
-
-    int nchannel = info->meta_att->nchannels;
-    if(conf->shake)
-    {
-        info->meta_frame->stagePositionUm = ckcalloc(3*seqCount*nchannel,
-                                                     sizeof(double));
-    }
-
-    /* Information per xyz (all channels) */
-    for(int kk = 0; kk<seqCount; kk++)
+    nd2_file_free_string(nd2, fileMeta);
+    if(info->meta_att == NULL)
     {
-        char * frameMeta = Lim_FileGetFrameMetadata(nd2, kk);
-        if(conf->verbose > 2)
-        {
-            printf("# FileGetFrameMetadata for image %d\n", kk);
-            printf("%s\n", frameMeta);
-        }
-
-        if(conf->shake)
-        {
-            parse_stagePosition(frameMeta, nchannel,
-                                info->meta_frame->stagePositionUm + 3*kk*nchannel); // offset
-        }
-        Lim_FileFreeString(frameMeta);
+        size_t slen = strlen(file) + 128;
+        info->error = ckcalloc(slen, 1);
+        snprintf(info->error, slen,
+                 "Error: Can't find the image size in the metadata of %s\n", file);
+        return EXIT_FAILURE;
     }
 
     /* Lim_FileGetTextinfo does not return JSON. It contains
@@ -746,7 +993,7 @@ static nd2info_t * nd2info(ntconf_t * conf, const char * file)
      * then we don't need the filter_textinfo function. See how it is
      * done for camera name etc below.
      */
-    char * textinfo = Lim_FileGetTextinfo(nd2);
+    char * textinfo = nd2_file_textinfo(nd2);
     filter_textinfo(textinfo); /* Output filled with '\r\n\' written out as text */
     if(conf->verbose > 2)
     {
@@ -770,7 +1017,7 @@ static nd2info_t * nd2info(ntconf_t * conf, const char * file)
     {
         info->loopstring = strdup("Not available");
     }
-    Lim_FileFreeString(textinfo);
+    nd2_file_free_string(nd2, textinfo);
 
     /* Look for camera name and microscope name This part is fragile
      * to how the meta data was written since it isn't structured
@@ -778,7 +1025,7 @@ static nd2info_t * nd2info(ntconf_t * conf, const char * file)
      *
      * */
 
-    char * textinfo2 = Lim_FileGetTextinfo(nd2);
+    char * textinfo2 = nd2_file_textinfo(nd2);
     cJSON *j2 = cJSON_Parse(textinfo2);
     if(j2 != NULL)
     {
@@ -814,7 +1061,7 @@ static nd2info_t * nd2info(ntconf_t * conf, const char * file)
         free(j_desc);
         cJSON_Delete(j2);
     }
-    Lim_FileFreeString(textinfo2);
+    nd2_file_free_string(nd2, textinfo2);
 
 
     /* This is interesting. The order probably plays a role here.
@@ -824,10 +1071,282 @@ static nd2info_t * nd2info(ntconf_t * conf, const char * file)
      * Is it possible to see where the looping over colors occur based on this?
      */
 
-    char * expinfo = Lim_FileGetExperiment(nd2);
-    Lim_FileFreeString(expinfo);
+    char * expinfo = nd2_file_experiment(nd2);
+    nd2_file_free_string(nd2, expinfo);
+
+    return EXIT_SUCCESS;
+}
+
+/* Increase when the content of nd2info_cache_save changes */
+#define ND2INFO_CACHE_VERSION 3
+
+/** @brief Check if the stage positions of all selected frames are known */
+static int
+nd2info_have_frames(const ntconf_t * conf, const nd2info_t * info)
+{
+    const uint8_t * valid = info->meta_frame->valid;
+    if(valid == NULL)
+    {
+        return 0;
+    }
+    i64 P = info->meta_att->channels[0]->P;
+    i64 p0 = 0;
+    i64 p1 = 0;
+    nd2_slice_range(conf, P, &p0, &p1);
+    for(i64 ff = 0; ff < info->nFOV; ff++)
+    {
+        if(!nd2_fov_selected(conf, ff))
+        {
+            continue;
+        }
+        for(i64 kk = p0; kk < p1 && kk + ff*P < info->seqCount; kk++)
+        {
+            if(valid[kk + ff*P] == 0)
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/** @brief Store the parsed metadata in the cache, see cache_util.h */
+static int
+nd2info_cache_save(const nd2info_t * info, const cache_key_t * key)
+{
+    cache_buf_t * buf = cache_buf_new();
+    cache_put_i64(buf, ND2INFO_CACHE_VERSION);
+    cache_put_i64(buf, info->nFOV);
+    cache_put_i64(buf, info->seqCount);
+
+    const file_attrib_t * fa = info->file_att;
+    cache_put_i64(buf, fa->bitsPerComponentInMemory);
+    cache_put_i64(buf, fa->bitsPerComponentSignificant);
+    cache_put_i64(buf, fa->componentCount);
+    cache_put_i64(buf, fa->heightPx);
+    cache_put_i64(buf, fa->pixelDataType);
+    cache_put_i64(buf, fa->sequenceCount);
+    cache_put_i64(buf, fa->widthBytes);
+    cache_put_i64(buf, fa->widthPx);
+    cache_put_i64(buf, fa->compressed);
+
+    const metadata_t * m = info->meta_att;
+    cache_put_i64(buf, m->nchannels);
+    for(int kk = 0; kk < m->nchannels; kk++)
+    {
+        const channel_attrib_t * c = m->channels[kk];
+        cache_put_str(buf, c->name);
+        cache_put_f64(buf, c->emissionLambdaNm);
+        cache_put_f64(buf, c->objectiveMagnification);
+        cache_put_str(buf, c->objectiveName);
+        cache_put_f64(buf, c->objectiveNumericalAperture);
+        cache_put_f64(buf, c->immersionRefractiveIndex);
+        cache_put_i64(buf, c->index);
+        cache_put_i64(buf, c->M);
+        cache_put_i64(buf, c->N);
+        cache_put_i64(buf, c->P);
+        cache_put_f64(buf, c->dx_nm);
+        cache_put_f64(buf, c->dy_nm);
+        cache_put_f64(buf, c->dz_nm);
+    }
+
+    cache_put_str(buf, info->loopstring);
+    cache_put_str(buf, info->camera_name);
+    cache_put_str(buf, info->microscope_name);
+
+    /* The frame metadata that has been read so far */
+    const meta_frame_t * mf = info->meta_frame;
+    cache_put_i64(buf, mf->valid != NULL);
+    if(mf->valid != NULL)
+    {
+        size_t nvalues = (size_t) info->seqCount*m->nchannels;
+        cache_put_bytes(buf, mf->valid, info->seqCount);
+        cache_put_f64s(buf, mf->stagePositionUm, 3*nvalues);
+        cache_put_f64s(buf, mf->relativeTimeMs, nvalues);
+        cache_put_f64s(buf, mf->absoluteJulianDayNumber, nvalues);
+        cache_put_f64s(buf, mf->pfsOffset, nvalues);
+    }
+
+    int status = cache_write(key, buf);
+    cache_buf_free(buf);
+    return status;
+}
+
+/** @brief Fill info from the cache
+ *
+ * Returns EXIT_FAILURE, with info unchanged, if there is no valid
+ * entry for key.
+ */
+static int
+nd2info_cache_load(nd2info_t * info, const cache_key_t * key)
+{
+    cache_buf_t * buf = cache_read(key);
+    if(buf == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    if(cache_get_i64(buf) != ND2INFO_CACHE_VERSION)
+    {
+        cache_buf_free(buf);
+        return EXIT_FAILURE;
+    }
+    int nFOV = cache_get_i64(buf);
+    int seqCount = cache_get_i64(buf);
+
+    file_attrib_t * fa = ckcalloc(1, sizeof(file_attrib_t));
+    fa->bitsPerComponentInMemory = cache_get_i64(buf);
+    fa->bitsPerComponentSignificant = cache_get_i64(buf);
+    fa->componentCount = cache_get_i64(buf);
+    fa->heightPx = cache_get_i64(buf);
+    fa->pixelDataType = cache_get_i64(buf);
+    fa->sequenceCount = cache_get_i64(buf);
+    fa->widthBytes = cache_get_i64(buf);
+    fa->widthPx = cache_get_i64(buf);
+    fa->compressed = cache_get_i64(buf);
+
+    metadata_t * m = ckcalloc(1, sizeof(metadata_t));
+    i64 nchannels = cache_get_i64(buf);
+    if(nchannels < 1 || nchannels > 1024 || seqCount < 0)
+    {
+        buf->error = 1;
+        nchannels = 0;
+    }
+    m->nchannels = nchannels;
+    m->channels = ckcalloc(nchannels, sizeof(channel_attrib_t*));
+    for(int kk = 0; kk < m->nchannels; kk++)
+    {
+        channel_attrib_t * c = ckcalloc(1, sizeof(channel_attrib_t));
+        m->channels[kk] = c;
+        c->name = cache_get_str(buf);
+        c->emissionLambdaNm = cache_get_f64(buf);
+        c->objectiveMagnification = cache_get_f64(buf);
+        c->objectiveName = cache_get_str(buf);
+        c->objectiveNumericalAperture = cache_get_f64(buf);
+        c->immersionRefractiveIndex = cache_get_f64(buf);
+        c->index = cache_get_i64(buf);
+        c->M = cache_get_i64(buf);
+        c->N = cache_get_i64(buf);
+        c->P = cache_get_i64(buf);
+        c->dx_nm = cache_get_f64(buf);
+        c->dy_nm = cache_get_f64(buf);
+        c->dz_nm = cache_get_f64(buf);
+    }
+
+    char * loopstring = cache_get_str(buf);
+    char * camera_name = cache_get_str(buf);
+    char * microscope_name = cache_get_str(buf);
+
+    meta_frame_t mf = {0};
+    if(cache_get_i64(buf) && !buf->error)
+    {
+        size_t nvalues = (size_t) seqCount*nchannels;
+        if(seqCount + 6*nvalues*sizeof(double) > buf->size - buf->pos)
+        {
+            buf->error = 1;
+        } else {
+            meta_frame_alloc(&mf, seqCount, nchannels);
+            cache_get_bytes(buf, mf.valid, seqCount);
+            cache_get_f64s(buf, mf.stagePositionUm, 3*nvalues);
+            cache_get_f64s(buf, mf.relativeTimeMs, nvalues);
+            cache_get_f64s(buf, mf.absoluteJulianDayNumber, nvalues);
+            cache_get_f64s(buf, mf.pfsOffset, nvalues);
+        }
+    }
+
+    int status = EXIT_SUCCESS;
+    if(buf->error || m->nchannels < 1 || m->channels[0]->P < 1)
+    {
+        file_attrib_free(fa);
+        metadata_free(m);
+        free(loopstring);
+        free(camera_name);
+        free(microscope_name);
+        free(mf.stagePositionUm);
+        free(mf.relativeTimeMs);
+        free(mf.absoluteJulianDayNumber);
+        free(mf.pfsOffset);
+        free(mf.valid);
+        status = EXIT_FAILURE;
+    } else {
+        info->nFOV = nFOV;
+        info->seqCount = seqCount;
+        info->file_att = fa;
+        info->meta_att = m;
+        info->loopstring = loopstring;
+        info->camera_name = camera_name;
+        info->microscope_name = microscope_name;
+        *info->meta_frame = mf;
+    }
+    cache_buf_free(buf);
+    return status;
+}
+
+static nd2info_t * nd2info(ntconf_t * conf, const char * file)
+{
+    nd2info_t * info = nd2info_new(conf);
+    NOT_NULL(info);
+    assert(file != NULL);
+    info->filename = strdup(file);
+    NOT_NULL(info->filename);
+
+    struct stat stats;
+    if(stat(info->filename, &stats) != 0)
+    {
+        size_t slen = strlen(file) + 128;
+        info->error = ckcalloc(slen, 1);
+        snprintf(info->error, slen, "Can't open %s\n", file);
+        return info;
+    }
+
+    /* The file is only opened if something is missing in the cache */
+    cache_key_t key = {0};
+    int use_cache = conf->cache && cache_key_get(file, &key) == EXIT_SUCCESS;
+    int cached = use_cache && nd2info_cache_load(info, &key) == EXIT_SUCCESS;
+    int dirty = !cached;
+    if(conf->verbose > 1 && cached)
+    {
+        printf("Using cached metadata for %s\n", file);
+    }
+
+    /* The per-frame metadata is only needed for the stage positions
+     * and the frame table */
+    int want_frames = conf->shake || conf->frame_table;
+    int need_frames = cached && want_frames && !nd2info_have_frames(conf, info);
+
+    if(!cached || need_frames)
+    {
+        info->nd2 = nd2_file_open(conf->backend, file);
+        if(info->nd2 == NULL)
+        {
+            size_t slen = strlen(file) + 128;
+            info->error = ckcalloc(slen, 1);
+            snprintf(info->error, slen,
+                     "%s is not a valid nd2 file\n", file);
+            cache_key_free(&key);
+            return info;
+        }
+    }
+
+    if(!cached && nd2info_parse(conf, info, info->nd2) != EXIT_SUCCESS)
+    {
+        cache_key_free(&key);
+        return info;
+    }
 
-    Lim_FileClose(nd2);
+    if(want_frames && !nd2info_have_frames(conf, info))
+    {
+        nd2info_read_frames(conf, info, info->nd2);
+        dirty = 1;
+    }
+
+    if(use_cache && dirty && !conf->dry)
+    {
+        if(nd2info_cache_save(info, &key) != EXIT_SUCCESS && conf->verbose > 1)
+        {
+            printf("Unable to cache the metadata of %s\n", file);
+        }
+    }
+    cache_key_free(&key);
 
     nd2info_set_outfolder(info);
     return info;
@@ -853,7 +1372,7 @@ open_nd2(ntconf_t * conf, char * filename)
     }
 
     /* Please note that this reports true also for tif files */
-    void * nd2 = Lim_FileOpenForReadUtf8(filename);
+    void * nd2 = nd2_file_open(conf->backend, filename);
     if(nd2 == NULL)
     {
         if(conf->verbose > 0)
@@ -895,512 +1414,1972 @@ static void ensure_output_folder(ntconf_t * conf, nd2info_t * info)
 
     return;
 }
-
-/** @brief Write an ND2 file as one file per FOV and channel. Default option. */
-static void nd2_to_tiff_splitC(void * nd2, ntconf_t * conf, nd2info_t * info)
+/** @brief Plane seq in the file mapped by info->native
+ *
+ * Returns the first row and sets the distance between the rows in
+ * stride, in bytes. Returns NULL if the plane is missing or shorter
+ * than expected. Only used for files that are not compressed.
+ */
+static const uint8_t *
+nd2_native_rows(const nd2info_t * info, i64 seq, size_t * stride)
 {
-
-    /* Prepare metadata for the tiff files */
-    ttags * tags = ttags_new();
+    size_t M = info->meta_att->channels[0]->M;
+    size_t N = info->meta_att->channels[0]->N;
+    size_t row = M*info->meta_att->nchannels*sizeof(uint16_t);
+    stride[0] = row;
+    if(info->file_att->widthBytes > 0 && (size_t) info->file_att->widthBytes > row)
     {
-        size_t slen = 1024;
-        char * sw_string = ckcalloc(slen, 1);
-        snprintf(sw_string, slen,
-                 "github.com/elgw/nd2tool source image: %s",
+        stride[0] = info->file_att->widthBytes;
+    }
+    uint64_t nbytes = 0;
+    const uint8_t * data = nd2_reader_frame(info->native, seq, &nbytes);
+    if(data == NULL || nbytes < stride[0]*(N-1) + row)
+    {
+        return NULL;
+    }
+    return data;
+}
+
+/** @brief Read one plane (all channels, interlaced) from an ND2 file
+ *
+ * Returns a pointer to the pixel data, also in plane->pixels, exits
+ * on failure. With --reader native the pointer goes straight into
+ * the mapped file when the rows are not padded, otherwise the plane
+ * is copied to plane->pic. The SDK is used for the planes that the
+ * built-in reader can't handle. With --reader check the plane is
+ * read with the SDK and compared to the built-in reader.
+ */
+static const uint16_t *
+nd2_get_plane(void * nd2, nd2info_t * info, i64 seq, nd2_plane_t * plane)
+{
+    uint64_t t0 = prof_begin();
+    LIMPICTURE * pic = &plane->pic;
+    const uint8_t * rows = NULL;
+    size_t stride = 0;
+    if(info->native != NULL)
+    {
+        rows = nd2_native_rows(info, seq, &stride);
+    }
+    size_t row = (size_t) info->meta_att->channels[0]->M
+        * info->meta_att->nchannels * sizeof(uint16_t);
+    size_t N = info->meta_att->channels[0]->N;
+
+    if(rows != NULL && info->conf->reader == READER_NATIVE)
+    {
+        if(stride == row && (uintptr_t) rows % sizeof(uint16_t) == 0)
+        {
+            /* Start reading from disk before the pixels are used */
+            nd2_reader_prefetch(info->native, seq);
+            plane->pixels = (const uint16_t *) rows;
+        } else {
+            uint8_t * dest = (uint8_t *) pic->pImageData;
+            for(size_t rr = 0; rr < N; rr++)
+            {
+                memcpy(dest + rr*row, rows + rr*stride, row);
+            }
+            plane->pixels = (const uint16_t *) dest;
+        }
+        __atomic_fetch_add(&info->nread, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&info->nnative, 1, __ATOMIC_RELAXED);
+        prof_end(PROF_READ, t0, row*N, seq);
+        return plane->pixels;
+    }
+
+    /* Returns interlaced data */
+    int res = nd2_file_image_data(nd2,
+                                   seq, //uiSeqIndex,
+                                   pic);
+    if(res != 0)
+    {
+        fprintf(stderr, "Failed to read from %s. At line %d\n",
+                info->filename, __LINE__);
+    }
+
+    if( (pic->pImageData == NULL) || (pic->uiSize == 0) )
+    {
+        fprintf(stderr, "Failed to retrieve image data\n");
+    }
+    uint16_t * pixels = (uint16_t *) pic->pImageData;
+    if(pixels == NULL)
+    {
+        fprintf(stderr, "No pixel data could be found in the image\n");
+        exit(EXIT_FAILURE);
+    }
+    if(rows != NULL)
+    {
+        /* --reader check */
+        for(size_t rr = 0; rr < N; rr++)
+        {
+            if(memcmp((uint8_t *) pixels + rr*row, rows + rr*stride, row) != 0)
+            {
+                fprintf(stderr, "Error: Plane %" PRId64 " of %s differs between "
+                        "the SDK and the built-in reader (row %zu)\n",
+                        seq, info->filename, rr);
+                exit(EXIT_FAILURE);
+            }
+        }
+        __atomic_fetch_add(&info->nnative, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&info->nread, 1, __ATOMIC_RELAXED);
+    plane->pixels = pixels;
+    prof_end(PROF_READ, t0, row*N, seq);
+    return pixels;
+}
+
+/** @brief Create a temporary file to write outname through
+ *
+ * Returns the name of the file that was created, outname_tmp_XXXXXX.
+ */
+static char *
+create_tmp_file(const char * outname)
+{
+    size_t slen = strlen(outname) + 16;
+    char * outname_tmp = ckcalloc(slen, 1);
+
+    snprintf(outname_tmp, slen,
+             "%s_tmp_XXXXXX", outname);
+    int tfid = 0;
+    if((tfid = mkstemp(outname_tmp)) == -1)
+    {
+        fprintf(stderr, "Failed to create a temporary file based on pattern: %s\n", outname_tmp);
+        exit(EXIT_FAILURE);
+    }
+    close(tfid);
+    return outname_tmp;
+}
+
+/** @brief Add a line to the manifest, see nd2info_hash_start
+ *
+ * Only the file name is recorded, the files are in the outfolder.
+ */
+static void
+nd2info_manifest(nd2info_t * info, const char * kind, uint64_t hash,
+                 const char * name)
+{
+    if(info->manifest == NULL)
+    {
+        return;
+    }
+    const char * slash = strrchr(name, '/');
+    /* One call per line, stdio keeps the lines from the threads
+     * apart */
+    fprintf(info->manifest, "%s\txxh64\t%016" PRIx64 "\t%s\n", kind, hash,
+            slash == NULL ? name : slash + 1);
+    fflush(info->manifest);
+}
+
+/** @brief Move a finished file or folder to its final name
+ *
+ * nbytes, the size of what was written, is added to
+ * info->bytes_written. hash, the hash of the pixel data (NULL if
+ * there is none), goes to the log and the manifest.
+ */
+static void
+nd2worker_commit(nd2worker_t * w, const char * outname_tmp,
+                 const char * outname, i64 nbytes, const uint64_t * hash)
+{
+    uint64_t t0 = prof_begin();
+    if(rename(outname_tmp, outname) != 0)
+    {
+        fprintf(stderr, "Failed to rename %s to %s\n", outname_tmp, outname);
+        exit(EXIT_FAILURE);
+    }
+    prof_end(PROF_RENAME, t0, 0, -1);
+    __atomic_fetch_add(&w->info->bytes_written, nbytes, __ATOMIC_RELAXED);
+    if(hash != NULL)
+    {
+        nd2worker_log(w, "xxh64 %016" PRIx64 " ", hash[0]);
+        nd2info_manifest(w->info, "pixels", hash[0], outname);
+    }
+    return;
+}
+
+/** @brief Finish a tif file and move it to its final name
+ *
+ * For compressed files the compression ratio and speed are logged.
+ */
+static void
+nd2worker_finish_tiff(nd2worker_t * w, tiff_writer_t * tw,
+                      const char * outname_tmp, const char * outname)
+{
+    if(tw->compression != COMPRESSION_NONE && tw->bytes_compressed > 0)
+    {
+        double ratio = (double) tw->bytes_raw / (double) tw->bytes_compressed;
+        double mbs = 0;
+        if(tw->ns_compress > 0)
+        {
+            mbs = (double) tw->bytes_raw / (double) tw->ns_compress * 1e3;
+        }
+        nd2worker_log(w, "(%s: %.2fx, %.0f MB/s) ",
+                      tiff_compress_name(tw->compression), ratio, mbs);
+        if(w->conf->verbose > 1)
+        {
+            nd2worker_printf(w, "(%s: %.2fx, %.0f MB/s) ",
+                             tiff_compress_name(tw->compression), ratio, mbs);
+        }
+    }
+    uint64_t hash = tiff_writer_hash(tw);
+    uint64_t t0 = prof_begin();
+    tiff_writer_finish(tw);
+    prof_end(PROF_FINISH, t0, 0, -1);
+
+    struct stat sb;
+    i64 nbytes = 0;
+    if(stat(outname_tmp, &sb) == 0)
+    {
+        nbytes = (i64) sb.st_size;
+    }
+    nd2worker_commit(w, outname_tmp, outname, nbytes, &hash);
+    return;
+}
+
+/** @brief Print a message about the conversion
+ *
+ * Goes to stdout or, when several threads are used, to a buffer that
+ * is printed when the previous FOVs are done.
+ */
+static void
+nd2worker_printf(nd2worker_t * w, const char *fmt, ...)
+{
+    va_list argp;
+    va_start(argp, fmt);
+    vfprintf(w->out, fmt, argp);
+    va_end(argp);
+    return;
+}
+
+/** @brief Print to the log file, see nd2worker_printf */
+static void
+nd2worker_log(nd2worker_t * w, const char *fmt, ...)
+{
+    if(w->conf->dry || w->log == NULL)
+    {
+        return;
+    }
+    va_list argp;
+    va_start(argp, fmt);
+    vfprintf(w->log, fmt, argp);
+    va_end(argp);
+    return;
+}
+
+/** @brief Tif tags shared by all files written from info */
+static ttags *
+nd2_new_ttags(const nd2info_t * info, int P)
+{
+    ttags * tags = ttags_new();
+    {
+        size_t slen = 1024;
+        char * sw_string = ckcalloc(slen, 1);
+        snprintf(sw_string, slen,
+                 "github.com/elgw/nd2tool source image: %s",
                  info->filename);
         ttags_set_software(tags , sw_string);
         free(sw_string);
     }
 
+    ttags_set_imagesize(tags,
+                        info->meta_att->channels[0]->M,
+                        info->meta_att->channels[0]->N,
+                        P);
+    ttags_set_pixelsize_nm(tags,
+                           info->meta_att->channels[0]->dx_nm,
+                           info->meta_att->channels[0]->dy_nm,
+                           info->meta_att->channels[0]->dz_nm);
+    ttags_set_compression(tags, info->conf->compression);
+    return tags;
+}
+
+/** @brief Open a tif file for writing with the selected backend */
+static tiff_writer_t *
+nd2worker_tiff_writer_init(nd2worker_t * w, const char * outname,
+                           i64 M, i64 N, i64 P)
+{
+    if(w->conf->libtiff)
+    {
+        return tiff_writer_init_libtiff(outname, w->tags, M, N, P);
+    }
+    return tiff_writer_init(outname, w->tags, M, N, P);
+}
+
+/** @brief Open a tif file to write outname through, outname_tmp
+ *
+ * The file is recorded in the journal so that the pages can be kept
+ * if the conversion is interrupted. When the journal has an
+ * unfinished file for outname with the same size it is continued, jf
+ * then tells what pages that are already written. jf is NULL when
+ * there is no journal or with --libtiff.
+ */
+static tiff_writer_t *
+nd2worker_tiff_open(nd2worker_t * w, const char * outname,
+                    i64 M, i64 N, i64 P,
+                    char ** outname_tmp, journal_file_t ** jf)
+{
+    journal_t * j = w->info->journal;
+    jf[0] = NULL;
+    if(j == NULL || w->conf->libtiff)
+    {
+        outname_tmp[0] = create_tmp_file(outname);
+        return nd2worker_tiff_writer_init(w, outname_tmp[0], M, N, P);
+    }
+
+    journal_file_t * f = journal_find(j, outname);
+    if(f != NULL)
+    {
+        char * tmpname = journal_tmpname(j, f);
+        tiff_writer_t * tw = NULL;
+        if(f->M == M && f->N == N && f->P == P
+           && f->compression == w->tags->compression)
+        {
+            tw = tiff_writer_resume(tmpname, w->tags, M, N, P);
+        }
+        int ok = tw != NULL && tw->blocks_per_page == f->bpp;
+        i64 nkept = 0;
+        for(i64 kk = 0; ok && kk < P; kk++)
+        {
+            if(f->done[kk])
+            {
+                ok = tiff_writer_restore_page(tw, kk, f->offsets + kk*f->bpp,
+                                              f->bytes + kk*f->bpp,
+                                              f->page_hash[kk]) == 0;
+                nkept++;
+            }
+        }
+        if(ok)
+        {
+            journal_resume(j, f, tw->fd);
+            nd2worker_log(w, "Resuming %s with %" PRId64 " of %" PRId64
+                          " planes written\n", outname, nkept, P);
+            if(w->conf->verbose > 0)
+            {
+                nd2worker_printf(w, "Resuming %s with %" PRId64 " of %" PRId64
+                                 " planes written\n", outname, nkept, P);
+            }
+            outname_tmp[0] = tmpname;
+            jf[0] = f;
+            return tw;
+        }
+        /* Start over */
+        if(tw != NULL)
+        {
+            tiff_writer_abort(tw);
+        }
+        unlink(tmpname);
+        free(tmpname);
+        journal_drop(j, f);
+    }
+
+    outname_tmp[0] = create_tmp_file(outname);
+    tiff_writer_t * tw = nd2worker_tiff_writer_init(w, outname_tmp[0], M, N, P);
+    jf[0] = journal_begin(j, outname, outname_tmp[0], M, N, P,
+                          tw->blocks_per_page, tw->compression, tw->fd);
+    return tw;
+}
+
+/** @brief Read the planes of the worker's list, used as a thread
+ *
+ * The planes are put in the ring in the order of the list.
+ */
+static void *
+nd2worker_reader(void * p)
+{
+    nd2worker_t * w = (nd2worker_t *) p;
+    prof_thread_name("reader");
+    for(i64 kk = 0; kk < w->nseq; kk++)
+    {
+        uint64_t t0 = prof_begin();
+        plane_slot_t * slot = plane_ring_get_empty(w->ring);
+        prof_end(PROF_WAIT_SLOT, t0, 0, -1);
+        nd2_get_plane(w->nd2, w->info, w->seq[kk], (nd2_plane_t *) slot->data);
+        slot->seq = w->seq[kk];
+        plane_ring_put_full(w->ring, slot);
+    }
+    plane_ring_close(w->ring);
+    return NULL;
+}
+
+/** @brief Start reading the planes with sequence index in seq[0..n-1]
+ *
+ * With --queue-depth > 0 the planes are read ahead by a separate
+ * thread so that the reading overlaps with the writing.  The planes
+ * are then fetched in order with nd2worker_next_plane until it
+ * returns NULL. seq has to be valid until nd2worker_stop_planes.
+ */
+static void
+nd2worker_start_planes(nd2worker_t * w, const i64 * seq, i64 n)
+{
+    w->seq = seq;
+    w->nseq = n;
+    w->nextseq = 0;
+    w->slot = NULL;
+    if(w->ring != NULL)
+    {
+        plane_ring_reset(w->ring);
+        if(pthread_create(&w->reader, NULL, nd2worker_reader, w) != 0)
+        {
+            fprintf(stderr, "Failed to start the reader thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/** @brief Get the next interlaced plane, NULL when there are no more
+ *
+ * The sequence index of the plane is written to seq. The data is
+ * valid until the next call.
+ */
+static const uint16_t *
+nd2worker_next_plane(nd2worker_t * w, i64 * seq)
+{
+    if(w->ring == NULL)
+    {
+        if(w->nextseq == w->nseq)
+        {
+            return NULL;
+        }
+        seq[0] = w->seq[w->nextseq++];
+        return nd2_get_plane(w->nd2, w->info, seq[0], w->plane);
+    }
+
+    if(w->slot != NULL)
+    {
+        plane_ring_put_empty(w->ring, w->slot);
+    }
+    uint64_t t0 = prof_begin();
+    w->slot = plane_ring_get_full(w->ring);
+    prof_end(PROF_WAIT_PLANE, t0, 0, -1);
+    if(w->slot == NULL)
+    {
+        return NULL;
+    }
+    seq[0] = w->slot->seq;
+    return ((nd2_plane_t *) w->slot->data)->pixels;
+}
+
+/** @brief Wait for the reader thread, if any */
+static void
+nd2worker_stop_planes(nd2worker_t * w)
+{
+    if(w->ring != NULL)
+    {
+        if(w->slot != NULL)
+        {
+            plane_ring_put_empty(w->ring, w->slot);
+            w->slot = NULL;
+        }
+        pthread_join(w->reader, NULL);
+    }
+}
+
+/* Receives the de-interleaved planes from nd2worker_write_planes.
+ * k is the index of the plane within the FOV, counted from the first
+ * plane that is written. Called from several threads at the same
+ * time, for different planes. */
+typedef void (*nd2_put_plane_t)(void * sink, int channel, i64 k,
+                                const uint16_t * plane);
+
+/* Plane sink for tif files. One file per channel (NULL to skip) or,
+ * with composite set, one file, tw[0], where plane k of channel cc is
+ * page k*nchan + cc. With one file per channel the pages can be
+ * recorded in a journal, jf[cc] (NULL to skip), see
+ * nd2worker_tiff_open. Pages that the journal has are not written
+ * again. */
+typedef struct
+{
+    tiff_writer_t ** tw;
+    int composite;
+    int nchan;
+    journal_t * journal;
+    journal_file_t ** jf;
+} nd2_tiff_sink_t;
+
+static void
+nd2_tiff_put_plane(void * sink, int cc, i64 k, const uint16_t * plane)
+{
+    nd2_tiff_sink_t * ts = (nd2_tiff_sink_t *) sink;
+    if(ts->composite)
+    {
+        tiff_writer_write_page(ts->tw[0], k*ts->nchan + cc, plane);
+    } else if(ts->tw[cc] != NULL)
+    {
+        tiff_writer_t * tw = ts->tw[cc];
+        journal_file_t * jf = ts->jf == NULL ? NULL : ts->jf[cc];
+        if(jf != NULL && jf->done[k])
+        {
+            return;
+        }
+        tiff_writer_write_page(tw, k, plane);
+        if(jf != NULL)
+        {
+            journal_page(ts->journal, jf, k,
+                         tw->strip_offsets + k*tw->blocks_per_page,
+                         tw->strip_bytes + k*tw->blocks_per_page,
+                         tw->page_hash[k]);
+        }
+    }
+}
+
+/* Plane sink for an image of the OME-Zarr store */
+static void
+nd2_zarr_put_plane(void * sink, int cc, i64 k, const uint16_t * plane)
+{
+    zarr_writer_write_plane((zarr_writer_t *) sink, cc, k, plane);
+}
+
+/* Plane sink for .npy files, one per channel (NULL to skip) */
+static void
+nd2_npy_put_plane(void * sink, int cc, i64 k, const uint16_t * plane)
+{
+    npy_writer_t ** nw = (npy_writer_t **) sink;
+    if(nw[cc] != NULL)
+    {
+        npy_writer_write_plane(nw[cc], k, plane);
+    }
+}
+
+/** @brief Store the focus measure of channel cc of plane seq
+ *
+ * Done on the de-interleaved planes on their way to the writers, so
+ * nothing has to be read again. Each plane has its own element of
+ * info->focus so the writer threads don't have to synchronize.
+ */
+static void
+nd2worker_focus(nd2worker_t * w, i64 seq, int cc, const uint16_t * plane)
+{
+    nd2info_t * info = w->info;
+    if(info->focus == NULL)
+    {
+        return;
+    }
+    int nchan = info->meta_att->nchannels;
+    size_t M = info->meta_att->channels[0]->M;
+    size_t N = info->meta_att->channels[0]->N;
+    i64 P = info->meta_att->channels[0]->P;
+
+    uint64_t t0 = prof_begin();
+    double f = focus_u16(plane, M, N);
+    prof_end(PROF_FOCUS, t0, M*N*sizeof(uint16_t), seq);
+    info->focus[(seq/P*nchan + cc)*P + seq % P] = f;
+}
+
+/* One of the threads writing the planes of a FOV */
+typedef struct
+{
+    nd2worker_t * w;
+    uint16_t * S; /* nchan planes */
+    nd2_put_plane_t put;
+    void * sink;
+    i64 seq0; /* Sequence index of the first plane */
+    pthread_t thread;
+} nd2writer_t;
+
+/** @brief Pass the de-interleaved plane in wr->S on to the sink */
+static void
+nd2writer_write(nd2writer_t * wr, i64 seq)
+{
+    nd2info_t * info = wr->w->info;
+    int nchan = info->meta_att->nchannels;
+    size_t MN = (size_t) info->meta_att->channels[0]->M
+        * info->meta_att->channels[0]->N;
+    i64 k = seq - wr->seq0;
+    for(int cc = 0; cc < nchan; cc++)
+    {
+        nd2worker_focus(wr->w, seq, cc, wr->S + cc*MN);
+        uint64_t t0 = prof_begin();
+        wr->put(wr->sink, cc, k, wr->S + cc*MN);
+        prof_end(PROF_WRITE, t0, MN*sizeof(uint16_t), seq);
+    }
+}
+
+/** @brief Take planes from the ring until it is empty, used as a thread
+ *
+ * The slot is given back as soon as the plane is de-interleaved so
+ * that the reader can continue while the pages are written.
+ */
+static void *
+nd2writer_run(void * p)
+{
+    nd2writer_t * wr = (nd2writer_t *) p;
+    nd2worker_t * w = wr->w;
+    int nchan = w->info->meta_att->nchannels;
+    size_t MN = (size_t) w->info->meta_att->channels[0]->M
+        * w->info->meta_att->channels[0]->N;
+    plane_slot_t * slot = NULL;
+    uint64_t t0 = prof_begin();
+    while((slot = plane_ring_get_full(w->ring)) != NULL)
+    {
+        prof_end(PROF_WAIT_PLANE, t0, 0, -1);
+        nd2_plane_t * plane = (nd2_plane_t *) slot->data;
+        i64 seq = slot->seq;
+        t0 = prof_begin();
+        deinterleave_u16(wr->S, plane->pixels, MN, nchan);
+        prof_end(PROF_DEINTERLEAVE, t0, MN*nchan*sizeof(uint16_t), seq);
+        plane_ring_put_empty(w->ring, slot);
+        nd2writer_write(wr, seq);
+        t0 = prof_begin();
+    }
+    prof_end(PROF_WAIT_PLANE, t0, 0, -1);
+    return NULL;
+}
+
+/** @brief nd2writer_run for the extra writer threads */
+static void *
+nd2writer_thread(void * p)
+{
+    prof_thread_name("writer");
+    return nd2writer_run(p);
+}
+
+/** @brief Read the planes seq[0..n-1] and pass them on to a sink
+ *
+ * Channel cc of plane seq0+k is given to put(sink, cc, k, plane).
+ *
+ * With more than one writer the planes are passed on out of order by
+ * w->nwriters threads, each with its own part of w->S.
+ */
+static void
+nd2worker_write_planes(nd2worker_t * w, const i64 * seq, i64 n, i64 seq0,
+                       nd2_put_plane_t put, void * sink)
+{
+    int nchan = w->info->meta_att->nchannels;
+    size_t MN = (size_t) w->info->meta_att->channels[0]->M
+        * w->info->meta_att->channels[0]->N;
+
+    int nwriters = w->ring == NULL ? 1 : w->nwriters;
+    nd2writer_t * wr = ckcalloc(nwriters, sizeof(nd2writer_t));
+    for(int kk = 0; kk < nwriters; kk++)
+    {
+        wr[kk].w = w;
+        wr[kk].S = w->S + kk*nchan*MN;
+        wr[kk].put = put;
+        wr[kk].sink = sink;
+        wr[kk].seq0 = seq0;
+    }
+
+    nd2worker_start_planes(w, seq, n);
+    if(nwriters == 1)
+    {
+        const uint16_t * pixels = NULL;
+        i64 sq = 0;
+        while((pixels = nd2worker_next_plane(w, &sq)) != NULL)
+        {
+            uint64_t t0 = prof_begin();
+            deinterleave_u16(wr->S, pixels, MN, nchan);
+            prof_end(PROF_DEINTERLEAVE, t0, MN*nchan*sizeof(uint16_t), sq);
+            nd2writer_write(wr, sq);
+        }
+    } else {
+        for(int kk = 1; kk < nwriters; kk++)
+        {
+            if(pthread_create(&wr[kk].thread, NULL, nd2writer_thread, wr + kk) != 0)
+            {
+                fprintf(stderr, "Failed to start a writer thread\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        nd2writer_run(wr);
+        for(int kk = 1; kk < nwriters; kk++)
+        {
+            pthread_join(wr[kk].thread, NULL);
+        }
+    }
+    nd2worker_stop_planes(w);
+    free(wr);
+}
+
+/** @brief The planes [p0, p1) of a FOV selected by --slice */
+static void
+nd2_slice_range(const ntconf_t * conf, i64 P, i64 * p0, i64 * p1)
+{
+    p0[0] = 0;
+    p1[0] = P;
+    if(conf->use_range)
+    {
+        p0[0] = conf->range_from-1;
+        p1[0] = conf->range_to;
+        if(p0[0] < 0 || p1[0] > P || p1[0] <= p0[0])
+        {
+            printf("Invalid slice range\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/** @brief Non-zero if the FOV ff (0-indexed) is selected by --fov */
+static int
+nd2_fov_selected(const ntconf_t * conf, i64 ff)
+{
+    if(conf->use_fov_range)
+    {
+        if( (ff+1) < conf->fov_range_from || (ff+1) > conf->fov_range_to)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/** @brief Write one FOV as one file per channel. Default option.
+ *
+ * Each image plane is read once and the channels are written to
+ * nchan tif files at the same time.
+ */
+static void nd2_to_tiff_splitC(nd2worker_t * w, i64 ff)
+{
+    ntconf_t * conf = w->conf;
+    nd2info_t * info = w->info;
+
+    int nchan = info->meta_att->nchannels;
+    int M = info->meta_att->channels[0]->M;
+    int N = info->meta_att->channels[0]->N;
+    int P = info->meta_att->channels[0]->P;
+
+    i64 p0 = 0;
+    i64 p1 = P;
+    nd2_slice_range(conf, P, &p0, &p1);
+
+    /* All channels are extracted from each plane that is read. The
+     * memory usage is the interlaced planes from the nd2 library plus
+     * one plane per channel and writer, in w->S. */
+
+    /* One open file per channel, NULL for channels that are skipped */
+    char ** outname = ckcalloc(nchan, sizeof(char*));
+    char ** outname_tmp = ckcalloc(nchan, sizeof(char*));
+    tiff_writer_t ** tw = ckcalloc(nchan, sizeof(tiff_writer_t*));
+    journal_file_t ** jf = ckcalloc(nchan, sizeof(journal_file_t*));
+
+    int nopen = 0;
+    for(i64 cc = 0; cc<nchan; cc++) /* For each channel */
+    {
+        size_t slen = 1024;
+        outname[cc] = ckcalloc(slen, 1);
+        snprintf(outname[cc], slen,
+                 "%s/%s_%03" PRId64 ".tif", info->outfolder,
+                 info->meta_att->channels[cc]->name, ff+1);
+
+        if(conf->verbose > 1)
+        {
+            nd2worker_printf(w, "outfolder: %s\n", info->outfolder);
+            nd2worker_printf(w, "channel name: %s\n", info->meta_att->channels[cc]->name);
+        }
+
+        if(conf->overwrite == 0)
+        {
+            if(isfile(outname[cc]))
+            {
+                nd2worker_printf(w, "%s ", outname[cc]);
+                nd2worker_log(w, "%s ", outname[cc]);
+                if(conf->shake)
+                {
+                    check_stage_position(w, ff, cc);
+                }
+                nd2worker_printf(w, "-- skipping, file exists\n");
+                nd2worker_log(w, "-- skipping, file exists\n");
+                continue;
+            }
+        }
+
+        if(conf->dry)
+        {
+            nd2worker_printf(w, "%s ", outname[cc]);
+            if(conf->shake)
+            {
+                check_stage_position(w, ff, cc);
+            }
+            nd2worker_printf(w, " (--dry, not writing)\n");
+            continue;
+        }
+
+        tw[cc] = nd2worker_tiff_open(w, outname[cc], M, N, p1-p0,
+                                     outname_tmp + cc, jf + cc);
+        nopen++;
+    }
+
+    if(nopen > 0)
+    {
+        if(conf->verbose > 0)
+        {
+            nd2worker_printf(w, "FOV %" PRId64 " ... writing ... ", ff+1);
+            fflush(w->out);
+        }
+
+        /* The planes that some file still needs, all unless resumed */
+        i64 * seq = ckcalloc(p1-p0, sizeof(i64));
+        i64 nseq = 0;
+        for(i64 kk = p0; kk < p1; kk++) /* For each plane */
+        {
+            int needed = 0;
+            for(int cc = 0; cc < nchan; cc++)
+            {
+                if(tw[cc] != NULL && (jf[cc] == NULL || jf[cc]->done[kk-p0] == 0))
+                {
+                    needed = 1;
+                }
+            }
+            if(needed)
+            {
+                seq[nseq++] = kk + ff*P;
+            }
+        }
+
+        if(nseq > 0)
+        {
+            nd2_tiff_sink_t sink = {tw, 0, nchan, info->journal, jf};
+            nd2worker_write_planes(w, seq, nseq, p0 + ff*P,
+                                   nd2_tiff_put_plane, &sink);
+        }
+        free(seq);
+
+        if(conf->verbose > 0)
+        {
+            nd2worker_printf(w, "done\n");
+        }
+    }
+
+    /* Finish the images of this FOV */
+    if(nopen > 0 && info->journal != NULL)
+    {
+        journal_sync(info->journal);
+    }
+    for(i64 cc = 0; cc<nchan; cc++)
+    {
+        if(tw[cc] != NULL)
+        {
+            nd2worker_printf(w, "%s ", outname[cc]);
+            nd2worker_log(w, "%s ", outname[cc]);
+            nd2worker_finish_tiff(w, tw[cc], outname_tmp[cc], outname[cc]);
+            if(jf[cc] != NULL)
+            {
+                journal_end(info->journal, jf[cc]);
+            }
+            if(conf->shake)
+            {
+                check_stage_position(w, ff, cc);
+            }
+            nd2worker_printf(w, "\n");
+            nd2worker_log(w, "\n");
+        }
+        free(outname_tmp[cc]);
+        free(outname[cc]);
+    } // cc
+
+    free(jf);
+    free(tw);
+    free(outname_tmp);
+    free(outname);
+}
+
+
+/** @brief Write one FOV as one file per channel and plane
+ *
+ * Each image plane is read once and written to one file per channel.
+ */
+static void nd2_to_tiff_splitC_splitZ(nd2worker_t * w, i64 ff)
+{
+    ntconf_t * conf = w->conf;
+    nd2info_t * info = w->info;
+
+    int nchan = info->meta_att->nchannels;
+    int M = info->meta_att->channels[0]->M;
+    int N = info->meta_att->channels[0]->N;
+    int P = info->meta_att->channels[0]->P;
+
+    /* One slice per color, channel cc at S + cc*M*N */
+    uint16_t * S = w->S;
+
+    /* Output file per plane and channel, NULL for files that are
+     * skipped */
+    char ** outname = ckcalloc((size_t) P*nchan, sizeof(char*));
+    /* The planes where at least one file will be written */
+    i64 * seq = ckcalloc(P, sizeof(i64));
+    i64 nseq = 0;
+
+    for(i64 kk = 0; kk<P; kk++) /* For each plane */
+    {
+        int nwrite = 0;
+        for(i64 cc = 0; cc<nchan; cc++) /* For each channel */
+        {
+            size_t slen = 1024;
+            char * name = ckcalloc(slen, 1);
+            /* SpaceTx
+             * <image_type>-f<fov_id>-r<round_label>-c<ch_label>-z<zplane_label>.
+             * Example: nuclei-f0-r2-c3-z33.tiff
+             */
+            snprintf(name, slen,
+                     "%s/%s_f%" PRId64 "-r%d-c%" PRIu64 "-z%" PRIu64 ".tif",
+                     info->outfolder,
+                     info->outfolder, /* <image_type> */
+                     ff, /* <fov_id> */
+                     0, /* <round_label> */
+                     cc, /* <ch_label> */
+                     kk); /* <zplane_label> */
+
+            if(conf->overwrite == 0)
+            {
+                if(isfile(name))
+                {
+                    nd2worker_printf(w, "%s ", name);
+                    nd2worker_log(w, "%s ", name);
+                    if(conf->shake)
+                    {
+                        check_stage_position(w, ff, cc);
+                    }
+                    nd2worker_printf(w, "-- skipping, file exists\n");
+                    nd2worker_log(w, "-- skipping, file exists\n");
+                    free(name);
+                    continue;
+                }
+            }
+
+            if(conf->dry)
+            {
+                nd2worker_printf(w, "%s ", name);
+                if(conf->shake)
+                {
+                    check_stage_position(w, ff, cc);
+                }
+                nd2worker_printf(w, " (--dry, not writing)\n");
+                free(name);
+                continue;
+            }
+            outname[kk*nchan + cc] = name;
+            nwrite++;
+        }
+
+        if(nwrite > 0)
+        {
+            seq[nseq++] = kk + ff*P;
+        }
+    }
+
+    nd2worker_start_planes(w, seq, nseq);
+    const uint16_t * pixels = NULL;
+    i64 sq = 0;
+    while((pixels = nd2worker_next_plane(w, &sq)) != NULL)
+    {
+        i64 kk = sq - ff*P;
+
+        uint64_t t0 = prof_begin();
+        deinterleave_u16(S, pixels, (size_t) M*N, nchan);
+        prof_end(PROF_DEINTERLEAVE, t0, (i64) M*N*nchan*sizeof(uint16_t), sq);
+
+        for(i64 cc = 0; cc<nchan; cc++)
+        {
+            char * name = outname[kk*nchan + cc];
+            if(name == NULL)
+            {
+                continue;
+            }
+            nd2worker_focus(w, sq, cc, S + cc*M*N);
+
+            nd2worker_printf(w, "%s ", name);
+            nd2worker_log(w, "%s ", name);
+
+            if(conf->shake)
+            {
+                check_stage_position(w, ff, cc);
+            }
+
+            if(conf->verbose > 0)
+            {
+                nd2worker_printf(w, "... writing ... ");
+                fflush(w->out);
+            }
+
+            /* Write out to disk */
+            char * outname_tmp = create_tmp_file(name);
+            tiff_writer_t * tw = nd2worker_tiff_writer_init(w, outname_tmp, M, N, 1);
+            t0 = prof_begin();
+            tiff_writer_write(tw, S + cc*M*N);
+            prof_end(PROF_WRITE, t0, (i64) M*N*sizeof(uint16_t), sq);
+
+            /* Finish this image */
+            nd2worker_finish_tiff(w, tw, outname_tmp, name);
+            if(conf->verbose > 0)
+            {
+                nd2worker_printf(w, "done\n");
+            }
+            nd2worker_log(w, "\n");
+            free(outname_tmp);
+        } // cc
+    }
+    nd2worker_stop_planes(w);
+
+    for(i64 kk = 0; kk < (i64) P*nchan; kk++)
+    {
+        free(outname[kk]);
+    }
+    free(outname);
+    free(seq);
+}
+
+
+/** @brief Write one FOV as a composite tif file
+ *
+ * Each image plane is read once and all channels are written from
+ * it.
+ */
+static void
+nd2_to_tiff_composite(nd2worker_t * w, i64 ff)
+{
+    ntconf_t * conf = w->conf;
+    nd2info_t * info = w->info;
+
     int nchan = info->meta_att->nchannels;
     int M = info->meta_att->channels[0]->M;
     int N = info->meta_att->channels[0]->N;
     int P = info->meta_att->channels[0]->P;
 
-    ttags_set_imagesize(tags, M, N, P);
-    ttags_set_pixelsize_nm(tags,
-                           info->meta_att->channels[0]->dx_nm,
-                           info->meta_att->channels[0]->dy_nm,
-                           info->meta_att->channels[0]->dz_nm);
+    /* Write out to disk */
+    size_t slen = 1024;
+    char * outname = ckcalloc(slen, 1);
+    snprintf(outname, slen,
+             "%s/%s_%03" PRId64 ".tif", info->outfolder,
+             "composite", ff+1);
+
+    nd2worker_printf(w, "%s ", outname);
+    nd2worker_log(w, "%s ", outname);
+
+    if(conf->overwrite == 0)
+    {
+        if(isfile(outname))
+        {
+            nd2worker_printf(w, "-- skipping, file exists\n");
+            nd2worker_log(w, "-- skipping, file exists\n");
+            goto next_file;
+        }
+    }
+    if(conf->verbose > 0)
+    {
+        nd2worker_printf(w, "... writing ... ");
+        fflush(w->out);
+    }
 
+    /* Create temporary file */
+    char * outname_tmp = create_tmp_file(outname);
 
-    /* We choose to extract the image data multiple times and only
-     * collect pixels from one channel at a time. This is of course
-     * slightly slower than extracting all channels for a given FOV at
-     * a time but gives more predictable memory usage. */
+    tiff_writer_t * tw = nd2worker_tiff_writer_init(w, outname_tmp, M, N, P*nchan);
 
-    /* Buffer for one slice and one color */
-    uint16_t * S = ckcalloc(M*N, sizeof(uint16_t));
-    LIMPICTURE * pic = ckcalloc(1, sizeof(LIMPICTURE));
-    Lim_InitPicture(pic, M, N, 16, nchan);
+    i64 * seq = ckcalloc(P, sizeof(i64));
+    for(i64 kk = 0; kk<P; kk++) /* For each plane */
+    {
+        seq[kk] = kk + ff*P;
+    }
 
-    for(i64 ff = 0; ff<info->nFOV; ff++) /* For each FOV */
+    nd2_tiff_sink_t sink = {&tw, 1, nchan, NULL, NULL};
+    nd2worker_write_planes(w, seq, P, seq[0], nd2_tiff_put_plane, &sink);
+    free(seq);
+
+    /* Finish this image */
+    nd2worker_finish_tiff(w, tw, outname_tmp, outname);
+    if(conf->verbose > 0)
+    {
+        nd2worker_printf(w, "done\n");
+    }
+    nd2worker_log(w, "\n");
+    free(outname_tmp);
+next_file: ;
+    free(outname);
+}
+
+
+/** @brief Write one FOV as one .npy file per channel
+ *
+ * Like nd2_to_tiff_splitC but each volume is a C-ordered uint16 array
+ * of shape (planes, rows, columns) that can be memory mapped.
+ */
+static void
+nd2_to_npy(nd2worker_t * w, i64 ff)
+{
+    ntconf_t * conf = w->conf;
+    nd2info_t * info = w->info;
+
+    int nchan = info->meta_att->nchannels;
+    int M = info->meta_att->channels[0]->M;
+    int N = info->meta_att->channels[0]->N;
+    int P = info->meta_att->channels[0]->P;
+    i64 p0 = 0;
+    i64 p1 = P;
+    nd2_slice_range(conf, P, &p0, &p1);
+
+    char ** outname = ckcalloc(nchan, sizeof(char*));
+    char ** outname_tmp = ckcalloc(nchan, sizeof(char*));
+    npy_writer_t ** nw = ckcalloc(nchan, sizeof(npy_writer_t*));
+
+    int nopen = 0;
+    for(int cc = 0; cc < nchan; cc++)
     {
-        if(conf->use_fov_range)
+        size_t slen = 1024;
+        outname[cc] = ckcalloc(slen, 1);
+        snprintf(outname[cc], slen,
+                 "%s/%s_%03" PRId64 ".npy", info->outfolder,
+                 info->meta_att->channels[cc]->name, ff+1);
+
+        if(conf->overwrite == 0 && isfile(outname[cc]))
         {
-            if( (ff+1) < conf->fov_range_from)
-            {
-                continue;
-            }
-            if( (ff+1) > conf->fov_range_to)
-            {
-                continue;
-            }
+            nd2worker_printf(w, "%s -- skipping, file exists\n", outname[cc]);
+            nd2worker_log(w, "%s -- skipping, file exists\n", outname[cc]);
+            continue;
         }
-
-        for(i64 cc = 0; cc<nchan; cc++) /* For each channel */
+        if(conf->dry)
         {
-            /* Write out to disk */
-
-            size_t slen = 1024;
-            char * outname = ckcalloc(slen, 1);
-            snprintf(outname, slen,
-                     "%s/%s_%03" PRId64 ".tif", info->outfolder,
-                     info->meta_att->channels[cc]->name, ff+1);
+            nd2worker_printf(w, "%s  (--dry, not writing)\n", outname[cc]);
+            continue;
+        }
+        outname_tmp[cc] = create_tmp_file(outname[cc]);
+        nw[cc] = npy_writer_init(outname_tmp[cc], p1-p0, N, M);
+        nopen++;
+    }
 
-	    if(conf->verbose > 1)
-            {
-		printf("outfolder: %s\n", info->outfolder);
-		printf("channel name: %s\n", info->meta_att->channels[cc]->name);
-            }
-            printf("%s ", outname);
-            nd2info_log(info, "%s ", outname);
+    if(nopen > 0)
+    {
+        if(conf->verbose > 0)
+        {
+            nd2worker_printf(w, "FOV %" PRId64 " ... writing ... ", ff+1);
+            fflush(w->out);
+        }
+        i64 * seq = ckcalloc(p1-p0, sizeof(i64));
+        for(i64 kk = p0; kk < p1; kk++)
+        {
+            seq[kk-p0] = kk + ff*P;
+        }
+        nd2worker_write_planes(w, seq, p1-p0, seq[0], nd2_npy_put_plane, nw);
+        free(seq);
+        if(conf->verbose > 0)
+        {
+            nd2worker_printf(w, "done\n");
+        }
+    }
 
+    for(int cc = 0; cc < nchan; cc++)
+    {
+        if(nw[cc] != NULL)
+        {
+            nd2worker_printf(w, "%s ", outname[cc]);
+            nd2worker_log(w, "%s ", outname[cc]);
+            uint64_t hash = npy_writer_hash(nw[cc]);
+            uint64_t t0 = prof_begin();
+            i64 nbytes = npy_writer_finish(nw[cc]);
+            prof_end(PROF_FINISH, t0, 0, -1);
+            nd2worker_commit(w, outname_tmp[cc], outname[cc], nbytes, &hash);
             if(conf->shake)
             {
-                check_stage_position(info, ff, cc);
+                check_stage_position(w, ff, cc);
             }
+            nd2worker_printf(w, "\n");
+            nd2worker_log(w, "\n");
+        }
+        free(outname_tmp[cc]);
+        free(outname[cc]);
+    }
+    free(nw);
+    free(outname_tmp);
+    free(outname);
+}
 
-            if(conf->overwrite == 0)
-            {
-                if(isfile(outname))
-                {
-                    printf("-- skipping, file exists\n");
-                    nd2info_log(info, "-- skipping, file exists\n");
+/** @brief Display color of a channel as 0xRRGGBB */
+static uint32_t
+nd2_channel_color(const channel_attrib_t * channel)
+{
+    double l = channel->emissionLambdaNm;
+    if(l > 650)
+    {
+        l = 650;
+    }
+    if(l < 425)
+    {
+        l = 425;
+    }
+    double RGB[3] = {0,0,0};
+    srgb_from_lambda(l, RGB);
+    uint32_t color = 0;
+    for(int kk = 0; kk < 3; kk++)
+    {
+        color = (color << 8) | (uint32_t) round(255.0*RGB[kk]);
+    }
+    return color;
+}
 
-                    goto next_file;
-                }
-            }
-            if(conf->verbose > 0)
-            {
-                printf("... writing ... "); fflush(stdout);
-            }
+/** @brief Write one FOV as an image of the OME-Zarr store
+ *
+ * The FOVs are the series of a bioformats2raw store, i.e. FOV ff is
+ * the image group info->zarrstore/<ff-1>. The group is written to a
+ * temporary folder that is renamed when all planes are written.
+ */
+static void
+nd2_to_zarr(nd2worker_t * w, i64 ff)
+{
+    ntconf_t * conf = w->conf;
+    nd2info_t * info = w->info;
 
-            if(conf->dry)
-            {
-                printf(" (--dry, not writing)\n");
-                goto next_file;
-            }
+    int nchan = info->meta_att->nchannels;
+    channel_attrib_t * ch0 = info->meta_att->channels[0];
+    i64 p0 = 0;
+    i64 p1 = ch0->P;
+    nd2_slice_range(conf, ch0->P, &p0, &p1);
 
-            /* Create temporary file */
-            slen = strlen(outname) + 16;
-            char * outname_tmp = ckcalloc(slen, 1);
+    size_t slen = strlen(info->zarrstore) + 64;
+    char * outname = ckcalloc(slen, 1);
+    snprintf(outname, slen, "%s/%" PRId64, info->zarrstore, ff);
 
-            snprintf(outname_tmp, slen,
-                     "%s_tmp_XXXXXX", outname);
-            int tfid = 0;
-            if((tfid = mkstemp(outname_tmp)) == -1)
-            {
-                fprintf(stderr, "Failed to create a temporary file based on pattern: %s\n", outname_tmp);
-                exit(EXIT_FAILURE);
-            }
-            close(tfid);
+    nd2worker_printf(w, "%s ", outname);
+    nd2worker_log(w, "%s ", outname);
+    if(conf->shake)
+    {
+        for(int cc = 0; cc < nchan; cc++)
+        {
+            check_stage_position(w, ff, cc);
+        }
+    }
+
+    struct stat sb;
+    int exists = stat(outname, &sb) == 0;
+    if(exists && conf->overwrite == 0)
+    {
+        nd2worker_printf(w, "-- skipping, folder exists\n");
+        nd2worker_log(w, "-- skipping, folder exists\n");
+        free(outname);
+        return;
+    }
+    if(conf->dry)
+    {
+        nd2worker_printf(w, " (--dry, not writing)\n");
+        free(outname);
+        return;
+    }
+    if(conf->verbose > 0)
+    {
+        nd2worker_printf(w, "... writing ... ");
+        fflush(w->out);
+    }
 
-            tiff_writer_t * tw = tiff_writer_init(outname_tmp, tags, M, N, P);
+    char * outname_tmp = ckcalloc(slen, 1);
+    snprintf(outname_tmp, slen, "%s_tmp_XXXXXX", outname);
+    if(mkdtemp(outname_tmp) == NULL)
+    {
+        fprintf(stderr, "Failed to create a temporary folder based on pattern: %s\n",
+                outname_tmp);
+        exit(EXIT_FAILURE);
+    }
 
-            i64 p0 = 0;
-            i64 p1 = P;
-            /* For each plane */
-            if(conf->use_range)
-            {
-                p0 = conf->range_from-1;
-                p1 = conf->range_to;
-                if(p0 < 0)
-                {
-                    printf("Invalid slice range\n");
-                    exit(EXIT_FAILURE);
-                }
-                if(p1 > P)
-                {
-                    printf("Invalid slice range\n");
-                    exit(EXIT_FAILURE);
-                }
-            }
+    zarr_image_t img = {0};
+    img.C = nchan;
+    img.Z = p1-p0;
+    img.Y = ch0->N;
+    img.X = ch0->M;
+    img.dx_um = ch0->dx_nm/1000.0;
+    img.dy_um = ch0->dy_nm/1000.0;
+    img.dz_um = ch0->dz_nm/1000.0;
+    char * name = ckcalloc(slen, 1);
+    snprintf(name, slen, "%s FOV %" PRId64, info->outfolder, ff+1);
+    img.name = name;
+    img.channel_names = ckcalloc(nchan, sizeof(char *));
+    img.channel_colors = ckcalloc(nchan, sizeof(uint32_t));
+    for(int cc = 0; cc < nchan; cc++)
+    {
+        img.channel_names[cc] = info->meta_att->channels[cc]->name;
+        img.channel_colors[cc] = nd2_channel_color(info->meta_att->channels[cc]);
+    }
 
-            for(i64 kk = p0; kk < p1; kk++)
-            {
-                /* Returns interlaced data */
-                int res = Lim_FileGetImageData(nd2,
-                                               kk + ff*P, //uiSeqIndex,
-                                               pic);
-                if(res != 0)
-                {
-                    fprintf(stderr, "Failed to read from %s. At line %d\n",
-                            info->filename, __LINE__);
-                }
+    zarr_writer_t * zw = zarr_writer_init(outname_tmp, &img);
+    i64 * seq = ckcalloc(p1-p0, sizeof(i64));
+    for(i64 kk = p0; kk < p1; kk++)
+    {
+        seq[kk-p0] = kk + ff*ch0->P;
+    }
+    nd2worker_write_planes(w, seq, p1-p0, seq[0], nd2_zarr_put_plane, zw);
+    free(seq);
+    uint64_t t0 = prof_begin();
+    i64 nbytes = zarr_writer_finish(zw);
+    prof_end(PROF_FINISH, t0, 0, -1);
 
-                if( (pic->pImageData == NULL) || (pic->uiSize == 0) )
-                {
-                    fprintf(stderr, "Failed to retrieve image data\n");
-                }
-                uint16_t * pixels = (uint16_t *) pic->pImageData;
-                if(pixels == NULL)
-                {
-                    fprintf(stderr, "No pixel data could be found in the image\n");
-                    exit(EXIT_FAILURE);
-                }
+    if(exists && remove_tree(outname) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "Unable to remove %s\n", outname);
+        exit(EXIT_FAILURE);
+    }
+    nd2worker_commit(w, outname_tmp, outname, nbytes, NULL);
+    if(conf->verbose > 0)
+    {
+        nd2worker_printf(w, "done\n");
+    } else {
+        nd2worker_printf(w, "\n");
+    }
+    nd2worker_log(w, "\n");
 
-                for(i64 pp = 0; pp<M*N; pp++)
-                {
-                    S[pp] = pixels[pp*nchan+cc];
-                }
-                tiff_writer_write(tw, S);
-            } // kk
+    free(img.channel_colors);
+    free(img.channel_names);
+    free(name);
+    free(outname_tmp);
+    free(outname);
+}
 
-            /* Finish this image */
-            tiff_writer_finish(tw);
-            rename(outname_tmp, outname);
-            if(conf->verbose > 0)
-            {
-                printf("done\n");
-            }
-            nd2info_log(info, "\n");
-            free(outname_tmp);
-        next_file: ;
+/** @brief Write one FOV as a pyramidal OME-TIFF file
+ *
+ * All channels go to one file with tiled pages, plane k of channel
+ * cc is page k*nchan + cc. Each page has reduced resolution levels
+ * as SubIFDs, they are computed from the plane when it is written.
+ */
+static void
+nd2_to_ometiff(nd2worker_t * w, i64 ff)
+{
+    ntconf_t * conf = w->conf;
+    nd2info_t * info = w->info;
+
+    int nchan = info->meta_att->nchannels;
+    int M = info->meta_att->channels[0]->M;
+    int N = info->meta_att->channels[0]->N;
+    int P = info->meta_att->channels[0]->P;
+    i64 p0 = 0;
+    i64 p1 = P;
+    nd2_slice_range(conf, P, &p0, &p1);
+
+    size_t slen = 1024;
+    char * outname = ckcalloc(slen, 1);
+    snprintf(outname, slen,
+             "%s/%s_%03" PRId64 ".ome.tif", info->outfolder,
+             info->outfolder, ff+1);
+
+    nd2worker_printf(w, "%s ", outname);
+    nd2worker_log(w, "%s ", outname);
+
+    if(conf->overwrite == 0)
+    {
+        if(isfile(outname))
+        {
+            nd2worker_printf(w, "-- skipping, file exists\n");
+            nd2worker_log(w, "-- skipping, file exists\n");
             free(outname);
+            return;
+        }
+    }
+    if(conf->dry)
+    {
+        nd2worker_printf(w, " (--dry, not writing)\n");
+        free(outname);
+        return;
+    }
+    if(conf->verbose > 0)
+    {
+        nd2worker_printf(w, "... writing ... ");
+        fflush(w->out);
+    }
 
-        } // cc
-    }// ff
+    char * outname_tmp = create_tmp_file(outname);
+    tiff_writer_t * tw = nd2worker_tiff_writer_init(w, outname_tmp, M, N,
+                                                    (p1-p0)*nchan);
 
-    Lim_DestroyPicture(pic);
-    free(pic);
+    i64 * seq = ckcalloc(p1-p0, sizeof(i64));
+    for(i64 kk = p0; kk < p1; kk++)
+    {
+        seq[kk-p0] = kk + ff*P;
+    }
+    nd2_tiff_sink_t sink = {&tw, 1, nchan, NULL, NULL};
+    nd2worker_write_planes(w, seq, p1-p0, seq[0], nd2_tiff_put_plane, &sink);
+    free(seq);
+
+    nd2worker_finish_tiff(w, tw, outname_tmp, outname);
+    if(conf->shake)
+    {
+        for(int cc = 0; cc < nchan; cc++)
+        {
+            check_stage_position(w, ff, cc);
+        }
+    }
+    if(conf->verbose > 0)
+    {
+        nd2worker_printf(w, "done\n");
+    } else {
+        nd2worker_printf(w, "\n");
+    }
+    nd2worker_log(w, "\n");
+    free(outname_tmp);
+    free(outname);
+}
+
+/* Converts one FOV */
+typedef void (*nd2_fov_writer_t)(nd2worker_t * w, i64 ff);
+
+/* Shared state when converting the FOVs of a file in parallel */
+typedef struct
+{
+    ntconf_t * conf;
+    nd2info_t * info;
+    nd2_fov_writer_t write_fov;
+    nd2worker_t * workers; /* One per thread */
+    i64 nfov;
+    i64 * fov; /* The FOVs to convert, one job each */
+
+    /* With more than one thread the messages about each FOV are
+     * buffered and printed in FOV order */
+    int buffered;
+    char ** outbuf;
+    size_t * outsize;
+    char ** logbuf;
+    size_t * logsize;
+    int * done;
+    i64 next_print;
+    pthread_mutex_t lock;
+} nd2_convert_t;
+
+/** @brief Print the buffered messages of all finished FOVs in order */
+static void
+nd2_convert_flush(nd2_convert_t * c)
+{
+    while(c->next_print < c->nfov && c->done[c->next_print])
+    {
+        i64 kk = c->next_print;
+        fputs(c->outbuf[kk], stdout);
+        fflush(stdout);
+        if(c->info->log != NULL)
+        {
+            fputs(c->logbuf[kk], c->info->log);
+            fflush(c->info->log);
+        }
+        free(c->outbuf[kk]);
+        c->outbuf[kk] = NULL;
+        free(c->logbuf[kk]);
+        c->logbuf[kk] = NULL;
+        c->next_print++;
+    }
+}
+
+static void
+nd2_convert_job(void * arg, int64_t job, int thread)
+{
+    nd2_convert_t * c = (nd2_convert_t *) arg;
+    nd2worker_t * w = c->workers + thread;
+
+    if(c->buffered)
+    {
+        w->out = open_memstream(c->outbuf + job, c->outsize + job);
+        w->log = open_memstream(c->logbuf + job, c->logsize + job);
+        NOT_NULL(w->out);
+        NOT_NULL(w->log);
+    }
 
-    free(S);
-    ttags_free(&tags);
+    prof_thread_name("convert");
+    uint64_t t0 = prof_begin();
+    c->write_fov(w, c->fov[job]);
+    prof_end(PROF_FOV, t0, 0, c->fov[job]);
+
+    if(c->buffered)
+    {
+        fclose(w->out);
+        fclose(w->log);
+        pthread_mutex_lock(&c->lock);
+        c->done[job] = 1;
+        nd2_convert_flush(c);
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+/** @brief Set up a worker with its own handle to the nd2 file */
+static void
+nd2worker_init(nd2worker_t * w, nd2_convert_t * c, void * nd2,
+               const ttags * tags, int nwriters)
+{
+    nd2info_t * info = c->info;
+    int nchan = info->meta_att->nchannels;
+    int M = info->meta_att->channels[0]->M;
+    int N = info->meta_att->channels[0]->N;
+
+    w->conf = c->conf;
+    w->info = info;
+    w->nd2 = nd2;
+    if(w->nd2 == NULL)
+    {
+        w->nd2 = open_nd2(c->conf, info->filename);
+        if(w->nd2 == NULL)
+        {
+            fprintf(stderr, "Failed to read from %s\n", info->filename);
+            exit(EXIT_FAILURE);
+        }
+    }
+    w->nwriters = 1;
+    if(c->conf->queue_depth > 0)
+    {
+        /* The interlaced planes are in the ring, with one extra for
+         * each writer that is busy with a plane */
+        w->nwriters = nwriters;
+        int nslots = c->conf->queue_depth + nwriters - 1;
+        w->ring = plane_ring_new(nslots);
+        for(int kk = 0; kk < nslots; kk++)
+        {
+            nd2_plane_t * plane = ckcalloc(1, sizeof(nd2_plane_t));
+            Lim_InitPicture(&plane->pic, M, N, 16, nchan);
+            plane_ring_slot(w->ring, kk)->data = plane;
+        }
+    } else {
+        w->plane = ckcalloc(1, sizeof(nd2_plane_t));
+        Lim_InitPicture(&w->plane->pic, M, N, 16, nchan);
+    }
+    w->S = ckcalloc((size_t) M*N*nchan*w->nwriters, sizeof(uint16_t));
+    w->tags = ttags_copy(tags);
+    w->out = stdout;
+    w->log = info->log;
+}
+
+static void
+nd2worker_free(nd2worker_t * w, int close_nd2)
+{
+    if(close_nd2)
+    {
+        nd2_file_close(w->nd2);
+    }
+    if(w->ring != NULL)
+    {
+        for(int kk = 0; kk < plane_ring_nslots(w->ring); kk++)
+        {
+            nd2_plane_t * plane = (nd2_plane_t *) plane_ring_slot(w->ring, kk)->data;
+            Lim_DestroyPicture(&plane->pic);
+            free(plane);
+        }
+        plane_ring_free(w->ring);
+    } else {
+        Lim_DestroyPicture(&w->plane->pic);
+        free(w->plane);
+    }
+    free(w->S);
+    ttags_free(&w->tags);
 }
 
-
-/** @brief Write an ND2 file as one file per FOV and channel */
-static void nd2_to_tiff_splitC_splitZ(void * nd2, ntconf_t * conf, nd2info_t * info)
+/** @brief Convert all selected FOVs with write_fov
+ *
+ * The FOVs are distributed over conf->nthreads threads. Each thread
+ * has its own handle to the nd2 file, the first one uses nd2.
+ */
+static void
+nd2_convert_fovs(ntconf_t * conf, nd2info_t * info, void * nd2,
+                 const ttags * tags, nd2_fov_writer_t write_fov)
 {
+    nd2_convert_t c = {0};
+    c.conf = conf;
+    c.info = info;
+    c.write_fov = write_fov;
 
-    /* Prepare metadata for the tiff files */
-    ttags * tags = ttags_new();
+    c.fov = ckcalloc(info->nFOV, sizeof(i64));
+    for(i64 ff = 0; ff<info->nFOV; ff++) /* For each FOV */
     {
-        size_t slen = 1024;
-        char * sw_string = ckcalloc(slen, 1);
-        snprintf(sw_string, slen,
-                 "github.com/elgw/nd2tool source image: %s",
-                 info->filename);
-        ttags_set_software(tags , sw_string);
-        free(sw_string);
+        if(nd2_fov_selected(conf, ff))
+        {
+            c.fov[c.nfov++] = ff;
+        }
     }
 
-    int nchan = info->meta_att->nchannels;
-    int M = info->meta_att->channels[0]->M;
-    int N = info->meta_att->channels[0]->N;
-    int P = info->meta_att->channels[0]->P;
-
-    ttags_set_imagesize(tags, M, N, 1);
-    ttags_set_pixelsize_nm(tags,
-                           info->meta_att->channels[0]->dx_nm,
-                           info->meta_att->channels[0]->dy_nm,
-                           info->meta_att->channels[0]->dz_nm);
-
-
-    /* We choose to extract the image data multiple times and only
-     * collect pixels from one channel at a time. This is of course
-     * slightly slower than extracting all channels for a given FOV at
-     * a time but gives more predictable memory usage. */
-
-    /* Buffer for one slice and one color */
-    uint16_t * S = ckcalloc(M*N, sizeof(uint16_t));
-    LIMPICTURE * pic = ckcalloc(1, sizeof(LIMPICTURE));
-    Lim_InitPicture(pic, M, N, 16, nchan);
-
-    for(i64 ff = 0; ff<info->nFOV; ff++) /* For each FOV */
+    int nthreads = conf->nthreads;
+    if(nthreads < 1)
+    {
+        nthreads = tpool_ncpu();
+    }
+    if(nthreads > c.nfov)
+    {
+        nthreads = c.nfov;
+    }
+    if(nthreads < 1)
     {
+        free(c.fov);
+        return;
+    }
 
-        if(conf->use_fov_range)
+    /* Threads that are not needed for the FOVs write the planes
+     * within the FOVs. That requires the planes to be read ahead and
+     * the built-in tif writer, or another format. */
+    int nwriters = 1;
+    if(conf->queue_depth > 0 && conf->libtiff == 0
+       && write_fov != nd2_to_tiff_splitC_splitZ)
+    {
+        int ntotal = conf->nthreads < 1 ? tpool_ncpu() : conf->nthreads;
+        nwriters = ntotal / nthreads;
+        if(nwriters < 1)
         {
-            if( (ff+1) < conf->fov_range_from)
-            {
-                continue;
-            }
-            if( (ff+1) > conf->fov_range_to)
-            {
-                continue;
-            }
+            nwriters = 1;
         }
-        
-        for(i64 cc = 0; cc<nchan; cc++) /* For each channel */
-        {
-            for(i64 kk = 0; kk<P; kk++) /* For each plane */
-            {
+    }
 
-                /* Write out to disk */
-                size_t slen = 1024;
-                char * outname = ckcalloc(slen, 1);
-                /* SpaceTx
-                 * <image_type>-f<fov_id>-r<round_label>-c<ch_label>-z<zplane_label>.
-                 * Example: nuclei-f0-r2-c3-z33.tiff
-                 */
-                snprintf(outname, slen,
-                         "%s/%s_f%" PRId64 "-r%d-c%" PRIu64 "-z%" PRIu64 ".tif",
-                         info->outfolder,
-                         info->outfolder, /* <image_type> */
-                         ff, /* <fov_id> */
-                         0, /* <round_label> */
-                         cc, /* <ch_label> */
-                         kk); /* <zplane_label> */
-
-                printf("%s ", outname);
-                nd2info_log(info, "%s ", outname);
+    if(conf->verbose > 1 && (nthreads > 1 || nwriters > 1))
+    {
+        printf("Converting %" PRId64 " FOVs using %d threads "
+               "with %d writer(s) each\n",
+               c.nfov, nthreads, nwriters);
+    }
 
-                if(conf->shake)
-                {
-                    check_stage_position(info, ff, cc);
-                }
+    c.workers = ckcalloc(nthreads, sizeof(nd2worker_t));
+    for(int kk = 0; kk < nthreads; kk++)
+    {
+        nd2worker_init(c.workers + kk, &c, kk == 0 ? nd2 : NULL, tags,
+                       nwriters);
+    }
 
-                if(conf->overwrite == 0)
-                {
-                    if(isfile(outname))
-                    {
-                        printf("-- skipping, file exists\n");
-                        nd2info_log(info, "-- skipping, file exists\n");
+    c.buffered = nthreads > 1;
+    if(c.buffered)
+    {
+        c.outbuf = ckcalloc(c.nfov, sizeof(char*));
+        c.outsize = ckcalloc(c.nfov, sizeof(size_t));
+        c.logbuf = ckcalloc(c.nfov, sizeof(char*));
+        c.logsize = ckcalloc(c.nfov, sizeof(size_t));
+        c.done = ckcalloc(c.nfov, sizeof(int));
+        pthread_mutex_init(&c.lock, NULL);
+    }
 
-                        goto next_file;
-                    }
-                }
-                if(conf->verbose > 0)
-                {
-                    printf("... writing ... "); fflush(stdout);
-                }
+    tpool_t * pool = tpool_new(nthreads);
+    tpool_run(pool, c.nfov, nd2_convert_job, &c);
+    tpool_free(pool);
 
-                if(conf->dry)
-                {
-                    printf(" (--dry, not writing)\n");
-                    goto next_file;
-                }
+    for(int kk = 0; kk < nthreads; kk++)
+    {
+        nd2worker_free(c.workers + kk, kk > 0);
+    }
+    free(c.workers);
 
-                /* Create temporary file */
-                slen = strlen(outname) + 32;
-                char * outname_tmp = ckcalloc(slen, 1);
+    if(c.buffered)
+    {
+        pthread_mutex_destroy(&c.lock);
+        free(c.outbuf);
+        free(c.outsize);
+        free(c.logbuf);
+        free(c.logsize);
+        free(c.done);
+    }
+    free(c.fov);
+}
 
-                snprintf(outname_tmp, slen,
-                         "%s_tmp_XXXXXX", outname);
-                int tfid = 0;
-                if((tfid = mkstemp(outname_tmp)) == -1)
-                {
-                    fprintf(stderr, "Failed to create a temporary file based on pattern: %s\n", outname_tmp);
-                    exit(EXIT_FAILURE);
-                }
-                close(tfid);
 
-                tiff_writer_t * tw = tiff_writer_init(outname_tmp, tags, M, N, 1);
+/** @brief Number of image planes covered by the FOV and slice selection
+ *
+ * This is the number of sequence indices that a conversion needs to
+ * read, each of them only once.
+ */
+static i64
+nd2info_count_planes(const ntconf_t * conf, const nd2info_t * info)
+{
+    i64 P = info->meta_att->channels[0]->P;
+    i64 nfov = 0;
+    for(i64 ff = 0; ff < info->nFOV; ff++)
+    {
+        nfov += nd2_fov_selected(conf, ff);
+    }
 
-                /* Returns interlaced data */
-                int res = Lim_FileGetImageData(nd2,
-                                               kk + ff*P, //uiSeqIndex,
-                                               pic);
-                if(res != 0)
-                {
-                    fprintf(stderr, "Failed to read from %s. At line %d\n",
-                            info->filename, __LINE__);
-                }
+    i64 nplanes = P;
+    if(conf->use_range && !conf->composite && !conf->save_individual_planes)
+    {
+        nplanes = conf->range_to - conf->range_from + 1;
+    }
+    return nfov*nplanes;
+}
 
-                if( (pic->pImageData == NULL) || (pic->uiSize == 0) )
-                {
-                    fprintf(stderr, "Failed to retrieve image data\n");
-                }
-                uint16_t * pixels = (uint16_t *) pic->pImageData;
+/** @brief Log the number of image planes that were read
+ *
+ * Reading an interlaced plane is the most expensive part of the
+ * conversion and all channels are extracted from each read, so no
+ * plane should be read more than once, see nd2_to_tiff_ut.
+ */
+static void
+nd2info_log_reads(const ntconf_t * conf, nd2info_t * info)
+{
+    i64 nplanes = nd2info_count_planes(conf, info);
+    if(conf->verbose > 1)
+    {
+        printf("Read %" PRId64 " image planes (%" PRId64 " selected)\n",
+               info->nread, nplanes);
+    }
+    if(info->native != NULL)
+    {
+        const char * how = conf->reader == READER_CHECK ?
+            "checked against" : "read with";
+        if(conf->verbose > 1)
+        {
+            printf("%" PRId64 " planes %s the built-in reader\n",
+                   info->nnative, how);
+        }
+        nd2info_log(info, "%" PRId64 " of %" PRId64 " planes %s the built-in reader\n",
+                    info->nnative, info->nread, how);
+    }
+    assert(info->nread <= nplanes);
+}
 
-                for(i64 pp = 0; pp<M*N; pp++)
+/** @brief Write the focus measures to nd2tool.focus.csv, see --focus
+ *
+ * One row per FOV, channel and slice that was written this time, with
+ * best = 1 for the slice with the highest value of each FOV and
+ * channel. The best slices are also logged.
+ */
+static int
+nd2info_write_focus(nd2info_t * info)
+{
+    if(info->focus == NULL)
+    {
+        return EXIT_SUCCESS;
+    }
+    int nchan = info->meta_att->nchannels;
+    i64 P = info->meta_att->channels[0]->P;
+
+    size_t slen = strlen(info->outfolder) + 32;
+    char * name = ckcalloc(slen, 1);
+    snprintf(name, slen, "%s/nd2tool.focus.csv", info->outfolder);
+    FILE * fid = fopen(name, "w");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "Unable to write to %s\n", name);
+        free(name);
+        return EXIT_FAILURE;
+    }
+    fprintf(fid, "fov, channel, name, slice, focus, best\n");
+    for(i64 ff = 0; ff < info->nFOV; ff++)
+    {
+        for(int cc = 0; cc < nchan; cc++)
+        {
+            const double * F = info->focus + (ff*nchan + cc)*P;
+            i64 best = -1;
+            for(i64 kk = 0; kk < P; kk++)
+            {
+                if(!isnan(F[kk]) && (best < 0 || F[kk] > F[best]))
                 {
-                    S[pp] = pixels[pp*nchan+cc];
+                    best = kk;
                 }
-                tiff_writer_write(tw, S);
-
-
-                /* Finish this image */
-                tiff_writer_finish(tw);
-                rename(outname_tmp, outname);
-                if(conf->verbose > 0)
+            }
+            if(best < 0)
+            {
+                continue;
+            }
+            const char * cname = info->meta_att->channels[cc]->name;
+            for(i64 kk = 0; kk < P; kk++)
+            {
+                if(!isnan(F[kk]))
                 {
-                    printf("done\n");
+                    /* 1-indexed like --coord */
+                    fprintf(fid, "%" PRId64 ", %d, %s, %" PRId64 ", %.6g, %d\n",
+                            ff+1, cc+1, cname, kk+1, F[kk], kk == best);
                 }
-                nd2info_log(info, "\n");
-                free(outname_tmp);
-            next_file: ;
-                free(outname);
-            } // kk
-        } // cc
-    }// ff
+            }
+            nd2info_log(info, "FOCUS: FOV %" PRId64 ", %s, best slice %" PRId64 "\n",
+                        ff+1, cname, best+1);
+        }
+    }
+    int status = EXIT_SUCCESS;
+    if(fclose(fid) != 0)
+    {
+        fprintf(stderr, "Failed to write %s\n", name);
+        status = EXIT_FAILURE;
+    }
+    free(name);
+    return status;
+}
 
-    Lim_DestroyPicture(pic);
-    free(pic);
 
-    free(S);
-    ttags_free(&tags);
+/** @brief Hash the nd2 file, used as a thread */
+static void *
+nd2info_source_thread(void * p)
+{
+    nd2info_t * info = (nd2info_t *) p;
+    prof_thread_name("hash");
+    info->source_status = hash_file(info->filename, &info->source_hash,
+                                    &info->source_size);
+    return NULL;
 }
 
-
-/** @brief Write an ND2 file as composite tif files
+/** @brief Open the manifest and start to hash the nd2 file
  *
- * One file per FOV
+ * The nd2 file is hashed by a thread of its own while it is
+ * converted. Since the conversion reads the same file most of it
+ * comes from the page cache, it isn't read twice from storage.
  */
 static void
-nd2_to_tiff_composite(void * nd2, ntconf_t * conf, nd2info_t * info)
+nd2info_hash_start(nd2info_t * info)
 {
-
-    /* Prepare metadata for the tiff files */
-    ttags * tags = ttags_new();
+    size_t slen = strlen(info->outfolder) + 32;
+    char * name = ckcalloc(slen, 1);
+    snprintf(name, slen, "%s/nd2tool.manifest", info->outfolder);
+    info->manifest = fopen(name, "a");
+    if(info->manifest == NULL)
     {
-        size_t slen = 1024;
-        char * sw_string = ckcalloc(slen, 1);
-        snprintf(sw_string, slen,
-                 "github.com/elgw/nd2tool source image: %s",
-                 info->filename);
-        ttags_set_software(tags , sw_string);
-        free(sw_string);
+        fprintf(stderr, "Unable to write to %s\n", name);
+    } else if(ftell(info->manifest) == 0)
+    {
+        fprintf(info->manifest, "# nd2tool manifest: kind, algorithm, "
+                "hash, file. See nd2tool --verify\n");
     }
-    int nchan = info->meta_att->nchannels;
-    int M = info->meta_att->channels[0]->M;
-    int N = info->meta_att->channels[0]->N;
-    int P = info->meta_att->channels[0]->P;
-
-    ttags_set_imagesize(tags, M, N, P);
-    ttags_set_pixelsize_nm(tags,
-                           info->meta_att->channels[0]->dx_nm,
-                           info->meta_att->channels[0]->dy_nm,
-                           info->meta_att->channels[0]->dz_nm);
+    free(name);
 
-    ttags_set_composite(tags, nchan);
-
-    // TODO: Set the extra tags needed for composite images.
-
-    /* We choose to extract the image data multiple times and only
-     * collect pixels from one channel at a time. This is of course
-     * slightly slower than extracting all channels for a given FOV at
-     * a time but gives more predictable memory usage. */
-
-    /* Buffer for one slice and one color */
-    uint16_t * S = ckcalloc(M*N, sizeof(uint16_t));
+    if(pthread_create(&info->source_thread, NULL,
+                      nd2info_source_thread, info) == 0)
+    {
+        info->source_hashing = 1;
+    }
+}
 
-    LIMPICTURE * pic = ckcalloc(sizeof(LIMPICTURE), 1);
-    Lim_InitPicture(pic, M, N, 16, nchan);
+/** @brief Wait for the hash of the nd2 file, log it and close the
+ * manifest */
+static void
+nd2info_hash_finish(nd2info_t * info)
+{
+    if(info->source_hashing)
+    {
+        pthread_join(info->source_thread, NULL);
+        info->source_hashing = 0;
+        if(info->source_status == 0)
+        {
+            nd2info_log(info, "SOURCE: xxh64 %016" PRIx64 ", %" PRId64 " bytes\n",
+                        info->source_hash, info->source_size);
+            nd2info_manifest(info, "source", info->source_hash,
+                             info->filename);
+        } else {
+            nd2info_log(info, "SOURCE: Unable to hash %s\n", info->filename);
+        }
+    }
+    if(info->manifest != NULL)
+    {
+        fclose(info->manifest);
+        info->manifest = NULL;
+    }
+}
 
+/* An entry of the manifest, see nd2_verify */
+typedef struct
+{
+    char * kind;
+    char * name; /* Without the folder */
+    uint64_t hash;
+    uint64_t found;
+    int status; /* 0: match, 1: differs, -1: unable to read */
+} nd2_verify_entry_t;
 
+typedef struct
+{
+    nd2info_t * info;
+    nd2_verify_entry_t * entry;
+} nd2_verify_t;
 
-    for(i64 ff = 0; ff<info->nFOV; ff++) /* For each FOV */
+/** @brief Hash one file of the manifest, a job of nd2_verify */
+static void
+nd2_verify_job(void * arg, int64_t job, int thread)
+{
+    (void) thread;
+    nd2_verify_t * v = (nd2_verify_t *) arg;
+    nd2_verify_entry_t * e = v->entry + job;
+    int res = -1;
+    if(strcmp(e->kind, "source") == 0)
     {
-        if(conf->use_fov_range)
+        res = hash_file(v->info->filename, &e->found, NULL);
+    } else {
+        size_t slen = strlen(v->info->outfolder) + strlen(e->name) + 2;
+        char * name = ckcalloc(slen, 1);
+        snprintf(name, slen, "%s/%s", v->info->outfolder, e->name);
+        size_t len = strlen(name);
+        if(len > 4 && strcmp(name + len - 4, ".npy") == 0)
         {
-            if( (ff+1) < conf->fov_range_from)
-            {
-                continue;
-            }
-            if( (ff+1) > conf->fov_range_to)
-            {
-                continue;
-            }
+            res = npy_hash_planes(name, &e->found);
+        } else {
+            res = tiff_hash_pages(name, &e->found);
         }
+        free(name);
+    }
+    e->status = res != 0 ? -1 : (e->found != e->hash);
+}
 
-        /* Write out to disk */
-        size_t slen = 1024;
-        char * outname = ckcalloc(slen, 1);
-        snprintf(outname, slen,
-                 "%s/%s_%03" PRId64 ".tif", info->outfolder,
-                 "composite", ff+1);
-
-        printf("%s ", outname);
-        nd2info_log(info, "%s ", outname);
+/** @brief Check the hashes in the manifest of the outfolder, see
+ * --verify
+ *
+ * The nd2 file is hashed as it is and the output files by their pixel
+ * data, so that the hashes don't depend on the compression. When a
+ * file is listed more than once the last entry is used.
+ *
+ * @return EXIT_SUCCESS if all files match
+ */
+static int
+nd2_verify(ntconf_t * conf, nd2info_t * info)
+{
+    nd2info_set_outfolder(info);
+    size_t slen = strlen(info->outfolder) + 32;
+    char * mname = ckcalloc(slen, 1);
+    snprintf(mname, slen, "%s/nd2tool.manifest", info->outfolder);
+    FILE * fid = fopen(mname, "r");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "Unable to open %s, there is nothing to verify\n", mname);
+        free(mname);
+        return EXIT_FAILURE;
+    }
 
-        if(conf->overwrite == 0)
+    nd2_verify_entry_t * entry = NULL;
+    int nentry = 0;
+    char * line = NULL;
+    size_t len = 0;
+    while(getline(&line, &len, fid) > 0)
+    {
+        if(line[0] == '#')
         {
-            if(isfile(outname))
-            {
-                printf("-- skipping, file exists\n");
-                nd2info_log(info, "-- skipping, file exists\n");
-                goto next_file;
-            }
+            continue;
         }
-        if(conf->verbose > 0)
+        line[strcspn(line, "\n")] = '\0';
+        char * save = NULL;
+        char * kind = strtok_r(line, "\t", &save);
+        char * algo = strtok_r(NULL, "\t", &save);
+        char * hash = strtok_r(NULL, "\t", &save);
+        char * name = strtok_r(NULL, "\t", &save);
+        if(name == NULL || strcmp(algo, "xxh64") != 0)
         {
-            printf("... writing ... "); fflush(stdout);
+            continue;
         }
-
-        /* Create temporary file */
-        slen = strlen(outname) + 16;
-        char * outname_tmp = ckcalloc(slen, 1);
-        snprintf(outname_tmp, slen,
-                 "%s_tmp_XXXXXX", outname);
-        int tfid = 0;
-        if((tfid = mkstemp(outname_tmp)) == -1)
+        int kk = 0;
+        while(kk < nentry && (strcmp(entry[kk].kind, kind) != 0
+                              || strcmp(entry[kk].name, name) != 0))
         {
-            fprintf(stderr, "Failed to create a temporary file based on pattern: %s\n", outname_tmp);
-            exit(EXIT_FAILURE);
+            kk++;
         }
-        close(tfid);
-
-        tiff_writer_t * tw = tiff_writer_init(outname_tmp, tags, M, N, P*nchan);
-
-        for(i64 kk = 0; kk<P; kk++) /* For each plane */
+        if(kk == nentry)
         {
-            for(i64 cc = 0; cc<nchan; cc++) /* For each channel */
+            entry = realloc(entry, (nentry + 1)*sizeof(nd2_verify_entry_t));
+            if(entry == NULL)
             {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            memset(entry + nentry, 0, sizeof(nd2_verify_entry_t));
+            entry[nentry].kind = strdup(kind);
+            entry[nentry].name = strdup(name);
+            nentry++;
+        }
+        entry[kk].hash = strtoull(hash, NULL, 16);
+    }
+    free(line);
+    fclose(fid);
 
-                /* Returns interlaced data */
-                int res = Lim_FileGetImageData(nd2,
-                                               kk + ff*P, //uiSeqIndex,
-                                               pic);
-                if(res != 0)
-                {
-                    fprintf(stderr, "Failed to read from %s. At line %d\n",
-                            info->filename, __LINE__);
-                }
-
-                if( (pic->pImageData == NULL) || (pic->uiSize == 0) )
-                {
-                    fprintf(stderr, "Failed to retrieve image data\n");
-                }
-                uint16_t * pixels = (uint16_t *) pic->pImageData;
-                if(pixels == NULL)
-                {
-                    fprintf(stderr, "Failed to get pixels from the image\n");
-                    exit(EXIT_FAILURE);
-                }
-
-                for(i64 pp = 0; pp<M*N; pp++)
-                {
-                    S[pp] = pixels[pp*nchan+cc];
-                }
-                tiff_writer_write(tw, S);
-            } // cc
+    nd2_verify_t v = {info, entry};
+    tpool_t * pool = tpool_new(conf->nthreads);
+    tpool_run(pool, nentry, nd2_verify_job, &v);
+    tpool_free(pool);
 
-        } // kk
-        /* Finish this image */
-        tiff_writer_finish(tw);
-        rename(outname_tmp, outname);
-        if(conf->verbose > 0)
+    int nfail = 0;
+    for(int kk = 0; kk < nentry; kk++)
+    {
+        nd2_verify_entry_t * e = entry + kk;
+        const char * name = strcmp(e->kind, "source") == 0 ?
+            info->filename : e->name;
+        if(e->status == 0)
+        {
+            if(conf->verbose > 0)
+            {
+                printf("%s: OK\n", name);
+            }
+        } else if(e->status > 0)
         {
-            printf("done\n");
+            printf("%s: FAILED, xxh64 %016" PRIx64 " instead of %016" PRIx64 "\n",
+                   name, e->found, e->hash);
+            nfail++;
+        } else {
+            printf("%s: FAILED, unable to read it\n", name);
+            nfail++;
         }
-        nd2info_log(info, "\n");
-        free(outname_tmp);
-    next_file: ;
-        free(outname);
-
-    }// ff
-
-    Lim_DestroyPicture(pic);
-    free(pic);
-
-    free(S);
-    ttags_free(&tags);
+        free(e->kind);
+        free(e->name);
+    }
+    free(entry);
+    printf("%s: %d of %d files verified\n", mname, nentry - nfail, nentry);
+    free(mname);
+    return nfail == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-
 /** @brief Try to convert an ND2 file to tif
  *
  * @return EXIT_SUCCESS or EXIT_FAILURE
@@ -1408,7 +3387,13 @@ nd2_to_tiff_composite(void * nd2, ntconf_t * conf, nd2info_t * info)
 static int
 nd2_to_tiff(ntconf_t * conf, nd2info_t * info)
 {
-    void * nd2 = open_nd2(conf, info->filename);
+    /* The handle from nd2info, which does not open the file when
+     * the metadata was found in the cache */
+    if(info->nd2 == NULL)
+    {
+        info->nd2 = open_nd2(conf, info->filename);
+    }
+    void * nd2 = info->nd2;
     if(nd2 == NULL)
     {
         fprintf(stderr, "Failed to read from %s\n", info->filename);
@@ -1429,6 +3414,27 @@ nd2_to_tiff(ntconf_t * conf, nd2info_t * info)
                 info->file_att->bitsPerComponentInMemory);
         return EXIT_FAILURE;
     }
+
+    if(conf->reader != READER_SDK && info->native == NULL)
+    {
+        /* Compressed planes can't be told from raw ones by the
+         * built-in reader */
+        if(!info->file_att->compressed)
+        {
+            info->native = nd2_reader_open(info->filename, conf->verbose);
+        }
+        if(info->native == NULL)
+        {
+            if(conf->reader == READER_CHECK)
+            {
+                fprintf(stderr, "Error: --reader check can't be used for %s\n",
+                        info->filename);
+                return EXIT_FAILURE;
+            }
+            printf("Using the %s backend to read %s\n",
+                   conf->backend->name, info->filename);
+        }
+    }
     size_t slen = strlen(info->outfolder) + 128;
     info->logfile = ckcalloc(slen, 1);
     snprintf(info->logfile, slen,
@@ -1447,51 +3453,146 @@ nd2_to_tiff(ntconf_t * conf, nd2info_t * info)
         info->log = fopen(info->logfile, "a");
         if(info->log == NULL)
         {
-            fprintf(stderr, "Unable to create the log file: %s\n",
-                    info->logfile);
-            exit(EXIT_FAILURE);
+            fprintf(stderr, "Unable to create the log file: %s\n",
+                    info->logfile);
+            exit(EXIT_FAILURE);
+        }
+        /* A newline will separate what is written to the log this time to
+           what was already written. */
+        nd2info_log(info, "\n");
+
+        /* Without a journal, when another process writes to the same
+         * folder, the files are written as usual but can't be
+         * resumed */
+        info->journal = journal_open(info->outfolder, conf->resume);
+        if(info->journal == NULL)
+        {
+            printf("Warning: Another process is writing to %s, "
+                   "continuing without a journal%s\n", info->outfolder,
+                   conf->resume ? ", nothing is resumed" : "");
+            nd2info_log(info, "Another process has the journal, "
+                        "continuing without one\n");
+        }
+        nd2info_hash_start(info);
+    }
+
+    int P = info->meta_att->channels[0]->P;
+    int nchan = info->meta_att->nchannels;
+
+    if(conf->focus && conf->dry == 0)
+    {
+        size_t nfocus = (size_t) info->nFOV*nchan*P;
+        info->focus = ckcalloc(nfocus, sizeof(double));
+        for(size_t kk = 0; kk < nfocus; kk++)
+        {
+            info->focus[kk] = NAN;
         }
-        /* A newline will separate what is written to the log this time to
-           what was already written. */
-        nd2info_log(info, "\n");
     }
 
-    if(conf->composite)
+    if(conf->format == FORMAT_ZARR)
+    {
+        slen = 2*strlen(info->outfolder) + 32;
+        info->zarrstore = ckcalloc(slen, 1);
+        snprintf(info->zarrstore, slen, "%s/%s.ome.zarr",
+                 info->outfolder, info->outfolder);
+        if(conf->dry == 0 && zarr_write_root(info->zarrstore) != EXIT_SUCCESS)
+        {
+            fprintf(stderr, "Failed to create %s\n", info->zarrstore);
+            nd2info_hash_finish(info);
+            journal_close(info->journal, 0);
+            info->journal = NULL;
+            return EXIT_FAILURE;
+        }
+        ttags * tags = nd2_new_ttags(info, P);
+        nd2_convert_fovs(conf, info, nd2, tags, nd2_to_zarr);
+        ttags_free(&tags);
+    } else if(conf->format == FORMAT_OMETIFF)
+    {
+        int nslices = P;
+        if(conf->use_range)
+        {
+            nslices = conf->range_to - conf->range_from + 1;
+        }
+        ttags * tags = nd2_new_ttags(info, nslices);
+        ttags_set_pyramid(tags, 256);
+        char ** names = ckcalloc(nchan, sizeof(char *));
+        uint32_t * colors = ckcalloc(nchan, sizeof(uint32_t));
+        double * lambda = ckcalloc(nchan, sizeof(double));
+        for(int cc = 0; cc < nchan; cc++)
+        {
+            names[cc] = info->meta_att->channels[cc]->name;
+            colors[cc] = nd2_channel_color(info->meta_att->channels[cc]);
+            lambda[cc] = info->meta_att->channels[cc]->emissionLambdaNm;
+        }
+        ttags_set_ome(tags, nchan, names, colors, lambda);
+        free(lambda);
+        free(colors);
+        free(names);
+        nd2_convert_fovs(conf, info, nd2, tags, nd2_to_ometiff);
+        ttags_free(&tags);
+    } else if(conf->format == FORMAT_NPY)
     {
-        nd2_to_tiff_composite(nd2, conf, info);
+        ttags * tags = nd2_new_ttags(info, P);
+        nd2_convert_fovs(conf, info, nd2, tags, nd2_to_npy);
+        ttags_free(&tags);
+    } else if(conf->composite)
+    {
+        ttags * tags = nd2_new_ttags(info, P);
+        ttags_set_composite(tags, nchan);
+        // TODO: Set the extra tags needed for composite images.
+        nd2_convert_fovs(conf, info, nd2, tags, nd2_to_tiff_composite);
+        ttags_free(&tags);
     } else {
         if(conf->save_individual_planes)
         {
-            nd2_to_tiff_splitC_splitZ(nd2, conf, info);
+            ttags * tags = nd2_new_ttags(info, 1);
+            nd2_convert_fovs(conf, info, nd2, tags, nd2_to_tiff_splitC_splitZ);
+            ttags_free(&tags);
         } else {
-            nd2_to_tiff_splitC(nd2, conf, info);
+            /* Only the selected slices go to the files */
+            int nslices = P;
+            if(conf->use_range)
+            {
+                nslices = conf->range_to - conf->range_from + 1;
+            }
+            ttags * tags = nd2_new_ttags(info, nslices);
+            nd2_convert_fovs(conf, info, nd2, tags, nd2_to_tiff_splitC);
+            ttags_free(&tags);
         }
     }
 
-    Lim_FileClose(nd2);
-    return EXIT_SUCCESS;
+    nd2info_log_reads(conf, info);
+    int status = EXIT_SUCCESS;
+    if(nd2info_write_focus(info) != EXIT_SUCCESS)
+    {
+        status = EXIT_FAILURE;
+    }
+    nd2info_hash_finish(info);
+    /* Kept for --resume unless everything went well */
+    int nremoved = journal_close(info->journal, status == EXIT_SUCCESS);
+    info->journal = NULL;
+    if(nremoved > 0)
+    {
+        nd2info_log(info, "Removed %d temporary files from an earlier run\n",
+                    nremoved);
+    }
+    return status;
 }
 
+/** @brief Parse the metadata of frame seq into mf */
 static void
-parse_stagePosition(const char * frameMeta, int nchannels, double * pos)
+parse_frame_meta(const char * frameMeta, int nchannels,
+                 meta_frame_t * mf, i64 seq)
 {
-
-    cJSON *json = cJSON_Parse(frameMeta);
-    if (json == NULL)
+    /* Called for every frame, so the values are picked from the text
+     * without building a cJSON tree */
+    const char * j_channels = json_path(frameMeta, "channels");
+    int nchannels_validation = json_array_size(j_channels);
+    if(nchannels_validation < 0)
     {
         fprintf(stderr, "Error parsing stagePosition\n");
-        const char *error_ptr = cJSON_GetErrorPtr();
-        if (error_ptr != NULL)
-        {
-            fprintf(stderr, "Error before: %s\n", error_ptr);
-        }
         exit(EXIT_FAILURE);
     }
-    const cJSON * j_channels = cJSON_GetObjectItemCaseSensitive(json,
-                                                                "channels");
-    /* TODO: Validate that this agrees with the information about the
-       number of channels that we got from somewhere else  */
-    int nchannels_validation = cJSON_GetArraySize(j_channels);
 
     if(nchannels != nchannels_validation)
     {
@@ -1500,35 +3601,36 @@ parse_stagePosition(const char * frameMeta, int nchannels, double * pos)
         exit(EXIT_FAILURE);
     }
 
-    for(int cc = 0; cc<nchannels; cc++)
+    int cc = 0;
+    for(const char * j_chan = json_first(j_channels);
+        j_chan != NULL; j_chan = json_next(j_chan))
     {
-        const cJSON * j_chan = cJSON_GetArrayItem(j_channels, cc);
-        assert(j_channels != NULL);
-        const cJSON * j_position = cJSON_GetObjectItemCaseSensitive(j_chan,
-                                                                    "position");
-        assert(j_position != NULL);
-        const cJSON * j_stagePositionUm = cJSON_GetObjectItemCaseSensitive(j_position,
-                                                                           "stagePositionUm");
-        assert(j_stagePositionUm != NULL);
-
-        const cJSON * j_x = cJSON_GetArrayItem(j_stagePositionUm, 0);
-        assert(j_x != NULL);
-        assert(cJSON_IsNumber(j_x));
-
-        const cJSON * j_y = cJSON_GetArrayItem(j_stagePositionUm, 1);
-        assert(j_y != NULL);
-        assert(cJSON_IsNumber(j_y));
-
-        const cJSON * j_z = cJSON_GetArrayItem(j_stagePositionUm, 2);
-        assert(j_z != NULL);
-        assert(cJSON_IsNumber(j_z));
-        pos[3*cc] = j_x->valuedouble;
-        pos[3*cc+1] = j_y->valuedouble;
-        pos[3*cc+2] = j_z->valuedouble;
-
-        //printf("%f, %f ,%f,\n", j_x->valuedouble, j_y->valuedouble, j_z->valuedouble);
+        i64 idx = seq*nchannels + cc;
+        if(json_path_doubles(j_chan, "position.stagePositionUm",
+                             mf->stagePositionUm + 3*idx, 3) != 0)
+        {
+            fprintf(stderr, "Error parsing stagePosition of channel %d\n", cc);
+            exit(EXIT_FAILURE);
+        }
+        /* Optional */
+        const char * j_time = json_path(j_chan, "time");
+        if(json_path_double(j_time, "relativeTimeMs",
+                            mf->relativeTimeMs + idx) != 0)
+        {
+            mf->relativeTimeMs[idx] = NAN;
+        }
+        if(json_path_double(j_time, "absoluteJulianDayNumber",
+                            mf->absoluteJulianDayNumber + idx) != 0)
+        {
+            mf->absoluteJulianDayNumber[idx] = NAN;
+        }
+        if(json_path_double(j_chan, "position.pfsOffset",
+                            mf->pfsOffset + idx) != 0)
+        {
+            mf->pfsOffset[idx] = NAN;
+        }
+        cc++;
     }
-    cJSON_Delete(json);
     return;
 }
 
@@ -1624,6 +3726,8 @@ static void print_version(FILE * fid)
 #endif
     fprintf(fid, "\n");
     fprintf(fid, "TIFF: '%s'\n", TIFFGetVersion());
+    fprintf(fid, "De-interleave: %s\n",
+            deinterleave_isa_name(deinterleave_isa()));
     return;
 }
 
@@ -1660,13 +3764,64 @@ static void show_help(char * name)
     printf("  -h, --help\n\t Show this message and quit\n");
     printf("  -o, --overwrite\n\t Overwrite existing tif files. Default: %d.\n",
            conf->overwrite);
-    printf("  -c, --coord\n\t Show coordinates in csv format for all z-planes\n");
+    printf("  -c, --coord\n\t Show coordinates in csv format for all z-planes\n\t"
+           "selected by --fov and --slice\n");
     printf("  -s, --shake\n\t Enable experimental shake detection\n");
+    printf("  --frame-table\n\t Write the stage positions and time stamps of\n\t"
+           " all frames to file.nd2.frames, one binary array per field\n");
     printf("  --fov '[a, b]'\n\t Only extract Field Of View in range [a, b]\n");
     printf("  --slice '[a, b]'\n\t"
            "Where range is a json array, for example [2, 10]\n\t"
            "Only extract slices in the 1-indexed range [a, b]\n");
     printf("  -C, --composite\n\t Don't split by channel\n");
+    printf("  -T, --threads n\n\t"
+           "Convert up to n FOVs in parallel and read the frame metadata\n\t"
+           "with n threads. 0 = one per core. Default: %d.\n",
+           conf->nthreads);
+    printf("  --queue-depth n\n\t"
+           "Read up to n planes ahead of the writing, per thread.\n\t"
+           "0 reads and writes on the same thread. Default: %d.\n",
+           conf->queue_depth);
+    printf("  -j, --jobs n\n\t"
+           "Convert up to n files at the same time, sharing the threads\n\t"
+           "from --threads. Default: %d.\n",
+           conf->njobs);
+    printf("  --compress method\n\t"
+           "Compress the tif files with none, lzw, deflate%s.\n\t"
+           "Default: none\n",
+           tiff_compress_from_name("zstd") ? " or zstd" : "");
+    printf("  --reader r\n\t"
+           "Read the image planes with the SDK (sdk), by mapping the file\n\t"
+           "with the built-in reader (native) or with both, failing if\n\t"
+           "they differ (check). Default: sdk\n");
+    printf("  --backend b\n\t"
+           "Read the files with the Nikon SDK (sdk) or, for testing and\n\t"
+           "benchmarks, synthesize the data described by each file (mock).\n\t"
+           "See nd2_mock.h. Default: sdk\n");
+    printf("  --libtiff\n\t"
+           "Write the tif files with libtiff instead of the built-in writer\n");
+    printf("  --profile\n\t"
+           "Show the time spent reading, de-interleaving, writing,\n\t"
+           "finishing and renaming, per stage and per thread\n");
+    printf("  --trace file\n\t"
+           "Write a Chrome trace of the stages to file, see\n\t"
+           "https://ui.perfetto.dev\n");
+    printf("  --resume\n\t"
+           "Continue the tif files of an interrupted conversion from the\n\t"
+           "planes that were written, see nd2tool.journal in the output\n\t"
+           "folder. Without it they are started over.\n");
+    printf("  --verify\n\t"
+           "Check the hashes in nd2tool.manifest of the output folder:\n\t"
+           "of the nd2 file and of the pixel data of the tif and npy\n\t"
+           "files. Nothing is converted\n");
+    printf("  --focus\n\t"
+           "Measure how in focus each plane is while it is written and\n\t"
+           "write the values, and the best slice per FOV and channel, to\n\t"
+           "nd2tool.focus.csv in the output folder\n");
+    printf("  --format fmt\n\t"
+           "Write tif files (tif), one pyramidal OME-TIFF per FOV (ometiff),\n\t"
+           "one OME-Zarr store per nd2 file (zarr) or one NumPy .npy file\n\t"
+           "per FOV and channel (npy). Default: tif\n");
     printf("  --deconwolf\n\t"
            "for each file, generate a script to run deconwolf\n");
     printf("  --deconwolfx\n\t"
@@ -1675,6 +3830,9 @@ static void show_help(char * name)
            "write a script for dot detection with `dw dots`\n");
     printf("  --dry\n\t"
            "Perform a dry run, i.e. do not write files or create folders\n");
+    printf("  --no-cache\n\t"
+           "Parse the metadata from the nd2 file, ignoring and not updating\n\t"
+           "the cache in $XDG_CACHE_HOME/nd2tool\n");
     printf("  --SpaceTx\n\t"
            "Save one image per z-plane according to the SpaceTx convention.\n\t"
            "<image_type>-f<fov_id>-r<round_label>-c<ch_label>-z<zplane_label>\n\t"
@@ -1703,6 +3861,12 @@ static ntconf_t * ntconf_new(void)
     conf->convert = 1;
     conf->showinfo = 1;
     conf->purpose = CONVERT_TO_TIF;
+    conf->nthreads = 1;
+    conf->queue_depth = 2;
+    conf->njobs = 1;
+    conf->compression = COMPRESSION_NONE;
+    conf->cache = 1;
+    conf->backend = &nd2_backend_sdk;
     return conf;
 }
 
@@ -1712,10 +3876,342 @@ static void ntconf_free(ntconf_t * conf)
     if(conf != NULL)
     {
         free(conf->dwargs);
+        free(conf->trace);
     }
     free(conf);
 }
 
+/** @brief Convert a mock file and check that each plane is read once
+ *
+ * For each way to convert, all selected sequence indices have to be
+ * read exactly once and the others not at all, with one and with
+ * several threads.
+ */
+static void nd2_to_tiff_ut(void)
+{
+    printf("-> testing nd2_to_tiff reads\n");
+    char dir[] = "/tmp/nd2tool_ut_XXXXXX";
+    char * cwd = getcwd(NULL, 0);
+    if(mkdtemp(dir) == NULL || cwd == NULL || chdir(dir) != 0)
+    {
+        fprintf(stderr, "nd2_to_tiff_ut: Unable to create %s\n", dir);
+        exit(EXIT_FAILURE);
+    }
+
+    nd2_mock_spec_t spec = {3, 2, 5, 64, 48, 0};
+    const char * file = "mock.nd2";
+    if(nd2_mock_write_spec(file, &spec) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "nd2_to_tiff_ut: Unable to write %s/%s\n", dir, file);
+        exit(EXIT_FAILURE);
+    }
+    i64 nseq = (i64) spec.fov*spec.planes;
+    uint32_t * reads = ckcalloc(nseq, sizeof(uint32_t));
+
+    /* The slices [p0, p1) and the FOVs [f0, f1) that are read */
+    typedef struct {
+        const char * name;
+        int composite;
+        int spacetx;
+        int range_from, range_to;
+        int fov_from, fov_to;
+        i64 p0, p1, f0, f1;
+    } read_case_t;
+    const read_case_t cases[] = {
+        {"splitC",            0, 0, 0, 0, 0, 0, 0, 5, 0, 3},
+        {"composite",         1, 0, 0, 0, 0, 0, 0, 5, 0, 3},
+        {"SpaceTx",           0, 1, 0, 0, 0, 0, 0, 5, 0, 3},
+        {"--slice [2, 4]",    0, 0, 2, 4, 0, 0, 1, 4, 0, 3},
+        {"--fov [2, 3]",      0, 0, 0, 0, 2, 3, 0, 5, 1, 3},
+        {"composite --fov 2", 1, 0, 0, 0, 2, 2, 0, 5, 1, 2},
+    };
+    const int ncases = sizeof(cases)/sizeof(cases[0]);
+
+    for(int kk = 0; kk < 2*ncases; kk++)
+    {
+        const read_case_t * c = cases + kk/2;
+        int nthreads = kk % 2 == 0 ? 1 : 3;
+
+        ntconf_t * conf = ntconf_new();
+        conf->backend = &nd2_backend_mock;
+        conf->verbose = 0;
+        conf->cache = 0;
+        conf->nthreads = nthreads;
+        conf->composite = c->composite;
+        conf->save_individual_planes = c->spacetx;
+        if(c->range_from > 0)
+        {
+            conf->use_range = 1;
+            conf->range_from = c->range_from;
+            conf->range_to = c->range_to;
+        }
+        if(c->fov_from > 0)
+        {
+            conf->use_fov_range = 1;
+            conf->fov_range_from = c->fov_from;
+            conf->fov_range_to = c->fov_to;
+        }
+
+        memset(reads, 0, nseq*sizeof(uint32_t));
+        nd2_mock_count_reads(reads);
+        /* The file names are printed also with verbose = 0 */
+        fflush(stdout);
+        int out = dup(STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        if(out < 0 || null < 0 || dup2(null, STDOUT_FILENO) < 0)
+        {
+            fprintf(stderr, "nd2_to_tiff_ut: Unable to redirect stdout\n");
+            exit(EXIT_FAILURE);
+        }
+        close(null);
+        nd2info_t * info = nd2info(conf, file);
+        int status = EXIT_FAILURE;
+        if(info->error == NULL)
+        {
+            status = nd2_to_tiff(conf, info);
+        }
+        fflush(stdout);
+        dup2(out, STDOUT_FILENO);
+        close(out);
+        nd2_mock_count_reads(NULL);
+
+        for(i64 seq = 0; seq < nseq; seq++)
+        {
+            i64 ff = seq / spec.planes;
+            i64 pp = seq % spec.planes;
+            uint32_t expected = ff >= c->f0 && ff < c->f1
+                && pp >= c->p0 && pp < c->p1;
+            if(status != EXIT_SUCCESS || reads[seq] != expected)
+            {
+                fprintf(stderr, "nd2_to_tiff_ut failed for %s with %d threads\n",
+                        c->name, nthreads);
+                fprintf(stderr, "status=%d, plane %" PRId64 " read %u times, "
+                        "expected %u\n", status, seq, reads[seq], expected);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if(info->outfolder != NULL && remove_tree(info->outfolder) != EXIT_SUCCESS)
+        {
+            fprintf(stderr, "nd2_to_tiff_ut: Unable to remove %s/%s\n",
+                    dir, info->outfolder);
+            exit(EXIT_FAILURE);
+        }
+        nd2info_free(info);
+        ntconf_free(conf);
+        if(kk % 2 == 1)
+        {
+            printf("ok: nd2_to_tiff reads, %s\n", c->name);
+        }
+    }
+    free(reads);
+
+    if(unlink(file) != 0 || chdir(cwd) != 0 || rmdir(dir) != 0)
+    {
+        fprintf(stderr, "nd2_to_tiff_ut: Unable to remove %s\n", dir);
+        exit(EXIT_FAILURE);
+    }
+    free(cwd);
+}
+
+/** @brief Convert file with one thread for nd2_to_tiff_resume_ut
+ *
+ * stdout goes to /dev/null. When hash is not NULL, the page hashes of
+ * the file of each channel, first FOV, are written there. Returns the
+ * status of nd2_to_tiff.
+ */
+static int nd2_to_tiff_resume_run(const char * file, int resume,
+                                  uint64_t * hash)
+{
+    ntconf_t * conf = ntconf_new();
+    conf->backend = &nd2_backend_mock;
+    conf->verbose = 0;
+    conf->cache = 0;
+    conf->nthreads = 1;
+    conf->resume = resume;
+
+    fflush(stdout);
+    int out = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if(out < 0 || null < 0 || dup2(null, STDOUT_FILENO) < 0)
+    {
+        fprintf(stderr, "nd2_to_tiff_resume_ut: Unable to redirect stdout\n");
+        exit(EXIT_FAILURE);
+    }
+    close(null);
+    nd2info_t * info = nd2info(conf, file);
+    int status = EXIT_FAILURE;
+    if(info->error == NULL)
+    {
+        status = nd2_to_tiff(conf, info);
+    }
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+
+    for(int cc = 0; status == EXIT_SUCCESS && hash != NULL
+            && cc < info->meta_att->nchannels; cc++)
+    {
+        char name[1024];
+        snprintf(name, sizeof(name), "%s/%s_001.tif", info->outfolder,
+                 info->meta_att->channels[cc]->name);
+        if(tiff_hash_pages(name, hash + cc) != 0)
+        {
+            fprintf(stderr, "nd2_to_tiff_resume_ut: Unable to read %s\n", name);
+            status = EXIT_FAILURE;
+        }
+    }
+    nd2info_free(info);
+    ntconf_free(conf);
+    return status;
+}
+
+/** @brief Interrupt a conversion and continue it with --resume
+ *
+ * A slow mock file is converted by a child process that is killed
+ * once the journal has pages. The resumed run must not read those
+ * planes again and has to give the same pixel data as a run that was
+ * not interrupted. Both with one channel and with two.
+ */
+static void nd2_to_tiff_resume_ut(void)
+{
+    printf("-> testing nd2_to_tiff --resume\n");
+    char dir[] = "/tmp/nd2tool_ut_XXXXXX";
+    char * cwd = getcwd(NULL, 0);
+    if(mkdtemp(dir) == NULL || cwd == NULL || chdir(dir) != 0)
+    {
+        fprintf(stderr, "nd2_to_tiff_resume_ut: Unable to create %s\n", dir);
+        exit(EXIT_FAILURE);
+    }
+
+    const char * file = "mock.nd2";
+    const char * outfolder = "mock";
+    const char * journal = "mock/nd2tool.journal";
+
+    for(int nchan = 1; nchan <= 2; nchan++)
+    {
+        /* Fast for the reference and the resumed run. About 50 ms per
+         * plane for the run that is interrupted */
+        nd2_mock_spec_t spec = {1, nchan, 40, 64, 48, 0};
+        i64 P = spec.planes;
+        uint64_t ref[2] = {0, 0};
+        uint64_t hash[2] = {0, 0};
+        if(nd2_mock_write_spec(file, &spec) != EXIT_SUCCESS
+           || nd2_to_tiff_resume_run(file, 0, ref) != EXIT_SUCCESS
+           || remove_tree(outfolder) != EXIT_SUCCESS)
+        {
+            fprintf(stderr, "nd2_to_tiff_resume_ut: Reference run failed, "
+                    "%d channels\n", nchan);
+            exit(EXIT_FAILURE);
+        }
+
+        spec.mbps = 0.12*nchan;
+        if(nd2_mock_write_spec(file, &spec) != EXIT_SUCCESS)
+        {
+            fprintf(stderr, "nd2_to_tiff_resume_ut: Unable to write %s\n", file);
+            exit(EXIT_FAILURE);
+        }
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if(pid == -1)
+        {
+            fprintf(stderr, "nd2_to_tiff_resume_ut: Failed to fork\n");
+            exit(EXIT_FAILURE);
+        }
+        if(pid == 0)
+        {
+            _exit(nd2_to_tiff_resume_run(file, 1, NULL));
+        }
+
+        /* Wait for the first page records */
+        int paged = 0;
+        int exited = 0;
+        for(int kk = 0; kk < 2000 && !paged && !exited; kk++)
+        {
+            usleep(10000);
+            FILE * fid = fopen(journal, "r");
+            if(fid != NULL)
+            {
+                char line[1024];
+                while(fgets(line, sizeof(line), fid) != NULL)
+                {
+                    if(strncmp(line, "page\t", 5) == 0)
+                    {
+                        paged = 1;
+                    }
+                }
+                fclose(fid);
+            }
+            exited = waitpid(pid, NULL, WNOHANG) == pid;
+        }
+        if(!exited)
+        {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+        }
+        if(!paged || exited)
+        {
+            fprintf(stderr, "nd2_to_tiff_resume_ut: The conversion was not "
+                    "interrupted with pages in the journal, %d channels\n",
+                    nchan);
+            exit(EXIT_FAILURE);
+        }
+
+        spec.mbps = 0;
+        uint32_t * reads = ckcalloc(P, sizeof(uint32_t));
+        int status = nd2_mock_write_spec(file, &spec);
+        if(status == EXIT_SUCCESS)
+        {
+            nd2_mock_count_reads(reads);
+            status = nd2_to_tiff_resume_run(file, 1, hash);
+            nd2_mock_count_reads(NULL);
+        }
+        /* At least the first sync, JOURNAL_SYNC_PAGES pages over all
+         * channels, is kept */
+        i64 nkept = 0;
+        for(i64 kk = 0; kk < P; kk++)
+        {
+            if(reads[kk] > 1)
+            {
+                status = EXIT_FAILURE;
+            }
+            nkept += reads[kk] == 0;
+        }
+        free(reads);
+        if(status != EXIT_SUCCESS || nkept < JOURNAL_SYNC_PAGES/nchan
+           || access(journal, F_OK) == 0)
+        {
+            fprintf(stderr, "nd2_to_tiff_resume_ut: Resume failed, %d channels, "
+                    "status=%d, %" PRId64 " planes kept\n", nchan, status, nkept);
+            exit(EXIT_FAILURE);
+        }
+        for(int cc = 0; cc < nchan; cc++)
+        {
+            if(hash[cc] != ref[cc])
+            {
+                fprintf(stderr, "nd2_to_tiff_resume_ut: Channel %d differs "
+                        "from the reference, %d channels\n", cc, nchan);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if(remove_tree(outfolder) != EXIT_SUCCESS)
+        {
+            fprintf(stderr, "nd2_to_tiff_resume_ut: Unable to remove %s/%s\n",
+                    dir, outfolder);
+            exit(EXIT_FAILURE);
+        }
+        printf("ok: nd2_to_tiff --resume, %d channels, %" PRId64
+               " of %" PRId64 " planes kept\n", nchan, nkept, P);
+    }
+
+    if(unlink(file) != 0 || chdir(cwd) != 0 || rmdir(dir) != 0)
+    {
+        fprintf(stderr, "nd2_to_tiff_resume_ut: Unable to remove %s\n", dir);
+        exit(EXIT_FAILURE);
+    }
+    free(cwd);
+}
+
 static int parse_json_range(const char * str, int * a, int *b)
 {
     /* Parse a json formatted range from the string, for example
@@ -1762,6 +4258,8 @@ static int argparse(ntconf_t * conf, int argc, char ** argv)
         { "coord",      no_argument, NULL, 'c'},
         { "composite",  no_argument, NULL, 'C'},
         { "dry",        no_argument, NULL, 'd'},
+        { "no-cache",   no_argument, NULL, 'N'},
+        { "frame-table", no_argument, NULL, 'm'},
         { "deconwolf",  no_argument, NULL, 'D'},
         { "deconwolfx", no_argument, NULL, 'E'},
         { "deconwolf_dots", no_argument, NULL, 'G'},
@@ -1772,6 +4270,19 @@ static int argparse(ntconf_t * conf, int argc, char ** argv)
         { "shake",      no_argument, NULL, 's'},
         { "SpaceTx",    no_argument, NULL, 'S'},
         { "test",       no_argument, NULL, 't'},
+        { "threads",    required_argument, NULL, 'T'},
+        { "queue-depth", required_argument, NULL, 'Q'},
+        { "jobs",       required_argument, NULL, 'j'},
+        { "libtiff",    no_argument, NULL, 'L'},
+        { "reader",     required_argument, NULL, 'R'},
+        { "backend",    required_argument, NULL, 'B'},
+        { "profile",    no_argument, NULL, 'P'},
+        { "trace",      required_argument, NULL, 'X'},
+        { "resume",     no_argument, NULL, 'U'},
+        { "verify",     no_argument, NULL, 'K'},
+        { "focus",      no_argument, NULL, 'A'},
+        { "compress",   required_argument, NULL, 'z'},
+        { "format",     required_argument, NULL, 'f'},
         { "verbose",    required_argument, NULL, 'v'},
         { "version",    no_argument, NULL, 'V'},
         { "fov",        required_argument, NULL, 'F'},
@@ -1785,7 +4296,7 @@ static int argparse(ntconf_t * conf, int argc, char ** argv)
     };
     int ch;
 
-    while((ch = getopt_long(argc, argv, "123456CDEFGSVcdhior:sv:t",
+    while((ch = getopt_long(argc, argv, "123456AB:CDEFGKLNPQ:R:ST:UVX:cdf:hij:mor:sv:tz:",
                             longopts, NULL)) != -1)
     {
         switch(ch) {
@@ -1881,8 +4392,122 @@ static int argparse(ntconf_t * conf, int argc, char ** argv)
         case 'S':
             conf->save_individual_planes = 1;
             break;
+        case 'L':
+            conf->libtiff = 1;
+            break;
+        case 'N':
+            conf->cache = 0;
+            break;
+        case 'm':
+            conf->frame_table = 1;
+            break;
+        case 'z':
+            conf->compression = tiff_compress_from_name(optarg);
+            if(conf->compression == 0)
+            {
+                printf("Unknown or unsupported --compress method: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'f':
+            if(strcmp(optarg, "tif") == 0)
+            {
+                conf->format = FORMAT_TIF;
+            } else if(strcmp(optarg, "zarr") == 0)
+            {
+                conf->format = FORMAT_ZARR;
+            } else if(strcmp(optarg, "ometiff") == 0)
+            {
+                conf->format = FORMAT_OMETIFF;
+            } else if(strcmp(optarg, "npy") == 0)
+            {
+                conf->format = FORMAT_NPY;
+            } else {
+                printf("Unknown --format: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'R':
+            if(strcmp(optarg, "sdk") == 0)
+            {
+                conf->reader = READER_SDK;
+            } else if(strcmp(optarg, "native") == 0)
+            {
+                conf->reader = READER_NATIVE;
+            } else if(strcmp(optarg, "check") == 0)
+            {
+                conf->reader = READER_CHECK;
+            } else {
+                printf("Unknown --reader: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'B':
+            conf->backend = nd2_backend_from_name(optarg);
+            if(conf->backend == NULL)
+            {
+                printf("Unknown --backend: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'P':
+            conf->profile = 1;
+            break;
+        case 'X':
+            free(conf->trace);
+            conf->trace = strdup(optarg);
+            break;
+        case 'U':
+            conf->resume = 1;
+            break;
+        case 'K':
+            conf->verify = 1;
+            break;
+        case 'A':
+            conf->focus = 1;
+            break;
+        case 'Q':
+            conf->queue_depth = atoi(optarg);
+            if(conf->queue_depth < 0)
+            {
+                printf("--queue-depth can't be negative\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'j':
+            conf->njobs = atoi(optarg);
+            if(conf->njobs < 1)
+            {
+                printf("--jobs has to be at least 1\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            conf->nthreads = atoi(optarg);
+            if(conf->nthreads < 0)
+            {
+                printf("--threads can't be negative\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
         case 't':
             nd2tool_util_ut();
+            deinterleave_ut();
+            focus_ut();
+            tiff_util_ut();
+            tiff_compress_ut();
+            zarr_util_ut();
+            npy_util_ut();
+            cache_util_ut();
+            coltab_util_ut();
+            json_util_ut();
+            nd2_reader_ut();
+            nd2_mock_ut();
+            nd2_to_tiff_ut();
+            nd2_to_tiff_resume_ut();
+            prof_ut();
+            journal_util_ut();
+            hash_util_ut();
             exit(EXIT_SUCCESS);
             break;
         case 'v':
@@ -1899,35 +4524,55 @@ static int argparse(ntconf_t * conf, int argc, char ** argv)
         }
     }
     conf->optind = optind;
+
+    if(conf->format != FORMAT_TIF)
+    {
+        if(conf->composite || conf->save_individual_planes)
+        {
+            printf("--composite and --SpaceTx only apply to --format tif\n");
+            exit(EXIT_FAILURE);
+        }
+        if(conf->libtiff)
+        {
+            printf("--libtiff only applies to --format tif\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if((conf->format == FORMAT_ZARR || conf->format == FORMAT_NPY)
+       && conf->compression != COMPRESSION_NONE)
+    {
+        printf("--compress can't be used with --format zarr or npy\n");
+        exit(EXIT_FAILURE);
+    }
     return EXIT_SUCCESS;
 }
 
 
-static void showmeta_file(char * file)
+static void showmeta_file(ntconf_t * conf, char * file)
 {
-    void * nd2 = Lim_FileOpenForReadUtf8(file);
+    void * nd2 = nd2_file_open(conf->backend, file);
     if(nd2 == NULL)
     {
         fprintf(stderr, "%s is not a valid nd2 file\n", file);
         exit(EXIT_FAILURE);
     }
-    char * fileMeta = Lim_FileGetMetadata(nd2);
+    char * fileMeta = nd2_file_metadata(nd2);
     printf("%s\n", fileMeta);
-    Lim_FileFreeString(fileMeta);
-    Lim_FileClose(nd2);
+    nd2_file_free_string(nd2, fileMeta);
+    nd2_file_close(nd2);
     return;
 }
 
 
-static void showmeta_coord(char * file)
+static void showmeta_coord(ntconf_t * conf, char * file)
 {
-    void * nd2 = Lim_FileOpenForReadUtf8(file);
+    void * nd2 = nd2_file_open(conf->backend, file);
     if(nd2 == NULL)
     {
         fprintf(stderr, "%s is not a valid nd2 file\n", file);
         exit(EXIT_FAILURE);
     }
-    int csize = Lim_FileGetCoordSize(nd2);
+    int csize = nd2_file_coord_size(nd2);
     if(csize == 0)
     {
         printf("%s contains only one frame (not an ND document).\n",
@@ -1939,53 +4584,53 @@ static void showmeta_coord(char * file)
 
     for(int kk = 0; kk<csize; kk++)
     {
-        int dsize = Lim_FileGetCoordInfo(nd2, kk, buffer, buffsize);
+        int dsize = nd2_file_coord_info(nd2, kk, buffer, buffsize);
         printf("%s (loop size: %d)\n", buffer, dsize);
     }
     free(buffer);
 
-    Lim_FileClose(nd2);
+    nd2_file_close(nd2);
     return;
 }
 
 
-static void showmeta_frame(char * file)
+static void showmeta_frame(ntconf_t * conf, char * file)
 {
-    void * nd2 = Lim_FileOpenForReadUtf8(file);
+    void * nd2 = nd2_file_open(conf->backend, file);
     if(nd2 == NULL)
     {
         fprintf(stderr, "%s is not a valid nd2 file\n", file);
         exit(EXIT_FAILURE);
     }
 
-    int seqCount = Lim_FileGetSeqCount(nd2);
+    int seqCount = nd2_file_seq_count(nd2);
 
     for(int kk = 0; kk<seqCount; kk++)
     {
-        char * info = Lim_FileGetFrameMetadata(nd2, kk);
+        char * info = nd2_file_frame_metadata(nd2, kk);
         printf("%s\n", info);
-        Lim_FileFreeString(info);
+        nd2_file_free_string(nd2, info);
     }
 
-    Lim_FileClose(nd2);
+    nd2_file_close(nd2);
     return;
 }
 
 
-static void showmeta_exp(char * file)
+static void showmeta_exp(ntconf_t * conf, char * file)
 {
-    void * nd2 = Lim_FileOpenForReadUtf8(file);
+    void * nd2 = nd2_file_open(conf->backend, file);
     if(nd2 == NULL)
     {
         fprintf(stderr, "%s is not a valid nd2 file\n", file);
         exit(EXIT_FAILURE);
     }
-    char * expinfo = Lim_FileGetExperiment(nd2);
+    char * expinfo = nd2_file_experiment(nd2);
 
     printf("%s\n", expinfo);
-    Lim_FileFreeString(expinfo);
+    nd2_file_free_string(nd2, expinfo);
 
-    Lim_FileClose(nd2);
+    nd2_file_close(nd2);
     return;
 }
 
@@ -1996,28 +4641,29 @@ static void showmeta_exp(char * file)
  * - optics
  * The elements are all text.
  */
-static void showmeta_text(char * file)
+static void showmeta_text(ntconf_t * conf, char * file)
 {
-    void * nd2 = Lim_FileOpenForReadUtf8(file);
+    void * nd2 = nd2_file_open(conf->backend, file);
     if(nd2 == NULL)
     {
         fprintf(stderr, "%s is not a valid nd2 file\n", file);
         exit(EXIT_FAILURE);
     }
-    char * textinfo = Lim_FileGetTextinfo(nd2);
+    char * textinfo = nd2_file_textinfo(nd2);
     filter_textinfo(textinfo); /* Output filled with '\r\n\' written out as text */
 
     printf("%s\n", textinfo);
-    Lim_FileFreeString(textinfo);
+    nd2_file_free_string(nd2, textinfo);
 
-    Lim_FileClose(nd2);
+    nd2_file_close(nd2);
     return;
 }
 
 
 /** @brief Shake detection in z */
-static void check_stage_position(nd2info_t * info, int fov, int channel)
+static void check_stage_position(nd2worker_t * w, int fov, int channel)
 {
+    nd2info_t * info = w->info;
     int nchannel = info->meta_att->nchannels;
     /* Assuming equal number of planes in all channels */
     int nplane = info->meta_att->channels[0]->P;
@@ -2026,13 +4672,16 @@ static void check_stage_position(nd2info_t * info, int fov, int channel)
     size_t offset = fov*stride*nplane + 3*channel;
     XYZ = XYZ + offset;
 
-    /* check dz */
+    /* check dz, only the planes selected by --slice were read */
+    i64 p0 = 0;
+    i64 p1 = 0;
+    nd2_slice_range(w->conf, nplane, &p0, &p1);
     double dz_min = 0;
     double dz_max = 0;
-    for(int zz = 1; zz < nplane; zz++)
+    for(i64 zz = p0+1; zz < p1; zz++)
     {
         double dz = XYZ[stride*zz + 2] - XYZ[stride*(zz-1) + 2];
-        if(zz == 1)
+        if(zz == p0+1)
         {
             dz_min = dz;
             dz_max = dz;
@@ -2043,10 +4692,10 @@ static void check_stage_position(nd2info_t * info, int fov, int channel)
 
     if( fabs(1000.0*(dz_max - dz_min)) > 1 )
     {
-        printf("WARNING: dz_nm [%.0f, %.0f] ", dz_min*1000, dz_max*1000);
+        nd2worker_printf(w, "WARNING: dz_nm [%.0f, %.0f] ", dz_min*1000, dz_max*1000);
     }
 
-    nd2info_log(info, "dz_nm [%.f, %.0f] ", dz_min*1000, dz_max*1000);
+    nd2worker_log(w, "dz_nm [%.f, %.0f] ", dz_min*1000, dz_max*1000);
     return;
 }
 
@@ -2055,23 +4704,23 @@ static void showmeta(ntconf_t * conf, char * file)
 {
     if(conf->meta_file)
     {
-        showmeta_file(file);
+        showmeta_file(conf, file);
     }
     if(conf->meta_coord)
     {
-        showmeta_coord(file);
+        showmeta_coord(conf, file);
     }
     if(conf->meta_frame)
     {
-        showmeta_frame(file);
+        showmeta_frame(conf, file);
     }
     if(conf->meta_text)
     {
-        showmeta_text(file);
+        showmeta_text(conf, file);
     }
     if(conf->meta_exp)
     {
-        showmeta_exp(file);
+        showmeta_exp(conf, file);
     }
     return;
 }
@@ -2111,32 +4760,150 @@ static void hello_log(__attribute__((unused)) ntconf_t * conf,
 static void nd2_show_coordinates(nd2info_t * info)
 {
     /* see check_stage_position */
+    const ntconf_t * conf = info->conf;
     int nchan = info->meta_att->nchannels;
     int nfov = info->nFOV;
     int nplane = info->meta_att->channels[0]->P;
     double * _XYZ = info->meta_frame->stagePositionUm;
     assert(_XYZ != NULL);
+    i64 p0 = 0;
+    i64 p1 = 0;
+    nd2_slice_range(conf, nplane, &p0, &p1);
 
     printf("FOV, Channel, Z, X_um, Y_um, Z_um\n");
     for(int fov = 0; fov < nfov; fov++)
     {
+        if(!nd2_fov_selected(conf, fov))
+        {
+            continue;
+        }
+        for(int cc = 0; cc < nchan; cc++)
+        {
+            for(int zz = p0; zz < p1; zz++)
+            {
+                size_t offset = fov*nchan*nplane*3; /* select fov */
+                offset += zz*3*nchan; /* select plane */
+                offset += cc*3; /* select channel */
+                double * XYZ = _XYZ + offset;
+                double x = XYZ[0];
+                double y = XYZ[1];
+                double z = XYZ[2];
+                printf("%d, %d, %d, %f, %f, %f\n",
+                       fov+1, cc+1, zz+1, x, y, z);
+            }
+        }
+    }
+    return;
+}
+
+
+/** @brief Write the frame metadata as one array per field
+ *
+ * One row per frame and channel for the frames selected by --fov and
+ * --slice, in the order of acquisition.
+ */
+static int nd2_write_frame_table(nd2info_t * info)
+{
+    const ntconf_t * conf = info->conf;
+    const meta_frame_t * mf = info->meta_frame;
+    int nchan = info->meta_att->nchannels;
+    i64 P = info->meta_att->channels[0]->P;
+    assert(mf->valid != NULL);
+
+    i64 p0 = 0;
+    i64 p1 = 0;
+    nd2_slice_range(conf, P, &p0, &p1);
+    i64 nrows = 0;
+    for(i64 seq = 0; seq < info->seqCount; seq++)
+    {
+        i64 zz = seq % P;
+        if(mf->valid[seq] && nd2_fov_selected(conf, seq / P)
+           && zz >= p0 && zz < p1)
+        {
+            nrows += nchan;
+        }
+    }
+
+    int32_t * fov = ckcalloc(nrows, sizeof(int32_t));
+    int32_t * plane = ckcalloc(nrows, sizeof(int32_t));
+    int32_t * channel = ckcalloc(nrows, sizeof(int32_t));
+    int32_t * frame = ckcalloc(nrows, sizeof(int32_t));
+    double * xyz[3];
+    for(int kk = 0; kk < 3; kk++)
+    {
+        xyz[kk] = ckcalloc(nrows, sizeof(double));
+    }
+    double * time_ms = ckcalloc(nrows, sizeof(double));
+    double * julian_day = ckcalloc(nrows, sizeof(double));
+    double * pfs_offset = ckcalloc(nrows, sizeof(double));
+
+    i64 row = 0;
+    for(i64 seq = 0; seq < info->seqCount; seq++)
+    {
+        i64 zz = seq % P;
+        if(!(mf->valid[seq] && nd2_fov_selected(conf, seq / P)
+             && zz >= p0 && zz < p1))
+        {
+            continue;
+        }
         for(int cc = 0; cc < nchan; cc++)
         {
-            for(int zz = 0; zz < nplane; zz++)
+            i64 idx = seq*nchan + cc;
+            /* 1-indexed like --coord */
+            fov[row] = seq / P + 1;
+            plane[row] = zz + 1;
+            channel[row] = cc + 1;
+            frame[row] = seq;
+            for(int kk = 0; kk < 3; kk++)
             {
-                size_t offset = fov*nchan*nplane*3; /* select fov */
-                offset += zz*3*nchan; /* select plane */
-                offset += cc*3; /* select channel */
-                double * XYZ = _XYZ + offset;
-                double x = XYZ[0];
-                double y = XYZ[1];
-                double z = XYZ[2];
-                printf("%d, %d, %d, %f, %f, %f\n",
-                       fov+1, cc+1, zz+1, x, y, z);
+                xyz[kk][row] = mf->stagePositionUm[3*idx + kk];
             }
+            time_ms[row] = mf->relativeTimeMs[idx];
+            julian_day[row] = mf->absoluteJulianDayNumber[idx];
+            pfs_offset[row] = mf->pfsOffset[idx];
+            row++;
         }
     }
-    return;
+
+    const coltab_col_t cols[] = {
+        {"fov", NULL, COLTAB_INT32, fov},
+        {"plane", NULL, COLTAB_INT32, plane},
+        {"channel", NULL, COLTAB_INT32, channel},
+        {"frame", NULL, COLTAB_INT32, frame},
+        {"x", "um", COLTAB_FLOAT64, xyz[0]},
+        {"y", "um", COLTAB_FLOAT64, xyz[1]},
+        {"z", "um", COLTAB_FLOAT64, xyz[2]},
+        {"relative_time", "ms", COLTAB_FLOAT64, time_ms},
+        {"absolute_julian_day", "d", COLTAB_FLOAT64, julian_day},
+        {"pfs_offset", NULL, COLTAB_FLOAT64, pfs_offset}};
+
+    int status = EXIT_SUCCESS;
+    char * fname = postfix_filename(info->filename, ".frames");
+    if(conf->dry)
+    {
+        printf("Not writing %s (--dry)\n", fname);
+    } else {
+        if(conf->verbose > 0)
+        {
+            printf("Writing %" PRId64 " rows to %s\n", nrows, fname);
+        }
+        status = coltab_write(fname, info->filename, nrows, cols,
+                              sizeof(cols)/sizeof(cols[0]));
+    }
+    free(fname);
+
+    free(fov);
+    free(plane);
+    free(channel);
+    free(frame);
+    for(int kk = 0; kk < 3; kk++)
+    {
+        free(xyz[kk]);
+    }
+    free(time_ms);
+    free(julian_day);
+    free(pfs_offset);
+    return status;
 }
 
 
@@ -2292,141 +5059,583 @@ nd2info_show_deconwolf_dots(const ntconf_t * conf,
 }
 
 
-/** @brief Command line interface to nd2tool */
-int nd2tool_cli(int argc, char ** argv)
+/** @brief Name of a --format */
+static const char *
+nt_format_name(nt_format format)
 {
-    check_cmd_line(argc, argv);
+    switch(format)
+    {
+    case FORMAT_TIF:
+        return "tif";
+    case FORMAT_ZARR:
+        return "zarr";
+    case FORMAT_OMETIFF:
+        return "ometiff";
+    case FORMAT_NPY:
+        return "npy";
+    }
+    return "unknown";
+}
 
-    ntconf_t * conf = ntconf_new();
-    if(argparse(conf, argc, argv) != EXIT_SUCCESS)
+/* Write s as a quoted JSON string */
+static void json_puts(FILE * fid, const char * s)
+{
+    fputc('"', fid);
+    for( ; *s != '\0'; s++)
     {
-        exit(EXIT_FAILURE);
+        unsigned char ch = (unsigned char) *s;
+        if(ch == '"' || ch == '\\')
+        {
+            fprintf(fid, "\\%c", ch);
+        } else if(ch < 0x20)
+        {
+            fprintf(fid, "\\u%04x", ch);
+        } else {
+            fputc(ch, fid);
+        }
     }
+    fputc('"', fid);
+}
 
-    /* Process each file */
+/** @brief Difference between two I/O counters, -1 if unknown */
+static i64
+io_delta(i64 before, i64 after)
+{
+    if(before < 0 || after < 0)
+    {
+        return -1;
+    }
+    return after - before;
+}
 
-    /* Show some metadata and exit */
-    if(conf->purpose == SHOW_METADATA)
+/** @brief Log the resources used for a file since ru0
+ *
+ * Wall and CPU time, peak RSS, bytes read according to
+ * /proc/self/io, bytes written and the write speed for the output
+ * format. Also appended as one line of JSON per conversion to
+ * nd2tool.log.jsonl next to the log file.
+ */
+static void
+nd2info_log_resources(ntconf_t * conf, nd2info_t * info,
+                      const resource_usage_t * ru0)
+{
+    if(conf->dry || info->log == NULL)
     {
-        for(int ff = optind; ff<argc; ff++)
+        return;
+    }
+    resource_usage_t ru;
+    get_resource_usage(&ru);
+    double wall_s = ru.wall_s - ru0->wall_s;
+    double user_s = ru.user_s - ru0->user_s;
+    double sys_s = ru.sys_s - ru0->sys_s;
+    i64 rchar = io_delta(ru0->rchar, ru.rchar);
+    i64 read_bytes = io_delta(ru0->read_bytes, ru.read_bytes);
+    i64 write_bytes = io_delta(ru0->write_bytes, ru.write_bytes);
+    double mbs = wall_s > 0 ? (double) info->bytes_written / wall_s / 1e6 : 0;
+    const char * format = nt_format_name(conf->format);
+    const char * compression = "none";
+    if(conf->format == FORMAT_TIF || conf->format == FORMAT_OMETIFF)
+    {
+        compression = tiff_compress_name(conf->compression);
+    }
+
+    nd2info_log(info, "RESOURCES: wall %.2f s, CPU %.2f s (user %.2f s, sys %.2f s), "
+                "peak RSS %zu kB\n",
+                wall_s, user_s + sys_s, user_s, sys_s, ru.peak_rss_kb);
+    if(rchar >= 0)
+    {
+        nd2info_log(info, "READ: %.1f MB from storage, %.1f MB in total\n",
+                    (double) read_bytes/1e6, (double) rchar/1e6);
+    }
+    nd2info_log(info, "WRITTEN: %.1f MB as %s (%s), %.1f MB/s\n",
+                (double) info->bytes_written/1e6, format, compression, mbs);
+
+    size_t slen = strlen(info->outfolder) + 32;
+    char * jsonfile = ckcalloc(slen, 1);
+    snprintf(jsonfile, slen, "%s/nd2tool.log.jsonl", info->outfolder);
+    FILE * fid = fopen(jsonfile, "a");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "Unable to write to %s\n", jsonfile);
+        free(jsonfile);
+        return;
+    }
+    char date[32] = "";
+    time_t now = time(NULL);
+    struct tm tm_now;
+    if(gmtime_r(&now, &tm_now) != NULL)
+    {
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", &tm_now);
+    }
+    fprintf(fid, "{\"file\": ");
+    json_puts(fid, info->filename);
+    fprintf(fid, ", \"date\": \"%s\", \"version\": \"%s\", "
+            "\"format\": \"%s\", \"compression\": \"%s\", \"threads\": %d, "
+            "\"wall_s\": %.3f, \"user_s\": %.3f, \"sys_s\": %.3f, "
+            "\"peak_rss_kb\": %zu, \"rchar\": %" PRId64 ", "
+            "\"read_bytes\": %" PRId64 ", \"write_bytes\": %" PRId64 ", "
+            "\"bytes_written\": %" PRId64 ", \"mb_per_s\": %.1f}\n",
+            date, nd2tool_version, format, compression, conf->nthreads,
+            wall_s, user_s, sys_s, ru.peak_rss_kb, rchar, read_bytes,
+            write_bytes, info->bytes_written, mbs);
+    if(fclose(fid) != 0)
+    {
+        fprintf(stderr, "Unable to write to %s\n", jsonfile);
+    }
+    free(jsonfile);
+    return;
+}
+
+/* Outcome of processing one file, see nd2tool_batch */
+typedef struct
+{
+    int status;
+    double wall_s;
+    i64 bytes_written;
+    size_t peak_kb;
+} nd2result_t;
+
+/** @brief Process one input file according to conf
+ *
+ * Returns EXIT_SUCCESS or EXIT_FAILURE, res->bytes_written is set to
+ * the size of the files that were created.
+ */
+static int
+nd2tool_file(ntconf_t * conf, char * file, int argc, char ** argv,
+             nd2result_t * res)
+{
+    int status = EXIT_SUCCESS;
+    resource_usage_t ru0;
+    get_resource_usage(&ru0);
+    /* Parse information */
+    nd2info_t * info = nd2info(conf, file);
+
+    if(info->error != NULL)
+    {
+        fprintf(stderr, "%s", info->error);
+        status = EXIT_FAILURE;
+        goto cleanup_file;
+    }
+
+    if(conf->deconwolf)
+    {
+        char * script_name0 = prefix_filename(info->filename, "deconwolf_");
+        char * script_name = postfix_filename(script_name0, ".sh");
+        free(script_name0);
+
+        FILE * fid_dw_script = fopen(script_name, "w");
+        if(fid_dw_script == NULL)
         {
-            showmeta(conf, argv[ff]);
+            fprintf(stderr, "Unable to open %s for writing\n", script_name);
+            free(script_name);
+            exit(EXIT_FAILURE);
         }
-        goto done;
+        if(conf->verbose > 0)
+        {
+            fprintf(stdout, "Writing to %s\n", script_name);
+        }
+        nd2info_show_deconwolf(conf, info, fid_dw_script);
+        fclose(fid_dw_script);
+        make_file_executable(script_name);
+
+        free(script_name);
+        goto cleanup_file;
     }
 
-    /* Convert to tif */
-    int nfiles = argc-optind;
-    if(nfiles == 0)
+    if(conf->deconwolf_dots)
     {
-        printf("error: No file(s) given\n");
-        exit(EXIT_FAILURE);
+        char * script_name0 = prefix_filename(info->filename, "deconwolf_dots_");
+        char * script_name = postfix_filename(script_name0, ".sh");
+        free(script_name0);
+
+        FILE * fid_dw_script = fopen(script_name, "w");
+        if(fid_dw_script == NULL)
+        {
+            fprintf(stderr, "Unable to open %s for writing\n", script_name);
+            free(script_name);
+            exit(EXIT_FAILURE);
+        }
+        if(conf->verbose > 0)
+        {
+            fprintf(stdout, "Writing to %s\n", script_name);
+        }
+        nd2info_show_deconwolf_dots(conf, info, fid_dw_script);
+        fclose(fid_dw_script);
+        make_file_executable(script_name);
+
+        free(script_name);
+        goto cleanup_file;
+    }
+
+    if(conf->showinfo == 1 && conf->verbose > 0)
+    {
+        /* Show brief summary */
+        nd2info_print(conf, stdout, info);
+    }
+
+    if(conf->frame_table)
+    {
+        status = nd2_write_frame_table(info);
+        goto cleanup_file;
+    }
+
+    if(conf->showcoords)
+    {
+        nd2_show_coordinates(info);
+        goto cleanup_file;
+    }
+
+    if(conf->verify)
+    {
+        status = nd2_verify(conf, info);
+        goto cleanup_file;
     }
 
-    for(int ff = optind; ff<argc; ff++)
+    if(conf->convert)
     {
-        if(nfiles > 1 && conf->verbose > 0)
+        /* Create output folder and export tiff files */
+        if(nd2_to_tiff(conf, info) == EXIT_SUCCESS)
         {
-            printf(" -> %s (%d/%d)\n",
-                   argv[ff], ff-optind+1, nfiles);
+            /* Write some basic information to the log */
+            hello_log(conf, info, argc, argv);
+            nd2info_print(conf, info->log, info);
+            nd2info_log_resources(conf, info, &ru0);
+            nd2info_log(info, "done\n");
+
+        } else {
+            status = EXIT_FAILURE;
+            fprintf(stderr,
+                    "Conversion failed for %s, please make a bug report at "
+                    "https://github.com/elgw/nd2tool/issues in order to "
+                    "improve the program.\n", file);
         }
-        /* Parse information */
-        nd2info_t * info = nd2info(conf, argv[ff]);
+    }
+    /* Might jump directly here if an error occurred  */
+cleanup_file: ;
+    res->bytes_written = info->bytes_written;
+    /* Clean up */
+    nd2info_free(info);
+    return status;
+}
+
+/** @brief Name of the trace of file number part, see --trace */
+static char *
+nd2tool_trace_part(const ntconf_t * conf, int part)
+{
+    size_t len = strlen(conf->trace) + 32;
+    char * name = ckcalloc(len, 1);
+    snprintf(name, len, "%s.%d.part", conf->trace, part);
+    return name;
+}
+
+/** @brief Show the --profile summary and write the --trace of a file
+ *
+ * With part >= 0, i.e. when the file was converted in a child
+ * process, the trace events are written to a part file that
+ * nd2tool_batch merges when all files are done.
+ */
+static void
+nd2tool_prof_report(const ntconf_t * conf, const char * file, int part)
+{
+    if(conf->profile)
+    {
+        prof_summary(stdout, file);
+    }
+    if(conf->trace == NULL)
+    {
+        return;
+    }
+    if(part < 0)
+    {
+        prof_write_trace(conf->trace, 1, file);
+        return;
+    }
+    char * name = nd2tool_trace_part(conf, part);
+    FILE * fid = fopen(name, "w");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "Unable to write the trace to %s\n", name);
+    } else {
+        prof_write_events(fid, part + 1, file);
+        fclose(fid);
+    }
+    free(name);
+}
 
-        if(info->error != NULL)
+/** @brief Convert one file in a child process
+ *
+ * The result is passed back through the pipe fd. Anything that
+ * makes the child exit, including calls to exit(EXIT_FAILURE) deep
+ * down, only affects this file.
+ */
+static pid_t
+nd2tool_file_fork(ntconf_t * conf, char * file, int index,
+                  int argc, char ** argv, int * fd)
+{
+    int pipefd[2];
+    if(pipe(pipefd) != 0)
+    {
+        fprintf(stderr, "Failed to create a pipe for %s\n", file);
+        return -1;
+    }
+    /* Don't let the child print what is still buffered */
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if(pid == -1)
+    {
+        fprintf(stderr, "Failed to fork for %s\n", file);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    if(pid == 0)
+    {
+        close(pipefd[0]);
+        nd2result_t res = {0};
+        res.status = nd2tool_file(conf, file, argc, argv, &res);
+        res.peak_kb = get_peakMemoryKB();
+        nd2tool_prof_report(conf, file, index);
+        if(write(pipefd[1], &res, sizeof(res)) != (ssize_t) sizeof(res))
         {
-            fprintf(stderr, "%s", info->error);
-            goto cleanup_file;
+            fprintf(stderr, "Failed to report the result for %s\n", file);
         }
+        close(pipefd[1]);
+        exit(res.status);
+    }
+    close(pipefd[1]);
+    *fd = pipefd[0];
+    return pid;
+}
 
-        if(conf->deconwolf)
-        {
-            char * script_name0 = prefix_filename(info->filename, "deconwolf_");
-            char * script_name = postfix_filename(script_name0, ".sh");
-            free(script_name0);
+/** @brief Process all files given on the command line
+ *
+ * With a single file and --jobs 1 everything runs in this process.
+ * Otherwise each file is converted in a child process so that a
+ * failing file does not stop the others, and up to conf->njobs
+ * files are processed at the same time. The threads from --threads
+ * are shared between the running files.
+ */
+static void
+nd2tool_batch(ntconf_t * conf, int argc, char ** argv, nd2result_t * res)
+{
+    int nfiles = argc-optind;
+    int njobs = conf->njobs;
+    if(njobs > nfiles)
+    {
+        njobs = nfiles;
+    }
+
+    if(nfiles == 1 && njobs == 1)
+    {
+        double t0 = get_wall_time();
+        res[0].status = nd2tool_file(conf, argv[optind], argc, argv, res);
+        res[0].wall_s = get_wall_time() - t0;
+        res[0].peak_kb = get_peakMemoryKB();
+        nd2tool_prof_report(conf, argv[optind], -1);
+        return;
+    }
+
+    /* Split the thread budget between the jobs */
+    int nthreads = conf->nthreads;
+    if(nthreads < 1)
+    {
+        nthreads = tpool_ncpu();
+    }
+    conf->nthreads = nthreads / njobs;
+    if(conf->nthreads < 1)
+    {
+        conf->nthreads = 1;
+    }
+    if(conf->verbose > 1 && njobs > 1)
+    {
+        printf("Converting %d files at a time using %d threads each\n",
+               njobs, conf->nthreads);
+    }
 
-            FILE * fid_dw_script = fopen(script_name, "w");
-            if(fid_dw_script == NULL)
+    pid_t * pid = ckcalloc(nfiles, sizeof(pid_t));
+    int * fd = ckcalloc(nfiles, sizeof(int));
+    double * t0 = ckcalloc(nfiles, sizeof(double));
+    int next = 0;
+    int running = 0;
+    while(next < nfiles || running > 0)
+    {
+        while(running < njobs && next < nfiles)
+        {
+            char * file = argv[optind + next];
+            if(conf->verbose > 0)
             {
-                fprintf(stderr, "Unable to open %s for writing\n", script_name);
-                free(script_name);
-                exit(EXIT_FAILURE);
+                printf(" -> %s (%d/%d)\n", file, next+1, nfiles);
             }
-            if(conf->verbose > 0)
+            t0[next] = get_wall_time();
+            pid[next] = nd2tool_file_fork(conf, file, next, argc, argv, fd + next);
+            if(pid[next] == -1)
             {
-                fprintf(stdout, "Writing to %s\n", script_name);
+                res[next].status = EXIT_FAILURE;
+            } else {
+                running++;
             }
-            nd2info_show_deconwolf(conf, info, fid_dw_script);
-            fclose(fid_dw_script);
-            make_file_executable(script_name);
-
-            free(script_name);
-            goto cleanup_file;
+            next++;
         }
-
-        if(conf->deconwolf_dots)
+        if(running == 0)
         {
-            char * script_name0 = prefix_filename(info->filename, "deconwolf_dots_");
-            char * script_name = postfix_filename(script_name0, ".sh");
-            free(script_name0);
+            continue;
+        }
 
-            FILE * fid_dw_script = fopen(script_name, "w");
-            if(fid_dw_script == NULL)
-            {
-                fprintf(stderr, "Unable to open %s for writing\n", script_name);
-                free(script_name);
-                exit(EXIT_FAILURE);
-            }
-            if(conf->verbose > 0)
+        int wstatus = 0;
+        pid_t done = waitpid(-1, &wstatus, 0);
+        if(done == -1)
+        {
+            if(errno == EINTR)
             {
-                fprintf(stdout, "Writing to %s\n", script_name);
+                continue;
             }
-            nd2info_show_deconwolf_dots(conf, info, fid_dw_script);
-            fclose(fid_dw_script);
-            make_file_executable(script_name);
-
-            free(script_name);
-            goto cleanup_file;
+            fprintf(stderr, "waitpid failed\n");
+            exit(EXIT_FAILURE);
         }
-
-        if(conf->showinfo == 1 && conf->verbose > 0)
+        int kk = 0;
+        while(kk < nfiles && pid[kk] != done)
+        {
+            kk++;
+        }
+        if(kk == nfiles)
         {
-            /* Show brief summary */
-            nd2info_print(conf, stdout, info);
+            continue;
         }
+        running--;
+        pid[kk] = 0;
+        if(read(fd[kk], res + kk, sizeof(nd2result_t)) != (ssize_t) sizeof(nd2result_t))
+        {
+            memset(res + kk, 0, sizeof(nd2result_t));
+            res[kk].status = EXIT_FAILURE;
+        }
+        close(fd[kk]);
+        res[kk].wall_s = get_wall_time() - t0[kk];
 
-        if(conf->showcoords)
+        if(WIFSIGNALED(wstatus))
         {
-            nd2_show_coordinates(info);
-            goto cleanup_file;
+            fprintf(stderr, "Processing of %s was terminated by signal %d\n",
+                    argv[optind+kk], WTERMSIG(wstatus));
+            res[kk].status = EXIT_FAILURE;
+        } else if(!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != EXIT_SUCCESS)
+        {
+            res[kk].status = EXIT_FAILURE;
         }
+    }
+    free(t0);
+    free(fd);
+    free(pid);
 
-        if(conf->convert)
+    if(conf->trace != NULL)
+    {
+        char ** parts = ckcalloc(nfiles, sizeof(char *));
+        for(int kk = 0; kk < nfiles; kk++)
         {
-            /* Create output folder and export tiff files */
-            if(nd2_to_tiff(conf, info) == EXIT_SUCCESS)
-            {
-                /* Write some basic information to the log */
-                hello_log(conf, info, argc, argv);
-                nd2info_print(conf, info->log, info);
-                nd2info_log(info, "done\n");
+            parts[kk] = nd2tool_trace_part(conf, kk);
+        }
+        prof_merge_traces(conf->trace, parts, nfiles);
+        for(int kk = 0; kk < nfiles; kk++)
+        {
+            free(parts[kk]);
+        }
+        free(parts);
+    }
+    return;
+}
 
-            } else {
-                fprintf(stderr,
-                        "Conversion failed for %s, please make a bug report at "
-                        "https://github.com/elgw/nd2tool/issues in order to "
-                        "improve the program.\n", argv[ff]);
-            }
+/** @brief Show wall time and output size per file */
+static void
+nd2tool_batch_summary(FILE * fid, int nfiles, char ** files,
+                      const nd2result_t * res)
+{
+    double wall_s = 0;
+    i64 bytes = 0;
+    int nfail = 0;
+    fprintf(fid, "%-6s %10s %12s  %s\n", "Status", "Time [s]", "Written [MB]", "File");
+    for(int kk = 0; kk < nfiles; kk++)
+    {
+        fprintf(fid, "%-6s %10.1f %12.1f  %s\n",
+                res[kk].status == EXIT_SUCCESS ? "ok" : "FAILED",
+                res[kk].wall_s,
+                (double) res[kk].bytes_written/1e6,
+                files[kk]);
+        wall_s += res[kk].wall_s;
+        bytes += res[kk].bytes_written;
+        nfail += res[kk].status != EXIT_SUCCESS;
+    }
+    fprintf(fid, "%-6s %10.1f %12.1f  %d files, %d failed\n",
+            "Total", wall_s, (double) bytes/1e6, nfiles, nfail);
+    return;
+}
+
+
+/** @brief Command line interface to nd2tool */
+int nd2tool_cli(int argc, char ** argv)
+{
+    check_cmd_line(argc, argv);
+    int status = EXIT_SUCCESS;
+
+    ntconf_t * conf = ntconf_new();
+    if(argparse(conf, argc, argv) != EXIT_SUCCESS)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    /* Process each file */
+
+    /* Show some metadata and exit */
+    if(conf->purpose == SHOW_METADATA)
+    {
+        for(int ff = optind; ff<argc; ff++)
+        {
+            showmeta(conf, argv[ff]);
         }
-        /* Might jump directly here if an error occurred  */
-    cleanup_file: ;
-        /* Clean up */
-        nd2info_free(info);
+        goto done;
+    }
+
+    /* Convert to tif */
+    int nfiles = argc-optind;
+    if(nfiles == 0)
+    {
+        printf("error: No file(s) given\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(conf->profile || conf->trace != NULL)
+    {
+        prof_init(conf->trace != NULL);
+        prof_thread_name("main");
     }
 
-    /* Print out peak memory usage */
+    nd2result_t * res = ckcalloc(nfiles, sizeof(nd2result_t));
+    double t0 = get_wall_time();
+    nd2tool_batch(conf, argc, argv, res);
+    double wall_s = get_wall_time() - t0;
+
     size_t mem = get_peakMemoryKB();
+    for(int kk = 0; kk < nfiles; kk++)
+    {
+        if(res[kk].status != EXIT_SUCCESS)
+        {
+            status = EXIT_FAILURE;
+        }
+        if(res[kk].peak_kb > mem)
+        {
+            mem = res[kk].peak_kb;
+        }
+    }
+
+    if(nfiles > 1 && conf->verbose > 0)
+    {
+        nd2tool_batch_summary(stdout, nfiles, argv + optind, res);
+        if(conf->verbose > 1)
+        {
+            printf("Wall time: %.1f s\n", wall_s);
+        }
+    }
+    free(res);
 
+    /* Print out peak memory usage, per process */
     if(mem > 0)
     {
         if(conf->verbose > 1)
@@ -2443,6 +5652,7 @@ int nd2tool_cli(int argc, char ** argv)
 
     /* Final cleanup */
  done: ;
+    prof_free();
     ntconf_free(conf);
-    return EXIT_SUCCESS;
+    return status;
 }
@@ -0,0 +1,588 @@
+/* Microbenchmarks of the hot paths of nd2tool.
+ *
+ * Runs each kernel at the sizes of real data and writes the timings
+ * as JSON, so that they can be compared between compilers, flags and
+ * machines. See nd2tool_bench --help.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "version.h"
+#include "deinterleave.h"
+#include "focus.h"
+#include "hash_util.h"
+#include "json_util.h"
+#include "nd2tool_util.h"
+#include "tiff_compress.h"
+#include "tiff_util.h"
+
+typedef struct
+{
+    int quick; /* Smaller sizes and shorter runs */
+    double min_time; /* Seconds per benchmark */
+    const char * dir; /* For the tif files */
+    FILE * out; /* The JSON results */
+    int nresults;
+} bench_conf_t;
+
+/* Timings of the repetitions of a benchmark, in seconds */
+typedef struct
+{
+    double * t;
+    int n;
+    int alloc;
+    double spent; /* Total time, including all calls per repetition */
+} bench_times_t;
+
+static void * ckcalloc(size_t n, size_t size)
+{
+    void * p = calloc(n, size);
+    if(p == NULL)
+    {
+        fprintf(stderr, "nd2tool_bench: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* Add a repetition that took t seconds for nrep calls */
+static void bench_times_add(bench_times_t * bt, double t, int nrep)
+{
+    bt->spent += t;
+    t /= nrep;
+    if(bt->n == bt->alloc)
+    {
+        bt->alloc = bt->alloc == 0 ? 64 : 2*bt->alloc;
+        bt->t = realloc(bt->t, bt->alloc*sizeof(double));
+        if(bt->t == NULL)
+        {
+            fprintf(stderr, "nd2tool_bench: Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    bt->t[bt->n++] = t;
+}
+
+static int cmp_double(const void * a, const void * b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Should the benchmark continue after the repetitions in bt? At least
+ * 3 repetitions and conf->min_time seconds */
+static int bench_more(const bench_conf_t * conf, const bench_times_t * bt)
+{
+    return bt->n < 3 || bt->spent < conf->min_time;
+}
+
+/* Write one result. params is a JSON fragment with the parameters,
+ * bytes the amount of data per repetition for the MB/s */
+static void bench_report(bench_conf_t * conf, const char * name,
+                         const char * params, bench_times_t * bt,
+                         double bytes)
+{
+    qsort(bt->t, bt->n, sizeof(double), cmp_double);
+    double median = bt->t[bt->n/2];
+    double best = bt->t[0];
+    fprintf(conf->out, "%s\n    {\"name\": \"%s\", %s, \"reps\": %d, "
+            "\"median_ns\": %.0f, \"min_ns\": %.0f",
+            conf->nresults > 0 ? "," : "", name, params, bt->n,
+            1e9*median, 1e9*best);
+    if(bytes > 0)
+    {
+        fprintf(conf->out, ", \"mb_per_s\": %.1f", bytes/median/1e6);
+    }
+    fprintf(conf->out, "}");
+    fflush(conf->out);
+    conf->nresults++;
+    fprintf(stderr, "%-16s %-44s %12.1f us\n", name, params, 1e6*median);
+    free(bt->t);
+    bt->t = NULL;
+    bt->n = 0;
+    bt->alloc = 0;
+}
+
+/* Like the planes returned by the SDK, with some noise */
+static void fill_plane(uint16_t * V, size_t n)
+{
+    uint32_t rng = 0x9E3779B9u;
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        V[kk] = (uint16_t) (100 + (kk % 4096) / 64 + (rng & 0x3f));
+    }
+}
+
+/* The channel de-interleave loop, one plane of all channels */
+static void bench_deinterleave(bench_conf_t * conf, const int * sizes, int nsizes)
+{
+    deinterleave_isa_t best = deinterleave_isa();
+    for(int ss = 0; ss < nsizes; ss++)
+    {
+        size_t npix = (size_t) sizes[ss]*sizes[ss];
+        uint16_t * in = ckcalloc(npix*6, sizeof(uint16_t));
+        uint16_t * out = ckcalloc(npix*6, sizeof(uint16_t));
+        fill_plane(in, npix*6);
+        for(int nchan = 1; nchan <= 6; nchan++)
+        {
+            for(int isa = DEINTERLEAVE_SCALAR; isa <= (int) best; isa++)
+            {
+                bench_times_t bt = {0};
+                while(bench_more(conf, &bt))
+                {
+                    double t0 = get_wall_time();
+                    deinterleave_u16_isa(out, in, npix, nchan, isa);
+                    bench_times_add(&bt, get_wall_time() - t0, 1);
+                }
+                char params[128];
+                snprintf(params, sizeof(params),
+                         "\"size\": %d, \"channels\": %d, \"isa\": \"%s\"",
+                         sizes[ss], nchan, deinterleave_isa_name(isa));
+                bench_report(conf, "deinterleave", params, &bt,
+                             (double) npix*nchan*sizeof(uint16_t));
+            }
+        }
+        free(out);
+        free(in);
+    }
+}
+
+/* The focus measure of one plane, done for every plane with --focus */
+static void bench_focus(bench_conf_t * conf, const int * sizes, int nsizes)
+{
+    deinterleave_isa_t best = deinterleave_isa();
+    for(int ss = 0; ss < nsizes; ss++)
+    {
+        size_t npix = (size_t) sizes[ss]*sizes[ss];
+        uint16_t * V = ckcalloc(npix, sizeof(uint16_t));
+        fill_plane(V, npix);
+        for(int isa = DEINTERLEAVE_SCALAR; isa <= (int) best; isa++)
+        {
+            volatile uint64_t sink = 0;
+            bench_times_t bt = {0};
+            while(bench_more(conf, &bt))
+            {
+                focus_sums_t fs;
+                double t0 = get_wall_time();
+                focus_sums_u16_isa(&fs, V, sizes[ss], sizes[ss], isa);
+                bench_times_add(&bt, get_wall_time() - t0, 1);
+                sink ^= fs.energy;
+            }
+            (void) sink;
+            char params[128];
+            snprintf(params, sizeof(params), "\"size\": %d, \"isa\": \"%s\"",
+                     sizes[ss], deinterleave_isa_name(isa));
+            bench_report(conf, "focus", params, &bt,
+                         (double) npix*sizeof(uint16_t));
+        }
+        free(V);
+    }
+}
+
+/* The hash of one plane, done for every plane that is written */
+static void bench_hash(bench_conf_t * conf, const int * sizes, int nsizes)
+{
+    for(int ss = 0; ss < nsizes; ss++)
+    {
+        size_t npix = (size_t) sizes[ss]*sizes[ss];
+        uint16_t * V = ckcalloc(npix, sizeof(uint16_t));
+        fill_plane(V, npix);
+        volatile uint64_t sink = 0;
+        bench_times_t bt = {0};
+        while(bench_more(conf, &bt))
+        {
+            double t0 = get_wall_time();
+            sink ^= hash_u64(V, npix*sizeof(uint16_t));
+            bench_times_add(&bt, get_wall_time() - t0, 1);
+        }
+        (void) sink;
+        char params[64];
+        snprintf(params, sizeof(params), "\"size\": %d", sizes[ss]);
+        bench_report(conf, "hash", params, &bt, (double) npix*sizeof(uint16_t));
+        free(V);
+    }
+}
+
+/* tiff_writer_write for each plane of a file, and tiff_writer_finish */
+static void bench_tiff_write(bench_conf_t * conf, const int * sizes, int nsizes)
+{
+    const int P = conf->quick ? 4 : 8;
+    const char * methods[] = {"none", "lzw", "deflate", "zstd"};
+    char * fName = ckcalloc(strlen(conf->dir) + 64, 1);
+    sprintf(fName, "%s/nd2tool_bench_%d.tif", conf->dir, (int) getpid());
+
+    for(int ss = 0; ss < nsizes; ss++)
+    {
+        int64_t M = sizes[ss];
+        uint16_t * V = ckcalloc(M*M*P, sizeof(uint16_t));
+        fill_plane(V, M*M*P);
+        for(int libtiff = 0; libtiff < 2; libtiff++)
+        {
+            for(size_t mm = 0; mm < sizeof(methods)/sizeof(methods[0]); mm++)
+            {
+                uint16_t compression = tiff_compress_from_name(methods[mm]);
+                if(compression == 0 || (libtiff && compression != COMPRESSION_NONE))
+                {
+                    continue;
+                }
+                ttags * T = ttags_new();
+                ttags_set_imagesize(T, M, M, P);
+                ttags_set_pixelsize_nm(T, 130, 130, 300);
+                ttags_set_compression(T, compression);
+
+                bench_times_t bt_write = {0};
+                bench_times_t bt_finish = {0};
+                while(bench_more(conf, &bt_write) || bt_finish.n < 3)
+                {
+                    tiff_writer_t * tw = libtiff ?
+                        tiff_writer_init_libtiff(fName, T, M, M, P) :
+                        tiff_writer_init(fName, T, M, M, P);
+                    if(tw == NULL)
+                    {
+                        fprintf(stderr, "nd2tool_bench: Unable to write %s\n",
+                                fName);
+                        exit(EXIT_FAILURE);
+                    }
+                    for(int pp = 0; pp < P; pp++)
+                    {
+                        double t0 = get_wall_time();
+                        tiff_writer_write(tw, V + pp*M*M);
+                        bench_times_add(&bt_write, get_wall_time() - t0, 1);
+                    }
+                    double t0 = get_wall_time();
+                    tiff_writer_finish(tw);
+                    bench_times_add(&bt_finish, get_wall_time() - t0, 1);
+                    unlink(fName);
+                }
+                ttags_free(&T);
+
+                char params[128];
+                snprintf(params, sizeof(params),
+                         "\"size\": %d, \"compression\": \"%s\", \"writer\": \"%s\"",
+                         sizes[ss], methods[mm], libtiff ? "libtiff" : "built-in");
+                bench_report(conf, "tiff_write_plane", params, &bt_write,
+                             (double) M*M*sizeof(uint16_t));
+                snprintf(params, sizeof(params),
+                         "\"size\": %d, \"compression\": \"%s\", \"writer\": \"%s\", "
+                         "\"planes\": %d",
+                         sizes[ss], methods[mm], libtiff ? "libtiff" : "built-in", P);
+                bench_report(conf, "tiff_finish", params, &bt_finish, 0);
+            }
+        }
+        free(V);
+    }
+    free(fName);
+}
+
+/* ttags_set on an open libtiff file, once per page */
+static void bench_ttags_set(bench_conf_t * conf)
+{
+    char * fName = ckcalloc(strlen(conf->dir) + 64, 1);
+    sprintf(fName, "%s/nd2tool_bench_%d.tif", conf->dir, (int) getpid());
+    TIFF * tif = TIFFOpen(fName, "w8");
+    if(tif == NULL)
+    {
+        fprintf(stderr, "nd2tool_bench: Unable to write %s\n", fName);
+        exit(EXIT_FAILURE);
+    }
+    ttags * T = ttags_new();
+    ttags_set_imagesize(T, 2048, 2048, 51);
+    ttags_set_pixelsize_nm(T, 130, 130, 300);
+    ttags_set_software(T, "nd2tool_bench");
+
+    bench_times_t bt = {0};
+    while(bench_more(conf, &bt))
+    {
+        const int nrep = 1000;
+        double t0 = get_wall_time();
+        for(int kk = 0; kk < nrep; kk++)
+        {
+            ttags_set(tif, T);
+        }
+        bench_times_add(&bt, get_wall_time() - t0, nrep);
+    }
+    bench_report(conf, "ttags_set", "\"size\": 2048", &bt, 0);
+    ttags_free(&T);
+    TIFFClose(tif);
+    unlink(fName);
+    free(fName);
+}
+
+/* Frame metadata with nchan channels, made from the sample in
+ * json_util.c */
+static char * frame_metadata(int nchan)
+{
+    const char * js = json_util_sample();
+    const char * first = json_first(json_path(js, "channels"));
+    const char * next = json_next(first);
+    if(first == NULL || next == NULL)
+    {
+        fprintf(stderr, "nd2tool_bench: Unexpected frame metadata sample\n");
+        exit(EXIT_FAILURE);
+    }
+    const char * end = next;
+    while(end > first && end[-1] != ',')
+    {
+        end--;
+    }
+    size_t len = end - 1 - first;
+    char * out = ckcalloc(64 + nchan*(len+1), 1);
+    char * p = out + sprintf(out, "{\"contents\":{\"channelCount\":%d},\"channels\":[",
+                             nchan);
+    for(int cc = 0; cc < nchan; cc++)
+    {
+        if(cc > 0)
+        {
+            *p++ = ',';
+        }
+        memcpy(p, first, len);
+        p += len;
+    }
+    strcpy(p, "]}");
+    return out;
+}
+
+/* The stage positions as parse_stagePosition in nd2tool.c used to
+ * get them, with a cJSON tree. Returns the number of channels, -1 on
+ * failure */
+static int stage_positions_cjson(const char * js, double * pos, int maxchan)
+{
+    cJSON * json = cJSON_Parse(js);
+    if(json == NULL)
+    {
+        return -1;
+    }
+    const cJSON * j_channels = cJSON_GetObjectItemCaseSensitive(json, "channels");
+    int nchan = cJSON_GetArraySize(j_channels);
+    for(int cc = 0; cc < nchan && cc < maxchan; cc++)
+    {
+        const cJSON * j_chan = cJSON_GetArrayItem(j_channels, cc);
+        const cJSON * j_position = cJSON_GetObjectItemCaseSensitive(j_chan, "position");
+        const cJSON * j_pos = cJSON_GetObjectItemCaseSensitive(j_position, "stagePositionUm");
+        for(int kk = 0; kk < 3; kk++)
+        {
+            const cJSON * v = cJSON_GetArrayItem(j_pos, kk);
+            if(!cJSON_IsNumber(v))
+            {
+                cJSON_Delete(json);
+                return -1;
+            }
+            pos[3*cc+kk] = v->valuedouble;
+        }
+    }
+    cJSON_Delete(json);
+    return nchan < maxchan ? nchan : maxchan;
+}
+
+/* The stage positions from the frame metadata, as in
+ * parse_frame_meta, with json_path and with cJSON. The two have to
+ * give exactly the same values. */
+static void bench_frame_meta(bench_conf_t * conf)
+{
+    for(int nchan = 1; nchan <= 6; nchan++)
+    {
+        char * js = frame_metadata(nchan);
+        double pos[18];
+        double ref[18] = {0};
+        if(json_stage_positions(js, ref, nchan) != nchan)
+        {
+            fprintf(stderr, "nd2tool_bench: Failed to parse the "
+                    "frame metadata\n");
+            exit(EXIT_FAILURE);
+        }
+        for(int use_cjson = 0; use_cjson < 2; use_cjson++)
+        {
+            bench_times_t bt = {0};
+            while(bench_more(conf, &bt))
+            {
+                const int nrep = 1000;
+                double t0 = get_wall_time();
+                for(int kk = 0; kk < nrep; kk++)
+                {
+                    int n = use_cjson ?
+                        stage_positions_cjson(js, pos, nchan) :
+                        json_stage_positions(js, pos, nchan);
+                    if(n != nchan)
+                    {
+                        fprintf(stderr, "nd2tool_bench: Failed to parse the "
+                                "frame metadata\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                bench_times_add(&bt, get_wall_time() - t0, nrep);
+                if(memcmp(pos, ref, nchan*3*sizeof(double)) != 0)
+                {
+                    fprintf(stderr, "nd2tool_bench: The stage positions "
+                            "from cJSON and json_path differ\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            char params[128];
+            snprintf(params, sizeof(params),
+                     "\"channels\": %d, \"parser\": \"%s\", \"bytes\": %zu",
+                     nchan, use_cjson ? "cJSON" : "json_path", strlen(js));
+            bench_report(conf, "frame_meta", params, &bt, (double) strlen(js));
+        }
+        free(js);
+    }
+}
+
+/* Creating a temporary file and renaming it, as for each output file */
+static void bench_tmp_rename(bench_conf_t * conf)
+{
+    size_t slen = strlen(conf->dir) + 64;
+    char * tmp = ckcalloc(slen, 1);
+    char * final = ckcalloc(slen, 1);
+    snprintf(final, slen, "%s/nd2tool_bench_%d.tif", conf->dir, (int) getpid());
+    bench_times_t bt = {0};
+    while(bench_more(conf, &bt))
+    {
+        const int nrep = 100;
+        double t0 = get_wall_time();
+        for(int kk = 0; kk < nrep; kk++)
+        {
+            snprintf(tmp, slen, "%s_tmp_XXXXXX", final);
+            int fd = mkstemp(tmp);
+            if(fd < 0 || rename(tmp, final) != 0)
+            {
+                fprintf(stderr, "nd2tool_bench: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            close(fd);
+        }
+        bench_times_add(&bt, get_wall_time() - t0, nrep);
+    }
+    unlink(final);
+    bench_report(conf, "tmp_rename", "\"files\": 1", &bt, 0);
+    free(final);
+    free(tmp);
+}
+
+static void usage(const char * name)
+{
+    printf("Usage: %s [options]\n", name);
+    printf("Microbenchmarks of nd2tool, the results are written as JSON.\n");
+    printf("  --out file\n\t Write the JSON to file instead of stdout\n");
+    printf("  --dir dir\n\t Where to write the tif files. Default: $TMPDIR or /tmp\n");
+    printf("  --quick\n\t Only 2048 x 2048 and short runs\n");
+    printf("  --time s\n\t Run each benchmark for at least s seconds. Default: 0.5\n");
+    printf("  --only name\n\t Only run deinterleave, focus, hash, tiff, ttags,\n\t frame_meta or io\n");
+    printf("  --help\n\t Show this message\n");
+}
+
+int main(int argc, char ** argv)
+{
+    bench_conf_t conf = {0};
+    conf.min_time = 0.5;
+    conf.dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    conf.out = stdout;
+    const char * outfile = NULL;
+    const char * only = NULL;
+
+    struct option longopts[] = {
+        { "out",   required_argument, NULL, 'o'},
+        { "dir",   required_argument, NULL, 'd'},
+        { "quick", no_argument, NULL, 'q'},
+        { "time",  required_argument, NULL, 't'},
+        { "only",  required_argument, NULL, 'O'},
+        { "help",  no_argument, NULL, 'h'},
+        { NULL, 0, NULL, 0 }
+    };
+    int ch;
+    while((ch = getopt_long(argc, argv, "O:d:ho:qt:", longopts, NULL)) != -1)
+    {
+        switch(ch) {
+        case 'o':
+            outfile = optarg;
+            break;
+        case 'd':
+            conf.dir = optarg;
+            break;
+        case 'q':
+            conf.quick = 1;
+            conf.min_time = 0.05;
+            break;
+        case 't':
+            conf.min_time = atof(optarg);
+            break;
+        case 'O':
+            only = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(outfile != NULL)
+    {
+        conf.out = fopen(outfile, "w");
+        if(conf.out == NULL)
+        {
+            fprintf(stderr, "Unable to open %s: %s\n", outfile, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    const int sizes[] = {2048, 4096};
+    int nsizes = conf.quick ? 1 : 2;
+
+    fprintf(conf.out, "{\"nd2tool_bench\": 1, \"version\": \"%s\", ",
+            nd2tool_version);
+#ifdef ND2TOOL_GIT_VERSION
+    fprintf(conf.out, "\"git\": \"%s\", ", ND2TOOL_GIT_VERSION);
+#endif
+#ifdef __VERSION__
+    fprintf(conf.out, "\"compiler\": \"%s\", ", __VERSION__);
+#endif
+    fprintf(conf.out, "\"isa\": \"%s\", \"min_time_s\": %g, \"results\": [",
+            deinterleave_isa_name(deinterleave_isa()), conf.min_time);
+
+    if(only == NULL || strcmp(only, "deinterleave") == 0)
+    {
+        bench_deinterleave(&conf, sizes, nsizes);
+    }
+    if(only == NULL || strcmp(only, "focus") == 0)
+    {
+        bench_focus(&conf, sizes, nsizes);
+    }
+    if(only == NULL || strcmp(only, "hash") == 0)
+    {
+        bench_hash(&conf, sizes, nsizes);
+    }
+    if(only == NULL || strcmp(only, "tiff") == 0)
+    {
+        bench_tiff_write(&conf, sizes, nsizes);
+    }
+    if(only == NULL || strcmp(only, "ttags") == 0)
+    {
+        bench_ttags_set(&conf);
+    }
+    if(only == NULL || strcmp(only, "frame_meta") == 0)
+    {
+        bench_frame_meta(&conf);
+    }
+    if(only == NULL || strcmp(only, "io") == 0)
+    {
+        bench_tmp_rename(&conf);
+    }
+    fprintf(conf.out, "\n]}\n");
+
+    if(conf.out != stdout)
+    {
+        fclose(conf.out);
+    }
+    return EXIT_SUCCESS;
+}
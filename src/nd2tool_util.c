@@ -1,3 +1,7 @@
+#include <dirent.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+
 #include "nd2tool_util.h"
 
 static void * ckcalloc(size_t nmemb, size_t size)
@@ -139,6 +143,67 @@ size_t get_peakMemoryKB(void)
 }
 #endif
 
+/** @brief Seconds from an arbitrary but fixed point in time */
+double get_wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + 1e-9*(double) ts.tv_nsec;
+}
+
+/** @brief Get the wall time, CPU time, peak RSS and I/O so far
+ *
+ * The I/O counters are only available on Linux.
+ */
+void get_resource_usage(resource_usage_t * ru)
+{
+    memset(ru, 0, sizeof(resource_usage_t));
+    ru->wall_s = get_wall_time();
+    ru->rchar = -1;
+    ru->read_bytes = -1;
+    ru->write_bytes = -1;
+
+    struct rusage r_usage;
+    if(getrusage(RUSAGE_SELF, &r_usage) == 0)
+    {
+        ru->user_s = (double) r_usage.ru_utime.tv_sec
+            + 1e-6*(double) r_usage.ru_utime.tv_usec;
+        ru->sys_s = (double) r_usage.ru_stime.tv_sec
+            + 1e-6*(double) r_usage.ru_stime.tv_usec;
+#ifdef __APPLE__
+        /* In bytes on macOS */
+        ru->peak_rss_kb = (size_t) r_usage.ru_maxrss / 1024;
+#else
+        ru->peak_rss_kb = (size_t) r_usage.ru_maxrss;
+#endif
+    }
+
+    FILE * fid = fopen("/proc/self/io", "r");
+    if(fid == NULL)
+    {
+        return;
+    }
+    char * line = NULL;
+    size_t len = 0;
+    while(getline(&line, &len, fid) > 0)
+    {
+        int64_t value = 0;
+        if(sscanf(line, "rchar: %" SCNd64, &value) == 1)
+        {
+            ru->rchar = value;
+        } else if(sscanf(line, "read_bytes: %" SCNd64, &value) == 1)
+        {
+            ru->read_bytes = value;
+        } else if(sscanf(line, "write_bytes: %" SCNd64, &value) == 1)
+        {
+            ru->write_bytes = value;
+        }
+    }
+    free(line);
+    fclose(fid);
+    return;
+}
+
 /** @brief Check if file exists
  */
 int isfile(char * filename)
@@ -153,6 +218,49 @@ int isfile(char * filename)
     return EXIT_SUCCESS;
 }
 
+/** @brief Remove a folder and everything in it (rm -r)
+ *
+ * Symbolic links are removed, not followed.
+ */
+int remove_tree(const char * dir)
+{
+    DIR * d = opendir(dir);
+    if(d == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    int status = EXIT_SUCCESS;
+    struct dirent * e = NULL;
+    while((e = readdir(d)) != NULL)
+    {
+        if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+        {
+            continue;
+        }
+        size_t slen = strlen(dir) + strlen(e->d_name) + 2;
+        char * path = ckcalloc(slen, 1);
+        snprintf(path, slen, "%s/%s", dir, e->d_name);
+        struct stat sb;
+        if(lstat(path, &sb) == 0 && S_ISDIR(sb.st_mode))
+        {
+            if(remove_tree(path) != EXIT_SUCCESS)
+            {
+                status = EXIT_FAILURE;
+            }
+        } else if(remove(path) != 0)
+        {
+            status = EXIT_FAILURE;
+        }
+        free(path);
+    }
+    closedir(d);
+    if(rmdir(dir) != 0)
+    {
+        status = EXIT_FAILURE;
+    }
+    return status;
+}
+
 /** @brief make file executable by user (chmod u+x file)*/
 void make_file_executable(const char * filename)
 {
@@ -277,8 +385,42 @@ static void prefix_filename_ut(void)
     prefix_filename_test("", "", "");
 }
 
+static void remove_tree_ut(void)
+{
+    printf("-> testing remove_tree\n");
+    char dir[] = "/tmp/nd2tool_ut_XXXXXX";
+    if(mkdtemp(dir) == NULL)
+    {
+        fprintf(stderr, "remove_tree_ut: Unable to create a temporary folder\n");
+        exit(EXIT_FAILURE);
+    }
+    const char * sub[] = {"a", "a/b", "a/b/c"};
+    size_t slen = strlen(dir) + 32;
+    char * path = ckcalloc(slen, 1);
+    for(int kk = 0; kk < 3; kk++)
+    {
+        snprintf(path, slen, "%s/%s", dir, sub[kk]);
+        mkdir(path, 0777);
+        snprintf(path, slen, "%s/%s/file", dir, sub[kk]);
+        FILE * fid = fopen(path, "w");
+        if(fid != NULL)
+        {
+            fclose(fid);
+        }
+    }
+    free(path);
+    struct stat sb;
+    if(remove_tree(dir) != EXIT_SUCCESS || stat(dir, &sb) == 0)
+    {
+        fprintf(stderr, "remove_tree_ut: %s was not removed\n", dir);
+        exit(EXIT_FAILURE);
+    }
+    printf("ok: %s removed\n", dir);
+}
+
 /** @brief Unit tests */
 void nd2tool_util_ut()
 {
     prefix_filename_ut();
+    remove_tree_ut();
 }
@@ -2,11 +2,13 @@
 
 #include <math.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 void filter_textinfo(char * s);
@@ -15,8 +17,27 @@ void remove_file_ext(char * str);
 
 size_t get_peakMemoryKB(void);
 
+double get_wall_time(void);
+
+/* Resources used by the process so far, see get_resource_usage */
+typedef struct {
+    double wall_s; /* get_wall_time */
+    double user_s; /* CPU time of all threads */
+    double sys_s;
+    size_t peak_rss_kb; /* Largest resident set size */
+    /* From /proc/self/io, -1 when not available */
+    int64_t rchar; /* Bytes read with read() and friends */
+    int64_t read_bytes; /* Bytes read from storage, including mapped files */
+    int64_t write_bytes; /* Bytes sent to storage */
+} resource_usage_t;
+
+void get_resource_usage(resource_usage_t * ru);
+
 int isfile(char *);
 
+/* Remove a folder and everything in it */
+int remove_tree(const char * dir);
+
 void make_file_executable(const char * filename);
 
 void show_color(FILE * fid, const double * RGB, double lambda);
@@ -0,0 +1,260 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "npy_util.h"
+#include "hash_util.h"
+
+#define NOT_NULL(x) {                                           \
+        if(x == NULL){                                          \
+            fprintf(stderr, "npy_writer: NULL pointer at %s:%d\n", \
+                    __FILE__, __LINE__);                        \
+            exit(EXIT_FAILURE);                                 \
+        }                                                       \
+    }
+
+static void pwrite_all(int fd, const void * buf, size_t nbytes, uint64_t offset)
+{
+    const uint8_t * p = buf;
+    while(nbytes > 0)
+    {
+        ssize_t nw = pwrite(fd, p, nbytes, (off_t) offset);
+        if(nw < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(nw <= 0)
+        {
+            fprintf(stderr, "npy_writer: Failed to write %zu bytes at %" PRIu64 ": %s\n",
+                    nbytes, offset, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        p += nw;
+        nbytes -= nw;
+        offset += nw;
+    }
+}
+
+/* The magic string, the version, the header length and the header
+ * dict padded with spaces and a newline to a multiple of 64
+ * bytes. Returns the total size, at most 128 bytes. */
+static size_t npy_header(const npy_writer_t * nw, char * buf)
+{
+    const uint16_t one = 1;
+    char endian = *((const uint8_t *) &one) == 1 ? '<' : '>';
+    char dict[100];
+    int len = snprintf(dict, sizeof(dict),
+                       "{'descr': '%cu2', 'fortran_order': False, "
+                       "'shape': (%" PRId64 ", %" PRId64 ", %" PRId64 "), }",
+                       endian, nw->Z, nw->Y, nw->X);
+    size_t total = (10 + len + 1 + 63) / 64 * 64;
+    uint16_t header_len = (uint16_t) (total - 10);
+    memcpy(buf, "\x93NUMPY\x01\x00", 8);
+    /* Little endian regardless of the data */
+    buf[8] = (char) (header_len & 0xFF);
+    buf[9] = (char) (header_len >> 8);
+    memset(buf + 10, ' ', total - 10);
+    memcpy(buf + 10, dict, len);
+    buf[total-1] = '\n';
+    return total;
+}
+
+npy_writer_t * npy_writer_init(const char * fName,
+                               int64_t Z, int64_t Y, int64_t X)
+{
+    if(Z < 1 || Y < 1 || X < 1)
+    {
+        fprintf(stderr, "npy_writer: Invalid size\n");
+        exit(EXIT_FAILURE);
+    }
+    npy_writer_t * nw = calloc(1, sizeof(npy_writer_t));
+    NOT_NULL(nw);
+    nw->Z = Z;
+    nw->Y = Y;
+    nw->X = X;
+    nw->plane_bytes = Y*X*sizeof(uint16_t);
+    nw->plane_hash = calloc(Z, sizeof(uint64_t));
+    NOT_NULL(nw->plane_hash);
+
+    nw->fd = open(fName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(nw->fd < 0)
+    {
+        fprintf(stderr, "npy_writer: Unable to open %s: %s\n",
+                fName, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    char header[128];
+    nw->data_offset = npy_header(nw, header);
+    pwrite_all(nw->fd, header, nw->data_offset, 0);
+
+    /* Reserve the full size so that the planes can be written in any
+     * order */
+    if(ftruncate(nw->fd, (off_t) (nw->data_offset + Z*nw->plane_bytes)) != 0)
+    {
+        fprintf(stderr, "npy_writer: Failed to set the size of %s: %s\n",
+                fName, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return nw;
+}
+
+void npy_writer_write_plane(npy_writer_t * nw, int64_t z,
+                            const uint16_t * plane)
+{
+    if(z < 0 || z >= nw->Z)
+    {
+        fprintf(stderr, "npy_writer: Plane %" PRId64 " is outside of [0, %" PRId64 ")\n",
+                z, nw->Z);
+        exit(EXIT_FAILURE);
+    }
+    nw->plane_hash[z] = hash_u64(plane, nw->plane_bytes);
+    pwrite_all(nw->fd, plane, nw->plane_bytes,
+               nw->data_offset + z*nw->plane_bytes);
+}
+
+uint64_t npy_writer_hash(const npy_writer_t * nw)
+{
+    return hash_pages(nw->plane_hash, nw->Z);
+}
+
+int64_t npy_writer_finish(npy_writer_t * nw)
+{
+    int64_t nbytes = nw->data_offset + nw->Z*nw->plane_bytes;
+    if(close(nw->fd) != 0)
+    {
+        fprintf(stderr, "npy_writer: Failed to close the file: %s\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    free(nw->plane_hash);
+    free(nw);
+    return nbytes;
+}
+
+int npy_hash_planes(const char * fName, uint64_t * hash)
+{
+    FILE * fid = fopen(fName, "rb");
+    if(fid == NULL)
+    {
+        return -1;
+    }
+    /* Version 1.0 has a 16-bit header length, the later 32-bit */
+    uint8_t pre[12];
+    char * header = NULL;
+    int status = -1;
+    if(fread(pre, 1, 12, fid) != 12 || memcmp(pre, "\x93NUMPY", 6) != 0)
+    {
+        goto done;
+    }
+    size_t header_len = pre[8] + 256*pre[9];
+    long data_offset = 10 + header_len;
+    if(pre[6] > 1)
+    {
+        header_len = pre[8] + 256*(pre[9] + 256*(pre[10] + 256*(size_t) pre[11]));
+        data_offset = 12 + header_len;
+    }
+    header = calloc(header_len + 1, 1);
+    NOT_NULL(header);
+    if(fseek(fid, data_offset - header_len, SEEK_SET) != 0
+       || fread(header, 1, header_len, fid) != header_len)
+    {
+        goto done;
+    }
+    int64_t Z = 0, Y = 0, X = 0;
+    const char * shape = strstr(header, "'shape': (");
+    if(strstr(header, "u2'") == NULL || shape == NULL
+       || sscanf(shape, "'shape': (%" SCNd64 ", %" SCNd64 ", %" SCNd64 ")",
+                 &Z, &Y, &X) != 3 || Z < 1 || Y < 1 || X < 1)
+    {
+        goto done;
+    }
+
+    size_t plane_bytes = Y*X*sizeof(uint16_t);
+    uint8_t * plane = malloc(plane_bytes);
+    uint64_t * plane_hash = calloc(Z, sizeof(uint64_t));
+    NOT_NULL(plane);
+    NOT_NULL(plane_hash);
+    status = 0;
+    for(int64_t kk = 0; kk < Z; kk++)
+    {
+        if(fread(plane, 1, plane_bytes, fid) != plane_bytes)
+        {
+            status = -1;
+            break;
+        }
+        plane_hash[kk] = hash_u64(plane, plane_bytes);
+    }
+    if(status == 0)
+    {
+        hash[0] = hash_pages(plane_hash, Z);
+    }
+    free(plane_hash);
+    free(plane);
+done:
+    free(header);
+    fclose(fid);
+    return status;
+}
+
+void npy_util_ut(void)
+{
+    printf("-> testing npy_writer\n");
+    int64_t Z = 3;
+    int64_t Y = 5;
+    int64_t X = 7;
+    uint16_t * V = calloc(Z*Y*X, sizeof(uint16_t));
+    NOT_NULL(V);
+    for(int64_t kk = 0; kk < Z*Y*X; kk++)
+    {
+        V[kk] = (uint16_t) (kk*7919);
+    }
+
+    char fName[] = "/tmp/nd2tool_ut_XXXXXX";
+    int fd = mkstemp(fName);
+    if(fd < 0)
+    {
+        fprintf(stderr, "npy_util_ut: Unable to create a temporary file\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    npy_writer_t * nw = npy_writer_init(fName, Z, Y, X);
+    int64_t offset = nw->data_offset;
+    for(int64_t kk = Z-1; kk >= 0; kk--)
+    {
+        npy_writer_write_plane(nw, kk, V + kk*Y*X);
+    }
+    uint64_t whash = npy_writer_hash(nw);
+    int64_t nbytes = npy_writer_finish(nw);
+    uint64_t rhash = 0;
+    int hash_ok = npy_hash_planes(fName, &rhash) == 0 && rhash == whash;
+
+    FILE * fid = fopen(fName, "rb");
+    NOT_NULL(fid);
+    uint8_t * buf = calloc(nbytes + 1, 1);
+    NOT_NULL(buf);
+    size_t nread = fread(buf, 1, nbytes + 1, fid);
+    fclose(fid);
+    unlink(fName);
+
+    int ok = hash_ok && (int64_t) nread == nbytes && offset % 64 == 0;
+    ok = ok && memcmp(buf, "\x93NUMPY\x01\x00", 8) == 0;
+    ok = ok && buf[8] + 256*buf[9] + 10 == offset;
+    ok = ok && buf[offset-1] == '\n';
+    ok = ok && strstr((char *) buf + 10, "'shape': (3, 5, 7)") != NULL;
+    ok = ok && memcmp(buf + offset, V, Z*Y*X*sizeof(uint16_t)) == 0;
+    if(!ok)
+    {
+        fprintf(stderr, "npy_util_ut: Wrong file content\n");
+        exit(EXIT_FAILURE);
+    }
+    free(buf);
+    free(V);
+    printf("ok: %" PRId64 " bytes, data at %" PRId64 "\n", nbytes, offset);
+}
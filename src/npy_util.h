@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Writes 3D volumes of uint16_t as NumPy .npy files (format version
+ * 1.0), C-ordered with the shape (Z, Y, X).
+ *
+ * The header is padded to 64 bytes and the file is allocated to its
+ * full size by npy_writer_init, so plane z is always at
+ * data_offset + z*Y*X*2. The planes can be written in any order and
+ * from several threads. The file can be used with numpy.load(...,
+ * mmap_mode='r') or mapped directly, skipping data_offset bytes.
+ */
+
+typedef struct {
+    int fd;
+    int64_t Z;
+    int64_t Y;
+    int64_t X;
+    int64_t data_offset;
+    int64_t plane_bytes;
+    uint64_t * plane_hash; /* Z, see npy_writer_hash */
+} npy_writer_t;
+
+/* Create fName for a volume of Z planes of Y rows of X pixels. Exits
+ * on failure. */
+npy_writer_t * npy_writer_init(const char * fName,
+                               int64_t Z, int64_t Y, int64_t X);
+
+/* Write plane z. Thread safe, every plane once. */
+void npy_writer_write_plane(npy_writer_t * nw, int64_t z,
+                            const uint16_t * plane);
+
+/* The hash of the pixel data of all planes, see hash_pages. Call
+ * before npy_writer_finish when all planes are written. */
+uint64_t npy_writer_hash(const npy_writer_t * nw);
+
+/* Close the file and free nw. Returns the size of the file. */
+int64_t npy_writer_finish(npy_writer_t * nw);
+
+/* Hash the planes of a uint16 .npy file in the same way as
+ * npy_writer_hash. Returns 0 on success. */
+int npy_hash_planes(const char * fName, uint64_t * hash);
+
+/* Write a small volume and read it back */
+void npy_util_ut(void);
@@ -0,0 +1,154 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "plane_ring.h"
+
+/* A FIFO of slot indices */
+typedef struct {
+    int * idx;
+    int head; /* Next to pop */
+    int count;
+} slot_fifo_t;
+
+struct plane_ring {
+    int nslots;
+    plane_slot_t * slots;
+    slot_fifo_t empty;
+    slot_fifo_t full;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t has_empty;
+    pthread_cond_t has_full;
+};
+
+static void fifo_push(slot_fifo_t * f, int nslots, int k)
+{
+    f->idx[(f->head + f->count) % nslots] = k;
+    f->count++;
+}
+
+static int fifo_pop(slot_fifo_t * f, int nslots)
+{
+    int k = f->idx[f->head];
+    f->head = (f->head + 1) % nslots;
+    f->count--;
+    return k;
+}
+
+plane_ring_t * plane_ring_new(int nslots)
+{
+    plane_ring_t * ring = calloc(1, sizeof(plane_ring_t));
+    if(ring == NULL || nslots < 1)
+    {
+        fprintf(stderr, "plane_ring_new: Unable to create a ring with %d slots\n",
+                nslots);
+        exit(EXIT_FAILURE);
+    }
+    ring->nslots = nslots;
+    ring->slots = calloc(nslots, sizeof(plane_slot_t));
+    ring->empty.idx = calloc(nslots, sizeof(int));
+    ring->full.idx = calloc(nslots, sizeof(int));
+    if(ring->slots == NULL || ring->empty.idx == NULL || ring->full.idx == NULL)
+    {
+        fprintf(stderr, "plane_ring_new: calloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->has_empty, NULL);
+    pthread_cond_init(&ring->has_full, NULL);
+    plane_ring_reset(ring);
+    return ring;
+}
+
+void plane_ring_reset(plane_ring_t * ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->empty.head = 0;
+    ring->empty.count = 0;
+    ring->full.head = 0;
+    ring->full.count = 0;
+    for(int kk = 0; kk < ring->nslots; kk++)
+    {
+        fifo_push(&ring->empty, ring->nslots, kk);
+    }
+    ring->closed = 0;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void plane_ring_free(plane_ring_t * ring)
+{
+    if(ring == NULL)
+    {
+        return;
+    }
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->has_empty);
+    pthread_cond_destroy(&ring->has_full);
+    free(ring->empty.idx);
+    free(ring->full.idx);
+    free(ring->slots);
+    free(ring);
+}
+
+int plane_ring_nslots(const plane_ring_t * ring)
+{
+    return ring->nslots;
+}
+
+plane_slot_t * plane_ring_slot(plane_ring_t * ring, int k)
+{
+    return ring->slots + k;
+}
+
+plane_slot_t * plane_ring_get_empty(plane_ring_t * ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    while(ring->empty.count == 0)
+    {
+        pthread_cond_wait(&ring->has_empty, &ring->lock);
+    }
+    int k = fifo_pop(&ring->empty, ring->nslots);
+    pthread_mutex_unlock(&ring->lock);
+    return ring->slots + k;
+}
+
+void plane_ring_put_full(plane_ring_t * ring, plane_slot_t * slot)
+{
+    pthread_mutex_lock(&ring->lock);
+    fifo_push(&ring->full, ring->nslots, (int) (slot - ring->slots));
+    pthread_cond_signal(&ring->has_full);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void plane_ring_close(plane_ring_t * ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->closed = 1;
+    pthread_cond_broadcast(&ring->has_full);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+plane_slot_t * plane_ring_get_full(plane_ring_t * ring)
+{
+    plane_slot_t * slot = NULL;
+    pthread_mutex_lock(&ring->lock);
+    while(ring->full.count == 0 && ring->closed == 0)
+    {
+        pthread_cond_wait(&ring->has_full, &ring->lock);
+    }
+    if(ring->full.count > 0)
+    {
+        slot = ring->slots + fifo_pop(&ring->full, ring->nslots);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return slot;
+}
+
+void plane_ring_put_empty(plane_ring_t * ring, plane_slot_t * slot)
+{
+    pthread_mutex_lock(&ring->lock);
+    fifo_push(&ring->empty, ring->nslots, (int) (slot - ring->slots));
+    pthread_cond_signal(&ring->has_empty);
+    pthread_mutex_unlock(&ring->lock);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+/* A bounded ring of image plane buffers shared by one producer
+ * thread and one or more consumer threads.
+ *
+ * The producer takes an empty slot with plane_ring_get_empty, fills
+ * it and passes it on with plane_ring_put_full. Consumers get the
+ * filled slots, in the order that they were put, with
+ * plane_ring_get_full and give them back with plane_ring_put_empty.
+ * Both sides block when there is nothing to do, so the memory usage
+ * is bounded by the number of slots.
+ *
+ * The buffers are owned by the caller, attach them to the slots with
+ * plane_ring_slot after plane_ring_new.
+ */
+
+typedef struct {
+    void * data; /* Plane buffer, set up by the caller */
+    int64_t seq; /* Which plane, set by the producer */
+} plane_slot_t;
+
+typedef struct plane_ring plane_ring_t;
+
+plane_ring_t * plane_ring_new(int nslots);
+void plane_ring_free(plane_ring_t * ring);
+
+int plane_ring_nslots(const plane_ring_t * ring);
+plane_slot_t * plane_ring_slot(plane_ring_t * ring, int k);
+
+/* Make all slots empty again and open the ring after
+ * plane_ring_close. Only when no thread is using the ring. */
+void plane_ring_reset(plane_ring_t * ring);
+
+/* Producer side */
+plane_slot_t * plane_ring_get_empty(plane_ring_t * ring);
+void plane_ring_put_full(plane_ring_t * ring, plane_slot_t * slot);
+/* No more planes will be put */
+void plane_ring_close(plane_ring_t * ring);
+
+/* Consumer side. Returns NULL when the ring is closed and there are
+ * no filled slots left */
+plane_slot_t * plane_ring_get_full(plane_ring_t * ring);
+void plane_ring_put_empty(plane_ring_t * ring, plane_slot_t * slot);
@@ -0,0 +1,518 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "prof_util.h"
+
+typedef struct {
+    uint64_t t0;
+    uint64_t dur;
+    int64_t arg;
+    int64_t stage;
+} prof_event_t;
+
+/* The counters and spans of a thread. When a thread ends its entry
+ * can be taken over by a new thread with the same name, so that the
+ * reader and writer threads that are started for each FOV don't give
+ * one line each in the trace. */
+typedef struct prof_thread {
+    int tid;
+    int active;
+    char name[32];
+    int64_t count[PROF_NSTAGES];
+    uint64_t ns[PROF_NSTAGES];
+    uint64_t max_ns[PROF_NSTAGES];
+    int64_t bytes[PROF_NSTAGES];
+    prof_event_t * events;
+    int64_t nevents;
+    int64_t nalloc;
+    struct prof_thread * next;
+} prof_thread_t;
+
+static const struct {
+    const char * name;
+    const char * arg; /* Name of the argument in the trace */
+} prof_stages[PROF_NSTAGES] = {
+    [PROF_READ] = {"read", "seq"},
+    [PROF_DEINTERLEAVE] = {"deinterleave", "seq"},
+    [PROF_FOCUS] = {"focus", "seq"},
+    [PROF_WRITE] = {"write", "seq"},
+    [PROF_FINISH] = {"finish", NULL},
+    [PROF_RENAME] = {"rename", NULL},
+    [PROF_WAIT_PLANE] = {"wait_plane", NULL},
+    [PROF_WAIT_SLOT] = {"wait_slot", NULL},
+    [PROF_FRAME_META] = {"frame_meta", "seq"},
+    [PROF_FOV] = {"fov", "fov"}
+};
+
+int prof_enabled = 0;
+static int prof_trace = 0;
+static uint64_t prof_t0 = 0;
+static pthread_key_t prof_key;
+static pthread_once_t prof_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static prof_thread_t * prof_threads = NULL;
+static int prof_nthreads = 0;
+
+static uint64_t prof_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+uint64_t prof_now(void)
+{
+    return prof_clock() - prof_t0;
+}
+
+const char * prof_stage_name(prof_stage_t stage)
+{
+    if(stage < 0 || stage >= PROF_NSTAGES)
+    {
+        return "unknown";
+    }
+    return prof_stages[stage].name;
+}
+
+/* Called when a thread ends */
+static void prof_release(void * p)
+{
+    prof_thread_t * t = (prof_thread_t *) p;
+    pthread_mutex_lock(&prof_lock);
+    t->active = 0;
+    pthread_mutex_unlock(&prof_lock);
+}
+
+static void prof_key_create(void)
+{
+    if(pthread_key_create(&prof_key, prof_release) != 0)
+    {
+        fprintf(stderr, "prof_util: Failed to create a thread key\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Get an entry for the calling thread, a free one with the same name
+ * if possible */
+static prof_thread_t * prof_register(const char * name)
+{
+    pthread_mutex_lock(&prof_lock);
+    prof_thread_t * t = prof_threads;
+    prof_thread_t * last = NULL;
+    while(t != NULL)
+    {
+        if(t->active == 0 && strcmp(t->name, name) == 0)
+        {
+            break;
+        }
+        last = t;
+        t = t->next;
+    }
+    if(t == NULL)
+    {
+        t = calloc(1, sizeof(prof_thread_t));
+        if(t == NULL)
+        {
+            fprintf(stderr, "prof_util: Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        t->tid = prof_nthreads++;
+        snprintf(t->name, sizeof(t->name), "%s", name);
+        if(last == NULL)
+        {
+            prof_threads = t;
+        } else {
+            last->next = t;
+        }
+    }
+    t->active = 1;
+    pthread_mutex_unlock(&prof_lock);
+    pthread_setspecific(prof_key, t);
+    return t;
+}
+
+static prof_thread_t * prof_self(void)
+{
+    prof_thread_t * t = (prof_thread_t *) pthread_getspecific(prof_key);
+    if(t == NULL)
+    {
+        t = prof_register("");
+    }
+    return t;
+}
+
+void prof_init(int trace)
+{
+    pthread_once(&prof_key_once, prof_key_create);
+    /* prof_now is never 0 so that prof_begin can return 0 when
+     * disabled */
+    prof_t0 = prof_clock() - 1;
+    prof_trace = trace;
+    prof_enabled = 1;
+}
+
+void prof_thread_name(const char * name)
+{
+    if(!prof_enabled)
+    {
+        return;
+    }
+    prof_thread_t * t = (prof_thread_t *) pthread_getspecific(prof_key);
+    if(t == NULL)
+    {
+        prof_register(name);
+        return;
+    }
+    pthread_mutex_lock(&prof_lock);
+    if(t->name[0] == '\0')
+    {
+        snprintf(t->name, sizeof(t->name), "%s", name);
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+
+void prof_end_span(prof_stage_t stage, uint64_t t0, int64_t bytes, int64_t arg)
+{
+    uint64_t dur = prof_now() - t0;
+    prof_thread_t * t = prof_self();
+    t->count[stage]++;
+    t->ns[stage] += dur;
+    t->bytes[stage] += bytes;
+    if(dur > t->max_ns[stage])
+    {
+        t->max_ns[stage] = dur;
+    }
+    if(!prof_trace)
+    {
+        return;
+    }
+    if(t->nevents == t->nalloc)
+    {
+        t->nalloc = t->nalloc == 0 ? 1024 : 2*t->nalloc;
+        t->events = realloc(t->events, t->nalloc*sizeof(prof_event_t));
+        if(t->events == NULL)
+        {
+            fprintf(stderr, "prof_util: Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    prof_event_t * e = t->events + t->nevents++;
+    e->t0 = t0;
+    e->dur = dur;
+    e->arg = arg;
+    e->stage = stage;
+}
+
+void prof_summary(FILE * fid, const char * title)
+{
+    int64_t count[PROF_NSTAGES] = {0};
+    uint64_t ns[PROF_NSTAGES] = {0};
+    uint64_t max_ns[PROF_NSTAGES] = {0};
+    int64_t bytes[PROF_NSTAGES] = {0};
+
+    pthread_mutex_lock(&prof_lock);
+    for(prof_thread_t * t = prof_threads; t != NULL; t = t->next)
+    {
+        for(int ss = 0; ss < PROF_NSTAGES; ss++)
+        {
+            count[ss] += t->count[ss];
+            ns[ss] += t->ns[ss];
+            bytes[ss] += t->bytes[ss];
+            if(t->max_ns[ss] > max_ns[ss])
+            {
+                max_ns[ss] = t->max_ns[ss];
+            }
+        }
+    }
+
+    /* Print everything at once since several processes might write
+     * to fid */
+    char * buf = NULL;
+    size_t len = 0;
+    FILE * out = open_memstream(&buf, &len);
+    if(out == NULL)
+    {
+        pthread_mutex_unlock(&prof_lock);
+        return;
+    }
+    fprintf(out, "Profile of %s (times summed over the threads)\n", title);
+    fprintf(out, "%-13s %8s %10s %10s %10s %10s %8s\n",
+            "Stage", "Calls", "Time [s]", "Mean [ms]", "Max [ms]", "MB", "MB/s");
+    for(int ss = 0; ss < PROF_NSTAGES; ss++)
+    {
+        if(count[ss] == 0)
+        {
+            continue;
+        }
+        fprintf(out, "%-13s %8" PRId64 " %10.3f %10.3f %10.3f",
+                prof_stages[ss].name, count[ss], (double) ns[ss]*1e-9,
+                (double) ns[ss]*1e-6 / (double) count[ss],
+                (double) max_ns[ss]*1e-6);
+        if(bytes[ss] > 0 && ns[ss] > 0)
+        {
+            fprintf(out, " %10.1f %8.0f", (double) bytes[ss]*1e-6,
+                    (double) bytes[ss] / (double) ns[ss] * 1e3);
+        }
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "Time per thread [s]\n");
+    fprintf(out, "%-6s %-10s", "Thread", "Name");
+    for(int ss = 0; ss < PROF_NSTAGES; ss++)
+    {
+        if(count[ss] > 0)
+        {
+            fprintf(out, " %*s", (int) (strlen(prof_stages[ss].name) < 6 ? 6 :
+                                        strlen(prof_stages[ss].name)),
+                    prof_stages[ss].name);
+        }
+    }
+    fprintf(out, "\n");
+    for(prof_thread_t * t = prof_threads; t != NULL; t = t->next)
+    {
+        fprintf(out, "%-6d %-10s", t->tid, t->name[0] ? t->name : "-");
+        for(int ss = 0; ss < PROF_NSTAGES; ss++)
+        {
+            if(count[ss] > 0)
+            {
+                fprintf(out, " %*.3f", (int) (strlen(prof_stages[ss].name) < 6 ? 6 :
+                                              strlen(prof_stages[ss].name)),
+                        (double) t->ns[ss]*1e-9);
+            }
+        }
+        fprintf(out, "\n");
+    }
+    pthread_mutex_unlock(&prof_lock);
+    fclose(out);
+    fwrite(buf, 1, len, fid);
+    fflush(fid);
+    free(buf);
+}
+
+/* Write s as a JSON string */
+static void prof_json_string(FILE * fid, const char * s)
+{
+    fputc('"', fid);
+    for( ; *s != '\0'; s++)
+    {
+        unsigned char c = (unsigned char) *s;
+        if(c == '"' || c == '\\')
+        {
+            fprintf(fid, "\\%c", c);
+        } else if(c < 0x20)
+        {
+            fprintf(fid, "\\u%04x", c);
+        } else {
+            fputc(c, fid);
+        }
+    }
+    fputc('"', fid);
+}
+
+int64_t prof_write_events(FILE * fid, int pid, const char * pname)
+{
+    int64_t nevents = 0;
+    pthread_mutex_lock(&prof_lock);
+    fprintf(fid, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":", pid);
+    prof_json_string(fid, pname);
+    fprintf(fid, "}}");
+    for(prof_thread_t * t = prof_threads; t != NULL; t = t->next)
+    {
+        fprintf(fid, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"name\":", pid, t->tid);
+        prof_json_string(fid, t->name[0] ? t->name : "thread");
+        fprintf(fid, "}}");
+        for(int64_t kk = 0; kk < t->nevents; kk++)
+        {
+            const prof_event_t * e = t->events + kk;
+            fprintf(fid, ",\n{\"name\":\"%s\",\"cat\":\"nd2tool\",\"ph\":\"X\","
+                    "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+                    prof_stages[e->stage].name, (double) e->t0*1e-3,
+                    (double) e->dur*1e-3, pid, t->tid);
+            if(prof_stages[e->stage].arg != NULL && e->arg >= 0)
+            {
+                fprintf(fid, ",\"args\":{\"%s\":%" PRId64 "}",
+                        prof_stages[e->stage].arg, e->arg);
+            }
+            fprintf(fid, "}");
+        }
+        nevents += t->nevents;
+    }
+    pthread_mutex_unlock(&prof_lock);
+    return nevents;
+}
+
+int prof_write_trace(const char * fName, int pid, const char * pname)
+{
+    FILE * fid = fopen(fName, "w");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "Unable to write the trace to %s\n", fName);
+        return EXIT_FAILURE;
+    }
+    fprintf(fid, "{\"traceEvents\":[\n");
+    prof_write_events(fid, pid, pname);
+    fprintf(fid, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    if(fclose(fid) != 0)
+    {
+        fprintf(stderr, "Unable to write the trace to %s\n", fName);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int prof_merge_traces(const char * fName, char ** parts, int nparts)
+{
+    FILE * fid = fopen(fName, "w");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "Unable to write the trace to %s\n", fName);
+        return EXIT_FAILURE;
+    }
+    fprintf(fid, "{\"traceEvents\":[\n");
+    int first = 1;
+    char buf[65536];
+    for(int kk = 0; kk < nparts; kk++)
+    {
+        FILE * part = fopen(parts[kk], "r");
+        if(part == NULL)
+        {
+            continue;
+        }
+        size_t n = 0;
+        while((n = fread(buf, 1, sizeof(buf), part)) > 0)
+        {
+            if(first == 0)
+            {
+                fprintf(fid, ",\n");
+            }
+            first = -1;
+            fwrite(buf, 1, n, fid);
+        }
+        if(first == -1)
+        {
+            first = 0;
+        }
+        fclose(part);
+        unlink(parts[kk]);
+    }
+    fprintf(fid, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    if(fclose(fid) != 0)
+    {
+        fprintf(stderr, "Unable to write the trace to %s\n", fName);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void prof_free(void)
+{
+    pthread_once(&prof_key_once, prof_key_create);
+    pthread_mutex_lock(&prof_lock);
+    prof_thread_t * t = prof_threads;
+    while(t != NULL)
+    {
+        prof_thread_t * next = t->next;
+        free(t->events);
+        free(t);
+        t = next;
+    }
+    prof_threads = NULL;
+    prof_nthreads = 0;
+    prof_enabled = 0;
+    prof_trace = 0;
+    pthread_mutex_unlock(&prof_lock);
+    pthread_setspecific(prof_key, NULL);
+}
+
+/* p[0] is the number of spans. When p[1] > 0 the threads wait for
+ * each other after registering, until p[2] reaches p[1] */
+static void * prof_ut_thread(void * p)
+{
+    int * n = (int *) p;
+    prof_thread_name("ut");
+    __atomic_fetch_add(n + 2, 1, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(n + 2, __ATOMIC_SEQ_CST) < n[1])
+    {
+        sched_yield();
+    }
+    for(int kk = 0; kk < n[0]; kk++)
+    {
+        uint64_t t0 = prof_begin();
+        prof_end(PROF_WRITE, t0, 100, kk);
+    }
+    return NULL;
+}
+
+void prof_ut(void)
+{
+    printf("-> testing prof_util\n");
+    if(prof_begin() != 0)
+    {
+        fprintf(stderr, "prof_ut: prof_begin should return 0 when disabled\n");
+        exit(EXIT_FAILURE);
+    }
+    prof_init(1);
+    prof_thread_name("main");
+    uint64_t t0 = prof_begin();
+    prof_end(PROF_READ, t0, 1000, 7);
+
+    /* Two threads one after the other share an entry, two at the
+     * same time don't */
+    int n = 10;
+    int arg[3] = {n, 0, 0};
+    pthread_t th[2];
+    pthread_create(th, NULL, prof_ut_thread, arg);
+    pthread_join(th[0], NULL);
+    arg[1] = 2;
+    arg[2] = 0;
+    pthread_create(th, NULL, prof_ut_thread, arg);
+    pthread_create(th+1, NULL, prof_ut_thread, arg);
+    pthread_join(th[0], NULL);
+    pthread_join(th[1], NULL);
+
+    int ok = prof_nthreads == 3;
+    int64_t nwrite = 0;
+    for(prof_thread_t * t = prof_threads; t != NULL; t = t->next)
+    {
+        nwrite += t->count[PROF_WRITE];
+    }
+    ok = ok && nwrite == 3*n;
+
+    char part[] = "/tmp/prof_ut_XXXXXX";
+    int fd = mkstemp(part);
+    FILE * fid = fd < 0 ? NULL : fdopen(fd, "w");
+    ok = ok && fid != NULL;
+    if(fid != NULL)
+    {
+        ok = ok && prof_write_events(fid, 1, "a \"file\"") == 3*n + 1;
+        fclose(fid);
+        char * parts[2] = {part, part};
+        char trace[sizeof(part) + 8];
+        snprintf(trace, sizeof(trace), "%s.json", part);
+        /* The second part is already removed */
+        ok = ok && prof_merge_traces(trace, parts, 2) == EXIT_SUCCESS;
+        FILE * tf = fopen(trace, "r");
+        char head[20] = {0};
+        ok = ok && tf != NULL && fread(head, 1, 16, tf) == 16
+            && strcmp(head, "{\"traceEvents\":[") == 0;
+        if(tf != NULL)
+        {
+            fclose(tf);
+        }
+        unlink(trace);
+    }
+    prof_free();
+    if(!ok || prof_begin() != 0)
+    {
+        fprintf(stderr, "prof_ut: failed\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("ok: prof_util\n");
+}
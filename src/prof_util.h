@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Timing of the stages of the conversion, see --profile and --trace.
+ *
+ * A stage is timed with
+ *
+ *   uint64_t t0 = prof_begin();
+ *   ... work ...
+ *   prof_end(PROF_READ, t0, nbytes, seq);
+ *
+ * Each thread has its own counters and, with tracing, its own list of
+ * spans, so the threads don't have to synchronize. When profiling is
+ * not enabled prof_begin returns 0 and prof_end does nothing, all that
+ * is left is a test of prof_enabled.
+ *
+ * The trace is in the Chrome trace event format, open it in
+ * https://ui.perfetto.dev or chrome://tracing
+ */
+
+typedef enum {
+    PROF_READ, /* Get an image plane from the nd2 file */
+    PROF_DEINTERLEAVE, /* Separate the channels of a plane */
+    PROF_FOCUS, /* The focus measure of a plane, see --focus */
+    PROF_WRITE, /* Give a plane to a writer */
+    PROF_FINISH, /* Finish an output file, e.g. write the tif directories */
+    PROF_RENAME, /* Move a finished file to its final name */
+    PROF_WAIT_PLANE, /* A writer waiting for the reader */
+    PROF_WAIT_SLOT, /* The reader waiting for a free slot */
+    PROF_FRAME_META, /* Read and parse the metadata of a frame */
+    PROF_FOV, /* Everything for one FOV */
+    PROF_NSTAGES
+} prof_stage_t;
+
+extern int prof_enabled;
+
+/* Nanoseconds since prof_init */
+uint64_t prof_now(void);
+
+static inline uint64_t prof_begin(void)
+{
+    return prof_enabled ? prof_now() : 0;
+}
+
+void prof_end_span(prof_stage_t stage, uint64_t t0, int64_t bytes, int64_t arg);
+
+/* arg is shown in the trace, e.g. the sequence index of a plane.
+ * Negative to leave out. */
+static inline void prof_end(prof_stage_t stage, uint64_t t0,
+                            int64_t bytes, int64_t arg)
+{
+    if(t0 != 0)
+    {
+        prof_end_span(stage, t0, bytes, arg);
+    }
+}
+
+/* Start profiling. With trace != 0 all spans are kept for
+ * prof_write_trace, otherwise only the counters. */
+void prof_init(int trace);
+
+/* Name the calling thread in the summary and the trace, unless it
+ * already has a name. E.g. a job of a thread pool is run by the
+ * calling thread when the pool has a single thread. */
+void prof_thread_name(const char * name);
+
+const char * prof_stage_name(prof_stage_t stage);
+
+/* Print the time per stage, and per thread */
+void prof_summary(FILE * fid, const char * title);
+
+/* Write the spans as trace events, separated by commas but without
+ * the surrounding array. pid and pname identify the process, i.e. the
+ * file, in the trace. Returns the number of events. */
+int64_t prof_write_events(FILE * fid, int pid, const char * pname);
+
+/* Write a complete trace. Returns EXIT_SUCCESS or EXIT_FAILURE */
+int prof_write_trace(const char * fName, int pid, const char * pname);
+
+/* Write the events from the files in parts, see prof_write_events, as
+ * one trace to fName and remove the parts. Missing parts are
+ * skipped. Returns EXIT_SUCCESS or EXIT_FAILURE */
+int prof_merge_traces(const char * fName, char ** parts, int nparts);
+
+/* Free everything and stop profiling */
+void prof_free(void);
+
+void prof_ut(void);
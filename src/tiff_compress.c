@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+#ifdef ND2TOOL_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "tiff_compress.h"
+
+/* Values of the TIFF Compression tag */
+#define TC_NONE 1
+#define TC_LZW 5
+#define TC_DEFLATE 8
+#define TC_ZSTD 50000
+
+/* Levels that favour speed since the compression should keep up
+ * with the reading of the nd2 file */
+#define DEFLATE_LEVEL 1
+#define ZSTD_LEVEL 3
+
+uint16_t tiff_compress_from_name(const char * name)
+{
+    if(strcmp(name, "none") == 0)
+    {
+        return TC_NONE;
+    }
+    if(strcmp(name, "lzw") == 0)
+    {
+        return TC_LZW;
+    }
+    if(strcmp(name, "deflate") == 0)
+    {
+        return TC_DEFLATE;
+    }
+#ifdef ND2TOOL_HAVE_ZSTD
+    if(strcmp(name, "zstd") == 0)
+    {
+        return TC_ZSTD;
+    }
+#endif
+    return 0;
+}
+
+const char * tiff_compress_name(uint16_t method)
+{
+    switch(method)
+    {
+    case TC_NONE:
+        return "none";
+    case TC_LZW:
+        return "lzw";
+    case TC_DEFLATE:
+        return "deflate";
+    case TC_ZSTD:
+        return "zstd";
+    default:
+        return "unknown";
+    }
+}
+
+void tiff_predictor_u16(uint16_t * data, size_t width, size_t nrows)
+{
+    for(size_t rr = 0; rr < nrows; rr++)
+    {
+        uint16_t * row = data + rr*width;
+        for(size_t kk = width-1; kk > 0; kk--)
+        {
+            row[kk] -= row[kk-1];
+        }
+    }
+}
+
+size_t tiff_compress_bound(uint16_t method, size_t n)
+{
+    switch(method)
+    {
+    case TC_LZW:
+        /* At most one 12-bit code per byte plus the clear codes */
+        return n + n/2 + n/1000 + 64;
+    case TC_DEFLATE:
+        return compressBound(n);
+#ifdef ND2TOOL_HAVE_ZSTD
+    case TC_ZSTD:
+        return ZSTD_compressBound(n);
+#endif
+    default:
+        return n;
+    }
+}
+
+size_t tiff_compress(uint16_t method, void * out, size_t outsize,
+                     const void * in, size_t n)
+{
+    switch(method)
+    {
+    case TC_NONE:
+        if(outsize < n)
+        {
+            return 0;
+        }
+        memcpy(out, in, n);
+        return n;
+    case TC_LZW:
+        return tiff_lzw_encode(out, outsize, in, n);
+    case TC_DEFLATE:
+    {
+        uLongf len = outsize;
+        if(compress2(out, &len, in, n, DEFLATE_LEVEL) != Z_OK)
+        {
+            return 0;
+        }
+        return len;
+    }
+#ifdef ND2TOOL_HAVE_ZSTD
+    case TC_ZSTD:
+    {
+        size_t len = ZSTD_compress(out, outsize, in, n, ZSTD_LEVEL);
+        if(ZSTD_isError(len))
+        {
+            return 0;
+        }
+        return len;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+/*
+ * LZW as described in section 13 of the TIFF 6.0 specification,
+ * with the code width increased one code early like libtiff does.
+ */
+
+#define LZW_CLEAR 256
+#define LZW_EOI 257
+#define LZW_FIRST 258
+#define LZW_MAXCODE(n) ((1u << (n)) - 1)
+#define LZW_HBITS 13
+#define LZW_HSIZE (1u << LZW_HBITS)
+
+typedef struct{
+    uint8_t * out;
+    size_t outsize;
+    size_t pos;
+    uint32_t acc;
+    int nacc;
+    int overflow;
+} lzw_bits_t;
+
+static void lzw_put(lzw_bits_t * b, unsigned code, int nbits)
+{
+    b->acc = (b->acc << nbits) | code;
+    b->nacc += nbits;
+    while(b->nacc >= 8)
+    {
+        b->nacc -= 8;
+        if(b->pos < b->outsize)
+        {
+            b->out[b->pos++] = (uint8_t) (b->acc >> b->nacc);
+        } else {
+            b->overflow = 1;
+        }
+    }
+    b->acc &= (1u << b->nacc) - 1;
+}
+
+static void lzw_flush(lzw_bits_t * b)
+{
+    if(b->nacc > 0)
+    {
+        lzw_put(b, 0, 8 - b->nacc);
+    }
+}
+
+static uint32_t lzw_hash(uint32_t key)
+{
+    return (key * 2654435761u) >> (32 - LZW_HBITS);
+}
+
+size_t tiff_lzw_encode(uint8_t * out, size_t outsize,
+                       const uint8_t * in, size_t n)
+{
+    lzw_bits_t b = {0};
+    b.out = out;
+    b.outsize = outsize;
+
+    /* String table as a hash of (prefix code, byte) -> code. The
+     * keys are stored +1 so that 0 means empty */
+    uint32_t * keys = calloc(LZW_HSIZE, sizeof(uint32_t));
+    uint16_t * codes = calloc(LZW_HSIZE, sizeof(uint16_t));
+    if(keys == NULL || codes == NULL)
+    {
+        fprintf(stderr, "tiff_lzw_encode: calloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int nbits = 9;
+    unsigned maxcode = LZW_MAXCODE(9);
+    unsigned free_ent = LZW_FIRST;
+    lzw_put(&b, LZW_CLEAR, nbits);
+
+    if(n > 0)
+    {
+        unsigned prefix = in[0];
+        for(size_t kk = 1; kk < n; kk++)
+        {
+            uint32_t key = (prefix << 8 | in[kk]) + 1;
+            uint32_t h = lzw_hash(key);
+            while(keys[h] != 0 && keys[h] != key)
+            {
+                h = (h + 1) & (LZW_HSIZE - 1);
+            }
+            if(keys[h] == key)
+            {
+                prefix = codes[h];
+                continue;
+            }
+
+            lzw_put(&b, prefix, nbits);
+            keys[h] = key;
+            codes[h] = (uint16_t) free_ent++;
+            if(free_ent == LZW_MAXCODE(12) - 1)
+            {
+                /* The table is full, start over */
+                lzw_put(&b, LZW_CLEAR, nbits);
+                memset(keys, 0, LZW_HSIZE*sizeof(uint32_t));
+                nbits = 9;
+                maxcode = LZW_MAXCODE(9);
+                free_ent = LZW_FIRST;
+            } else if(free_ent > maxcode)
+            {
+                nbits++;
+                maxcode = LZW_MAXCODE(nbits);
+            }
+            prefix = in[kk];
+        }
+
+        lzw_put(&b, prefix, nbits);
+        /* The decoder adds one more entry when reading prefix */
+        free_ent++;
+        if(free_ent == LZW_MAXCODE(12) - 1)
+        {
+            lzw_put(&b, LZW_CLEAR, nbits);
+            nbits = 9;
+        } else if(free_ent > maxcode)
+        {
+            nbits++;
+        }
+    }
+    lzw_put(&b, LZW_EOI, nbits);
+    lzw_flush(&b);
+
+    free(keys);
+    free(codes);
+    if(b.overflow)
+    {
+        return 0;
+    }
+    return b.pos;
+}
+
+/* Decoder, only used to test the encoder. Returns the number of
+ * bytes written to out or 0 on errors. */
+static size_t lzw_decode(uint8_t * out, size_t outsize,
+                         const uint8_t * in, size_t n)
+{
+    uint16_t prefix[4096];
+    uint8_t suffix[4096];
+    uint8_t first[4096];
+    uint16_t length[4096];
+    uint8_t stack[4096];
+    for(int kk = 0; kk < 256; kk++)
+    {
+        suffix[kk] = (uint8_t) kk;
+        first[kk] = (uint8_t) kk;
+        length[kk] = 1;
+    }
+
+    size_t bitpos = 0;
+    size_t pos = 0;
+    int nbits = 9;
+    unsigned free_ent = LZW_FIRST;
+    int old = -1;
+    while(bitpos + nbits <= 8*n)
+    {
+        unsigned code = 0;
+        for(int bb = 0; bb < nbits; bb++)
+        {
+            size_t p = bitpos + bb;
+            code = (code << 1) | ((in[p/8] >> (7 - p%8)) & 1);
+        }
+        bitpos += nbits;
+
+        if(code == LZW_EOI)
+        {
+            return pos;
+        }
+        if(code == LZW_CLEAR)
+        {
+            nbits = 9;
+            free_ent = LZW_FIRST;
+            old = -1;
+            continue;
+        }
+        if(old == -1)
+        {
+            if(code > 255 || pos == outsize)
+            {
+                return 0;
+            }
+            out[pos++] = (uint8_t) code;
+            old = code;
+            continue;
+        }
+        if(code > free_ent || free_ent > 4095)
+        {
+            return 0;
+        }
+        /* Add old + first byte of the string for code */
+        prefix[free_ent] = (uint16_t) old;
+        first[free_ent] = first[old];
+        suffix[free_ent] = code < free_ent ? first[code] : first[old];
+        length[free_ent] = length[old] + 1;
+        free_ent++;
+
+        /* Write out the string for code */
+        int len = length[code];
+        if(pos + len > outsize)
+        {
+            return 0;
+        }
+        unsigned c = code;
+        for(int kk = len-1; kk >= 0; kk--)
+        {
+            stack[kk] = suffix[c];
+            c = prefix[c];
+        }
+        memcpy(out + pos, stack, len);
+        pos += len;
+
+        if(free_ent >= LZW_MAXCODE(nbits) && nbits < 12)
+        {
+            nbits++;
+        }
+        old = code;
+    }
+    return 0;
+}
+
+static int tiff_decompress(uint16_t method, void * out, size_t outsize,
+                           const void * in, size_t n)
+{
+    switch(method)
+    {
+    case TC_NONE:
+        memcpy(out, in, n);
+        return n == outsize;
+    case TC_LZW:
+        return lzw_decode(out, outsize, in, n) == outsize;
+    case TC_DEFLATE:
+    {
+        uLongf len = outsize;
+        return uncompress(out, &len, in, n) == Z_OK && len == outsize;
+    }
+#ifdef ND2TOOL_HAVE_ZSTD
+    case TC_ZSTD:
+        return ZSTD_decompress(out, outsize, in, n) == outsize;
+#endif
+    default:
+        return 0;
+    }
+}
+
+void tiff_compress_ut(void)
+{
+    printf("-> testing tiff_compress\n");
+    const char * names[] = {"none", "lzw", "deflate", "zstd"};
+    size_t width = 512;
+    size_t nrows = 100;
+    size_t n = width*nrows*sizeof(uint16_t);
+    uint16_t * image = malloc(n);
+    uint16_t * pred = malloc(n);
+    uint16_t * dec = malloc(n);
+    if(image == NULL || pred == NULL || dec == NULL)
+    {
+        fprintf(stderr, "tiff_compress_ut: malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    /* Smooth background with noise, and a constant part that gives
+     * long LZW strings */
+    uint32_t rng = 1;
+    for(size_t kk = 0; kk < width*nrows; kk++)
+    {
+        rng = rng*1664525u + 1013904223u;
+        image[kk] = (uint16_t) (1000 + kk % 97 + (rng >> 28));
+        if(kk > width*nrows/2)
+        {
+            image[kk] = 7;
+        }
+    }
+
+    for(size_t mm = 0; mm < sizeof(names)/sizeof(names[0]); mm++)
+    {
+        uint16_t method = tiff_compress_from_name(names[mm]);
+        if(method == 0)
+        {
+            printf("skipping %s, not available\n", names[mm]);
+            continue;
+        }
+        memcpy(pred, image, n);
+        tiff_predictor_u16(pred, width, nrows);
+        size_t bound = tiff_compress_bound(method, n);
+        uint8_t * comp = malloc(bound);
+        size_t ncomp = tiff_compress(method, comp, bound, pred, n);
+        if(ncomp == 0 || !tiff_decompress(method, dec, n, comp, ncomp))
+        {
+            fprintf(stderr, "tiff_compress_ut: %s failed\n", names[mm]);
+            exit(EXIT_FAILURE);
+        }
+        /* Undo the predictor */
+        for(size_t rr = 0; rr < nrows; rr++)
+        {
+            for(size_t kk = 1; kk < width; kk++)
+            {
+                dec[rr*width + kk] += dec[rr*width + kk-1];
+            }
+        }
+        if(memcmp(dec, image, n) != 0)
+        {
+            fprintf(stderr, "tiff_compress_ut: %s did not round trip\n", names[mm]);
+            exit(EXIT_FAILURE);
+        }
+        printf("ok: %s %zu -> %zu bytes\n", names[mm], n, ncomp);
+        free(comp);
+    }
+    free(image);
+    free(pred);
+    free(dec);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compression of TIFF strips, see tiff_writer.
+ *
+ * The methods are identified by their value of the TIFF Compression
+ * tag. Deflate uses zlib, zstd is only available when built with
+ * ND2TOOL_HAVE_ZSTD and LZW is implemented here.
+ */
+
+/* Parse "none", "lzw", "deflate" or "zstd". Returns the TIFF
+ * Compression value or 0 if the name isn't known or the method is
+ * not available. */
+uint16_t tiff_compress_from_name(const char * name);
+
+/* Inverse of tiff_compress_from_name */
+const char * tiff_compress_name(uint16_t method);
+
+/* Apply the horizontal differencing predictor (Predictor = 2) to
+ * nrows rows of width pixels */
+void tiff_predictor_u16(uint16_t * data, size_t width, size_t nrows);
+
+/* Upper bound of the compressed size of n bytes */
+size_t tiff_compress_bound(uint16_t method, size_t n);
+
+/* Compress n bytes from in to out which has room for outsize bytes,
+ * at least tiff_compress_bound. Returns the number of bytes written
+ * to out or 0 on failure. */
+size_t tiff_compress(uint16_t method, void * out, size_t outsize,
+                     const void * in, size_t n);
+
+/* TIFF LZW, MSB first codes with early change */
+size_t tiff_lzw_encode(uint8_t * out, size_t outsize,
+                       const uint8_t * in, size_t n);
+
+/* Round trip tests of the methods */
+void tiff_compress_ut(void);
@@ -1,4 +1,9 @@
+#include <errno.h>
+#include <sys/stat.h>
+
 #include "tiff_util.h"
+#include "tiff_compress.h"
+#include "hash_util.h"
 
 #define NOT_NULL(x) {                                           \
         if(x == NULL){                                          \
@@ -29,9 +34,706 @@ void tiffErrHandler(const char* module, const char* fmt, va_list ap)
 }
 
 
+/* A TIFF image file directory (IFD) under construction, see
+ * tifd_add. Values that don't fit in an entry are pointed to and
+ * have to stay valid until tifd_serialize. */
+#define TIFD_MAX_ENTRIES 24
+
+typedef struct{
+    uint16_t tag;
+    uint16_t type;
+    uint64_t count;
+    uint8_t value[8]; /* The value when it fits in the entry */
+    const void * data; /* Otherwise the value is here */
+} tifd_entry_t;
+
+typedef struct{
+    int bigtiff;
+    int n;
+    tifd_entry_t entry[TIFD_MAX_ENTRIES];
+} tifd_t;
+
+static size_t tifd_type_size(uint16_t type)
+{
+    switch(type)
+    {
+    case TIFF_BYTE:
+    case TIFF_ASCII:
+        return 1;
+    case TIFF_SHORT:
+        return 2;
+    case TIFF_LONG:
+    case TIFF_IFD:
+        return 4;
+    case TIFF_RATIONAL:
+    case TIFF_LONG8:
+    case TIFF_IFD8:
+        return 8;
+    default:
+        fprintf(stderr, "tifd: Unsupported type %d\n", type);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Size of the value field in an entry */
+static size_t tifd_value_size(const tifd_t * ifd)
+{
+    return ifd->bigtiff ? 8 : 4;
+}
+
+/* Add an entry, they are kept sorted by tag as the standard
+ * requires */
+static void tifd_add(tifd_t * ifd, uint16_t tag, uint16_t type,
+                     uint64_t count, const void * values)
+{
+    if(ifd->n == TIFD_MAX_ENTRIES)
+    {
+        fprintf(stderr, "tifd: Too many entries\n");
+        exit(EXIT_FAILURE);
+    }
+    int pos = ifd->n;
+    while(pos > 0 && ifd->entry[pos-1].tag > tag)
+    {
+        ifd->entry[pos] = ifd->entry[pos-1];
+        pos--;
+    }
+    tifd_entry_t * e = ifd->entry + pos;
+    memset(e, 0, sizeof(tifd_entry_t));
+    e->tag = tag;
+    e->type = type;
+    e->count = count;
+    size_t nbytes = count*tifd_type_size(type);
+    if(nbytes <= tifd_value_size(ifd))
+    {
+        memcpy(e->value, values, nbytes);
+    } else {
+        e->data = values;
+    }
+    ifd->n++;
+}
+
+static void tifd_add_short(tifd_t * ifd, uint16_t tag, uint16_t value)
+{
+    tifd_add(ifd, tag, TIFF_SHORT, 1, &value);
+}
+
+static void tifd_add_long(tifd_t * ifd, uint16_t tag, uint32_t value)
+{
+    tifd_add(ifd, tag, TIFF_LONG, 1, &value);
+}
+
+/* File offsets or byte counts, LONG or LONG8 depending on the
+ * format. For classic TIFF the values are converted to 32-bit in
+ * scratch which has to have room for n values. */
+static void tifd_add_offsets(tifd_t * ifd, uint16_t tag, int64_t n,
+                             const uint64_t * values, uint32_t * scratch)
+{
+    if(ifd->bigtiff)
+    {
+        tifd_add(ifd, tag, TIFF_LONG8, n, values);
+    } else {
+        for(int64_t kk = 0; kk < n; kk++)
+        {
+            scratch[kk] = (uint32_t) values[kk];
+        }
+        tifd_add(ifd, tag, TIFF_LONG, n, scratch);
+    }
+}
+
+/* Offsets to other IFDs, like tifd_add_offsets */
+static void tifd_add_ifds(tifd_t * ifd, uint16_t tag, int64_t n,
+                          const uint64_t * values, uint32_t * scratch)
+{
+    if(ifd->bigtiff)
+    {
+        tifd_add(ifd, tag, TIFF_IFD8, n, values);
+    } else {
+        for(int64_t kk = 0; kk < n; kk++)
+        {
+            scratch[kk] = (uint32_t) values[kk];
+        }
+        tifd_add(ifd, tag, TIFF_IFD, n, scratch);
+    }
+}
+
+static void tifd_add_ascii(tifd_t * ifd, uint16_t tag, const char * str)
+{
+    tifd_add(ifd, tag, TIFF_ASCII, strlen(str)+1, str);
+}
+
+/* Number of bytes for the IFD including the values outside of it */
+static uint64_t tifd_nbytes(const tifd_t * ifd)
+{
+    uint64_t nbytes = ifd->bigtiff ? 8 + 20*ifd->n + 8 : 2 + 12*ifd->n + 4;
+    for(int kk = 0; kk < ifd->n; kk++)
+    {
+        const tifd_entry_t * e = ifd->entry + kk;
+        if(e->data != NULL)
+        {
+            uint64_t n = e->count*tifd_type_size(e->type);
+            nbytes += n + n % 2; /* Word aligned */
+        }
+    }
+    return nbytes;
+}
+
+/* Write the IFD to buf which will be placed at pos in the file. next
+ * is the position of the next IFD, 0 for the last one. Returns the
+ * number of bytes written, i.e. tifd_nbytes */
+static uint64_t tifd_serialize(const tifd_t * ifd, uint64_t pos,
+                               uint64_t next, uint8_t * buf)
+{
+    uint64_t nbytes = tifd_nbytes(ifd);
+    memset(buf, 0, nbytes);
+    size_t vsize = tifd_value_size(ifd);
+    size_t esize = ifd->bigtiff ? 20 : 12;
+    uint8_t * p = buf;
+    if(ifd->bigtiff)
+    {
+        uint64_t n = ifd->n;
+        memcpy(p, &n, 8); p+=8;
+    } else {
+        uint16_t n = ifd->n;
+        memcpy(p, &n, 2); p+=2;
+    }
+    uint8_t * extra = p + ifd->n*esize + vsize;
+    for(int kk = 0; kk < ifd->n; kk++)
+    {
+        const tifd_entry_t * e = ifd->entry + kk;
+        memcpy(p, &e->tag, 2);
+        memcpy(p+2, &e->type, 2);
+        if(ifd->bigtiff)
+        {
+            memcpy(p+4, &e->count, 8);
+        } else {
+            uint32_t c32 = (uint32_t) e->count;
+            memcpy(p+4, &c32, 4);
+        }
+        uint8_t * v = p + 4 + vsize;
+        if(e->data == NULL)
+        {
+            memcpy(v, e->value, vsize);
+        } else {
+            uint64_t n = e->count*tifd_type_size(e->type);
+            uint64_t offset = pos + (extra - buf);
+            if(ifd->bigtiff)
+            {
+                memcpy(v, &offset, 8);
+            } else {
+                uint32_t o32 = (uint32_t) offset;
+                memcpy(v, &o32, 4);
+            }
+            memcpy(extra, e->data, n);
+            extra += n + n % 2;
+        }
+        p += esize;
+    }
+    if(ifd->bigtiff)
+    {
+        memcpy(p, &next, 8);
+    } else {
+        uint32_t n32 = (uint32_t) next;
+        memcpy(p, &n32, 4);
+    }
+    return nbytes;
+}
+
+/* Approximate a positive number by a TIFF RATIONAL */
+static void float_to_rational(double value, uint32_t * r)
+{
+    if(!(value > 0) || value >= 4294967295.0)
+    {
+        r[0] = value > 0 ? UINT32_MAX : 0;
+        r[1] = 1;
+        return;
+    }
+    double den = value < 1 ? 4294967295.0 : floor(4294967295.0 / value);
+    uint64_t a = (uint64_t) round(value*den);
+    uint64_t b = (uint64_t) den;
+    /* Reduce the fraction */
+    uint64_t x = a, y = b;
+    while(y != 0)
+    {
+        uint64_t t = x % y;
+        x = y;
+        y = t;
+    }
+    if(x > 1)
+    {
+        a /= x;
+        b /= x;
+    }
+    r[0] = (uint32_t) a;
+    r[1] = (uint32_t) b;
+}
+
+/* Size of resolution level l, the full image halved l times, and
+ * the index of its first strip or tile within the page */
+static void tiff_writer_level(const tiff_writer_t * tw, int l,
+                              int64_t * M, int64_t * N,
+                              int64_t * nblocks, int64_t * block0)
+{
+    int64_t m = tw->M;
+    int64_t n = tw->N;
+    int64_t b0 = 0;
+    for(int kk = 0; ; kk++)
+    {
+        int64_t nb = tw->nstrips;
+        if(tw->tile > 0)
+        {
+            nb = ((m + tw->tile - 1) / tw->tile) * ((n + tw->tile - 1) / tw->tile);
+        }
+        if(kk == l)
+        {
+            M[0] = m;
+            N[0] = n;
+            nblocks[0] = nb;
+            block0[0] = b0;
+            return;
+        }
+        b0 += nb;
+        m = (m + 1) / 2;
+        n = (n + 1) / 2;
+    }
+}
+
+/* Tags for resolution level l of page k of the P pages. Level 0 is
+ * the page itself which points to the reduced resolution levels at
+ * subifds. The resolution and the strings are only put on the first
+ * page, like with ttags_set */
+typedef struct{
+    uint32_t xres[2];
+    uint32_t yres[2];
+    uint16_t pagenumber[2];
+    uint32_t * offsets32; /* tw->nstrips values each */
+    uint32_t * bytes32;
+    uint32_t * subifds32; /* tw->nlevels */
+} tifd_values_t;
+
+static void tiff_writer_page_ifd(const tiff_writer_t * tw, const ttags * T,
+                                 int64_t k, int l, const uint64_t * subifds,
+                                 tifd_values_t * values, tifd_t * ifd)
+{
+    int64_t M = 0, N = 0, nblocks = 0, block0 = 0;
+    tiff_writer_level(tw, l, &M, &N, &nblocks, &block0);
+    const uint64_t * offsets = tw->strip_offsets + k*tw->blocks_per_page + block0;
+    const uint64_t * bytes = tw->strip_bytes + k*tw->blocks_per_page + block0;
+
+    memset(ifd, 0, sizeof(tifd_t));
+    ifd->bigtiff = tw->bigtiff;
+    tifd_add_long(ifd, TIFFTAG_SUBFILETYPE,
+                  l == 0 ? FILETYPE_PAGE : FILETYPE_REDUCEDIMAGE);
+    tifd_add_long(ifd, TIFFTAG_IMAGEWIDTH, (uint32_t) N);
+    tifd_add_long(ifd, TIFFTAG_IMAGELENGTH, (uint32_t) M);
+    tifd_add_short(ifd, TIFFTAG_BITSPERSAMPLE, 16);
+    tifd_add_short(ifd, TIFFTAG_COMPRESSION, tw->compression);
+    tifd_add_short(ifd, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    tifd_add_short(ifd, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
+    tifd_add_short(ifd, TIFFTAG_SAMPLESPERPIXEL, 1);
+    if(tw->tile > 0)
+    {
+        tifd_add_long(ifd, TIFFTAG_TILEWIDTH, (uint32_t) tw->tile);
+        tifd_add_long(ifd, TIFFTAG_TILELENGTH, (uint32_t) tw->tile);
+        tifd_add_offsets(ifd, TIFFTAG_TILEOFFSETS, nblocks,
+                         offsets, values->offsets32);
+        tifd_add_offsets(ifd, TIFFTAG_TILEBYTECOUNTS, nblocks,
+                         bytes, values->bytes32);
+    } else {
+        tifd_add_offsets(ifd, TIFFTAG_STRIPOFFSETS, nblocks,
+                         offsets, values->offsets32);
+        tifd_add_long(ifd, TIFFTAG_ROWSPERSTRIP, (uint32_t) tw->rows_per_strip);
+        tifd_add_offsets(ifd, TIFFTAG_STRIPBYTECOUNTS, nblocks,
+                         bytes, values->bytes32);
+    }
+    tifd_add_short(ifd, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    if(tw->compression != COMPRESSION_NONE)
+    {
+        tifd_add_short(ifd, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+    }
+    tifd_add_short(ifd, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
+    if(l > 0)
+    {
+        return;
+    }
+
+    /* PageNumber is 16-bit, left out for files with more pages */
+    if(tw->P <= UINT16_MAX)
+    {
+        values->pagenumber[0] = (uint16_t) k;
+        values->pagenumber[1] = (uint16_t) tw->P;
+        tifd_add(ifd, TIFFTAG_PAGENUMBER, TIFF_SHORT, 2, values->pagenumber);
+    }
+    if(tw->nlevels > 1)
+    {
+        tifd_add_ifds(ifd, TIFFTAG_SUBIFD, tw->nlevels - 1,
+                      subifds, values->subifds32);
+    }
+
+    if(k == 0)
+    {
+        if(T->imagedescription != NULL)
+        {
+            tifd_add_ascii(ifd, TIFFTAG_IMAGEDESCRIPTION, T->imagedescription);
+        }
+        if(T->software != NULL)
+        {
+            tifd_add_ascii(ifd, TIFFTAG_SOFTWARE, T->software);
+        }
+        float_to_rational(T->xresolution, values->xres);
+        float_to_rational(T->yresolution, values->yres);
+        tifd_add(ifd, TIFFTAG_XRESOLUTION, TIFF_RATIONAL, 1, values->xres);
+        tifd_add(ifd, TIFFTAG_YRESOLUTION, TIFF_RATIONAL, 1, values->yres);
+        tifd_add_short(ifd, TIFFTAG_RESOLUTIONUNIT, T->resolutionunit);
+    }
+}
+
+static void tifd_values_alloc(const tiff_writer_t * tw, tifd_values_t * values)
+{
+    memset(values, 0, sizeof(tifd_values_t));
+    values->offsets32 = calloc(tw->nstrips, sizeof(uint32_t));
+    values->bytes32 = calloc(tw->nstrips, sizeof(uint32_t));
+    values->subifds32 = calloc(tw->nlevels, sizeof(uint32_t));
+    NOT_NULL(values->offsets32);
+    NOT_NULL(values->bytes32);
+    NOT_NULL(values->subifds32);
+}
+
+static void tifd_values_free(tifd_values_t * values)
+{
+    free(values->offsets32);
+    free(values->bytes32);
+    free(values->subifds32);
+}
+
+/* pwrite all of buf or exit */
+static void pwrite_all(int fd, const void * buf, size_t nbytes, uint64_t offset)
+{
+    const uint8_t * p = buf;
+    while(nbytes > 0)
+    {
+        ssize_t nw = pwrite(fd, p, nbytes, (off_t) offset);
+        if(nw < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(nw <= 0)
+        {
+            fprintf(stderr, "tiff_writer: Failed to write %zu bytes at %" PRIu64 ": %s\n",
+                    nbytes, offset, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        p += nw;
+        nbytes -= nw;
+        offset += nw;
+    }
+}
+
+/* Write the TIFF header to buf, in the byte order of this machine */
+static uint64_t tiff_header(const tiff_writer_t * tw, uint64_t first_ifd,
+                            uint8_t * buf)
+{
+    const uint16_t one = 1;
+    uint8_t * p = buf;
+    if(*(const uint8_t *) &one == 1)
+    {
+        memcpy(p, "II", 2);
+    } else {
+        memcpy(p, "MM", 2);
+    }
+    if(tw->bigtiff)
+    {
+        uint16_t version = 43;
+        uint16_t offset_size = 8;
+        uint16_t zero = 0;
+        memcpy(p+2, &version, 2);
+        memcpy(p+4, &offset_size, 2);
+        memcpy(p+6, &zero, 2);
+        memcpy(p+8, &first_ifd, 8);
+        return 16;
+    }
+    uint16_t version = 42;
+    uint32_t first = (uint32_t) first_ifd;
+    memcpy(p+2, &version, 2);
+    memcpy(p+4, &first, 4);
+    return 8;
+}
+
+/* Serialize the IFDs of all pages to buf which will be placed at pos
+ * in the file. The IFDs of the reduced resolution levels of a page
+ * follow the IFD of the page. Returns the number of bytes. */
+static uint64_t tiff_writer_ifds(const tiff_writer_t * tw, const ttags * T,
+                                 uint64_t pos, uint8_t * buf)
+{
+    tifd_values_t values;
+    tifd_values_alloc(tw, &values);
+    uint64_t * subifds = calloc(tw->nlevels, sizeof(uint64_t));
+    NOT_NULL(subifds);
+    tifd_t ifd;
+    uint64_t start = pos;
+    for(int64_t kk = 0; kk < tw->P; kk++)
+    {
+        /* The size of an IFD does not depend on the values */
+        tiff_writer_page_ifd(tw, T, kk, 0, subifds, &values, &ifd);
+        uint64_t next = pos + tifd_nbytes(&ifd);
+        for(int ll = 1; ll < tw->nlevels; ll++)
+        {
+            subifds[ll-1] = next;
+            tiff_writer_page_ifd(tw, T, kk, ll, subifds, &values, &ifd);
+            next += tifd_nbytes(&ifd);
+        }
+        if(kk+1 == tw->P)
+        {
+            next = 0;
+        }
+        for(int ll = 0; ll < tw->nlevels; ll++)
+        {
+            tiff_writer_page_ifd(tw, T, kk, ll, subifds, &values, &ifd);
+            pos += tifd_serialize(&ifd, pos, ll == 0 ? next : 0,
+                                  buf + (pos - start));
+        }
+    }
+    free(subifds);
+    tifd_values_free(&values);
+    return pos - start;
+}
+
+/* Size of all IFDs */
+static uint64_t tiff_writer_ifds_nbytes(const tiff_writer_t * tw, const ttags * T)
+{
+    tifd_values_t values;
+    tifd_values_alloc(tw, &values);
+    uint64_t * subifds = calloc(tw->nlevels, sizeof(uint64_t));
+    NOT_NULL(subifds);
+    tifd_t ifd;
+    uint64_t nbytes = 0;
+    for(int64_t kk = 0; kk < tw->P; kk++)
+    {
+        for(int ll = 0; ll < tw->nlevels; ll++)
+        {
+            tiff_writer_page_ifd(tw, T, kk, ll, subifds, &values, &ifd);
+            nbytes += tifd_nbytes(&ifd);
+        }
+    }
+    free(subifds);
+    tifd_values_free(&values);
+    return nbytes;
+}
+
+/* Write the header and the IFDs for all pages. The pixel data of
+ * page k goes to tw->data_offset + k*tw->page_bytes */
+static void tiff_writer_layout(tiff_writer_t * tw, const ttags * T)
+{
+    uint64_t header_bytes = tw->bigtiff ? 16 : 8;
+    uint64_t ifd_end = header_bytes + tiff_writer_ifds_nbytes(tw, T);
+
+    /* Let the pixel data start at an even 16 bytes */
+    tw->data_offset = (ifd_end + 15) / 16 * 16;
+    uint64_t file_size = tw->data_offset + tw->P*tw->page_bytes;
+
+    if(tw->bigtiff == 0 && file_size > UINT32_MAX)
+    {
+        tw->bigtiff = 1;
+        tiff_writer_layout(tw, T);
+        return;
+    }
+
+    for(int64_t kk = 0; kk < tw->P; kk++)
+    {
+        tw->strip_offsets[kk] = tw->data_offset + kk*tw->page_bytes;
+        tw->strip_bytes[kk] = tw->page_bytes;
+    }
+
+    uint8_t * buf = calloc(tw->data_offset, 1);
+    NOT_NULL(buf);
+    tiff_header(tw, header_bytes, buf);
+    uint64_t nbytes = tiff_writer_ifds(tw, T, header_bytes, buf + header_bytes);
+    assert(header_bytes + nbytes == ifd_end);
+    (void) nbytes;
+
+    pwrite_all(tw->fd, buf, tw->data_offset, 0);
+    free(buf);
+
+    /* Reserve the full size so that the pages can be written in any
+     * order */
+    if(ftruncate(tw->fd, (off_t) file_size) != 0)
+    {
+        fprintf(stderr, "tiff_writer: Failed to set the file size: %s\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void ttags_set_composite_description(ttags * T);
+
+/* Target size of the strips of compressed images */
+#define TIFF_WRITER_STRIP_BYTES (256*1024)
+
+/* With resume an existing file is opened without truncating it,
+ * returns NULL if there is none */
+static tiff_writer_t * tiff_writer_open(const char * fName,
+                                        ttags * T,
+                                        int64_t N, int64_t M, int64_t P,
+                                        int resume)
+{
+    tiff_writer_t * tw = calloc(1, sizeof(tiff_writer_t));
+    NOT_NULL(tw);
+
+    tw->M = M;
+    tw->N = N;
+    tw->P = P;
+    tw->dd = 0;
+    tw->page_bytes = M*N*sizeof(uint16_t);
+    tw->compression = T->compression;
+
+    if(P < 1)
+    {
+        fprintf(stderr, "tiff_writer: Can't write %" PRId64 " pages\n", P);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Uncompressed pages are written as one strip. Compressed pages
+     * are split so that the strips can be decoded with little
+     * memory */
+    tw->rows_per_strip = M;
+    if(tw->compression != COMPRESSION_NONE)
+    {
+        tw->rows_per_strip = TIFF_WRITER_STRIP_BYTES / (N*sizeof(uint16_t));
+        if(tw->rows_per_strip < 1)
+        {
+            tw->rows_per_strip = 1;
+        }
+        if(tw->rows_per_strip > M)
+        {
+            tw->rows_per_strip = M;
+        }
+    }
+    tw->nstrips = (M + tw->rows_per_strip - 1) / tw->rows_per_strip;
+
+    /* Tiled pages are halved until they fit in one tile */
+    tw->nlevels = 1;
+    if(T->tile > 0)
+    {
+        if(T->tile % 16 != 0)
+        {
+            fprintf(stderr, "tiff_writer: The tile size has to be a multiple of 16\n");
+            exit(EXIT_FAILURE);
+        }
+        tw->tile = T->tile;
+        int64_t m = M;
+        int64_t n = N;
+        while(m > tw->tile || n > tw->tile)
+        {
+            m = (m + 1) / 2;
+            n = (n + 1) / 2;
+            tw->nlevels++;
+        }
+        tw->nstrips = ((M + tw->tile - 1) / tw->tile) * ((N + tw->tile - 1) / tw->tile);
+    }
+    int64_t m = 0, n = 0, nblocks = 0, block0 = 0;
+    tiff_writer_level(tw, tw->nlevels - 1, &m, &n, &nblocks, &block0);
+    tw->blocks_per_page = block0 + nblocks;
+
+    tw->strip_offsets = calloc(P*tw->blocks_per_page, sizeof(uint64_t));
+    tw->strip_bytes = calloc(P*tw->blocks_per_page, sizeof(uint64_t));
+    tw->page_hash = calloc(P, sizeof(uint64_t));
+    NOT_NULL(tw->strip_offsets);
+    NOT_NULL(tw->strip_bytes);
+    NOT_NULL(tw->page_hash);
+
+    tw->fd = resume ? open(fName, O_WRONLY) :
+        open(fName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(tw->fd < 0 && resume && errno == ENOENT)
+    {
+        free(tw->strip_offsets);
+        free(tw->strip_bytes);
+        free(tw->page_hash);
+        free(tw);
+        return NULL;
+    }
+    if(tw->fd < 0)
+    {
+        fprintf(stderr, "tiff_writer: Unable to open %s: %s\n",
+                fName, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if(T->composite)
+    {
+        ttags_set_composite_description(T);
+    }
+    if(tw->compression == COMPRESSION_NONE && tw->tile == 0)
+    {
+        tiff_writer_layout(tw, T);
+    } else {
+        /* The strips or tiles are appended after room for the header
+         * and the IFDs are written by tiff_writer_finish */
+        tw->T = ttags_copy(T);
+        tw->end = 16;
+    }
+    return tw;
+}
+
 tiff_writer_t * tiff_writer_init(const char * fName,
                                  ttags * T,
                                  int64_t N, int64_t M, int64_t P)
+{
+    return tiff_writer_open(fName, T, N, M, P, 0);
+}
+
+tiff_writer_t * tiff_writer_resume(const char * fName,
+                                   ttags * T,
+                                   int64_t N, int64_t M, int64_t P)
+{
+    return tiff_writer_open(fName, T, N, M, P, 1);
+}
+
+int tiff_writer_restore_page(tiff_writer_t * tw, int64_t k,
+                             const uint64_t * offsets,
+                             const uint64_t * bytes, uint64_t page_hash)
+{
+    if(tw->out != NULL || k < 0 || k >= tw->P)
+    {
+        return -1;
+    }
+    struct stat sb;
+    if(fstat(tw->fd, &sb) != 0)
+    {
+        return -1;
+    }
+    int64_t end = 16;
+    for(int64_t bb = 0; bb < tw->blocks_per_page; bb++)
+    {
+        if(offsets[bb] < 16 || offsets[bb] + bytes[bb] > (uint64_t) sb.st_size)
+        {
+            return -1;
+        }
+        if(tw->T == NULL && (offsets[bb] != tw->strip_offsets[k*tw->blocks_per_page + bb]
+                             || bytes[bb] != tw->strip_bytes[k*tw->blocks_per_page + bb]))
+        {
+            /* The fixed layout has changed */
+            return -1;
+        }
+        if((int64_t) (offsets[bb] + bytes[bb]) > end)
+        {
+            end = offsets[bb] + bytes[bb];
+        }
+    }
+    memcpy(tw->strip_offsets + k*tw->blocks_per_page, offsets,
+           tw->blocks_per_page*sizeof(uint64_t));
+    memcpy(tw->strip_bytes + k*tw->blocks_per_page, bytes,
+           tw->blocks_per_page*sizeof(uint64_t));
+    if(tw->T != NULL && end > tw->end)
+    {
+        tw->end = end;
+    }
+    tw->page_hash[k] = page_hash;
+    tw->dd++;
+    return 0;
+}
+
+tiff_writer_t * tiff_writer_init_libtiff(const char * fName,
+                                         ttags * T,
+                                         int64_t N, int64_t M, int64_t P)
 {
     tiff_writer_t * tw = calloc(1, sizeof(tiff_writer_t));
     NOT_NULL(tw);
@@ -40,6 +742,15 @@ tiff_writer_t * tiff_writer_init(const char * fName,
     tw->N = N;
     tw->P = P;
     tw->dd = 0;
+    tw->fd = -1;
+    tw->compression = T->compression;
+    tw->page_hash = calloc(P, sizeof(uint64_t));
+    NOT_NULL(tw->page_hash);
+    if(T->tile > 0)
+    {
+        fprintf(stderr, "tiff_writer: Tiled images can't be written with libtiff\n");
+        exit(EXIT_FAILURE);
+    }
 
     char formatString[4] = "w";
     if(M*N*P*sizeof(uint16_t) >= pow(2, 32))
@@ -56,16 +767,8 @@ tiff_writer_t * tiff_writer_init(const char * fName,
     return tw;
 }
 
-int tiff_writer_write(tiff_writer_t * tw, uint16_t * slice)
+static int tiff_writer_write_libtiff(tiff_writer_t * tw, uint16_t * slice)
 {
-    if(tw->dd == tw->P)
-    {
-        fprintf(stderr, "Error: Trying to write too many slices\n"
-                "%d slices were expected and %d has already been written\n",
-                (int) tw->P, (int) tw->dd);
-        fprintf(stderr, "In %s, line %d\n", __FILE__, __LINE__);
-        exit(EXIT_FAILURE);
-    }
     TIFFSetField(tw->out, TIFFTAG_IMAGEWIDTH, tw->N);  // set the width of the image
     TIFFSetField(tw->out, TIFFTAG_IMAGELENGTH, tw->M);    // set the height of the image
     TIFFSetField(tw->out, TIFFTAG_SAMPLESPERPIXEL, 1);   // set number of channels per pixel
@@ -75,11 +778,19 @@ int tiff_writer_write(tiff_writer_t * tw, uint16_t * slice)
     TIFFSetField(tw->out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
     TIFFSetField(tw->out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
     TIFFSetField(tw->out, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
+    TIFFSetField(tw->out, TIFFTAG_COMPRESSION, tw->compression);
+    if(tw->compression != COMPRESSION_NONE)
+    {
+        TIFFSetField(tw->out, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+    }
 
     /* We are writing single page of the multipage file */
     TIFFSetField(tw->out, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);
-    /* Set the page number */
-    TIFFSetField(tw->out, TIFFTAG_PAGENUMBER, tw->dd, tw->P);
+    /* Set the page number, it is 16-bit */
+    if(tw->P <= UINT16_MAX)
+    {
+        TIFFSetField(tw->out, TIFFTAG_PAGENUMBER, tw->dd, tw->P);
+    }
 
 
     for(size_t kk = 0; kk < (size_t) tw->M; kk++)
@@ -98,17 +809,395 @@ int tiff_writer_write(tiff_writer_t * tw, uint16_t * slice)
         }
     }
     TIFFWriteDirectory(tw->out);
-    tw->dd++;
     return 0;
 }
 
+int tiff_writer_write(tiff_writer_t * tw, uint16_t * slice)
+{
+    if(tw->dd == tw->P)
+    {
+        fprintf(stderr, "Error: Trying to write too many slices\n"
+                "%d slices were expected and %d has already been written\n",
+                (int) tw->P, (int) tw->dd);
+        fprintf(stderr, "In %s, line %d\n", __FILE__, __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    if(tw->out != NULL)
+    {
+        tw->page_hash[tw->dd] = hash_u64(slice, tw->M*tw->N*sizeof(uint16_t));
+        tiff_writer_write_libtiff(tw, slice);
+        tw->dd++;
+        return 0;
+    }
+    return tiff_writer_write_page(tw, tw->dd, slice);
+}
+
+/* Append the strip or tile idx of nrows x width pixels to the file,
+ * compressed with the predictor applied in place. out has room for
+ * tiff_compress_bound of the block. Returns the number of bytes
+ * written. */
+static int64_t tiff_writer_append(tiff_writer_t * tw, int64_t idx,
+                                  uint16_t * block, int64_t width,
+                                  int64_t nrows, uint8_t * out, size_t bound)
+{
+    const void * data = block;
+    size_t nout = width*nrows*sizeof(uint16_t);
+    if(tw->compression != COMPRESSION_NONE)
+    {
+        tiff_predictor_u16(block, width, nrows);
+        nout = tiff_compress(tw->compression, out, bound, block, nout);
+        if(nout == 0)
+        {
+            fprintf(stderr, "tiff_writer: %s compression failed\n",
+                    tiff_compress_name(tw->compression));
+            exit(EXIT_FAILURE);
+        }
+        data = out;
+    }
+    /* Reserve a place at the end of the file */
+    uint64_t offset = __atomic_fetch_add(&tw->end, (int64_t) nout,
+                                         __ATOMIC_RELAXED);
+    pwrite_all(tw->fd, data, nout, offset);
+    tw->strip_offsets[idx] = offset;
+    tw->strip_bytes[idx] = nout;
+    return nout;
+}
+
+/* Compress the strips of page k and append them to the file */
+static int64_t tiff_writer_write_strips(tiff_writer_t * tw, int64_t k,
+                                        const uint16_t * slice)
+{
+    size_t row_bytes = tw->N*sizeof(uint16_t);
+    size_t strip_max = tw->rows_per_strip*row_bytes;
+    size_t bound = tiff_compress_bound(tw->compression, strip_max);
+    uint16_t * strip = malloc(strip_max);
+    uint8_t * out = malloc(bound);
+    NOT_NULL(strip);
+    NOT_NULL(out);
+
+    int64_t nbytes = 0;
+    for(int64_t ss = 0; ss < tw->nstrips; ss++)
+    {
+        int64_t r0 = ss*tw->rows_per_strip;
+        int64_t nrows = tw->M - r0;
+        if(nrows > tw->rows_per_strip)
+        {
+            nrows = tw->rows_per_strip;
+        }
+        memcpy(strip, slice + r0*tw->N, nrows*row_bytes);
+        nbytes += tiff_writer_append(tw, k*tw->blocks_per_page + ss,
+                                     strip, tw->N, nrows, out, bound);
+    }
+    free(out);
+    free(strip);
+    return nbytes;
+}
+
+/* Halve an image of M x N pixels by taking the mean of each 2 x 2
+ * block, rounded. At odd edges the mean is of the pixels that
+ * exist. dst may be the same as src. */
+static void tiff_downsample_u16(uint16_t * dst, const uint16_t * src,
+                                int64_t M, int64_t N)
+{
+    int64_t M2 = (M + 1) / 2;
+    int64_t N2 = (N + 1) / 2;
+    for(int64_t yy = 0; yy < M2; yy++)
+    {
+        int64_t y0 = 2*yy;
+        int64_t y1 = y0 + 1 < M ? y0 + 1 : y0;
+        for(int64_t xx = 0; xx < N2; xx++)
+        {
+            int64_t x0 = 2*xx;
+            int64_t x1 = x0 + 1 < N ? x0 + 1 : x0;
+            uint32_t sum = (uint32_t) src[y0*N + x0] + src[y0*N + x1]
+                + src[y1*N + x0] + src[y1*N + x1];
+            dst[yy*N2 + xx] = (uint16_t) ((sum + 2) / 4);
+        }
+    }
+}
+
+/* Write page k as tiles, followed by the tiles of the reduced
+ * resolution levels. The levels are computed from the page so only
+ * one extra image of a quarter of the size is needed. */
+static int64_t tiff_writer_write_tiles(tiff_writer_t * tw, int64_t k,
+                                       const uint16_t * slice)
+{
+    int64_t ts = tw->tile;
+    size_t tile_bytes = ts*ts*sizeof(uint16_t);
+    size_t bound = tiff_compress_bound(tw->compression, tile_bytes);
+    uint16_t * tile = malloc(tile_bytes);
+    uint8_t * out = malloc(bound);
+    uint16_t * reduced = NULL;
+    NOT_NULL(tile);
+    NOT_NULL(out);
+    if(tw->nlevels > 1)
+    {
+        reduced = malloc(((tw->M + 1) / 2) * ((tw->N + 1) / 2) * sizeof(uint16_t));
+        NOT_NULL(reduced);
+    }
+
+    int64_t nbytes = 0;
+    const uint16_t * image = slice;
+    int64_t M = tw->M;
+    int64_t N = tw->N;
+    for(int ll = 0; ll < tw->nlevels; ll++)
+    {
+        if(ll > 0)
+        {
+            tiff_downsample_u16(reduced, image, M, N);
+            image = reduced;
+        }
+        int64_t nblocks = 0, block0 = 0;
+        tiff_writer_level(tw, ll, &M, &N, &nblocks, &block0);
+        int64_t idx = k*tw->blocks_per_page + block0;
+        for(int64_t y0 = 0; y0 < M; y0 += ts)
+        {
+            for(int64_t x0 = 0; x0 < N; x0 += ts)
+            {
+                /* Tiles at the edges are padded with zeros */
+                int64_t h = M - y0 < ts ? M - y0 : ts;
+                int64_t w = N - x0 < ts ? N - x0 : ts;
+                if(h < ts || w < ts)
+                {
+                    memset(tile, 0, tile_bytes);
+                }
+                for(int64_t yy = 0; yy < h; yy++)
+                {
+                    memcpy(tile + yy*ts, image + (y0 + yy)*N + x0,
+                           w*sizeof(uint16_t));
+                }
+                nbytes += tiff_writer_append(tw, idx++, tile, ts, ts, out, bound);
+            }
+        }
+    }
+    free(reduced);
+    free(out);
+    free(tile);
+    return nbytes;
+}
+
+int tiff_writer_write_page(tiff_writer_t * tw, int64_t k,
+                           const uint16_t * slice)
+{
+    if(k < 0 || k >= tw->P)
+    {
+        fprintf(stderr, "Error: Slice %" PRId64 " is outside of [0, %" PRId64 ")\n",
+                k, tw->P);
+        exit(EXIT_FAILURE);
+    }
+    if(tw->out != NULL)
+    {
+        if(k != tw->dd)
+        {
+            fprintf(stderr, "Error: libtiff can only write the slices in order\n");
+            exit(EXIT_FAILURE);
+        }
+        return tiff_writer_write(tw, (uint16_t *) slice);
+    }
+    tw->page_hash[k] = hash_u64(slice, tw->page_bytes);
+    if(tw->compression == COMPRESSION_NONE && tw->tile == 0)
+    {
+        /* The location of each page is fixed so there is nothing to
+         * coordinate except the count */
+        pwrite_all(tw->fd, slice, tw->page_bytes,
+                   tw->data_offset + k*tw->page_bytes);
+        __atomic_fetch_add(&tw->bytes_compressed, tw->page_bytes,
+                           __ATOMIC_RELAXED);
+    } else {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int64_t nbytes = tw->tile > 0 ?
+            tiff_writer_write_tiles(tw, k, slice) :
+            tiff_writer_write_strips(tw, k, slice);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        int64_t ns = (t1.tv_sec - t0.tv_sec)*1000000000 + (t1.tv_nsec - t0.tv_nsec);
+        __atomic_fetch_add(&tw->ns_compress, ns, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&tw->bytes_compressed, nbytes, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&tw->bytes_raw, tw->page_bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&tw->dd, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Write the IFDs after the appended strips or tiles and the header
+ * that points to them */
+static void tiff_writer_finish_appended(tiff_writer_t * tw)
+{
+    /* IFDs start on a word boundary */
+    uint64_t pos = (tw->end + 1) / 2 * 2;
+    uint64_t nbytes = tiff_writer_ifds_nbytes(tw, tw->T);
+    if(pos + nbytes > UINT32_MAX)
+    {
+        tw->bigtiff = 1;
+        nbytes = tiff_writer_ifds_nbytes(tw, tw->T);
+    }
+    uint8_t * buf = calloc(nbytes, 1);
+    NOT_NULL(buf);
+    tiff_writer_ifds(tw, tw->T, pos, buf);
+    pwrite_all(tw->fd, buf, nbytes, pos);
+    free(buf);
+
+    uint8_t header[16] = {0};
+    uint64_t header_bytes = tiff_header(tw, pos, header);
+    pwrite_all(tw->fd, header, header_bytes, 0);
+    ttags_free(&tw->T);
+}
+
 int tiff_writer_finish(tiff_writer_t * tw)
 {
-    TIFFClose(tw->out);
+    if(tw->out != NULL)
+    {
+        TIFFClose(tw->out);
+    } else {
+        if(tw->dd != tw->P)
+        {
+            fprintf(stderr, "tiff_writer: Warning: %" PRId64 " of %" PRId64
+                    " pages written\n", tw->dd, tw->P);
+        }
+        if(tw->T != NULL)
+        {
+            tiff_writer_finish_appended(tw);
+        }
+        if(close(tw->fd) != 0)
+        {
+            fprintf(stderr, "tiff_writer: Failed to close the file: %s\n",
+                    strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(tw->strip_offsets);
+    free(tw->strip_bytes);
+    free(tw->page_hash);
     free(tw);
     return 0;
 }
 
+void tiff_writer_abort(tiff_writer_t * tw)
+{
+    if(tw->out != NULL)
+    {
+        TIFFClose(tw->out);
+    } else {
+        close(tw->fd);
+    }
+    if(tw->T != NULL)
+    {
+        ttags_free(&tw->T);
+    }
+    free(tw->strip_offsets);
+    free(tw->strip_bytes);
+    free(tw->page_hash);
+    free(tw);
+}
+
+uint64_t tiff_writer_hash(const tiff_writer_t * tw)
+{
+    return hash_pages(tw->page_hash, tw->P);
+}
+
+/* Read the current page of tif into I, width x height pixels */
+static int tiff_read_page_u16(TIFF * tif, uint16_t * I,
+                              uint32_t width, uint32_t height)
+{
+    if(!TIFFIsTiled(tif))
+    {
+        for(uint32_t kk = 0; kk < height; kk++)
+        {
+            if(TIFFReadScanline(tif, I + (size_t) kk*width, kk, 0) != 1)
+            {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    uint32_t tw = 0;
+    uint32_t th = 0;
+    TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tw);
+    TIFFGetField(tif, TIFFTAG_TILELENGTH, &th);
+    if(tw == 0 || th == 0)
+    {
+        return -1;
+    }
+    uint16_t * buf = malloc((size_t) tw*th*sizeof(uint16_t));
+    NOT_NULL(buf);
+    int status = 0;
+    for(uint32_t y0 = 0; y0 < height && status == 0; y0 += th)
+    {
+        for(uint32_t x0 = 0; x0 < width; x0 += tw)
+        {
+            if(TIFFReadTile(tif, buf, x0, y0, 0, 0) < 0)
+            {
+                status = -1;
+                break;
+            }
+            for(uint32_t yy = y0; yy < height && yy < y0 + th; yy++)
+            {
+                uint32_t nx = width - x0 < tw ? width - x0 : tw;
+                memcpy(I + (size_t) yy*width + x0, buf + (size_t) (yy-y0)*tw,
+                       nx*sizeof(uint16_t));
+            }
+        }
+    }
+    free(buf);
+    return status;
+}
+
+int tiff_hash_pages(const char * fName, uint64_t * hash)
+{
+    TIFF * tif = TIFFOpen(fName, "r");
+    if(tif == NULL)
+    {
+        return -1;
+    }
+    int64_t npages = 0;
+    int64_t nalloc = 0;
+    uint64_t * page_hash = NULL;
+    uint16_t * I = NULL;
+    size_t I_bytes = 0;
+    int status = 0;
+    do {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint16_t bps = 0;
+        TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+        TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+        TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bps);
+        if(bps != 16 || width == 0 || height == 0)
+        {
+            status = -1;
+            break;
+        }
+        size_t nbytes = (size_t) width*height*sizeof(uint16_t);
+        if(nbytes > I_bytes)
+        {
+            free(I);
+            I = malloc(nbytes);
+            NOT_NULL(I);
+            I_bytes = nbytes;
+        }
+        if(tiff_read_page_u16(tif, I, width, height) != 0)
+        {
+            status = -1;
+            break;
+        }
+        if(npages == nalloc)
+        {
+            nalloc = nalloc == 0 ? 64 : 2*nalloc;
+            page_hash = realloc(page_hash, nalloc*sizeof(uint64_t));
+            NOT_NULL(page_hash);
+        }
+        page_hash[npages++] = hash_u64(I, nbytes);
+    } while(TIFFReadDirectory(tif));
+    TIFFClose(tif);
+    if(status == 0)
+    {
+        hash[0] = hash_pages(page_hash, npages);
+    }
+    free(page_hash);
+    free(I);
+    return status;
+}
+
 ttags * ttags_new()
 {
     ttags * T  = calloc(1, sizeof(ttags));
@@ -121,6 +1210,7 @@ ttags * ttags_new()
     T-> resolutionunit = RESUNIT_CENTIMETER;
     T->composite = 0;
     T->nchannel = 1;
+    T->compression = COMPRESSION_NONE;
     // Image size MxNxP
     T->M = 0;
     T->N = 0;
@@ -128,6 +1218,126 @@ ttags * ttags_new()
     return T;
 }
 
+ttags * ttags_copy(const ttags * T)
+{
+    ttags * C = calloc(1, sizeof(ttags));
+    NOT_NULL(C);
+    memcpy(C, T, sizeof(ttags));
+    if(T->imagedescription != NULL)
+    {
+        C->imagedescription = strdup(T->imagedescription);
+        NOT_NULL(C->imagedescription);
+    }
+    if(T->software != NULL)
+    {
+        C->software = strdup(T->software);
+        NOT_NULL(C->software);
+    }
+    return C;
+}
+
+void ttags_set_compression(ttags * T, uint16_t compression)
+{
+    T->compression = compression;
+}
+
+void ttags_set_pyramid(ttags * T, int64_t tile)
+{
+    T->tile = tile;
+}
+
+/* Write str to f with the XML special characters escaped */
+static void xml_puts(FILE * f, const char * str)
+{
+    for( ; *str != '\0'; str++)
+    {
+        switch(*str)
+        {
+        case '&':
+            fputs("&amp;", f);
+            break;
+        case '<':
+            fputs("&lt;", f);
+            break;
+        case '>':
+            fputs("&gt;", f);
+            break;
+        case '"':
+            fputs("&quot;", f);
+            break;
+        default:
+            fputc(*str, f);
+        }
+    }
+}
+
+void ttags_set_ome(ttags * T, int nchannel, char ** channel_names,
+                   const uint32_t * colors, const double * emission_nm)
+{
+    char * xml = NULL;
+    size_t xml_size = 0;
+    FILE * f = open_memstream(&xml, &xml_size);
+    NOT_NULL(f);
+    fprintf(f,
+            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<OME xmlns=\"http://www.openmicroscopy.org/Schemas/OME/2016-06\" "
+            "xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" "
+            "xsi:schemaLocation=\"http://www.openmicroscopy.org/Schemas/OME/2016-06 "
+            "http://www.openmicroscopy.org/Schemas/OME/2016-06/ome.xsd\"");
+    if(T->software != NULL)
+    {
+        fprintf(f, " Creator=\"");
+        xml_puts(f, T->software);
+        fprintf(f, "\"");
+    }
+    fprintf(f, ">\n"
+            "<Image ID=\"Image:0\">\n"
+            "<Pixels ID=\"Pixels:0\" DimensionOrder=\"XYCZT\" Type=\"uint16\" "
+            "SizeX=\"%" PRId64 "\" SizeY=\"%" PRId64 "\" SizeZ=\"%" PRId64 "\" "
+            "SizeC=\"%d\" SizeT=\"1\"",
+            T->M, T->N, T->P, nchannel);
+    if(T->resolutionunit == RESUNIT_NONE)
+    {
+        /* Set by ttags_set_pixelsize_nm */
+        fprintf(f, " PhysicalSizeX=\"%g\" PhysicalSizeXUnit=\"nm\""
+                " PhysicalSizeY=\"%g\" PhysicalSizeYUnit=\"nm\""
+                " PhysicalSizeZ=\"%g\" PhysicalSizeZUnit=\"nm\"",
+                1.0/T->xresolution, 1.0/T->yresolution, T->zresolution);
+    }
+    fprintf(f, ">\n");
+    for(int cc = 0; cc < nchannel; cc++)
+    {
+        fprintf(f, "<Channel ID=\"Channel:0:%d\" SamplesPerPixel=\"1\"", cc);
+        if(channel_names != NULL && channel_names[cc] != NULL)
+        {
+            fprintf(f, " Name=\"");
+            xml_puts(f, channel_names[cc]);
+            fprintf(f, "\"");
+        }
+        if(colors != NULL)
+        {
+            /* RGBA as a signed integer */
+            int32_t rgba = (int32_t) ((colors[cc] << 8) | 0xFF);
+            fprintf(f, " Color=\"%" PRId32 "\"", rgba);
+        }
+        if(emission_nm != NULL && emission_nm[cc] > 0)
+        {
+            fprintf(f, " EmissionWavelength=\"%g\" EmissionWavelengthUnit=\"nm\"",
+                    emission_nm[cc]);
+        }
+        fprintf(f, "/>\n");
+    }
+    fprintf(f, "<TiffData IFD=\"0\" PlaneCount=\"%" PRId64 "\"/>\n"
+            "</Pixels>\n"
+            "</Image>\n"
+            "</OME>\n",
+            T->P*nchannel);
+    fclose(f);
+
+    free(T->imagedescription);
+    T->imagedescription = xml;
+}
+
 void ttags_set_composite(ttags * T, int nchannel)
 {
     T->composite = 1;
@@ -204,6 +1414,33 @@ void ttags_set_software(ttags * T, char * sw)
              "%s", sw);
 }
 
+/* ImageJ hyperstack description for composite images */
+static void ttags_set_composite_description(ttags * T)
+{
+    if(T->imagedescription)
+    {
+        free(T->imagedescription);
+    }
+    size_t slen = 1024;
+    T->imagedescription = calloc(slen, 1);
+    NOT_NULL(T->imagedescription);
+
+    snprintf(T->imagedescription, slen,
+            "ImageJ=1.52r\n"
+            "images=%" PRId64 "\n"
+            "slices=%" PRId64 "\n"
+            "unit=nm\n"
+            "spacing=%.1f\n"
+            "loop=false\n"
+            "channels=%d\n"
+            "mode=composite\n"
+            "hyperstack=true\n",
+            T->P*T->nchannel,
+            T->P,
+            T->zresolution,
+            T->nchannel);
+}
+
 void ttags_set(TIFF * tfile, ttags * T)
 {
     //ttags_show(stdout, T);
@@ -219,28 +1456,7 @@ void ttags_set(TIFF * tfile, ttags * T)
 
     if(T->composite)
     {
-        if(T->imagedescription)
-        {
-            free(T->imagedescription);
-        }
-        size_t slen = 1024;
-        T->imagedescription = calloc(slen, 1);
-        NOT_NULL(T->imagedescription)
-
-            snprintf(T->imagedescription, slen,
-                "ImageJ=1.52r\n"
-                "images=%" PRId64 "\n"
-                "slices=%" PRId64 "\n"
-                "unit=nm\n"
-                "spacing=%.1f\n"
-                "loop=false\n"
-                "channels=%d\n"
-                "mode=composite\n"
-                "hyperstack=true\n",
-                T->P*T->nchannel,
-                T->P,
-                T->zresolution,
-                T->nchannel);
+        ttags_set_composite_description(T);
     }
 
     if(T->imagedescription != NULL)
@@ -286,3 +1502,294 @@ void ttags_show(FILE * fout, ttags* T)
 
     return;
 }
+
+/* Read back a file written by tiff_writer and compare to V */
+static void tiff_writer_check(const char * fName, const ttags * T,
+                              const uint16_t * V,
+                              int64_t N, int64_t M, int64_t P)
+{
+    TIFF * tif = TIFFOpen(fName, "r");
+    NOT_NULL(tif);
+    uint16_t * line = calloc(N, sizeof(uint16_t));
+    NOT_NULL(line);
+    int64_t npages = 0;
+    do {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+        TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+        if(width != N || height != M || npages >= P)
+        {
+            fprintf(stderr, "tiff_util_ut: Wrong image size in %s\n", fName);
+            exit(EXIT_FAILURE);
+        }
+        if(npages == 0)
+        {
+            char * desc = NULL;
+            if(TIFFGetField(tif, TIFFTAG_IMAGEDESCRIPTION, &desc) != 1
+               || strcmp(desc, T->imagedescription) != 0)
+            {
+                fprintf(stderr, "tiff_util_ut: Wrong description in %s\n", fName);
+                exit(EXIT_FAILURE);
+            }
+        }
+        for(int64_t kk = 0; kk < M; kk++)
+        {
+            TIFFReadScanline(tif, line, kk, 0);
+            if(memcmp(line, V + npages*M*N + kk*N, N*sizeof(uint16_t)) != 0)
+            {
+                fprintf(stderr, "tiff_util_ut: Wrong pixel data in %s\n", fName);
+                exit(EXIT_FAILURE);
+            }
+        }
+        npages++;
+    } while(TIFFReadDirectory(tif));
+    TIFFClose(tif);
+    free(line);
+    if(npages != P)
+    {
+        fprintf(stderr, "tiff_util_ut: %" PRId64 " pages instead of %" PRId64 "\n",
+                npages, P);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Compare the tiles of level l of a page with the image I of M x N
+ * pixels */
+static void tiff_writer_check_tiles(TIFF * tif, const uint16_t * I,
+                                    int64_t N, int64_t M, int64_t tile)
+{
+    uint32_t width = 0, height = 0, tw = 0, th = 0;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tw);
+    TIFFGetField(tif, TIFFTAG_TILELENGTH, &th);
+    if(!TIFFIsTiled(tif) || width != N || height != M || tw != tile || th != tile)
+    {
+        fprintf(stderr, "tiff_util_ut: Wrong tiles\n");
+        exit(EXIT_FAILURE);
+    }
+    uint16_t * buf = calloc(tile*tile, sizeof(uint16_t));
+    NOT_NULL(buf);
+    for(int64_t y0 = 0; y0 < M; y0 += tile)
+    {
+        for(int64_t x0 = 0; x0 < N; x0 += tile)
+        {
+            if(TIFFReadTile(tif, buf, x0, y0, 0, 0) != tile*tile*2)
+            {
+                fprintf(stderr, "tiff_util_ut: Unable to read a tile\n");
+                exit(EXIT_FAILURE);
+            }
+            for(int64_t yy = y0; yy < M && yy < y0 + tile; yy++)
+            {
+                for(int64_t xx = x0; xx < N && xx < x0 + tile; xx++)
+                {
+                    if(buf[(yy-y0)*tile + xx-x0] != I[yy*N + xx])
+                    {
+                        fprintf(stderr, "tiff_util_ut: Wrong pixel in tile\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+            }
+        }
+    }
+    free(buf);
+}
+
+/* Read back all pages and levels of a pyramidal file */
+static void tiff_writer_check_pyramid(const char * fName, const uint16_t * V,
+                                      int64_t N, int64_t M, int64_t P,
+                                      int64_t tile, int nlevels)
+{
+    TIFF * tif = TIFFOpen(fName, "r");
+    NOT_NULL(tif);
+    uint16_t * R = calloc(M*N, sizeof(uint16_t));
+    NOT_NULL(R);
+    for(int64_t kk = 0; kk < P; kk++)
+    {
+        TIFFSetDirectory(tif, kk);
+        const uint16_t * I = V + kk*M*N;
+        tiff_writer_check_tiles(tif, I, N, M, tile);
+
+        uint16_t nsub = 0;
+        uint64_t * sub = NULL;
+        if(TIFFGetField(tif, TIFFTAG_SUBIFD, &nsub, &sub) != 1
+           || nsub != nlevels - 1)
+        {
+            fprintf(stderr, "tiff_util_ut: Wrong number of SubIFDs\n");
+            exit(EXIT_FAILURE);
+        }
+        uint64_t * offsets = calloc(nsub, sizeof(uint64_t));
+        NOT_NULL(offsets);
+        memcpy(offsets, sub, nsub*sizeof(uint64_t));
+        int64_t m = M;
+        int64_t n = N;
+        for(int ll = 0; ll < nsub; ll++)
+        {
+            tiff_downsample_u16(R, I, m, n);
+            I = R;
+            m = (m + 1) / 2;
+            n = (n + 1) / 2;
+            TIFFSetSubDirectory(tif, offsets[ll]);
+            uint32_t type = 0;
+            TIFFGetField(tif, TIFFTAG_SUBFILETYPE, &type);
+            if(type != FILETYPE_REDUCEDIMAGE)
+            {
+                fprintf(stderr, "tiff_util_ut: Wrong SubFileType\n");
+                exit(EXIT_FAILURE);
+            }
+            tiff_writer_check_tiles(tif, I, n, m, tile);
+        }
+        free(offsets);
+    }
+    TIFFClose(tif);
+    free(R);
+}
+
+void tiff_util_ut(void)
+{
+    printf("-> testing tiff_writer\n");
+    /* Several strips per page when compressed */
+    int64_t N = 1000;
+    int64_t M = 301;
+    int64_t P = 3;
+    uint16_t * V = calloc(N*M*P, sizeof(uint16_t));
+    NOT_NULL(V);
+    for(int64_t kk = 0; kk < N*M*P; kk++)
+    {
+        V[kk] = (uint16_t) (kk*7919);
+    }
+
+    /* The hash of the pixel data, see tiff_writer_hash */
+    uint64_t * page_hash = calloc(P, sizeof(uint64_t));
+    NOT_NULL(page_hash);
+    for(int64_t kk = 0; kk < P; kk++)
+    {
+        page_hash[kk] = hash_u64(V + kk*M*N, M*N*sizeof(uint16_t));
+    }
+    uint64_t hash = hash_pages(page_hash, P);
+    free(page_hash);
+
+    ttags * T = ttags_new();
+    ttags_set_software(T, "tiff_util_ut");
+    ttags_set_imagesize(T, N, M, P);
+    ttags_set_pixelsize_nm(T, 130, 130, 300);
+
+    /* The built-in writer with each compression, then libtiff */
+    const char * methods[] = {"none", "lzw", "deflate", "zstd", "none"};
+    int nmethods = sizeof(methods)/sizeof(methods[0]);
+    for(int mm = 0; mm < nmethods; mm++)
+    {
+        int libtiff = mm + 1 == nmethods;
+        uint16_t compression = tiff_compress_from_name(methods[mm]);
+        if(compression == 0)
+        {
+            continue;
+        }
+        ttags_set_compression(T, compression);
+
+        char fName[] = "/tmp/nd2tool_ut_XXXXXX";
+        int fd = mkstemp(fName);
+        if(fd < 0)
+        {
+            fprintf(stderr, "tiff_util_ut: Unable to create a temporary file\n");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+        tiff_writer_t * tw = libtiff ?
+            tiff_writer_init_libtiff(fName, T, N, M, P) :
+            tiff_writer_init(fName, T, N, M, P);
+        for(int64_t kk = 0; kk < P; kk++)
+        {
+            if(libtiff)
+            {
+                tiff_writer_write(tw, V + kk*M*N);
+            } else {
+                /* Any order is fine */
+                int64_t k = P-kk-1;
+                tiff_writer_write_page(tw, k, V + k*M*N);
+            }
+        }
+        uint64_t whash = tiff_writer_hash(tw);
+        tiff_writer_finish(tw);
+        tiff_writer_check(fName, T, V, N, M, P);
+        uint64_t rhash = 0;
+        if(whash != hash || tiff_hash_pages(fName, &rhash) != 0 || rhash != hash)
+        {
+            fprintf(stderr, "tiff_util_ut: Wrong hash of %s\n", fName);
+            exit(EXIT_FAILURE);
+        }
+        unlink(fName);
+        printf("ok: %s backend, compression: %s\n",
+               libtiff ? "libtiff" : "built-in", methods[mm]);
+    }
+
+    /* Tiled with two reduced levels, 1000 x 301 -> 500 x 151 -> 250 x
+     * 76, written out of order */
+    ttags_set_pyramid(T, 256);
+    for(int mm = 0; mm < 2; mm++)
+    {
+        ttags_set_compression(T, tiff_compress_from_name(methods[2*mm]));
+        char fName[] = "/tmp/nd2tool_ut_XXXXXX";
+        int fd = mkstemp(fName);
+        if(fd < 0)
+        {
+            fprintf(stderr, "tiff_util_ut: Unable to create a temporary file\n");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+        tiff_writer_t * tw = tiff_writer_init(fName, T, N, M, P);
+        int nlevels = tw->nlevels;
+        for(int64_t kk = P-1; kk >= 0; kk--)
+        {
+            tiff_writer_write_page(tw, kk, V + kk*M*N);
+        }
+        tiff_writer_finish(tw);
+        tiff_writer_check_pyramid(fName, V, N, M, P, 256, nlevels);
+        uint64_t rhash = 0;
+        if(tiff_hash_pages(fName, &rhash) != 0 || rhash != hash)
+        {
+            fprintf(stderr, "tiff_util_ut: Wrong hash of %s\n", fName);
+            exit(EXIT_FAILURE);
+        }
+        unlink(fName);
+        printf("ok: pyramid with %d levels, compression: %s\n",
+               nlevels, methods[2*mm]);
+    }
+    ttags_free(&T);
+    free(V);
+
+    /* More pages than PageNumber can count */
+    N = 3;
+    M = 2;
+    P = UINT16_MAX + 2;
+    V = calloc(N*M*P, sizeof(uint16_t));
+    NOT_NULL(V);
+    for(int64_t kk = 0; kk < N*M*P; kk++)
+    {
+        V[kk] = (uint16_t) (kk*7919);
+    }
+    T = ttags_new();
+    ttags_set_software(T, "tiff_util_ut");
+    ttags_set_imagesize(T, N, M, P);
+    ttags_set_pixelsize_nm(T, 130, 130, 300);
+    char fName[] = "/tmp/nd2tool_ut_XXXXXX";
+    int fd = mkstemp(fName);
+    if(fd < 0)
+    {
+        fprintf(stderr, "tiff_util_ut: Unable to create a temporary file\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    tiff_writer_t * tw = tiff_writer_init(fName, T, N, M, P);
+    for(int64_t kk = 0; kk < P; kk++)
+    {
+        tiff_writer_write_page(tw, kk, V + kk*M*N);
+    }
+    tiff_writer_finish(tw);
+    tiff_writer_check(fName, T, V, N, M, P);
+    unlink(fName);
+    printf("ok: %" PRId64 " pages\n", P);
+    ttags_free(&T);
+    free(V);
+}
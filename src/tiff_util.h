@@ -11,6 +11,9 @@
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <time.h>
 
 #define INLINED inline __attribute__((always_inline))
 
@@ -34,10 +37,18 @@ typedef struct{
     int64_t P;
     int composite; /* Is a composite image or not */
     int nchannel; /* Number of channels, only used if composite is set */
+    /* COMPRESSION_NONE, _LZW, _ADOBE_DEFLATE or _ZSTD. Compressed
+     * images are written with the horizontal predictor. */
+    uint16_t compression;
+    /* Tile size for pyramidal pages, 0 for strips. See
+     * ttags_set_pyramid */
+    int64_t tile;
 } ttags;
 
 /* Create new tags with default values */
 ttags * ttags_new();
+/* Create a copy of T that can be modified independently */
+ttags * ttags_copy(const ttags * T);
 
 /* Print out the ttag */
 void ttags_show(FILE *, ttags *);
@@ -49,25 +60,102 @@ void ttags_set_pixelsize_nm(ttags *, double, double, double);
 void ttags_free(ttags **);
 
 void ttags_set_composite(ttags *, int nchannel);
+void ttags_set_compression(ttags *, uint16_t compression);
+/* Write tiled pages of tile x tile pixels, each with reduced
+ * resolution levels as SubIFDs, halved until they fit in one
+ * tile. Only with the built-in writer. */
+void ttags_set_pyramid(ttags *, int64_t tile);
+/* Use OME-XML as the image description, for T->P planes of nchannel
+ * channels stored as pages c + z*nchannel. channel_names, colors
+ * (0xRRGGBB) and emission_nm can be NULL. */
+void ttags_set_ome(ttags *, int nchannel, char ** channel_names,
+                   const uint32_t * colors, const double * emission_nm);
 
 typedef struct{
     int64_t M;
     int64_t N;
     int64_t P;
-    int64_t dd; // Slice to write
-    TIFF * out;
+    int64_t dd; // Slice to write, or number of slices written
+    TIFF * out; // Only used by the libtiff backend
+
+    /* Built-in writer. The IFDs of all pages are written by
+     * tiff_writer_init, followed by the pixel data of the pages as
+     * one strip each. */
+    int fd;
+    int bigtiff;
+    int64_t data_offset; // Start of the first page
+    int64_t page_bytes;
+    uint16_t compression;
+    int64_t rows_per_strip;
+    int64_t nstrips; // Per page, or tiles of the full resolution
+    /* Tiled pages with reduced resolution levels, see
+     * ttags_set_pyramid. tile = 0 for strips */
+    int64_t tile;
+    int nlevels; // Including the full resolution
+    int64_t blocks_per_page; // Strips or tiles of all levels
+    uint64_t * strip_offsets; // P x blocks_per_page
+    uint64_t * strip_bytes;
+    /* Compressed strips and tiles are appended at end, in the order
+     * they are written. The IFDs are written by tiff_writer_finish. */
+    int64_t end;
+    ttags * T;
+
+    /* XXH64 of the pixel data of each page, see tiff_writer_hash */
+    uint64_t * page_hash;
+
+    /* Statistics, valid until tiff_writer_finish */
+    int64_t bytes_raw;
+    int64_t bytes_compressed;
+    int64_t ns_compress; // Summed over threads
 } tiff_writer_t;
 
 /* These three functions enables writing a tif image slice by slice */
 
-/* State what you intend to do */
+/* State what you intend to do. Writes N x M x P images of uint16_t
+ * (N pixels per row) with the built-in writer. Switches to BigTIFF
+ * when the file would be larger than 4 GB. */
 tiff_writer_t * tiff_writer_init(const char * fName,
                                  ttags * T,
                                  int64_t N, int64_t M, int64_t P);
+/* Continue to write an existing file that was started by
+ * tiff_writer_init with the same arguments. The pages that are kept
+ * are given with tiff_writer_restore_page before any other page is
+ * written. Returns NULL if the file does not exist. */
+tiff_writer_t * tiff_writer_resume(const char * fName,
+                                   ttags * T,
+                                   int64_t N, int64_t M, int64_t P);
+/* Page k is already in the file, with its blocks (strips or tiles, see
+ * blocks_per_page) at offsets. Returns -1 if that can't be right. */
+int tiff_writer_restore_page(tiff_writer_t * tw, int64_t k,
+                             const uint64_t * offsets,
+                             const uint64_t * bytes, uint64_t page_hash);
+/* Same as tiff_writer_init but writes with libtiff */
+tiff_writer_t * tiff_writer_init_libtiff(const char * fName,
+                                         ttags * T,
+                                         int64_t N, int64_t M, int64_t P);
 /* Write a slice */
 int tiff_writer_write(tiff_writer_t * tw, uint16_t * slice);
+/* Write slice k, 0 <= k < P. With the built-in writer the slices can
+ * be written in any order and from several threads at the same
+ * time, every slice once. libtiff only accepts them in order. Not to
+ * be mixed with tiff_writer_write. */
+int tiff_writer_write_page(tiff_writer_t * tw, int64_t k,
+                           const uint16_t * slice);
 /* Close file and free memory */
 int tiff_writer_finish(tiff_writer_t * tw);
+/* Close the file as it is, without the IFDs, and free memory */
+void tiff_writer_abort(tiff_writer_t * tw);
+/* The hash of the pixel data of all pages, see hash_pages. Call
+ * before tiff_writer_finish when all pages are written. */
+uint64_t tiff_writer_hash(const tiff_writer_t * tw);
+
+/* Hash the pixel data of the pages of fName in the same way as
+ * tiff_writer_hash, reading it back with libtiff. Only the full
+ * resolution pages are included. Returns 0 on success. */
+int tiff_hash_pages(const char * fName, uint64_t * hash);
+
+/* Write a small image with both backends and read it back */
+void tiff_util_ut(void);
 
 int u16_to_tiff(const char * fName, uint16_t * V,
                 ttags * T,
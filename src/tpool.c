@@ -0,0 +1,184 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "tpool.h"
+
+typedef struct {
+    tpool_t * pool;
+    int id;
+} tpool_thread_t;
+
+struct tpool {
+    int nthreads;
+    pthread_t * threads;
+    tpool_thread_t * targs;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work; /* Signalled when there is a new batch or quit */
+    pthread_cond_t idle; /* Signalled when a batch is finished */
+
+    /* The current batch of jobs */
+    uint64_t batch; /* Incremented for each call to tpool_run */
+    tpool_fun_t fun;
+    void * arg;
+    int64_t njobs;
+    int64_t next; /* Next job to hand out */
+    int64_t ndone;
+    int quit;
+};
+
+static void * tpool_worker(void * p)
+{
+    tpool_thread_t * t = (tpool_thread_t *) p;
+    tpool_t * pool = t->pool;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while(1)
+    {
+        while(pool->quit == 0 && pool->batch == seen)
+        {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if(pool->quit)
+        {
+            break;
+        }
+        seen = pool->batch;
+
+        while(pool->next < pool->njobs)
+        {
+            int64_t job = pool->next++;
+            pthread_mutex_unlock(&pool->lock);
+            pool->fun(pool->arg, job, t->id);
+            pthread_mutex_lock(&pool->lock);
+            pool->ndone++;
+            if(pool->ndone == pool->njobs)
+            {
+                pthread_cond_broadcast(&pool->idle);
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int tpool_ncpu(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n < 1)
+    {
+        return 1;
+    }
+    return (int) n;
+}
+
+tpool_t * tpool_new(int nthreads)
+{
+    if(nthreads < 1)
+    {
+        nthreads = tpool_ncpu();
+    }
+
+    tpool_t * pool = calloc(1, sizeof(tpool_t));
+    if(pool == NULL)
+    {
+        fprintf(stderr, "tpool_new: calloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    pool->nthreads = nthreads;
+    if(nthreads == 1)
+    {
+        return pool;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    pool->targs = calloc(nthreads, sizeof(tpool_thread_t));
+    if(pool->threads == NULL || pool->targs == NULL)
+    {
+        fprintf(stderr, "tpool_new: calloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(int kk = 0; kk < nthreads; kk++)
+    {
+        pool->targs[kk].pool = pool;
+        pool->targs[kk].id = kk;
+        if(pthread_create(pool->threads + kk, NULL,
+                          tpool_worker, pool->targs + kk) != 0)
+        {
+            fprintf(stderr, "tpool_new: Failed to create thread %d\n", kk);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return pool;
+}
+
+void tpool_run(tpool_t * pool, int64_t njobs, tpool_fun_t fun, void * arg)
+{
+    if(njobs < 1)
+    {
+        return;
+    }
+
+    if(pool->nthreads == 1)
+    {
+        for(int64_t kk = 0; kk < njobs; kk++)
+        {
+            fun(arg, kk, 0);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fun = fun;
+    pool->arg = arg;
+    pool->njobs = njobs;
+    pool->next = 0;
+    pool->ndone = 0;
+    pool->batch++;
+    pthread_cond_broadcast(&pool->work);
+    while(pool->ndone < pool->njobs)
+    {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return;
+}
+
+int tpool_nthreads(const tpool_t * pool)
+{
+    return pool->nthreads;
+}
+
+void tpool_free(tpool_t * pool)
+{
+    if(pool == NULL)
+    {
+        return;
+    }
+    if(pool->nthreads > 1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->quit = 1;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+
+        for(int kk = 0; kk < pool->nthreads; kk++)
+        {
+            pthread_join(pool->threads[kk], NULL);
+        }
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->work);
+        pthread_cond_destroy(&pool->idle);
+    }
+    free(pool->threads);
+    free(pool->targs);
+    free(pool);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+/* A fixed set of threads that runs numbered jobs.
+ *
+ * tpool_run(pool, njobs, fun, arg) calls fun(arg, job, thread) for
+ * each job in [0, njobs) and returns when all jobs are done. Jobs are
+ * handed out in increasing order to the first free thread. thread is
+ * in [0, tpool_nthreads(pool)) and can be used to index per-thread
+ * resources since a thread only runs one job at a time.
+ *
+ * With one thread, the jobs are run by the calling thread and no
+ * threads are created. A pool must not be used from within one of
+ * its own jobs.
+ */
+
+typedef struct tpool tpool_t;
+
+typedef void (*tpool_fun_t)(void * arg, int64_t job, int thread);
+
+/* Create a pool with nthreads threads. nthreads = 0 uses one thread
+ * per online processor. */
+tpool_t * tpool_new(int nthreads);
+
+/* Run fun for each job, returns when all are done */
+void tpool_run(tpool_t * pool, int64_t njobs, tpool_fun_t fun, void * arg);
+
+int tpool_nthreads(const tpool_t * pool);
+
+/* Number of online processors */
+int tpool_ncpu(void);
+
+/* Stop the threads and free the pool */
+void tpool_free(tpool_t * pool);
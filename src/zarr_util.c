@@ -0,0 +1,533 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "zarr_util.h"
+
+#define NOT_NULL(x) {                                           \
+        if(x == NULL){                                          \
+            fprintf(stderr, "zarr_writer: NULL pointer at %s:%d\n", \
+                    __FILE__, __LINE__);                        \
+            exit(EXIT_FAILURE);                                 \
+        }                                                       \
+    }
+
+/* Inner chunk size in pixels */
+#define ZARR_CHUNK 256
+
+static void * ckcalloc(size_t nmemb, size_t size)
+{
+    void * p = calloc(nmemb, size);
+    NOT_NULL(p);
+    return p;
+}
+
+static void pwrite_all(int fd, const void * buf, size_t nbytes, uint64_t offset)
+{
+    const uint8_t * p = buf;
+    while(nbytes > 0)
+    {
+        ssize_t nw = pwrite(fd, p, nbytes, (off_t) offset);
+        if(nw < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(nw <= 0)
+        {
+            fprintf(stderr, "zarr_writer: Failed to write %zu bytes at %" PRIu64 ": %s\n",
+                    nbytes, offset, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        p += nw;
+        nbytes -= nw;
+        offset += nw;
+    }
+}
+
+/* mkdir that accepts existing folders */
+static int ensure_dir(const char * dir)
+{
+    if(mkdir(dir, 0777) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "zarr_writer: Unable to create %s: %s\n",
+                dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* The data and the shard index are stored in the byte order of this
+ * machine, and the metadata says which one */
+static const char * host_endian(void)
+{
+    const uint16_t one = 1;
+    return *((const uint8_t *) &one) == 1 ? "little" : "big";
+}
+
+/* Write s as a quoted JSON string */
+static void json_puts(FILE * fid, const char * s)
+{
+    fputc('"', fid);
+    for( ; *s != '\0'; s++)
+    {
+        unsigned char ch = (unsigned char) *s;
+        if(ch == '"' || ch == '\\')
+        {
+            fprintf(fid, "\\%c", ch);
+        } else if(ch < 0x20)
+        {
+            fprintf(fid, "\\u%04x", ch);
+        } else {
+            fputc(ch, fid);
+        }
+    }
+    fputc('"', fid);
+}
+
+static FILE * zarr_json_open(const char * dir)
+{
+    size_t slen = strlen(dir) + 32;
+    char * name = ckcalloc(slen, 1);
+    snprintf(name, slen, "%s/zarr.json", dir);
+    FILE * fid = fopen(name, "w");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "zarr_writer: Unable to create %s\n", name);
+    }
+    free(name);
+    return fid;
+}
+
+/* Close a zarr.json, returns its size or -1 on failure */
+static int64_t zarr_json_close(FILE * fid)
+{
+    long size = ftell(fid);
+    if(ferror(fid) || fclose(fid) != 0)
+    {
+        fprintf(stderr, "zarr_writer: Failed to write zarr.json\n");
+        return -1;
+    }
+    return size;
+}
+
+int zarr_write_root(const char * dir)
+{
+    if(ensure_dir(dir) != EXIT_SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
+    FILE * fid = zarr_json_open(dir);
+    if(fid == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    fprintf(fid,
+            "{\n"
+            "  \"zarr_format\": 3,\n"
+            "  \"node_type\": \"group\",\n"
+            "  \"attributes\": {\n"
+            "    \"ome\": {\n"
+            "      \"version\": \"0.5\",\n"
+            "      \"bioformats2raw.layout\": 3\n"
+            "    }\n"
+            "  }\n"
+            "}\n");
+    if(zarr_json_close(fid) < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* The image group with the multiscales and omero metadata */
+static int64_t zarr_write_group(const char * dir, const zarr_image_t * img)
+{
+    FILE * fid = zarr_json_open(dir);
+    if(fid == NULL)
+    {
+        return -1;
+    }
+    fprintf(fid,
+            "{\n"
+            "  \"zarr_format\": 3,\n"
+            "  \"node_type\": \"group\",\n"
+            "  \"attributes\": {\n"
+            "    \"ome\": {\n"
+            "      \"version\": \"0.5\",\n"
+            "      \"multiscales\": [{\n");
+    if(img->name != NULL)
+    {
+        fprintf(fid, "        \"name\": ");
+        json_puts(fid, img->name);
+        fprintf(fid, ",\n");
+    }
+    fprintf(fid,
+            "        \"axes\": [\n"
+            "          {\"name\": \"c\", \"type\": \"channel\"},\n"
+            "          {\"name\": \"z\", \"type\": \"space\", \"unit\": \"micrometer\"},\n"
+            "          {\"name\": \"y\", \"type\": \"space\", \"unit\": \"micrometer\"},\n"
+            "          {\"name\": \"x\", \"type\": \"space\", \"unit\": \"micrometer\"}\n"
+            "        ],\n"
+            "        \"datasets\": [{\n"
+            "          \"path\": \"0\",\n"
+            "          \"coordinateTransformations\": [{\n"
+            "            \"type\": \"scale\",\n"
+            "            \"scale\": [1.0, %.17g, %.17g, %.17g]\n"
+            "          }]\n"
+            "        }]\n"
+            "      }],\n",
+            img->dz_um, img->dy_um, img->dx_um);
+
+    fprintf(fid,
+            "      \"omero\": {\n"
+            "        \"channels\": [");
+    for(int64_t cc = 0; cc < img->C; cc++)
+    {
+        fprintf(fid, "%s\n          {\"label\": ", cc > 0 ? "," : "");
+        if(img->channel_names != NULL && img->channel_names[cc] != NULL)
+        {
+            json_puts(fid, img->channel_names[cc]);
+        } else {
+            fprintf(fid, "\"%" PRId64 "\"", cc);
+        }
+        uint32_t color = 0xFFFFFF;
+        if(img->channel_colors != NULL)
+        {
+            color = img->channel_colors[cc];
+        }
+        fprintf(fid, ", \"color\": \"%06" PRIX32 "\", \"active\": true, "
+                "\"window\": {\"min\": 0, \"max\": 65535, "
+                "\"start\": 0, \"end\": 65535}}",
+                color & 0xFFFFFF);
+    }
+    fprintf(fid,
+            "\n"
+            "        ],\n"
+            "        \"rdefs\": {\"model\": \"color\"}\n"
+            "      }\n"
+            "    }\n"
+            "  }\n"
+            "}\n");
+    return zarr_json_close(fid);
+}
+
+/* The array "0", one shard per channel */
+static int64_t zarr_write_array(const char * dir, const zarr_writer_t * zw)
+{
+    FILE * fid = zarr_json_open(dir);
+    if(fid == NULL)
+    {
+        return -1;
+    }
+    const char * endian = host_endian();
+    /* The shard shape has to be a multiple of the chunk shape */
+    fprintf(fid,
+            "{\n"
+            "  \"zarr_format\": 3,\n"
+            "  \"node_type\": \"array\",\n"
+            "  \"shape\": [%" PRId64 ", %" PRId64 ", %" PRId64 ", %" PRId64 "],\n"
+            "  \"data_type\": \"uint16\",\n"
+            "  \"chunk_grid\": {\n"
+            "    \"name\": \"regular\",\n"
+            "    \"configuration\": {\"chunk_shape\": [1, %" PRId64 ", %" PRId64 ", %" PRId64 "]}\n"
+            "  },\n"
+            "  \"chunk_key_encoding\": {\"name\": \"default\", \"configuration\": {\"separator\": \"/\"}},\n"
+            "  \"fill_value\": 0,\n"
+            "  \"codecs\": [{\n"
+            "    \"name\": \"sharding_indexed\",\n"
+            "    \"configuration\": {\n"
+            "      \"chunk_shape\": [1, 1, %" PRId64 ", %" PRId64 "],\n"
+            "      \"codecs\": [{\"name\": \"bytes\", \"configuration\": {\"endian\": \"%s\"}}],\n"
+            "      \"index_codecs\": [{\"name\": \"bytes\", \"configuration\": {\"endian\": \"%s\"}}],\n"
+            "      \"index_location\": \"end\"\n"
+            "    }\n"
+            "  }],\n"
+            "  \"dimension_names\": [\"c\", \"z\", \"y\", \"x\"]\n"
+            "}\n",
+            zw->C, zw->Z, zw->Y, zw->X,
+            zw->Z, zw->ny*zw->cy, zw->nx*zw->cx,
+            zw->cy, zw->cx,
+            endian, endian);
+    return zarr_json_close(fid);
+}
+
+zarr_writer_t * zarr_writer_init(const char * dir, const zarr_image_t * img)
+{
+    if(img->C < 1 || img->Z < 1 || img->Y < 1 || img->X < 1)
+    {
+        fprintf(stderr, "zarr_writer: Invalid image size\n");
+        exit(EXIT_FAILURE);
+    }
+
+    zarr_writer_t * zw = ckcalloc(1, sizeof(zarr_writer_t));
+    zw->C = img->C;
+    zw->Z = img->Z;
+    zw->Y = img->Y;
+    zw->X = img->X;
+    zw->cy = img->Y < ZARR_CHUNK ? img->Y : ZARR_CHUNK;
+    zw->cx = img->X < ZARR_CHUNK ? img->X : ZARR_CHUNK;
+    zw->ny = (zw->Y + zw->cy - 1) / zw->cy;
+    zw->nx = (zw->X + zw->cx - 1) / zw->cx;
+    zw->chunk_bytes = zw->cy*zw->cx*sizeof(uint16_t);
+    int64_t nchunks = zw->Z*zw->ny*zw->nx;
+    zw->shard_bytes = nchunks*zw->chunk_bytes + nchunks*2*sizeof(uint64_t);
+
+    size_t slen = strlen(dir) + 64;
+    char * name = ckcalloc(slen, 1);
+    int ok = ensure_dir(dir) == EXIT_SUCCESS;
+    int64_t nbytes = ok ? zarr_write_group(dir, img) : -1;
+    ok = nbytes >= 0;
+    zw->bytes_meta += nbytes;
+
+    snprintf(name, slen, "%s/0", dir);
+    ok = ok && ensure_dir(name) == EXIT_SUCCESS;
+    nbytes = ok ? zarr_write_array(name, zw) : -1;
+    ok = nbytes >= 0;
+    zw->bytes_meta += nbytes;
+    snprintf(name, slen, "%s/0/c", dir);
+    ok = ok && ensure_dir(name) == EXIT_SUCCESS;
+    if(!ok)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    zw->fd = ckcalloc(zw->C, sizeof(int));
+    for(int64_t cc = 0; cc < zw->C; cc++)
+    {
+        /* The key of shard (cc, 0, 0, 0) is c/cc/0/0/0 */
+        int len = snprintf(name, slen, "%s/0/c/%" PRId64, dir, cc);
+        for(int kk = 0; kk < 3; kk++)
+        {
+            if(kk > 0)
+            {
+                len += snprintf(name + len, slen - len, "/0");
+            }
+            if(ensure_dir(name) != EXIT_SUCCESS)
+            {
+                exit(EXIT_FAILURE);
+            }
+        }
+        snprintf(name + len, slen - len, "/0");
+        zw->fd[cc] = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if(zw->fd[cc] < 0)
+        {
+            fprintf(stderr, "zarr_writer: Unable to create %s: %s\n",
+                    name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        /* Reserve the full size so that the planes can be written in
+         * any order */
+        if(ftruncate(zw->fd[cc], (off_t) zw->shard_bytes) != 0)
+        {
+            fprintf(stderr, "zarr_writer: Failed to set the size of %s: %s\n",
+                    name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(name);
+    return zw;
+}
+
+void zarr_writer_write_plane(zarr_writer_t * zw, int64_t c, int64_t z,
+                             const uint16_t * plane)
+{
+    if(c < 0 || c >= zw->C || z < 0 || z >= zw->Z)
+    {
+        fprintf(stderr, "zarr_writer: Plane (%" PRId64 ", %" PRId64 ") is out of range\n",
+                c, z);
+        exit(EXIT_FAILURE);
+    }
+
+    /* The chunks are ordered z, y, x within the shard so each row of
+     * chunks is contiguous and written at once. Chunks at the edges
+     * are padded with zeros. */
+    size_t row_bytes = zw->nx*zw->chunk_bytes;
+    uint16_t * buf = ckcalloc(row_bytes, 1);
+    for(int64_t ty = 0; ty < zw->ny; ty++)
+    {
+        int64_t h = zw->Y - ty*zw->cy;
+        if(h > zw->cy)
+        {
+            h = zw->cy;
+        }
+        for(int64_t tx = 0; tx < zw->nx; tx++)
+        {
+            int64_t w = zw->X - tx*zw->cx;
+            if(w > zw->cx)
+            {
+                w = zw->cx;
+            }
+            uint16_t * chunk = buf + tx*zw->cy*zw->cx;
+            for(int64_t yy = 0; yy < h; yy++)
+            {
+                memcpy(chunk + yy*zw->cx,
+                       plane + (ty*zw->cy + yy)*zw->X + tx*zw->cx,
+                       w*sizeof(uint16_t));
+            }
+        }
+        uint64_t offset = ((z*zw->ny + ty)*zw->nx)*zw->chunk_bytes;
+        pwrite_all(zw->fd[c], buf, row_bytes, offset);
+        if(ty + 1 < zw->ny && zw->Y - (ty+1)*zw->cy < zw->cy)
+        {
+            /* The last row of chunks is not full */
+            memset(buf, 0, row_bytes);
+        }
+    }
+    free(buf);
+}
+
+int64_t zarr_writer_finish(zarr_writer_t * zw)
+{
+    /* (offset, nbytes) for each chunk, at the end of the shard */
+    int64_t nchunks = zw->Z*zw->ny*zw->nx;
+    uint64_t * index = ckcalloc(2*nchunks, sizeof(uint64_t));
+    for(int64_t kk = 0; kk < nchunks; kk++)
+    {
+        index[2*kk] = kk*zw->chunk_bytes;
+        index[2*kk + 1] = zw->chunk_bytes;
+    }
+
+    int64_t nbytes = zw->bytes_meta;
+    for(int64_t cc = 0; cc < zw->C; cc++)
+    {
+        pwrite_all(zw->fd[cc], index, 2*nchunks*sizeof(uint64_t),
+                   nchunks*zw->chunk_bytes);
+        if(close(zw->fd[cc]) != 0)
+        {
+            fprintf(stderr, "zarr_writer: Failed to close a shard: %s\n",
+                    strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        nbytes += zw->shard_bytes;
+    }
+    free(index);
+    free(zw->fd);
+    free(zw);
+    return nbytes;
+}
+
+void zarr_util_ut(void)
+{
+    printf("-> testing zarr_writer\n");
+    /* Partial chunks in both directions */
+    zarr_image_t img = {0};
+    img.C = 2;
+    img.Z = 3;
+    img.Y = 300;
+    img.X = 517;
+    img.dx_um = 0.13;
+    img.dy_um = 0.13;
+    img.dz_um = 0.3;
+    img.name = "zarr \"ut\"";
+    char * names[] = {"dapi", "a647"};
+    img.channel_names = names;
+
+    char dir[] = "/tmp/nd2tool_zarr_ut_XXXXXX";
+    if(mkdtemp(dir) == NULL)
+    {
+        fprintf(stderr, "zarr_util_ut: Unable to create a temporary folder\n");
+        exit(EXIT_FAILURE);
+    }
+    if(zarr_write_root(dir) != EXIT_SUCCESS)
+    {
+        exit(EXIT_FAILURE);
+    }
+    size_t slen = strlen(dir) + 64;
+    char * name = ckcalloc(slen, 1);
+    snprintf(name, slen, "%s/0", dir);
+
+    size_t YX = img.Y*img.X;
+    uint16_t * V = ckcalloc(img.C*img.Z*YX, sizeof(uint16_t));
+    for(size_t kk = 0; kk < img.C*img.Z*YX; kk++)
+    {
+        V[kk] = (uint16_t) (kk*7919 + 1);
+    }
+
+    zarr_writer_t * zw = zarr_writer_init(name, &img);
+    int64_t ny = zw->ny;
+    int64_t nx = zw->nx;
+    int64_t cy = zw->cy;
+    int64_t cx = zw->cx;
+    /* Out of order, as from several writers */
+    for(int64_t zz = img.Z-1; zz >= 0; zz--)
+    {
+        for(int64_t cc = 0; cc < img.C; cc++)
+        {
+            zarr_writer_write_plane(zw, cc, zz, V + (cc*img.Z + zz)*YX);
+        }
+    }
+    int64_t nbytes = zarr_writer_finish(zw);
+    int64_t nchunks = img.Z*ny*nx;
+    int64_t shard_bytes = nchunks*(cy*cx*2 + 16);
+
+    /* Read back each shard through its index */
+    for(int64_t cc = 0; cc < img.C; cc++)
+    {
+        snprintf(name, slen, "%s/0/0/c/%" PRId64 "/0/0/0", dir, cc);
+        FILE * fid = fopen(name, "rb");
+        NOT_NULL(fid);
+        uint8_t * shard = ckcalloc(shard_bytes + 1, 1);
+        size_t nread = fread(shard, 1, shard_bytes + 1, fid);
+        fclose(fid);
+        if((int64_t) nread != shard_bytes)
+        {
+            fprintf(stderr, "zarr_util_ut: %s has the wrong size\n", name);
+            exit(EXIT_FAILURE);
+        }
+        uint64_t * index = (uint64_t *) (shard + nchunks*cy*cx*2);
+        for(int64_t zz = 0; zz < img.Z; zz++)
+        {
+            for(int64_t yy = 0; yy < ny*cy; yy++)
+            {
+                for(int64_t xx = 0; xx < nx*cx; xx++)
+                {
+                    int64_t chunk = (zz*ny + yy/cy)*nx + xx/cx;
+                    uint16_t * C = (uint16_t *) (shard + index[2*chunk]);
+                    uint16_t v = C[(yy % cy)*cx + xx % cx];
+                    uint16_t e = 0;
+                    if(yy < img.Y && xx < img.X)
+                    {
+                        e = V[(cc*img.Z + zz)*YX + yy*img.X + xx];
+                    }
+                    if(v != e || index[2*chunk + 1] != (uint64_t) cy*cx*2)
+                    {
+                        fprintf(stderr, "zarr_util_ut: Wrong value at "
+                                "(%" PRId64 ", %" PRId64 ", %" PRId64 ", %" PRId64 ")\n",
+                                cc, zz, yy, xx);
+                        exit(EXIT_FAILURE);
+                    }
+                }
+            }
+        }
+        free(shard);
+    }
+    if(nbytes < img.C*shard_bytes)
+    {
+        fprintf(stderr, "zarr_util_ut: Wrong number of bytes written\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Clean up */
+    const char * files[] = {"0/0/c/0/0/0/0", "0/0/c/0/0/0", "0/0/c/0/0",
+        "0/0/c/0", "0/0/c/1/0/0/0", "0/0/c/1/0/0", "0/0/c/1/0",
+        "0/0/c/1", "0/0/c", "0/0/zarr.json", "0/0", "0/zarr.json", "0",
+        "zarr.json", ""};
+    for(size_t kk = 0; kk < sizeof(files)/sizeof(files[0]); kk++)
+    {
+        snprintf(name, slen, "%s/%s", dir, files[kk]);
+        if(remove(name) != 0)
+        {
+            fprintf(stderr, "zarr_util_ut: Unable to remove %s\n", name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(name);
+    free(V);
+    printf("ok: %" PRId64 " bytes in %" PRId64 " shards\n", nbytes, img.C);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Writes OME-Zarr (NGFF 0.5, Zarr v3) images of uint16_t.
+ *
+ * The store follows the bioformats2raw layout: a root group with one
+ * image group per series (FOV). Each image has a single resolution
+ * level, the array "0" with the axes c, z, y, x.
+ *
+ * To keep the number of files down, each channel is one shard,
+ * c/<c>/0/0/0, with inner chunks of 1 x 1 x 256 x 256 pixels. The
+ * chunks are not compressed so their place in the shard is known in
+ * advance and the planes can be written in any order and from
+ * several threads at the same time.
+ */
+
+/* Describes one image */
+typedef struct {
+    int64_t C; /* Channels */
+    int64_t Z; /* Planes */
+    int64_t Y; /* Rows */
+    int64_t X; /* Pixels per row */
+    double dx_um; /* Pixel size */
+    double dy_um;
+    double dz_um;
+    const char * name; /* Optional */
+    char ** channel_names; /* C names or NULL */
+    uint32_t * channel_colors; /* C colors as 0xRRGGBB or NULL */
+} zarr_image_t;
+
+typedef struct {
+    int64_t C;
+    int64_t Z;
+    int64_t Y;
+    int64_t X;
+    /* Inner chunks */
+    int64_t cy;
+    int64_t cx;
+    int64_t ny; /* Chunks per column */
+    int64_t nx; /* Chunks per row */
+    int64_t chunk_bytes;
+    int64_t shard_bytes; /* Including the index */
+    int * fd; /* One shard per channel */
+    int64_t bytes_meta; /* Size of the zarr.json files */
+} zarr_writer_t;
+
+/* Create the root group of a store at dir. The folder is created if
+ * it does not exist. Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int zarr_write_root(const char * dir);
+
+/* Create an image group in the folder dir, which is created if it
+ * does not exist. The shards are allocated to their full size. Exits
+ * on failure. */
+zarr_writer_t * zarr_writer_init(const char * dir, const zarr_image_t * img);
+
+/* Write plane z of channel c. Thread safe, every plane once. */
+void zarr_writer_write_plane(zarr_writer_t * zw, int64_t c, int64_t z,
+                             const uint16_t * plane);
+
+/* Write the shard indexes, close the files and free zw. Returns the
+ * size of all files of the image. */
+int64_t zarr_writer_finish(zarr_writer_t * zw);
+
+/* Write a small image and check the shards */
+void zarr_util_ut(void);